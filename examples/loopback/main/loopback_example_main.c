@@ -7,6 +7,7 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
+#include "sdkconfig.h"
 #include "protocol_examples_common.h"
 
 #include "rfc2217_server.h"
@@ -42,7 +43,7 @@ void app_main(void)
         .port = 3333,
         .task_stack_size = 4096,
         .task_priority = 5,
-        .task_core_id = 0
+        .task_core_id = RFC2217_NO_AFFINITY
     };
 
     ESP_ERROR_CHECK(rfc2217_server_create(&config, &s_server));
@@ -60,8 +61,19 @@ void app_main(void)
         const char *msg = "\r\nHello from ESP RFC2217 server!\r\n";
         rfc2217_server_send_data(s_server, (const uint8_t *) msg, strlen(msg));
 
+#if CONFIG_EXAMPLE_LOOPBACK_FLOOD_BLOCK_SIZE > 0
+        ESP_LOGI(TAG, "Sending data continuously until the client disconnects");
+        static uint8_t block[CONFIG_EXAMPLE_LOOPBACK_FLOOD_BLOCK_SIZE];
+        for (size_t i = 0; i < sizeof(block); i++) {
+            block[i] = 'A' + i % 26;
+        }
+        while (xSemaphoreTake(s_client_disconnected, 0) != pdTRUE) {
+            rfc2217_server_send_data(s_server, block, sizeof(block));
+        }
+#else
         ESP_LOGI(TAG, "Waiting for client to disconnect");
         xSemaphoreTake(s_client_disconnected, portMAX_DELAY);
+#endif
         ESP_LOGI(TAG, "Client disconnected");
     }
 }
@@ -1,14 +1,17 @@
 #include <string.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "esp_err.h"
 #include "esp_check.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include "esp_intr_alloc.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "protocol_examples_common.h"
@@ -16,17 +19,35 @@
 
 #include "rfc2217_server.h"
 
+#define UART_EVENT_QUEUE_SIZE 32
+#define UART_RX_TIMEOUT_MAX_SYMBOLS 126
+
 static const char *TAG = "app_main";
 static rfc2217_server_t s_server;
 static SemaphoreHandle_t s_client_connected;
 static SemaphoreHandle_t s_client_disconnected;
+static QueueHandle_t s_uart_queue;
+
+static struct {
+    uint32_t rx_bytes;          // bytes forwarded from UART to the client
+    uint32_t rx_events;         // number of UART_DATA events
+    uint32_t fifo_overruns;     // UART_FIFO_OVF events: hardware FIFO overflowed before the ISR emptied it
+    uint32_t buffer_overruns;   // UART_BUFFER_FULL events: driver's ring buffer was full
+    uint32_t line_errors;       // framing and parity errors
+    int64_t latency_sum_us;     // sum of (forward done - event dequeued) times
+    int64_t latency_max_us;
+} s_stats;
 
 static void on_connected(void *ctx);
 static void on_disconnected(void *ctx);
 static void on_data_received(void *ctx, const uint8_t *data, size_t len);
 static unsigned on_baudrate(void *ctx, unsigned baudrate);
+static int on_drain(void *ctx, unsigned timeout_ms);
 
 static esp_err_t init_uart(void);
+static void set_rx_timeout_for_baudrate(unsigned baudrate);
+static void handle_uart_event(const uart_event_t *event);
+static void log_stats(void);
 
 void app_main(void)
 {
@@ -48,10 +69,14 @@ void app_main(void)
         .on_control = NULL,
         .on_purge = NULL,
         .on_data_received = on_data_received,
+        // finish sending data at the old baud rate before a baud rate change
+        .on_drain = on_drain,
         .port = 3333,
         .task_stack_size = 4096,
         .task_priority = 5,
-        .task_core_id = 0
+        .task_core_id = RFC2217_NO_AFFINITY,
+        // pass data to uart_write_bytes at the line rate, so that it doesn't block on a full TX buffer
+        .rx_shaper_burst = CONFIG_EXAMPLE_UART_BUFFER_SIZE / 2,
     };
 
     ESP_ERROR_CHECK(rfc2217_server_create(&config, &s_server));
@@ -60,22 +85,90 @@ void app_main(void)
 
     ESP_ERROR_CHECK(rfc2217_server_start(s_server));
 
+    const TickType_t stats_interval = CONFIG_EXAMPLE_UART_STATS_INTERVAL_MS > 0 ?
+                                      pdMS_TO_TICKS(CONFIG_EXAMPLE_UART_STATS_INTERVAL_MS) : portMAX_DELAY;
     while (true) {
         ESP_LOGI(TAG, "Waiting for client to connect");
         xSemaphoreTake(s_client_connected, portMAX_DELAY);
 
         ESP_LOGI(TAG, "Client connected, starting data transfer");
+        // drop whatever was received while no client was connected
+        uart_flush_input(CONFIG_EXAMPLE_UART_PORT_NUM);
+        xQueueReset(s_uart_queue);
+        memset(&s_stats, 0, sizeof(s_stats));
 
+        TickType_t last_stats = xTaskGetTickCount();
         while (xSemaphoreTake(s_client_disconnected, 0) != pdTRUE) {
-            static uint8_t uart_read_buf[2048];
-            int len = uart_read_bytes(CONFIG_EXAMPLE_UART_PORT_NUM, uart_read_buf, sizeof(uart_read_buf), pdMS_TO_TICKS(100));
-            if (len > 0) {
-                rfc2217_server_send_data(s_server, uart_read_buf, len);
+            // Data events are generated when the RX FIFO reaches the full threshold or when the RX line
+            // has been idle for the RX timeout, so the data is forwarded as soon as either happens.
+            // The timeout here only bounds how long it takes to notice a disconnection.
+            uart_event_t event;
+            if (xQueueReceive(s_uart_queue, &event, pdMS_TO_TICKS(100)) == pdTRUE) {
+                handle_uart_event(&event);
+            }
+            if (stats_interval != portMAX_DELAY && xTaskGetTickCount() - last_stats >= stats_interval) {
+                log_stats();
+                last_stats = xTaskGetTickCount();
             }
         }
 
         ESP_LOGI(TAG, "Client disconnected");
+        log_stats();
+    }
+}
+
+static void handle_uart_event(const uart_event_t *event)
+{
+    const uart_port_t port = CONFIG_EXAMPLE_UART_PORT_NUM;
+    switch (event->type) {
+    case UART_DATA: {
+        int64_t start = esp_timer_get_time();
+        // read everything the driver has buffered, not just the amount reported in this event
+        static uint8_t buf[CONFIG_EXAMPLE_UART_BUFFER_SIZE];
+        size_t available = 0;
+        uart_get_buffered_data_len(port, &available);
+        if (available > sizeof(buf)) {
+            available = sizeof(buf);
+        }
+        int len = uart_read_bytes(port, buf, available, 0);
+        if (len > 0) {
+            rfc2217_server_send_data(s_server, buf, len);
+            s_stats.rx_bytes += len;
+        }
+        int64_t latency = esp_timer_get_time() - start;
+        s_stats.rx_events++;
+        s_stats.latency_sum_us += latency;
+        if (latency > s_stats.latency_max_us) {
+            s_stats.latency_max_us = latency;
+        }
+        break;
     }
+    case UART_FIFO_OVF:
+        s_stats.fifo_overruns++;
+        ESP_LOGW(TAG, "UART RX FIFO overflow");
+        uart_flush_input(port);
+        xQueueReset(s_uart_queue);
+        break;
+    case UART_BUFFER_FULL:
+        s_stats.buffer_overruns++;
+        ESP_LOGW(TAG, "UART RX buffer full");
+        uart_flush_input(port);
+        xQueueReset(s_uart_queue);
+        break;
+    case UART_FRAME_ERR:
+    case UART_PARITY_ERR:
+        s_stats.line_errors++;
+        break;
+    default:
+        break;
+    }
+}
+
+static void log_stats(void)
+{
+    ESP_LOGI(TAG, "RX: %" PRIu32 " bytes in %" PRIu32 " events, overruns: FIFO %" PRIu32 " buffer %" PRIu32 ", line errors: %" PRIu32 ", forward latency avg %" PRId64 " us max %" PRId64 " us",
+             s_stats.rx_bytes, s_stats.rx_events, s_stats.fifo_overruns, s_stats.buffer_overruns, s_stats.line_errors,
+             s_stats.rx_events ? s_stats.latency_sum_us / s_stats.rx_events : 0, s_stats.latency_max_us);
 }
 
 static void on_connected(void *ctx)
@@ -90,9 +183,16 @@ static void on_disconnected(void *ctx)
 
 static void on_data_received(void *ctx, const uint8_t *data, size_t len)
 {
+    // Only blocks when the driver's TX buffer is full, i.e. the client is sending faster than the baud rate.
+    // The RFC2217 server stops reading from the socket meanwhile, so the client gets TCP backpressure.
     uart_write_bytes(CONFIG_EXAMPLE_UART_PORT_NUM, data, len);
 }
 
+static int on_drain(void *ctx, unsigned timeout_ms)
+{
+    return uart_wait_tx_done(CONFIG_EXAMPLE_UART_PORT_NUM, pdMS_TO_TICKS(timeout_ms)) == ESP_OK ? 0 : -1;
+}
+
 static esp_err_t init_uart(void)
 {
     // Initial config. It may be changed later according to the RFC2217 negotiation.
@@ -103,17 +203,36 @@ static esp_err_t init_uart(void)
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
     };
-    const size_t tx_buffer_size = 4096;
-    const size_t rx_buffer_size = 4096;
-    ESP_RETURN_ON_ERROR(uart_driver_install(CONFIG_EXAMPLE_UART_PORT_NUM, rx_buffer_size, tx_buffer_size, 0, NULL, ESP_INTR_FLAG_LOWMED), TAG, "uart_driver_install failed");
+    const size_t tx_buffer_size = CONFIG_EXAMPLE_UART_BUFFER_SIZE;
+    const size_t rx_buffer_size = CONFIG_EXAMPLE_UART_BUFFER_SIZE;
+    ESP_RETURN_ON_ERROR(uart_driver_install(CONFIG_EXAMPLE_UART_PORT_NUM, rx_buffer_size, tx_buffer_size, UART_EVENT_QUEUE_SIZE, &s_uart_queue, ESP_INTR_FLAG_LOWMED), TAG, "uart_driver_install failed");
 
     ESP_RETURN_ON_ERROR(uart_param_config(CONFIG_EXAMPLE_UART_PORT_NUM, &uart_config), TAG, "uart_param_config failed");
 
     ESP_RETURN_ON_ERROR(uart_set_pin(CONFIG_EXAMPLE_UART_PORT_NUM, CONFIG_EXAMPLE_UART_TX_GPIO, CONFIG_EXAMPLE_UART_RX_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE), TAG, "uart_set_pin failed");
 
+    ESP_RETURN_ON_ERROR(uart_set_rx_full_threshold(CONFIG_EXAMPLE_UART_PORT_NUM, CONFIG_EXAMPLE_UART_RX_FULL_THRESHOLD), TAG, "uart_set_rx_full_threshold failed");
+
+    set_rx_timeout_for_baudrate(uart_config.baud_rate);
+
     return ESP_OK;
 }
 
+static void set_rx_timeout_for_baudrate(unsigned baudrate)
+{
+    // RX timeout is configured in character times (10 bit times for 8N1); keep it close to the configured duration
+    uint64_t symbols = (uint64_t) CONFIG_EXAMPLE_UART_RX_TIMEOUT_US * baudrate / 10 / 1000000;
+    if (symbols < 1) {
+        symbols = 1;
+    } else if (symbols > UART_RX_TIMEOUT_MAX_SYMBOLS) {
+        symbols = UART_RX_TIMEOUT_MAX_SYMBOLS;
+    }
+    esp_err_t err = uart_set_rx_timeout(CONFIG_EXAMPLE_UART_PORT_NUM, (uint8_t) symbols);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to set RX timeout to %u symbols", (unsigned) symbols);
+    }
+}
+
 static unsigned on_baudrate(void *ctx, unsigned baudrate)
 {
     esp_err_t err = uart_set_baudrate(CONFIG_EXAMPLE_UART_PORT_NUM, baudrate);
@@ -121,5 +240,6 @@ static unsigned on_baudrate(void *ctx, unsigned baudrate)
         ESP_LOGE(TAG, "Failed to set baudrate: %u", baudrate);
         return 0;
     }
+    set_rx_timeout_for_baudrate(baudrate);
     return baudrate;
 }
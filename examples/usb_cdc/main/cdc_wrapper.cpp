@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
+#include <atomic>
 
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+#include "sdkconfig.h"
 
 #include "usb/cdc_acm_host.h"
 #include "usb/vcp_ch34x.hpp"
@@ -22,13 +27,78 @@ static const char *TAG = "VCP example";
 static usb_cdc_wrapper_on_data_t s_on_data;
 static volatile bool s_device_connected;
 static SemaphoreHandle_t s_device_disconnected_sem;
-static std::unique_ptr<CdcAcmDevice> s_vcp;
+// shared, so that the device stays open while a transfer is in progress even if s_vcp is reset
+static std::shared_ptr<CdcAcmDevice> s_vcp;
+static SemaphoreHandle_t s_vcp_mutex;
+static cdc_acm_line_coding_t s_line_coding = {
+    .dwDTERate = 115200,
+    .bCharFormat = 0,  // 0: 1 stopbit, 1: 1.5 stopbits, 2: 2 stopbits
+    .bParityType = 0,  // 0: None, 1: Odd, 2: Even, 3: Mark, 4: Space
+    .bDataBits = 8,
+};
+
+// network -> USB: filled by usb_cdc_wrapper_send_data, drained by usb_tx_task
+static StreamBufferHandle_t s_tx_stream;
+// USB -> network: filled by handle_rx, drained by usb_rx_forward_task
+static StreamBufferHandle_t s_rx_stream;
+// Data staged for a device must not reach the next one. A stream buffer can't be reset while a task
+// is blocked reading it, so the reading tasks reset their stream when asked, see reset_if_requested.
+static volatile bool s_tx_reset_pending;
+static volatile bool s_rx_reset_pending;
+static SemaphoreHandle_t s_reset_done;
+// how long the reading tasks wait for data before checking for a reset request
+#define STREAM_RESET_POLL_MS 50
+// bytes put into s_tx_stream, and bytes usb_tx_task is done with (sent or dropped); wrapping counters
+static std::atomic<uint32_t> s_tx_queued;
+static std::atomic<uint32_t> s_tx_done;
+// given by usb_tx_task when s_tx_done has advanced
+static SemaphoreHandle_t s_tx_progress;
+// how long handle_rx waits for space in s_rx_stream before dropping data
+#define RX_STREAM_TIMEOUT_MS 100
+
+static struct {
+    volatile uint32_t tx_bytes;         // bytes sent to the USB device
+    volatile uint32_t tx_transfers;     // number of OUT transfers
+    volatile uint32_t rx_bytes;         // bytes received from the USB device
+    volatile uint32_t rx_batches;       // number of batches forwarded to the network
+    volatile uint32_t rx_dropped;       // bytes dropped because s_rx_stream was full
+} s_stats;
+
+static std::shared_ptr<CdcAcmDevice> get_vcp(void)
+{
+    xSemaphoreTake(s_vcp_mutex, portMAX_DELAY);
+    std::shared_ptr<CdcAcmDevice> vcp = s_vcp;
+    xSemaphoreGive(s_vcp_mutex);
+    return vcp;
+}
 
 static bool handle_rx(const uint8_t *data, size_t data_len, void *arg)
 {
-    if (s_on_data) {
-        s_on_data(data, data_len);
+    // Called from the USB host driver. Normally there is space and the data is just stashed for
+    // usb_rx_forward_task. If the network is slow, this waits for space, which holds back the next
+    // IN transfer, so the device gets backpressure; the data is only dropped if that takes too long.
+    size_t sent = xStreamBufferSend(s_rx_stream, data, data_len, pdMS_TO_TICKS(RX_STREAM_TIMEOUT_MS));
+    s_stats.rx_bytes += sent;
+    if (sent < data_len) {
+        s_stats.rx_dropped += data_len - sent;
+        ESP_LOGW(TAG, "Network too slow, dropped %u bytes from USB (%" PRIu32 " in total)",
+                 (unsigned)(data_len - sent), s_stats.rx_dropped);
+    }
+    return true;
+}
+
+static bool reset_if_requested(StreamBufferHandle_t stream, volatile bool *pending)
+{
+    // Called by the task reading the stream; returns true if the stream was reset, and the data just
+    // read from it must be dropped as well. Retries until a writer blocked on the stream has given up.
+    if (!*pending) {
+        return false;
+    }
+    while (xStreamBufferReset(stream) != pdPASS) {
+        vTaskDelay(1);
     }
+    *pending = false;
+    xSemaphoreGive(s_reset_done);
     return true;
 }
 
@@ -40,8 +110,8 @@ static void handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_
         break;
     case CDC_ACM_HOST_DEVICE_DISCONNECTED:
         ESP_LOGI(TAG, "Device suddenly disconnected");
-        xSemaphoreGive(s_device_disconnected_sem);
         s_device_connected = false;
+        xSemaphoreGive(s_device_disconnected_sem);
         break;
     case CDC_ACM_HOST_SERIAL_STATE:
         ESP_LOGI(TAG, "Serial state notif 0x%04X", event->data.serial_state.val);
@@ -65,11 +135,88 @@ static void usb_lib_task(void *arg)
     }
 }
 
+static void usb_tx_task(void *arg)
+{
+    // Coalesce whatever has been received from the network into OUT transfers of up to
+    // CONFIG_EXAMPLE_USB_OUT_TRANSFER_SIZE bytes. While one transfer is in progress, the
+    // RFC2217 server keeps filling s_tx_stream with the next chunk.
+    static uint8_t buf[CONFIG_EXAMPLE_USB_OUT_TRANSFER_SIZE];
+    while (1) {
+        size_t len = xStreamBufferReceive(s_tx_stream, buf, sizeof(buf), pdMS_TO_TICKS(STREAM_RESET_POLL_MS));
+        if (reset_if_requested(s_tx_stream, &s_tx_reset_pending)) {
+            s_tx_done = s_tx_queued.load();
+            xSemaphoreGive(s_tx_progress);
+            continue;
+        }
+        if (len == 0) {
+            continue;
+        }
+        std::shared_ptr<CdcAcmDevice> vcp = get_vcp();
+        if (s_device_connected && vcp) {
+            esp_err_t err = vcp->tx_blocking(buf, len);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "tx_blocking failed: %s", esp_err_to_name(err));
+            } else {
+                s_stats.tx_bytes += len;
+                s_stats.tx_transfers++;
+            }
+        }
+        s_tx_done += len;
+        xSemaphoreGive(s_tx_progress);
+    }
+}
+
+static void usb_rx_forward_task(void *arg)
+{
+    // Forward data received from USB in batches: while the previous batch is being sent
+    // over the network, the next one accumulates in s_rx_stream.
+    static uint8_t buf[CONFIG_EXAMPLE_USB_RX_BUFFER_SIZE / 2];
+    while (1) {
+        size_t len = xStreamBufferReceive(s_rx_stream, buf, sizeof(buf), pdMS_TO_TICKS(STREAM_RESET_POLL_MS));
+        if (reset_if_requested(s_rx_stream, &s_rx_reset_pending)) {
+            continue;
+        }
+        if (len > 0 && s_on_data) {
+            s_on_data(buf, len);
+            s_stats.rx_batches++;
+        }
+    }
+}
+
+static void stats_task(void *arg)
+{
+    const uint32_t interval_ms = CONFIG_EXAMPLE_USB_STATS_INTERVAL_MS;
+    uint32_t last_tx = 0;
+    uint32_t last_rx = 0;
+    int64_t last_time = esp_timer_get_time();
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(interval_ms));
+        int64_t now = esp_timer_get_time();
+        uint32_t tx = s_stats.tx_bytes;
+        uint32_t rx = s_stats.rx_bytes;
+        int64_t dt_us = now - last_time;
+        ESP_LOGI(TAG, "baud %" PRIu32 ", to USB: %" PRIu64 " B/s (%" PRIu32 " transfers), from USB: %" PRIu64 " B/s (%" PRIu32 " batches, %" PRIu32 " dropped)",
+                 s_line_coding.dwDTERate,
+                 (uint64_t)(tx - last_tx) * 1000000 / dt_us, s_stats.tx_transfers,
+                 (uint64_t)(rx - last_rx) * 1000000 / dt_us, s_stats.rx_batches, s_stats.rx_dropped);
+        last_tx = tx;
+        last_rx = rx;
+        last_time = now;
+    }
+}
+
 extern "C" esp_err_t usb_cdc_wrapper_init(usb_cdc_wrapper_on_data_t on_data)
 {
     s_on_data = on_data;
     s_device_connected = false;
     s_device_disconnected_sem = xSemaphoreCreateBinary();
+    s_vcp_mutex = xSemaphoreCreateMutex();
+    s_reset_done = xSemaphoreCreateCounting(2, 0);
+    s_tx_progress = xSemaphoreCreateBinary();
+    s_tx_stream = xStreamBufferCreate(CONFIG_EXAMPLE_USB_TX_BUFFER_SIZE, 1);
+    s_rx_stream = xStreamBufferCreate(CONFIG_EXAMPLE_USB_RX_BUFFER_SIZE, 1);
+    ESP_RETURN_ON_FALSE(s_device_disconnected_sem && s_vcp_mutex && s_reset_done && s_tx_progress && s_tx_stream && s_rx_stream, ESP_ERR_NO_MEM, TAG, "failed to allocate buffers");
+
     ESP_LOGI(TAG, "Installing USB Host");
     usb_host_config_t host_config = {};
     host_config.skip_phy_setup = false;
@@ -79,6 +226,17 @@ extern "C" esp_err_t usb_cdc_wrapper_init(usb_cdc_wrapper_on_data_t on_data)
     BaseType_t task_created = xTaskCreate(usb_lib_task, "usb_lib", 4096, NULL, 10, NULL);
     ESP_RETURN_ON_FALSE(task_created, ESP_ERR_NO_MEM, TAG, "xTaskCreate failed");
 
+    task_created = xTaskCreate(usb_tx_task, "usb_tx", 4096, NULL, 9, NULL);
+    ESP_RETURN_ON_FALSE(task_created, ESP_ERR_NO_MEM, TAG, "xTaskCreate failed");
+
+    task_created = xTaskCreate(usb_rx_forward_task, "usb_rx_fwd", 4096, NULL, 8, NULL);
+    ESP_RETURN_ON_FALSE(task_created, ESP_ERR_NO_MEM, TAG, "xTaskCreate failed");
+
+    if (CONFIG_EXAMPLE_USB_STATS_INTERVAL_MS > 0) {
+        task_created = xTaskCreate(stats_task, "usb_stats", 3072, NULL, 1, NULL);
+        ESP_RETURN_ON_FALSE(task_created, ESP_ERR_NO_MEM, TAG, "xTaskCreate failed");
+    }
+
     ESP_LOGI(TAG, "Installing CDC-ACM driver");
     ESP_RETURN_ON_ERROR(cdc_acm_host_install(NULL), TAG, "cdc_acm_host_install failed");
 
@@ -91,33 +249,40 @@ extern "C" esp_err_t usb_cdc_wrapper_init(usb_cdc_wrapper_on_data_t on_data)
 
 extern "C" esp_err_t usb_cdc_wrapper_wait_for_device_connected(void)
 {
+    xSemaphoreTake(s_vcp_mutex, portMAX_DELAY);
     s_vcp.reset();
+    xSemaphoreGive(s_vcp_mutex);
+
+    // drop the data staged for the previous device, in both directions
+    s_tx_reset_pending = true;
+    s_rx_reset_pending = true;
+    xSemaphoreTake(s_reset_done, portMAX_DELAY);
+    xSemaphoreTake(s_reset_done, portMAX_DELAY);
+
     const cdc_acm_host_device_config_t dev_config = {
         .connection_timeout_ms = 5000,
-        .out_buffer_size = 512,
-        .in_buffer_size = 512,
+        .out_buffer_size = CONFIG_EXAMPLE_USB_OUT_TRANSFER_SIZE,
+        .in_buffer_size = CONFIG_EXAMPLE_USB_IN_TRANSFER_SIZE,
         .event_cb = handle_event,
         .data_cb = handle_rx,
         .user_arg = NULL,
     };
     ESP_LOGI(TAG, "Opening VCP device...");
-    s_vcp = std::unique_ptr<CdcAcmDevice>(VCP::open(&dev_config));
+    std::shared_ptr<CdcAcmDevice> vcp(VCP::open(&dev_config));
 
-    if (s_vcp == nullptr) {
+    if (vcp == nullptr) {
         ESP_LOGI(TAG, "Failed to open VCP device");
         return ESP_FAIL;
     }
     vTaskDelay(10);
 
     ESP_LOGI(TAG, "Setting up line coding");
-    cdc_acm_line_coding_t line_coding = {
-        .dwDTERate = 115200,
-        .bCharFormat = 0,  // 0: 1 stopbit, 1: 1.5 stopbits, 2: 2 stopbits
-        .bParityType = 0,  // 0: None, 1: Odd, 2: Even, 3: Mark, 4: Space
-        .bDataBits = 8,
-    };
-    ESP_RETURN_ON_ERROR(s_vcp->line_coding_set(&line_coding), TAG, "line_coding_set failed");
+    ESP_RETURN_ON_ERROR(vcp->line_coding_set(&s_line_coding), TAG, "line_coding_set failed");
+
+    xSemaphoreTake(s_vcp_mutex, portMAX_DELAY);
+    s_vcp = std::move(vcp);
     s_device_connected = true;
+    xSemaphoreGive(s_vcp_mutex);
     return ESP_OK;
 }
 
@@ -132,14 +297,17 @@ extern "C" esp_err_t usb_cdc_wrapper_set_baudrate(unsigned baudrate)
     if (!s_device_connected) {
         return ESP_ERR_INVALID_STATE;
     }
+    if (baudrate == s_line_coding.dwDTERate) {
+        return ESP_OK;
+    }
     ESP_LOGI(TAG, "Setting baud rate to %u", baudrate);
-    cdc_acm_line_coding_t line_coding = {
-        .dwDTERate = baudrate,
-        .bCharFormat = 0,  // 0: 1 stopbit, 1: 1.5 stopbits, 2: 2 stopbits
-        .bParityType = 0,  // 0: None, 1: Odd, 2: Even, 3: Mark, 4: Space
-        .bDataBits = 8,
-    };
-    ESP_RETURN_ON_ERROR(s_vcp->line_coding_set(&line_coding), TAG, "line_coding_set failed");
+    // only the rate changes, the rest of the cached line coding is kept as is
+    cdc_acm_line_coding_t line_coding = s_line_coding;
+    line_coding.dwDTERate = baudrate;
+    std::shared_ptr<CdcAcmDevice> vcp = get_vcp();
+    ESP_RETURN_ON_FALSE(vcp, ESP_ERR_INVALID_STATE, TAG, "device not open");
+    ESP_RETURN_ON_ERROR(vcp->line_coding_set(&line_coding), TAG, "line_coding_set failed");
+    s_line_coding = line_coding;
     return ESP_OK;
 }
 
@@ -148,7 +316,34 @@ extern "C" esp_err_t usb_cdc_wrapper_send_data(const uint8_t *data, size_t len)
     if (!s_device_connected) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_RETURN_ON_ERROR(s_vcp->tx_blocking((uint8_t *) data, len), TAG, "tx_blocking failed");
+    // Only blocks if the staging buffer is full, i.e. the USB device can't keep up.
+    // In that case the RFC2217 server stops reading from the socket, and the client gets TCP backpressure.
+    while (len > 0 && s_device_connected) {
+        size_t sent = xStreamBufferSend(s_tx_stream, data, len, pdMS_TO_TICKS(100));
+        s_tx_queued += sent;
+        data += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+extern "C" esp_err_t usb_cdc_wrapper_wait_tx_done(unsigned timeout_ms)
+{
+    // Wait until the data passed to usb_cdc_wrapper_send_data so far has been transferred to the device.
+    // Data in the TX FIFO of the USB-serial chip itself isn't covered: CDC-ACM has no request for that.
+    const uint32_t target = s_tx_queued;
+    const int64_t deadline_us = esp_timer_get_time() + (int64_t) timeout_ms * 1000;
+    while ((int32_t)(s_tx_done - target) < 0) {
+        if (!s_device_connected) {
+            // the data is dropped, nothing to wait for
+            return ESP_OK;
+        }
+        int64_t remaining_us = deadline_us - esp_timer_get_time();
+        if (remaining_us <= 0) {
+            return ESP_ERR_TIMEOUT;
+        }
+        xSemaphoreTake(s_tx_progress, pdMS_TO_TICKS(remaining_us / 1000) + 1);
+    }
     return ESP_OK;
 }
 
@@ -157,6 +352,8 @@ extern "C" esp_err_t usb_cdc_wrapper_set_line_control(bool dtr, bool rts)
     if (!s_device_connected) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_RETURN_ON_ERROR(s_vcp->set_control_line_state(dtr, rts), TAG, "set_control_line_state failed");
+    std::shared_ptr<CdcAcmDevice> vcp = get_vcp();
+    ESP_RETURN_ON_FALSE(vcp, ESP_ERR_INVALID_STATE, TAG, "device not open");
+    ESP_RETURN_ON_ERROR(vcp->set_control_line_state(dtr, rts), TAG, "set_control_line_state failed");
     return ESP_OK;
 }
@@ -15,6 +15,9 @@ esp_err_t usb_cdc_wrapper_wait_for_device_disconnected(void);
 esp_err_t usb_cdc_wrapper_set_baudrate(unsigned baudrate);
 esp_err_t usb_cdc_wrapper_set_line_control(bool dtr, bool rts);
 esp_err_t usb_cdc_wrapper_send_data(const uint8_t *data, size_t len);
+/* Wait until the data passed to usb_cdc_wrapper_send_data has been transferred to the device.
+ * Returns ESP_ERR_TIMEOUT if that took longer than timeout_ms. */
+esp_err_t usb_cdc_wrapper_wait_tx_done(unsigned timeout_ms);
 
 
 #ifdef __cplusplus
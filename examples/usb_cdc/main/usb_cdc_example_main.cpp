@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "esp_err.h"
+#include "esp_check.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "esp_netif.h"
+#include "esp_intr_alloc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "protocol_examples_common.h"
+#include "sdkconfig.h"
+
+#include "rfc2217_server.hpp"
+#include "cdc_wrapper.h"
+
+static const char *TAG = "app_main";
+
+namespace {
+
+// Receives the callbacks from the RFC2217 server and forwards them to the USB device
+class UsbCdcBridge {
+public:
+    void on_client_connected()
+    {
+        ESP_LOGI(TAG, "RFC2217 client connected");
+        m_client_connected = true;
+    }
+
+    void on_client_disconnected()
+    {
+        ESP_LOGI(TAG, "RFC2217 client disconnected");
+        m_client_connected = false;
+    }
+
+    void on_data_received(rfc2217::ByteView data)
+    {
+        usb_cdc_wrapper_send_data(data.data(), data.size());
+    }
+
+    int on_drain(unsigned timeout_ms)
+    {
+        // data staged for USB before a baud rate change or a break goes out before it
+        return usb_cdc_wrapper_wait_tx_done(timeout_ms) == ESP_OK ? 0 : -1;
+    }
+
+    unsigned on_baudrate(unsigned baudrate)
+    {
+        usb_cdc_wrapper_set_baudrate(baudrate);
+        return baudrate;
+    }
+
+    void on_line_state(bool dtr, bool rts, bool brk)
+    {
+        // DTR and RTS changed together by the client arrive in one call, and go out in one USB transfer
+        usb_cdc_wrapper_set_line_control(dtr, rts);
+    }
+
+    bool client_connected() const
+    {
+        return m_client_connected;
+    }
+
+private:
+    volatile bool m_client_connected = false;
+};
+
+UsbCdcBridge s_bridge;
+rfc2217::Server<UsbCdcBridge> s_server;
+
+void on_data_received_from_usb(const uint8_t *data, size_t len)
+{
+    if (!s_bridge.client_connected()) {
+        return;
+    }
+    s_server.send({data, len});
+}
+
+} // namespace
+
+extern "C" void app_main(void)
+{
+    ESP_ERROR_CHECK(nvs_flash_init());
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    ESP_ERROR_CHECK(example_connect());
+    ESP_ERROR_CHECK(usb_cdc_wrapper_init(on_data_received_from_usb));
+
+    rfc2217_server_config_t config = {};
+    config.port = 3333;
+    config.task_stack_size = 4096;
+    config.task_priority = 5;
+    config.task_core_id = RFC2217_NO_AFFINITY;
+    // pySerial sends a DTR or RTS change 50 ms after the previous one (it checks for the reply every 50 ms),
+    // merge the changes which esptool makes together
+    config.line_state_window_us = 60000;
+
+    s_server = rfc2217::Server<UsbCdcBridge>(s_bridge, config);
+    if (!s_server.valid()) {
+        ESP_LOGE(TAG, "Failed to create RFC2217 server");
+        abort();
+    }
+
+    ESP_LOGI(TAG, "Starting RFC2217 server on port %u", config.port);
+
+    ESP_ERROR_CHECK(s_server.start());
+
+    while (true) {
+        usb_cdc_wrapper_wait_for_device_connected();
+        ESP_LOGI(TAG, "USB Device connected");
+        usb_cdc_wrapper_wait_for_device_disconnected();
+        ESP_LOGI(TAG, "USB Device disconnected");
+    }
+}
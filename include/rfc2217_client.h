@@ -0,0 +1,192 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "rfc2217_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief RFC2217 client instance handle
+ */
+typedef struct rfc2217_client_s *rfc2217_client_t;
+
+/**
+ * @brief Parity values of SET_PARITY
+ */
+typedef enum {
+    RFC2217_PARITY_NONE = 1,    //!< No parity
+    RFC2217_PARITY_ODD = 2,     //!< Odd parity
+    RFC2217_PARITY_EVEN = 3,    //!< Even parity
+    RFC2217_PARITY_MARK = 4,    //!< Mark parity
+    RFC2217_PARITY_SPACE = 5    //!< Space parity
+} rfc2217_parity_t;
+
+/**
+ * @brief Stop bit values of SET_STOPSIZE
+ */
+typedef enum {
+    RFC2217_STOPBITS_1 = 1,     //!< 1 stop bit
+    RFC2217_STOPBITS_2 = 2,     //!< 2 stop bits
+    RFC2217_STOPBITS_1_5 = 3    //!< 1.5 stop bits
+} rfc2217_stopbits_t;
+
+/**
+ * @brief Serial line settings
+ */
+typedef struct {
+    uint32_t baudrate;          //!< baud rate
+    uint8_t datasize;           //!< number of data bits, 5 to 8
+    rfc2217_parity_t parity;    //!< parity
+    rfc2217_stopbits_t stopbits;    //!< number of stop bits
+} rfc2217_line_config_t;
+
+/**
+ * @brief Notifications sent by the server
+ */
+typedef enum {
+    RFC2217_CLIENT_NOTIFY_LINESTATE,    //!< line state changed, value is the line state byte
+    RFC2217_CLIENT_NOTIFY_MODEMSTATE,   //!< modem state changed, value is the modem state byte
+    RFC2217_CLIENT_NOTIFY_FLOWCONTROL_SUSPEND,  //!< server asks the client to stop sending data
+    RFC2217_CLIENT_NOTIFY_FLOWCONTROL_RESUME    //!< server allows the client to send data again
+} rfc2217_client_notify_t;
+
+/**
+ * @brief callback on data received from the server
+ * @param ctx context pointer passed to rfc2217_client_create
+ * @param data pointer to received data
+ * @param len length of received data
+ */
+typedef void (*rfc2217_client_on_data_received_t)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief callback on a notification from the server
+ * @param ctx context pointer passed to rfc2217_client_create
+ * @param notify type of the notification
+ * @param value line or modem state, 0 for flow control notifications
+ */
+typedef void (*rfc2217_client_on_notify_t)(void *ctx, rfc2217_client_notify_t notify, uint8_t value);
+
+/**
+ * @brief callback on the connection closed by the server or by a network error
+ * @param ctx context pointer passed to rfc2217_client_create
+ */
+typedef void (*rfc2217_client_on_disconnected_t)(void *ctx);
+
+/**
+ * @brief RFC2217 client configuration
+ */
+typedef struct {
+    void *ctx;  //!< context pointer passed to callbacks
+    rfc2217_client_on_data_received_t on_data_received; //!< callback called with data from the server; if NULL, data is read with rfc2217_client_recv
+    rfc2217_client_on_notify_t on_notify;   //!< callback called on notifications from the server
+    rfc2217_client_on_disconnected_t on_disconnected;   //!< callback called when the server closes the connection
+    size_t rx_buffer_size;      //!< size of the socket read buffer (0: default, 4096)
+    size_t tx_buffer_size;      //!< size of the buffer used to escape data sent to the server (0: default, 4096)
+    size_t rx_queue_size;       //!< if on_data_received is NULL, size of the queue read by rfc2217_client_recv (0: default, 16384)
+    unsigned timeout_ms;        //!< how long to wait for the server to accept the connection and reply to requests (0: default, 3000 ms)
+    unsigned task_stack_size;   //!< stack size of the receive task (0: default)
+    unsigned task_priority;     //!< priority of the receive task (0: default)
+    unsigned task_core_id;      //!< core ID of the receive task (RFC2217_NO_AFFINITY: not pinned)
+} rfc2217_client_config_t;
+
+/*
+ * Data path of the client
+ *
+ * rfc2217_client_send sends the parts of the data without IAC straight from the caller's buffer,
+ * and copies data around IAC bytes into tx_buffer_size chunks with the IACs doubled, so large writes
+ * take a few send calls regardless of the content. The receive task reads rx_buffer_size blocks and
+ * passes the data between telnet commands to on_data_received in one piece; escaped IACs only split
+ * a block. Without on_data_received, the data is copied into a lock-free queue read by
+ * rfc2217_client_recv; when the queue is full, the receive task stops reading from the socket, so
+ * the server gets TCP backpressure.
+ * Requests (line settings, control, purge) are sent between data chunks and wait for the reply of
+ * the server, which the receive task processes ahead of data queued behind it in the socket.
+ * Callbacks are called from the receive task, and must not call rfc2217_client_disconnect.
+ */
+
+/** @brief Create RFC2217 client instance
+ *
+ * @param config RFC2217 client configuration
+ * @param out_client pointer to store created client instance
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_client_create(const rfc2217_client_config_t *config, rfc2217_client_t *out_client);
+
+/** @brief Connect to an RFC2217 server
+ *
+ * Returns after the server has accepted the COM-PORT-OPTION, or timeout_ms.
+ *
+ * @param client RFC2217 client instance
+ * @param host host name or address of the server
+ * @param port TCP port of the server
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_client_connect(rfc2217_client_t client, const char *host, unsigned port);
+
+/** @brief Set baud rate, data size, parity and stop bits
+ *
+ * The four requests are sent together, and the function waits for all the replies.
+ *
+ * @param client RFC2217 client instance
+ * @param config requested line settings
+ * @param out_actual pointer to store the settings reported by the server, may be NULL
+ * @return 0 on success, negative error code on failure or timeout
+ */
+int rfc2217_client_set_line_config(rfc2217_client_t client, const rfc2217_line_config_t *config, rfc2217_line_config_t *out_actual);
+
+/** @brief Set flow control, break, DTR or RTS
+ *
+ * @param client RFC2217 client instance
+ * @param control requested control setting
+ * @param out_actual pointer to store the value reported by the server, may be NULL
+ * @return 0 on success, negative error code on failure or timeout
+ */
+int rfc2217_client_set_control(rfc2217_client_t client, rfc2217_control_t control, rfc2217_control_t *out_actual);
+
+/** @brief Ask the server to purge its buffers
+ *
+ * @param client RFC2217 client instance
+ * @param purge buffers to purge
+ * @return 0 on success, negative error code on failure or timeout
+ */
+int rfc2217_client_purge(rfc2217_client_t client, rfc2217_purge_t purge);
+
+/** @brief Send data to the server
+ *
+ * @param client RFC2217 client instance
+ * @param data pointer to data to send
+ * @param len length of data to send
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_client_send(rfc2217_client_t client, const uint8_t *data, size_t len);
+
+/** @brief Read data received from the server, if on_data_received is not set
+ *
+ * @param client RFC2217 client instance
+ * @param buf buffer to store the data
+ * @param len size of the buffer
+ * @param timeout_ms how long to wait for data if none is available
+ * @return number of bytes read, 0 on timeout, negative error code if disconnected and no data is left
+ */
+int rfc2217_client_recv(rfc2217_client_t client, uint8_t *buf, size_t len, unsigned timeout_ms);
+
+/** @brief Close the connection
+ *
+ * @param client RFC2217 client instance
+ * @return 0 on success, negative error code if not connected
+ */
+int rfc2217_client_disconnect(rfc2217_client_t client);
+
+/** @brief Destroy RFC2217 client instance, closing the connection if open
+ *
+ * @param client RFC2217 client instance
+ */
+void rfc2217_client_destroy(rfc2217_client_t client);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rfc2217_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Multi-port mux (CONFIG_RFC2217_SERVER_MUX)
+ *
+ * Serves the ports of several server instances over one TCP connection, so that a client using many
+ * ports of a device needs one connection, one handshake and one pair of tasks on the device instead of
+ * one per port. Each port is a channel; the data of a channel is the RFC2217 session of the port, exactly
+ * as on its own listener, so the line settings, control lines and purges of each port are set separately
+ * and the callbacks of each server instance are called as for a client of its own.
+ *
+ * Protocol, on the mux port:
+ *
+ * 1. The client sends the telnet subnegotiation IAC SB RFC2217_MUX_OPTION <version> IAC SE, with
+ *    RFC2217_MUX_OPTION an option number not assigned by IANA. The server replies with
+ *    IAC SB RFC2217_MUX_OPTION RFC2217_MUX_VERSION <channel count> IAC SE, and closes the connection
+ *    if the version is not RFC2217_MUX_VERSION.
+ * 2. From then on, both sides send frames: <channel> <length, 2 bytes, big endian> <length bytes>.
+ *    Channels are numbered from 0 to channel count - 1, in the order of config.channels.
+ * 3. Frames on RFC2217_MUX_CONTROL_CHANNEL carry commands:
+ *    - RFC2217_MUX_CMD_OPEN <channel>: starts a session on the channel, as if a client connected to the
+ *      port. The server replies with RFC2217_MUX_CMD_OPEN <channel> <rfc2217_mux_open_status_t>, and
+ *      only then sends frames of the channel, starting with the telnet negotiation.
+ *    - RFC2217_MUX_CMD_CLOSE <channel>: ends the session, as if the client disconnected. The server
+ *      replies with RFC2217_MUX_CMD_CLOSE <channel>, after the last frame of the channel.
+ * 4. Frames of channels which aren't open are dropped. Closing the connection closes all channels.
+ *
+ * A port serves one session at a time: while a channel is open, a client connecting to the listener of
+ * the port is disconnected, and a channel can't be opened while the port has a client (status BUSY).
+ *
+ * One task reads the connection and processes the data of all channels, calling the callbacks of the
+ * server instances. If a channel can't take its data (on_data_received is slow, or the serial device sent
+ * XOFF), the other channels wait too; set rx_queue_size of the server instances to decouple them.
+ * A second task sends the data of the channels: it takes up to quantum bytes from each channel with data
+ * in turn and sends them with one send call, so a channel with a lot of data doesn't delay the others by
+ * more than quantum bytes each. Data sent by the application waits in channel_tx_buffer_size bytes of
+ * buffer per channel; rfc2217_server_send_data blocks while it is full. tx_queue_size and the flush
+ * delimiters of the server instances apply only to clients on their own listeners.
+ *
+ * The server instances don't need to be started to be used by the mux; start them to also serve the
+ * ports on their own listeners. Stop the mux before stopping or destroying the server instances.
+ */
+
+#define RFC2217_MUX_OPTION 0xC8             //!< telnet option number of the mux subnegotiation
+#define RFC2217_MUX_VERSION 1               //!< version of the protocol
+#define RFC2217_MUX_CONTROL_CHANNEL 0xFF    //!< channel number of the command frames
+#define RFC2217_MUX_MAX_CHANNELS 254        //!< maximum number of channels
+#define RFC2217_MUX_CMD_OPEN 1              //!< open a channel, see above
+#define RFC2217_MUX_CMD_CLOSE 2             //!< close a channel, see above
+
+/**
+ * @brief Result of RFC2217_MUX_CMD_OPEN
+ */
+typedef enum {
+    RFC2217_MUX_OPEN_OK = 0,            //!< channel is open
+    RFC2217_MUX_OPEN_BUSY = 1,          //!< port has a client, or the channel is open already
+    RFC2217_MUX_OPEN_NO_CHANNEL = 2     //!< no such channel
+} rfc2217_mux_open_status_t;
+
+/**
+ * @brief Mux instance handle
+ */
+typedef struct rfc2217_mux_s *rfc2217_mux_t;
+
+/**
+ * @brief Mux configuration
+ */
+typedef struct {
+    const rfc2217_server_t *channels;   //!< server instances served on channels 0, 1, ...
+    size_t channel_count;       //!< number of entries in channels, at most RFC2217_MUX_MAX_CHANNELS
+    unsigned port;              //!< TCP port of the mux
+    size_t channel_tx_buffer_size;  //!< size of the buffer of data waiting to be sent, per channel (0: default, 2048)
+    size_t quantum;             //!< bytes sent from one channel before the next channel's turn (0: default, 512)
+    unsigned task_stack_size;   //!< stack size of the mux tasks (0: default)
+    unsigned task_priority;     //!< priority of the mux tasks (0: default)
+    unsigned task_core_id;      //!< core ID of the task reading the connection (RFC2217_NO_AFFINITY: not pinned)
+    unsigned tx_task_core_id;   //!< core ID of the task sending to the connection (RFC2217_NO_AFFINITY: not pinned)
+} rfc2217_mux_config_t;
+
+/** @brief Create mux instance
+ *
+ * @param config mux configuration; the channels array is copied
+ * @param out_mux pointer to store created mux instance
+ * @return 0 on success, negative error code on failure or if CONFIG_RFC2217_SERVER_MUX is disabled
+ */
+int rfc2217_mux_create(const rfc2217_mux_config_t *config, rfc2217_mux_t *out_mux);
+
+/** @brief Start listening on the mux port
+ *
+ * @param mux mux instance
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_mux_start(rfc2217_mux_t mux);
+
+/** @brief Stop the mux, closing the connection and all channels
+ *
+ * @param mux mux instance
+ * @return 0 on success, negative error code if not started
+ */
+int rfc2217_mux_stop(rfc2217_mux_t mux);
+
+/** @brief Destroy mux instance, stopping it if started
+ *
+ * @param mux mux instance
+ */
+void rfc2217_mux_destroy(rfc2217_mux_t mux);
+
+#ifdef __cplusplus
+};
+#endif
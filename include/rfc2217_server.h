@@ -2,11 +2,17 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Core ID of a task which may run on any core (tskNO_AFFINITY)
+ */
+#define RFC2217_NO_AFFINITY 0x7FFFFFFFU
+
 /**
  * @brief RFC2217 server instance handle
  */
@@ -32,11 +38,20 @@ typedef enum {
  * @brief RFC2217 purge request definitions
  */
 typedef enum {
-    RFC2217_PURGE_RECEIVE = 0,      //!< Request to purge receive buffer
-    RFC2217_PURGE_TRANSMIT = 1,     //!< Request to purge transmit buffer
-    RFC2217_PURGE_BOTH = 2          //!< Request to purge both receive and transmit buffers
+    RFC2217_PURGE_RECEIVE = 1,      //!< Request to purge the receive buffer: data from the serial device not yet sent to the client
+    RFC2217_PURGE_TRANSMIT = 2,     //!< Request to purge the transmit buffer: data from the client not yet sent on the serial line
+    RFC2217_PURGE_BOTH = 3          //!< Request to purge both receive and transmit buffers
 } rfc2217_purge_t;
 
+/**
+ * @brief Protocol used on the server port
+ */
+typedef enum {
+    RFC2217_SERVER_MODE_RFC2217 = 0,    //!< telnet with the RFC2217 option (default)
+    RFC2217_SERVER_MODE_RAW = 1,        //!< plain TCP, data is passed through unchanged
+    RFC2217_SERVER_MODE_AUTO = 2        //!< RFC2217 if the client starts telnet negotiation right after connecting, raw otherwise
+} rfc2217_server_mode_t;
+
 /**
  * @brief baudrate change request callback
  *
@@ -55,15 +70,37 @@ typedef unsigned (*rfc2217_on_baudrate_t)(void *ctx, unsigned requested_baudrate
  */
 typedef rfc2217_control_t (*rfc2217_on_control_t)(void *ctx, rfc2217_control_t requested_control);
 
+/**
+ * @brief line state change callback, called instead of on_control for DTR, RTS and break changes
+ *
+ * @param ctx context pointer passed to rfc2217_server_create
+ * @param dtr requested state of DTR
+ * @param rts requested state of RTS
+ * @param brk true to send a break, false to end it
+ */
+typedef void (*rfc2217_on_line_state_t)(void *ctx, bool dtr, bool rts, bool brk);
+
 /**
  * @brief buffer purge request callback
  *
+ * The application purges the buffers of the serial device. When the callback returns, the server drops the
+ * data in its own queues (tx_queue_size, rx_queue_size) for the requested buffers, including data passed to
+ * rfc2217_server_send_data while the callback ran, and sends the return value to the client as the result.
+ *
  * @param ctx context pointer passed to rfc2217_server_create
  * @param requested_purge requested buffer purge
  * @return actual buffer purge that was performed
  */
 typedef rfc2217_purge_t (*rfc2217_on_purge_t)(void *ctx, rfc2217_purge_t requested_purge);
 
+/**
+ * @brief callback to wait until data passed to on_data_received has been sent on the serial line
+ * @param ctx context pointer passed to rfc2217_server_create
+ * @param timeout_ms longest time to wait
+ * @return 0 if the data has been sent, -1 on timeout or error
+ */
+typedef int (*rfc2217_on_drain_t)(void *ctx, unsigned timeout_ms);
+
 /**
  * @brief callback on client connection
  * @param ctx context pointer passed to rfc2217_server_create
@@ -84,6 +121,74 @@ typedef void (*rfc2217_on_client_disconnected_t)(void *ctx);
  */
 typedef void (*rfc2217_on_data_received_t)(void *ctx, const uint8_t *data, size_t len);
 
+/**
+ * @brief callback on a trigger pattern found in the data sent to the client
+ * @param ctx context pointer passed to rfc2217_server_create
+ * @param pattern_index index of the pattern in trigger_patterns
+ */
+typedef void (*rfc2217_on_trigger_t)(void *ctx, size_t pattern_index);
+
+/**
+ * @brief Application callbacks timed by the server
+ */
+typedef enum {
+    RFC2217_CALLBACK_DATA_RECEIVED, //!< on_data_received
+    RFC2217_CALLBACK_BAUDRATE,      //!< on_baudrate
+    RFC2217_CALLBACK_CONTROL,       //!< on_control
+    RFC2217_CALLBACK_PURGE,         //!< on_purge
+    RFC2217_CALLBACK_LINE_STATE,    //!< on_line_state
+    RFC2217_CALLBACK_COUNT          //!< number of timed callbacks
+} rfc2217_callback_t;
+
+/**
+ * @brief Memory allocated by the server, passed to the allocator
+ */
+typedef enum {
+    RFC2217_ALLOC_INSTANCE,     //!< server instance (only with rfc2217_server_create)
+    RFC2217_ALLOC_TX_QUEUE,     //!< TX queue, if tx_queue_size is non-zero
+    RFC2217_ALLOC_TRIGGERS,     //!< compiled trigger patterns, if trigger_pattern_count is non-zero
+    RFC2217_ALLOC_RAW_RX,       //!< receive buffer of raw mode, if mode isn't RFC2217_SERVER_MODE_RFC2217
+    RFC2217_ALLOC_CALLBACK_STATS,   //!< callback timing statistics, with CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    RFC2217_ALLOC_RX_QUEUE,     //!< RX queue, if rx_queue_size is non-zero
+    RFC2217_ALLOC_SITE_COUNT    //!< number of allocation sites
+} rfc2217_alloc_site_t;
+
+/**
+ * @brief Placement hint of an allocation
+ */
+typedef enum {
+    RFC2217_ALLOC_HOT,          //!< accessed for every byte or on every wakeup of the server tasks, best placed in internal RAM
+    RFC2217_ALLOC_BULK          //!< large buffer accessed sequentially, may be placed in external RAM
+} rfc2217_alloc_hint_t;
+
+/**
+ * @brief allocator function
+ * @param ctx context pointer from rfc2217_allocator_t
+ * @param site what the memory is used for
+ * @param hint where the memory should be placed; always the same for a site
+ * @param size size in bytes
+ * @return pointer to the memory, aligned for any type (doesn't need to be zeroed), or NULL on failure
+ */
+typedef void *(*rfc2217_alloc_t)(void *ctx, rfc2217_alloc_site_t site, rfc2217_alloc_hint_t hint, size_t size);
+
+/**
+ * @brief deallocator function
+ * @param ctx context pointer from rfc2217_allocator_t
+ * @param site site passed to the allocator function for this memory
+ * @param ptr pointer returned by the allocator function
+ * @param size size passed to the allocator function
+ */
+typedef void (*rfc2217_free_t)(void *ctx, rfc2217_alloc_site_t site, void *ptr, size_t size);
+
+/**
+ * @brief Allocator for the memory of a server instance
+ */
+typedef struct {
+    rfc2217_alloc_t alloc;      //!< allocator function
+    rfc2217_free_t free;        //!< deallocator function
+    void *ctx;                  //!< context pointer passed to the functions
+} rfc2217_allocator_t;
+
 /**
  * @brief RFC2217 server configuration
  */
@@ -93,14 +198,240 @@ typedef struct {
     rfc2217_on_client_disconnected_t on_client_disconnected;    //!< callback called when client disconnects
     rfc2217_on_baudrate_t on_baudrate;  //!< callback called when client requests baudrate change
     rfc2217_on_control_t on_control;    //!< callback called when client requests control signal change
+    rfc2217_on_line_state_t on_line_state;  //!< if set, DTR, RTS and break changes are merged and passed here instead of to on_control, see below
+    unsigned line_state_window_us;  //!< how long DTR and RTS changes are held back for more after the first one (0: only changes received together are merged)
     rfc2217_on_purge_t on_purge;    //!< callback called when client requests buffer purge
     rfc2217_on_data_received_t on_data_received;    //!< callback called when data is received from client
+    size_t rx_queue_size;       //!< if non-zero, data from the client is queued for rfc2217_server_read instead of being passed to on_data_received, see below
+    rfc2217_on_drain_t on_drain;    //!< if set, called before applying a baud rate change or a break, see below
+    unsigned drain_timeout_ms;  //!< timeout passed to on_drain (0: default, 1000 ms)
     unsigned port;              //!< TCP port to listen on
-    unsigned task_stack_size;   //!< server task stack size
-    unsigned task_priority;     //!< server task priority
-    unsigned task_core_id;      //!< server task core ID
+    unsigned task_stack_size;   //!< stack size of the server tasks (0: default)
+    unsigned task_priority;     //!< priority of the server tasks (0: default)
+    unsigned task_core_id;      //!< core ID of the server and network receive tasks (RFC2217_NO_AFFINITY: not pinned)
+    bool handle_xon_xoff;       //!< if true, XON/XOFF flow control selected by the client is implemented by the server, see below
+    size_t tx_queue_size;       //!< if non-zero, data is sent to the client from a separate TX task, through a queue of this size, see below
+    unsigned tx_task_core_id;   //!< core ID of the TX task, used if tx_queue_size is non-zero (RFC2217_NO_AFFINITY: not pinned)
+    uint8_t flush_delimiters[2];    //!< bytes which end a frame or line in the data sent to the client, e.g. 0xC0 for SLIP; used with tx_queue_size, see below
+    size_t flush_delimiter_count;   //!< number of entries in flush_delimiters (0 to 2); 0 sends queued data right away
+    size_t flush_threshold;     //!< queued bytes which are sent without waiting for a delimiter (0: default, half of the TX queue)
+    unsigned flush_timeout_ms;  //!< longest time data without a delimiter is held back (0: default, 10 ms)
+    size_t rx_shaper_burst;     //!< if non-zero, data is passed to on_data_received no faster than the serial line rate, in bursts of at most this many bytes, see below
+    unsigned rtt_probe_interval_ms; //!< if non-zero, round-trip time to the client is measured every this many milliseconds, see rfc2217_server_get_link_stats
+    const char *const *trigger_patterns;    //!< patterns to look for in the data passed to rfc2217_server_send_data, see below
+    size_t trigger_pattern_count;   //!< number of entries in trigger_patterns
+    rfc2217_on_trigger_t on_trigger;    //!< callback called when one of trigger_patterns is found
+    rfc2217_server_mode_t mode; //!< protocol used on the port, see below
+    unsigned auto_detect_timeout_ms;    //!< in RFC2217_SERVER_MODE_AUTO, how long to wait for telnet negotiation from a new client (0: default, 200 ms)
+    const rfc2217_allocator_t *allocator;   //!< allocator for the memory of the server, NULL to use the default, see below
+    unsigned callback_budget_us[RFC2217_CALLBACK_COUNT];    //!< longest expected duration of each callback, indexed by rfc2217_callback_t (0: no budget), see below
+    unsigned callback_watchdog_ms;  //!< if non-zero, a callback still running after this time is reported with the session state, see below
 } rfc2217_server_config_t;
 
+/**
+ * @brief Link quality statistics of the current client connection
+ */
+typedef struct {
+    uint32_t srtt_us;           //!< smoothed round-trip time in microseconds, 0 if not measured yet
+    uint32_t rttvar_us;         //!< round-trip time variation (jitter) in microseconds
+    uint32_t last_rtt_us;       //!< last round-trip time sample in microseconds
+    uint32_t rtt_samples;       //!< number of round-trip time samples taken in this connection
+    int32_t socket_unsent_bytes;    //!< bytes in the socket send buffer, not sent or not acknowledged yet; -1 if the TCP/IP stack can't report it
+    size_t tx_queue_bytes;      //!< bytes waiting in the TX queue (tx_queue_size != 0)
+    size_t rx_queue_bytes;      //!< bytes waiting in the RX queue for rfc2217_server_read (rx_queue_size != 0)
+} rfc2217_server_link_stats_t;
+
+/**
+ * @brief Memory use of one allocation site
+ */
+typedef struct {
+    size_t current;             //!< bytes allocated now
+    size_t peak;                //!< highest value of current since the server was created
+    uint32_t allocations;       //!< number of successful allocations
+    uint32_t failures;          //!< number of failed allocations
+} rfc2217_alloc_stats_t;
+
+/**
+ * @brief Timing statistics of one callback
+ */
+typedef struct {
+    uint32_t calls;             //!< number of calls
+    uint32_t over_budget;       //!< calls which took longer than the budget set in callback_budget_us
+    uint32_t stuck;             //!< calls reported by the watchdog
+    uint32_t max_us;            //!< longest call in microseconds
+    uint32_t mean_us;           //!< average duration in microseconds
+    uint32_t p50_us;            //!< median duration in microseconds, rounded up to a power of two minus one
+    uint32_t p99_us;            //!< 99th percentile duration in microseconds, rounded up to a power of two minus one
+} rfc2217_callback_stats_t;
+
+/*
+ * Pacing of received data at the serial line rate (rx_shaper_burst != 0)
+ *
+ * The server tracks the baud rate (as returned by on_baudrate), data size, parity and stop size set by
+ * the client, and passes data to on_data_received no faster than the serial line can transmit it,
+ * with bursts of up to rx_shaper_burst bytes (token bucket). While the server waits, it doesn't read
+ * from the socket, so the client gets TCP backpressure instead of on_data_received blocking on a full
+ * serial TX buffer. rx_shaper_burst should not exceed the TX buffer of the serial driver, and should be
+ * large enough to cover one RTOS tick at the highest baud rate used, otherwise the tick granularity
+ * limits the throughput. Data is not paced until the client sets the baud rate.
+ */
+
+/*
+ * Reading received data (rx_queue_size != 0)
+ *
+ * By default, the task which reads the socket passes the data to on_data_received, and reads nothing else
+ * until the callback returns; while a slow backend blocks in it (a full UART TX buffer, a USB transfer),
+ * requests from the client behind the data wait, and so do round-trip time probes and merged line state
+ * changes. With rx_queue_size set, the data goes into a lock-free queue of this size (rounded down to a
+ * power of two), and the application takes it from there with rfc2217_server_read, from a task of its own;
+ * on_data_received is not called. The server reads no more from the socket than there is space for in
+ * the queue, so a slow backend gives the client TCP backpressure and never blocks the session task:
+ * requests in the data read are processed as soon as they arrive, ahead of the data still queued.
+ * Before applying a baud rate change or a break, the server waits (up to drain_timeout_ms) until the
+ * application has read the data received before the request, then calls on_drain if it is set. While the
+ * serial device has sent XOFF (handle_xon_xoff), rfc2217_server_read returns no data. rx_shaper_burst is
+ * ignored: the application takes the data at its own pace. Data left in the queue when the client
+ * disconnects can still be read. Only one task may call rfc2217_server_read.
+ */
+
+/*
+ * Draining before baud rate changes and breaks (on_drain set)
+ *
+ * Data and commands from the client are processed in order, but data passed to on_data_received
+ * may still be in the TX buffer of the serial driver when a later SET_BAUDRATE arrives; it would then
+ * go out at the new baud rate. If on_drain is set, the server calls it before on_baudrate (for a
+ * baud rate change, not a query) and before on_control with RFC2217_CONTROL_SET_BREAK, and applies the
+ * change and replies to the client only after it returns. This lets clients such as esptool switch the
+ * baud rate right after sending data, without waiting on their side. If on_drain times out, the change
+ * is applied anyway. No data is read from the client while on_drain waits. For a UART, on_drain
+ * can call uart_wait_tx_done.
+ */
+
+/*
+ * Merging line state changes (on_line_state set)
+ *
+ * Clients change DTR, RTS and break with one SET_CONTROL request per signal; esptool's reset sequence
+ * changes DTR and RTS together several times. With on_control, each request is applied on its own, which
+ * costs a transfer per signal on a USB CDC device, and shows the device a state in between which the
+ * client never asked for. If on_line_state is set, these requests are not passed to on_control. The
+ * server merges the requests received in one block from the client, or within line_state_window_us of
+ * the first one, and calls on_line_state once with the resulting state of all three signals. Replies to
+ * the requests of one block are sent together. pySerial (and esptool, which uses it) waits for the reply
+ * to each request before sending the next one, checking for it every 50 ms, so its changes arrive 50 ms
+ * apart and are merged with a window of about 60 ms. The replies are then sent right away, and the
+ * changes are applied when the window ends, delayed by up to line_state_window_us (rounded up to whole
+ * milliseconds when no more data arrives); the time between the groups of changes is kept. Changes which cancel
+ * out within the window (a DTR or RTS pulse shorter than the window) are not applied. Pending changes
+ * are applied before any other request or data from the client is processed, and break changes are
+ * applied at once. DTR, RTS and break are off at the start of each session. Other SET_CONTROL requests
+ * (flow control, queries) still go to on_control.
+ */
+
+/*
+ * Raw mode (mode != RFC2217_SERVER_MODE_RFC2217)
+ *
+ * In a raw session, data is passed between the socket and rfc2217_server_send_data/on_data_received
+ * unchanged: there is no telnet processing, and 0xFF bytes are not escaped. Control requests, server-side
+ * flow control, pacing and round-trip time measurement are not available. The data from the client is read
+ * in blocks of CONFIG_RFC2217_SERVER_RAW_RX_BUFFER_SIZE bytes. on_client_connected is called when the
+ * session starts.
+ * In RFC2217_SERVER_MODE_AUTO, the server waits up to auto_detect_timeout_ms after accepting a connection
+ * for the first data from the client. If the data starts with IAC, the session uses RFC2217, otherwise (or
+ * if nothing arrives) it is raw. RFC2217 clients such as pySerial start the negotiation immediately, while
+ * tools such as nc and socat wait for the user. Until the mode is decided, rfc2217_server_send_data fails
+ * as if no client was connected.
+ */
+
+/*
+ * Trigger patterns (trigger_pattern_count != 0)
+ *
+ * rfc2217_server_create compiles trigger_patterns (non-empty, NUL-terminated strings) into an
+ * Aho-Corasick automaton; the strings aren't referenced afterwards. rfc2217_server_send_data scans
+ * the data passed to it, before sending it, and calls on_trigger for every occurrence of a pattern,
+ * including occurrences split between calls. Data is scanned even when no client is connected.
+ * The scan costs a few table lookups per byte on average, independent of the number of patterns, and
+ * never more than the length of the longest pattern. Memory use is about 12 bytes per pattern character
+ * plus 512 bytes; the total length of the patterns must be below 65535.
+ * on_trigger is called from the task calling rfc2217_server_send_data, and must not call
+ * rfc2217_server_send_data itself. If several tasks send data, matches are only reliable if the
+ * calls don't overlap.
+ */
+
+/*
+ * Separate TX task (tx_queue_size != 0)
+ *
+ * By default, rfc2217_server_send_data sends the data to the client from the calling task.
+ * With tx_queue_size set, it copies the data into a lock-free queue and returns; a separate TX task,
+ * pinned to tx_task_core_id, sends the data to the client. On dual-core chips this allows network
+ * receive (task_core_id) and network send (tx_task_core_id) to run on different cores. Note that
+ * core ID 0 pins the tasks to the core running Wi-Fi on most dual-core chips; use
+ * RFC2217_NO_AFFINITY to let the scheduler choose.
+ * rfc2217_server_send_data only blocks while the queue is full. Concurrent callers of
+ * rfc2217_server_send_data are serialized with a mutex. The queue size is rounded down to a power of two.
+ */
+
+/*
+ * Flushing on delimiters (tx_queue_size != 0 and flush_delimiter_count != 0)
+ *
+ * Serial devices often write a frame or a line in several pieces, and the TX task would send each
+ * piece to the client as a separate TCP segment. With flush_delimiters set, rfc2217_server_send_data
+ * scans the data it queues for the delimiters (a word at a time), and the TX task holds queued data
+ * back until a delimiter arrives, then sends everything up to the last delimiter at once. A delimiter
+ * right after the previous one doesn't trigger a flush, as it starts a frame. Data is also sent when
+ * flush_threshold bytes are queued, when it was held back for flush_timeout_ms, and when the client
+ * disconnects. Use 0xC0 for SLIP frames (esptool) or '\n' for text lines. This saves segments and
+ * client wakeups, and a frame is never sent later than when its last byte is queued.
+ */
+
+/*
+ * Memory allocation
+ *
+ * The server allocates all its memory in rfc2217_server_create or rfc2217_server_create_static, and
+ * frees it in rfc2217_server_destroy; nothing is allocated per connection or per data block. Each
+ * allocation is tagged with its site (rfc2217_alloc_site_t) and a placement hint: the instance, the
+ * trigger automaton, the raw mode receive buffer and the callback statistics are HOT, the TX and RX queues
+ * are BULK.
+ * If allocator is set, the server calls it for all of these, so the application can place them in
+ * specific memory (e.g. heap_caps_malloc with MALLOC_CAP_SPIRAM for BULK) or in an arena. The allocator
+ * must stay valid until rfc2217_server_destroy returns. Its functions are only called from
+ * rfc2217_server_create, rfc2217_server_create_static and rfc2217_server_destroy.
+ * Without an allocator, memory comes from malloc. With CONFIG_RFC2217_SERVER_BULK_IN_PSRAM, HOT
+ * memory comes from internal RAM and BULK memory from PSRAM, falling back to internal RAM.
+ * rfc2217_server_get_alloc_stats reports the memory in use and its high-water mark per site; the peak
+ * includes temporary memory used while compiling the trigger patterns.
+ */
+
+/*
+ * Callback timing (CONFIG_RFC2217_SERVER_CALLBACK_STATS)
+ *
+ * on_data_received, on_baudrate, on_control and on_purge run on the task which reads the socket, so a
+ * slow callback stalls the whole session. With CONFIG_RFC2217_SERVER_CALLBACK_STATS, the server times
+ * each call with the CPU cycle counter (a few cycles per call) and keeps per callback the number of
+ * calls, the maximum, the mean and a histogram, see rfc2217_server_get_callback_stats. Durations wrap
+ * around after 2^32 CPU cycles (about 18 s at 240 MHz), and are approximate with dynamic frequency
+ * scaling. on_drain, which waits on purpose, is not timed.
+ * A call which takes longer than its entry in callback_budget_us is counted in over_budget, and logged
+ * as a warning if it is also the longest call so far. If callback_watchdog_ms is set, the server task
+ * checks the callback in progress while a client is connected, and a call still running after
+ * callback_watchdog_ms is logged as an error once, with its argument (length, baud rate, control or purge
+ * value) and the state of the session, and counted in stuck.
+ * Without the option, the calls aren't timed, and rfc2217_server_get_callback_stats returns an error.
+ */
+
+/*
+ * XON/XOFF flow control handled by the server (handle_xon_xoff = true)
+ *
+ * When the client requests RFC2217_CONTROL_SET_XON_XOFF_FLOW_CONTROL, the request is still passed to
+ * on_control, but the server accepts it regardless of the value returned from the callback. While
+ * XON/XOFF flow control is active:
+ * - XOFF/XON characters in the data passed to rfc2217_server_send_data (i.e. sent by the serial device)
+ *   are removed from the stream. XOFF pauses delivery of data to on_data_received, XON resumes it.
+ *   While paused, the server stops reading from the socket, so the client gets TCP backpressure.
+ * - When the client sends FLOWCONTROL_SUSPEND/RESUME, the server passes a single XOFF/XON character
+ *   to on_data_received, so that the serial device stops/resumes sending.
+ * Selecting any other flow control mode disables this and resumes a paused data flow.
+ */
+
 
 /** @brief Create RFC2217 server instance
  *
@@ -110,6 +441,34 @@ typedef struct {
  */
 int rfc2217_server_create(const rfc2217_server_config_t *config, rfc2217_server_t *out_server);
 
+/**
+ * @brief Size of rfc2217_server_storage_t, in pointer-sized words
+ */
+#define RFC2217_SERVER_STORAGE_WORDS 216
+
+/**
+ * @brief Storage for a statically allocated RFC2217 server instance
+ *
+ * The contents are private. The size is checked against the actual instance size at compile time.
+ */
+typedef struct {
+    uintptr_t opaque[RFC2217_SERVER_STORAGE_WORDS];    //!< private
+} rfc2217_server_storage_t;
+
+/** @brief Create RFC2217 server instance in caller-provided storage
+ *
+ * Same as rfc2217_server_create, but doesn't allocate memory for the instance.
+ * The storage must stay valid until rfc2217_server_destroy is called.
+ * Optional buffers enabled in the configuration (e.g. tx_queue_size) are still allocated, from allocator
+ * if it is set, otherwise from the heap.
+ *
+ * @param config RFC2217 server configuration
+ * @param storage storage for the server instance
+ * @param out_server pointer to store created server instance
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_server_create_static(const rfc2217_server_config_t *config, rfc2217_server_storage_t *storage, rfc2217_server_t *out_server);
+
 /** @brief Start RFC2217 server
  *
  * @param server RFC2217 server instance
@@ -126,6 +485,50 @@ int rfc2217_server_start(rfc2217_server_t server);
  */
 int rfc2217_server_send_data(rfc2217_server_t server, const uint8_t *data, size_t len);
 
+/** @brief Read data received from the client, if rx_queue_size is set
+ *
+ * @param server RFC2217 server instance
+ * @param buf buffer to store the data
+ * @param len size of the buffer
+ * @param timeout_ms how long to wait for data if none is available
+ * @return number of bytes read, 0 on timeout, negative error code if rx_queue_size is not set or the feature is disabled
+ */
+int rfc2217_server_read(rfc2217_server_t server, uint8_t *buf, size_t len, unsigned timeout_ms);
+
+/** @brief Get link quality statistics of the current client connection
+ *
+ * Round-trip time is measured if rtt_probe_interval_ms is set, by sending telnet DO TIMING-MARK to
+ * the client (only to RFC2217 clients) and timing the reply. The sample includes the time the probe
+ * spends behind data already queued in the socket, and the time until the server processes the reply,
+ * i.e. it is the latency a control request sees, not only the network latency.
+ * socket_unsent_bytes is available on Linux; lwIP doesn't provide it.
+ *
+ * @param server RFC2217 server instance
+ * @param out_stats pointer to store the statistics
+ * @return 0 on success, negative error code if no client is connected or the feature is disabled
+ */
+int rfc2217_server_get_link_stats(rfc2217_server_t server, rfc2217_server_link_stats_t *out_stats);
+
+/** @brief Get memory use of the server per allocation site
+ *
+ * @param server RFC2217 server instance
+ * @param out_stats array of RFC2217_ALLOC_SITE_COUNT entries to store the statistics, indexed by rfc2217_alloc_site_t
+ * @return 0 on success, negative error code on failure
+ */
+int rfc2217_server_get_alloc_stats(rfc2217_server_t server, rfc2217_alloc_stats_t out_stats[RFC2217_ALLOC_SITE_COUNT]);
+
+/** @brief Get timing statistics of an application callback
+ *
+ * The statistics cover all calls since the server was created. They are updated by the task reading the
+ * socket without locking, so values read while a client is connected may be slightly inconsistent.
+ *
+ * @param server RFC2217 server instance
+ * @param callback callback to get the statistics of
+ * @param out_stats pointer to store the statistics
+ * @return 0 on success, negative error code if the callback is invalid or CONFIG_RFC2217_SERVER_CALLBACK_STATS is disabled
+ */
+int rfc2217_server_get_callback_stats(rfc2217_server_t server, rfc2217_callback_t callback, rfc2217_callback_stats_t *out_stats);
+
 /** @brief Stop RFC2217 server
  *
  * @param server RFC2217 server instance
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include "rfc2217_server.h"
+
+#if __cplusplus < 201703L
+#error "rfc2217_server.hpp requires C++17 or later"
+#endif
+
+/**
+ * @file rfc2217_server.hpp
+ * @brief Header-only C++ wrapper around the RFC2217 server C API
+ *
+ * The callbacks are bound at compile time: the handler type is a template parameter of
+ * rfc2217::Server, and each C callback is a small trampoline which calls the corresponding
+ * handler member function directly, so that the handler code can be inlined into it.
+ * Only the callbacks implemented by the handler are registered with the C API.
+ *
+ * Handler member functions (all optional):
+ *
+ *     void on_client_connected();
+ *     void on_client_disconnected();
+ *     unsigned on_baudrate(unsigned requested_baudrate);
+ *     rfc2217_control_t on_control(rfc2217_control_t requested_control);
+ *     void on_line_state(bool dtr, bool rts, bool brk);
+ *     rfc2217_purge_t on_purge(rfc2217_purge_t requested_purge);
+ *     void on_data_received(rfc2217::ByteView data);
+ *     int on_drain(unsigned timeout_ms);
+ *     void on_trigger(size_t pattern_index);
+ */
+
+namespace rfc2217 {
+
+/**
+ * @brief Non-owning view of a contiguous byte buffer
+ *
+ * Can be constructed from a pointer and a size, or implicitly from any contiguous container
+ * of 1-byte elements (std::array, std::vector, std::string, std::string_view, C arrays...).
+ */
+class ByteView {
+public:
+    constexpr ByteView() noexcept = default;
+    constexpr ByteView(const uint8_t *data, size_t size) noexcept : m_data(data), m_size(size) {}
+
+    template<class C,
+             class E = std::remove_pointer_t<decltype(std::data(std::declval<const C &>()))>,
+             class = std::enable_if_t<sizeof(E) == 1 && !std::is_same_v<std::decay_t<C>, ByteView>>>
+    constexpr ByteView(const C &container) noexcept
+        : m_data(reinterpret_cast<const uint8_t *>(std::data(container))), m_size(std::size(container)) {}
+
+    constexpr const uint8_t *data() const noexcept
+    {
+        return m_data;
+    }
+    constexpr size_t size() const noexcept
+    {
+        return m_size;
+    }
+    constexpr bool empty() const noexcept
+    {
+        return m_size == 0;
+    }
+    constexpr const uint8_t *begin() const noexcept
+    {
+        return m_data;
+    }
+    constexpr const uint8_t *end() const noexcept
+    {
+        return m_data + m_size;
+    }
+
+private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+namespace detail {
+
+template<class H, class = void> struct has_on_client_connected : std::false_type {};
+template<class H> struct has_on_client_connected<H, std::void_t<decltype(std::declval<H &>().on_client_connected())>> : std::true_type {};
+
+template<class H, class = void> struct has_on_client_disconnected : std::false_type {};
+template<class H> struct has_on_client_disconnected<H, std::void_t<decltype(std::declval<H &>().on_client_disconnected())>> : std::true_type {};
+
+template<class H, class = void> struct has_on_baudrate : std::false_type {};
+template<class H> struct has_on_baudrate<H, std::void_t<decltype(std::declval<H &>().on_baudrate(0U))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_control : std::false_type {};
+template<class H> struct has_on_control<H, std::void_t<decltype(std::declval<H &>().on_control(RFC2217_CONTROL_SET_DTR))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_line_state : std::false_type {};
+template<class H> struct has_on_line_state<H, std::void_t<decltype(std::declval<H &>().on_line_state(false, false, false))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_purge : std::false_type {};
+template<class H> struct has_on_purge<H, std::void_t<decltype(std::declval<H &>().on_purge(RFC2217_PURGE_BOTH))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_data_received : std::false_type {};
+template<class H> struct has_on_data_received<H, std::void_t<decltype(std::declval<H &>().on_data_received(ByteView{}))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_drain : std::false_type {};
+template<class H> struct has_on_drain<H, std::void_t<decltype(std::declval<H &>().on_drain(0U))>> : std::true_type {};
+
+template<class H, class = void> struct has_on_trigger : std::false_type {};
+template<class H> struct has_on_trigger<H, std::void_t<decltype(std::declval<H &>().on_trigger(size_t{}))>> : std::true_type {};
+
+} // namespace detail
+
+/**
+ * @brief RFC2217 server bound to a handler type
+ *
+ * Owns the underlying rfc2217_server_t. The server is stopped (if started) and destroyed when
+ * the object goes out of scope. The object is move-only. The handler is referenced, not owned,
+ * and must outlive the server.
+ */
+template<class Handler>
+class Server {
+public:
+    /** @brief Construct an empty server object, not associated with any server instance */
+    Server() noexcept = default;
+
+    /**
+     * @brief Create a server instance
+     *
+     * @param handler  handler which receives the callbacks
+     * @param config   server configuration; ctx and callback fields are ignored
+     *
+     * Check valid() to find out whether the server instance was created.
+     */
+    explicit Server(Handler &handler, const rfc2217_server_config_t &config)
+    {
+        rfc2217_server_config_t cfg = config;
+        cfg.ctx = &handler;
+        cfg.on_client_connected = nullptr;
+        cfg.on_client_disconnected = nullptr;
+        cfg.on_baudrate = nullptr;
+        cfg.on_control = nullptr;
+        cfg.on_line_state = nullptr;
+        cfg.on_purge = nullptr;
+        cfg.on_data_received = nullptr;
+        cfg.on_drain = nullptr;
+        cfg.on_trigger = nullptr;
+        if constexpr (detail::has_on_client_connected<Handler>::value) {
+            cfg.on_client_connected = [](void *ctx) {
+                static_cast<Handler *>(ctx)->on_client_connected();
+            };
+        }
+        if constexpr (detail::has_on_client_disconnected<Handler>::value) {
+            cfg.on_client_disconnected = [](void *ctx) {
+                static_cast<Handler *>(ctx)->on_client_disconnected();
+            };
+        }
+        if constexpr (detail::has_on_baudrate<Handler>::value) {
+            cfg.on_baudrate = [](void *ctx, unsigned requested_baudrate) -> unsigned {
+                return static_cast<Handler *>(ctx)->on_baudrate(requested_baudrate);
+            };
+        }
+        if constexpr (detail::has_on_control<Handler>::value) {
+            cfg.on_control = [](void *ctx, rfc2217_control_t requested_control) -> rfc2217_control_t {
+                return static_cast<Handler *>(ctx)->on_control(requested_control);
+            };
+        }
+        if constexpr (detail::has_on_line_state<Handler>::value) {
+            cfg.on_line_state = [](void *ctx, bool dtr, bool rts, bool brk) {
+                static_cast<Handler *>(ctx)->on_line_state(dtr, rts, brk);
+            };
+        }
+        if constexpr (detail::has_on_purge<Handler>::value) {
+            cfg.on_purge = [](void *ctx, rfc2217_purge_t requested_purge) -> rfc2217_purge_t {
+                return static_cast<Handler *>(ctx)->on_purge(requested_purge);
+            };
+        }
+        if constexpr (detail::has_on_data_received<Handler>::value) {
+            cfg.on_data_received = [](void *ctx, const uint8_t *data, size_t len) {
+                static_cast<Handler *>(ctx)->on_data_received(ByteView(data, len));
+            };
+        }
+        if constexpr (detail::has_on_drain<Handler>::value) {
+            cfg.on_drain = [](void *ctx, unsigned timeout_ms) -> int {
+                return static_cast<Handler *>(ctx)->on_drain(timeout_ms);
+            };
+        }
+        if constexpr (detail::has_on_trigger<Handler>::value) {
+            cfg.on_trigger = [](void *ctx, size_t pattern_index) {
+                static_cast<Handler *>(ctx)->on_trigger(pattern_index);
+            };
+        }
+        if (rfc2217_server_create(&cfg, &m_server) != 0) {
+            m_server = nullptr;
+        }
+    }
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    Server(Server &&other) noexcept
+        : m_server(std::exchange(other.m_server, nullptr)), m_started(std::exchange(other.m_started, false)) {}
+
+    Server &operator=(Server &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            m_server = std::exchange(other.m_server, nullptr);
+            m_started = std::exchange(other.m_started, false);
+        }
+        return *this;
+    }
+
+    ~Server()
+    {
+        reset();
+    }
+
+    /** @brief true if the server instance was created successfully */
+    bool valid() const noexcept
+    {
+        return m_server != nullptr;
+    }
+    explicit operator bool() const noexcept
+    {
+        return valid();
+    }
+
+    /** @brief Start the server, see rfc2217_server_start */
+    int start() noexcept
+    {
+        if (!m_server || m_started) {
+            return -1;
+        }
+        int res = rfc2217_server_start(m_server);
+        m_started = (res == 0);
+        return res;
+    }
+
+    /** @brief Stop the server, see rfc2217_server_stop */
+    int stop() noexcept
+    {
+        if (!m_server || !m_started) {
+            return -1;
+        }
+        m_started = false;
+        return rfc2217_server_stop(m_server);
+    }
+
+    /** @brief Send data to the client, see rfc2217_server_send_data */
+    int send(ByteView data) noexcept
+    {
+        if (!m_server) {
+            return -1;
+        }
+        return rfc2217_server_send_data(m_server, data.data(), data.size());
+    }
+
+    /** @brief Read data received from the client, see rfc2217_server_read */
+    int read(uint8_t *buf, size_t len, unsigned timeout_ms) noexcept
+    {
+        if (!m_server) {
+            return -1;
+        }
+        return rfc2217_server_read(m_server, buf, len, timeout_ms);
+    }
+
+    /** @brief Underlying C handle, for functions not covered by the wrapper */
+    rfc2217_server_t get() const noexcept
+    {
+        return m_server;
+    }
+
+private:
+    void reset() noexcept
+    {
+        if (m_server) {
+            if (m_started) {
+                rfc2217_server_stop(m_server);
+                m_started = false;
+            }
+            rfc2217_server_destroy(m_server);
+            m_server = nullptr;
+        }
+    }
+
+    rfc2217_server_t m_server = nullptr;
+    bool m_started = false;
+};
+
+} // namespace rfc2217
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "rfc2217_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Test sessions (CONFIG_RFC2217_SERVER_TEST_HOOKS, Linux target only)
+ *
+ * A test session runs the session code of the server on the calling task, without sockets and without
+ * the server tasks, under a clock provided by the test. The test passes the bytes the client would send
+ * to rfc2217_server_test_feed, and gets the bytes the server sends to the client in on_send. The server
+ * reads the time only from now_us, and instead of waiting (pacing with rx_shaper_burst) it calls
+ * sleep_us; with a virtual clock, sleep_us just advances the time. Time-based work which the server tasks
+ * would do on their own (round-trip time probes, sending data held back in the TX queue) is done in
+ * rfc2217_server_test_poll, which the test calls after advancing the clock. Scenarios spanning minutes
+ * of server time thus run in milliseconds, and every time measured by the server is reproducible.
+ *
+ * The server must not be started while a test session is open. All the functions of the server,
+ * including rfc2217_server_send_data, must be called from the task driving the session, and the callbacks
+ * are called from it. With a TX queue (tx_queue_size), rfc2217_server_send_data sends what the TX task
+ * would send right away, and data held back for a delimiter is sent by rfc2217_server_test_poll once
+ * flush_timeout_ms has passed on the session clock. With an RX queue (rx_queue_size), the test reads the
+ * data with rfc2217_server_read; data fed while the queue is full is dropped, and a baud rate change or a
+ * break doesn't wait for the queue to be read. XOFF from the serial device doesn't pause the delivery of
+ * data to on_data_received, as there is no other task to send XON. The callback watchdog doesn't run.
+ */
+
+/**
+ * @brief Clock and transport of a test session
+ */
+typedef struct {
+    void *ctx;                  //!< context pointer passed to the functions
+    uint64_t (*now_us)(void *ctx);  //!< current time in microseconds, above 0 and never going backwards
+    void (*sleep_us)(void *ctx, uint64_t us);   //!< called where the server would wait for this long
+    void (*on_send)(void *ctx, const uint8_t *data, size_t len);    //!< bytes sent by the server to the client
+} rfc2217_test_session_t;
+
+/** @brief Open a test session, as if a client had connected
+ *
+ * As with a TCP client, the server waits for the client to start telnet negotiation. In raw mode,
+ * on_client_connected is called right away.
+ *
+ * @param server RFC2217 server instance, not started
+ * @param session clock and transport, must stay valid until rfc2217_server_test_close
+ * @param raw serve the client in raw mode (requires CONFIG_RFC2217_SERVER_RAW_MODE)
+ * @return 0 on success, -1 if the server is running, a session is already open or the option is disabled
+ */
+int rfc2217_server_test_open(rfc2217_server_t server, const rfc2217_test_session_t *session, bool raw);
+
+/** @brief Process bytes sent by the client
+ *
+ * @param server RFC2217 server instance
+ * @param data bytes from the client
+ * @param len number of bytes
+ * @return 0 on success, -1 if no test session is open
+ */
+int rfc2217_server_test_feed(rfc2217_server_t server, const uint8_t *data, size_t len);
+
+/** @brief Do the time-based work due at the current time of the session clock
+ *
+ * Sends a round-trip time probe if one is due, and sends data from the TX queue which isn't held back
+ * any more (see flush_delimiters).
+ *
+ * @param server RFC2217 server instance
+ */
+void rfc2217_server_test_poll(rfc2217_server_t server);
+
+/** @brief Close the test session, as if the client had disconnected
+ *
+ * Data left in the TX queue is dropped, as when a client disconnects.
+ *
+ * @param server RFC2217 server instance
+ */
+void rfc2217_server_test_close(rfc2217_server_t server);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rfc2217_server.h"
+
+/*
+ * Sessions of a server carried over another connection instead of a socket of its own, used by the
+ * multi-port mux (rfc2217_mux.c, CONFIG_RFC2217_SERVER_MUX).
+ *
+ * A channel session is the session a TCP client of the port would have: the bytes passed to
+ * rfc2217_server_channel_feed are processed as if read from the client's socket, on the calling task,
+ * and the bytes the server would write to the socket are passed to the send function. The other tasks of
+ * the application use the server as usual. A port serves one session at a time, either a TCP client on its
+ * own listener or a channel.
+ */
+
+/**
+ * @brief function receiving the bytes sent by the server to the client of a channel
+ *
+ * Called with the send mutex of the server held, so calls for one server never overlap.
+ * May block until there is space for the data.
+ */
+typedef void (*rfc2217_channel_send_t)(void *ctx, const uint8_t *data, size_t len);
+
+/* Start a channel session, as if a client had connected. Returns -1 if the port has a client already. */
+int rfc2217_server_channel_open(rfc2217_server_t server, rfc2217_channel_send_t send, void *ctx);
+
+/* Process bytes sent by the client of the channel. The bytes are modified in place (IACs unescaped). */
+void rfc2217_server_channel_feed(rfc2217_server_t server, uint8_t *data, size_t len);
+
+/* Do the time-based work due now (RTT probes, merged line state changes). Returns how long the caller may
+ * wait before the next call: timeout_ms (0: no limit), or shorter. */
+unsigned rfc2217_server_channel_poll(rfc2217_server_t server, unsigned timeout_ms);
+
+/* Make a call of rfc2217_server_channel_feed waiting for XOFF to clear or for space in the RX queue return
+ * early; called from another task before closing the channel on shutdown */
+void rfc2217_server_channel_abort(rfc2217_server_t server);
+
+/* End the channel session, as if the client had disconnected. Waits for calls of the send function in progress. */
+void rfc2217_server_channel_close(rfc2217_server_t server);
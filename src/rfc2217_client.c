@@ -0,0 +1,681 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     // for pthread_attr_setaffinity_np
+#endif
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "sdkconfig.h"
+#if !CONFIG_RFC2217_SERVER_DEBUG_LOGS
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+#include "rfc2217_client.h"
+#include "rfc2217_ringbuf.h"
+#include "rfc2217_socket.h"
+#include "rfc2217_telnet.h"
+#include "rfc2217_thread.h"
+
+static const char *TAG = "rfc2217_client";
+
+#define DEFAULT_RX_BUFFER_SIZE 4096
+#define DEFAULT_TX_BUFFER_SIZE 4096
+#define DEFAULT_RX_QUEUE_SIZE 16384
+#define DEFAULT_TIMEOUT_MS 3000
+// Data without IAC is sent from the caller's buffer in pieces of at most this size; queued control messages are sent between them
+#define TCP_SEND_CHUNK_SIZE 16384
+// Limit of unsent data in the socket, where supported, so that requests don't queue behind a large socket send buffer
+#define TCP_NOTSENT_LOWAT_BYTES 16384
+// Size of the queue of control messages (requests, option negotiation) waiting to be sent
+#define CTRL_QUEUE_SIZE 64
+// Number of reply slots, indexed by the client to server command code
+#define REPLY_SLOTS (T_PURGE_DATA + 1)
+
+static void telnet_send_option(void *ctx, uint8_t action, uint8_t option);
+static void on_com_port(void *ctx, bool active);
+
+static const telnet_option_def_t s_telnet_option_defs[] = {
+    {T_BINARY, OPTION_NAME("we-BINARY"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, telnet_send_option},
+    {T_BINARY, OPTION_NAME("they-BINARY"), T_REQUESTED, T_DO, T_DONT, T_WILL, T_WONT, NULL, telnet_send_option},
+    {T_SGA, OPTION_NAME("we-SGA"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, telnet_send_option},
+    {T_SGA, OPTION_NAME("they-SGA"), T_REQUESTED, T_DO, T_DONT, T_WILL, T_WONT, NULL, telnet_send_option},
+    {T_COM_PORT_OPTION, OPTION_NAME("we-RFC2217"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, on_com_port, telnet_send_option},
+    {T_COM_PORT_OPTION, OPTION_NAME("they-RFC2217"), T_INACTIVE, T_DO, T_DONT, T_WILL, T_WONT, NULL, telnet_send_option},
+};
+
+#define TELNET_OPTIONS_COUNT (sizeof(s_telnet_option_defs) / sizeof(s_telnet_option_defs[0]))
+
+struct rfc2217_client_s {
+    rfc2217_client_config_t config;
+    int sock;
+    pthread_mutex_t socket_mutex;   // guards changes of sock
+    pthread_t rx_thread;
+    volatile bool rx_thread_running;
+    volatile bool rx_thread_shutdown;
+    volatile bool connected;        // cleared when the connection is closed by either side
+    uint8_t *rx_buffer;
+    uint8_t *tx_buffer;
+    telnet_parser_t parser;
+    telnet_option_t telnet_options[TELNET_OPTIONS_COUNT];
+    pthread_mutex_t tx_mutex;
+    // control messages waiting for the holder of tx_mutex, see send_control
+    pthread_mutex_t ctrl_queue_mutex;
+    uint8_t ctrl_queue[CTRL_QUEUE_SIZE];
+    size_t ctrl_queue_len;
+    atomic_bool ctrl_pending;
+    // replies of the server, guarded by reply_mutex
+    pthread_mutex_t reply_mutex;
+    pthread_cond_t reply_cond;
+    bool com_port_active;
+    uint32_t reply_seq[REPLY_SLOTS];    // incremented on each reply to the command
+    uint32_t reply_value[REPLY_SLOTS];  // value of the last reply
+    // received data, if config.on_data_received is NULL
+    ringbuf_t rx_queue;
+    uint8_t *rx_queue_buffer;
+    pthread_mutex_t rx_queue_mutex;
+    pthread_cond_t rx_queue_cond;
+};
+
+static void *rx_thread_fn(void *ctx /* rfc2217_client_t client */);
+static void deliver_received_data(void *ctx, const uint8_t *buf, size_t size);
+static void telnet_negotiate_option(void *ctx, uint8_t command, uint8_t option);
+static void process_subnegotiation(void *ctx, const uint8_t *suboption, size_t size);
+static bool send_chunk(rfc2217_client_t client, int sock, const uint8_t *data, size_t len);
+static void send_control(rfc2217_client_t client, const uint8_t *buf, size_t size);
+static void ctrl_queue_flush(rfc2217_client_t client, int sock);
+static void ctrl_queue_kick(rfc2217_client_t client);
+static int send_requests(rfc2217_client_t client, const uint8_t *commands, const uint32_t *values, size_t count, uint32_t *out_values);
+static void get_deadline(struct timespec *deadline, unsigned timeout_ms);
+
+static const telnet_parser_handlers_t s_telnet_parser_handlers = {
+    .on_data = deliver_received_data,
+    .on_negotiate = telnet_negotiate_option,
+    .on_subnegotiation = process_subnegotiation,
+    .on_command = NULL,
+};
+
+int rfc2217_client_create(const rfc2217_client_config_t *config, rfc2217_client_t *out_client)
+{
+    rfc2217_client_t client = calloc(1, sizeof(struct rfc2217_client_s));
+    if (!client) {
+        return -1;
+    }
+    client->config = *config;
+    if (client->config.rx_buffer_size == 0) {
+        client->config.rx_buffer_size = DEFAULT_RX_BUFFER_SIZE;
+    }
+    if (client->config.tx_buffer_size < 2) {
+        client->config.tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
+    }
+    if (client->config.timeout_ms == 0) {
+        client->config.timeout_ms = DEFAULT_TIMEOUT_MS;
+    }
+    client->sock = -1;
+    pthread_mutex_init(&client->socket_mutex, NULL);
+    pthread_mutex_init(&client->tx_mutex, NULL);
+    pthread_mutex_init(&client->ctrl_queue_mutex, NULL);
+    atomic_init(&client->ctrl_pending, false);
+    pthread_mutex_init(&client->reply_mutex, NULL);
+    pthread_cond_init(&client->reply_cond, NULL);
+    pthread_mutex_init(&client->rx_queue_mutex, NULL);
+    pthread_cond_init(&client->rx_queue_cond, NULL);
+
+    client->rx_buffer = malloc(client->config.rx_buffer_size);
+    client->tx_buffer = malloc(client->config.tx_buffer_size);
+    if (!client->rx_buffer || !client->tx_buffer) {
+        ESP_LOGE(TAG, "Failed to allocate buffers");
+        rfc2217_client_destroy(client);
+        return -1;
+    }
+    if (!config->on_data_received) {
+        size_t size = ringbuf_usable_size(config->rx_queue_size ? config->rx_queue_size : DEFAULT_RX_QUEUE_SIZE);
+        client->rx_queue_buffer = malloc(size);
+        if (!client->rx_queue_buffer) {
+            ESP_LOGE(TAG, "Failed to allocate RX queue");
+            rfc2217_client_destroy(client);
+            return -1;
+        }
+        ringbuf_init(&client->rx_queue, client->rx_queue_buffer, size);
+    }
+    *out_client = client;
+    return 0;
+}
+
+void rfc2217_client_destroy(rfc2217_client_t client)
+{
+    if (client->sock >= 0) {
+        rfc2217_client_disconnect(client);
+    }
+    pthread_cond_destroy(&client->rx_queue_cond);
+    pthread_mutex_destroy(&client->rx_queue_mutex);
+    pthread_cond_destroy(&client->reply_cond);
+    pthread_mutex_destroy(&client->reply_mutex);
+    pthread_mutex_destroy(&client->ctrl_queue_mutex);
+    pthread_mutex_destroy(&client->tx_mutex);
+    pthread_mutex_destroy(&client->socket_mutex);
+    free(client->rx_queue_buffer);
+    free(client->tx_buffer);
+    free(client->rx_buffer);
+    free(client);
+}
+
+static int connect_socket(const char *host, unsigned port)
+{
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, port_str, &hints, &res);
+    if (err != 0 || res == NULL) {
+        ESP_LOGE(TAG, "Failed to resolve %s: %d", host, err);
+        return -1;
+    }
+    int sock = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        ESP_LOGD(TAG, "Connect failed: errno %d (%s)", errno, strerror(errno));
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to connect to %s:%u", host, port);
+    }
+    return sock;
+}
+
+int rfc2217_client_connect(rfc2217_client_t client, const char *host, unsigned port)
+{
+    if (client->sock >= 0) {
+        ESP_LOGE(TAG, "Client is already connected");
+        return -1;
+    }
+    int sock = connect_socket(host, port);
+    if (sock < 0) {
+        return -1;
+    }
+    // requests are small and latency-sensitive; data is batched by rfc2217_client_send anyway
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#if defined(TCP_NOTSENT_LOWAT)
+    int notsent_lowat = TCP_NOTSENT_LOWAT_BYTES;
+    setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat, sizeof(notsent_lowat));
+#endif
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = SHUTDOWN_POLL_INTERVAL_MS * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    telnet_options_init(client->telnet_options, s_telnet_option_defs, TELNET_OPTIONS_COUNT, client);
+    telnet_parser_init(&client->parser, &s_telnet_parser_handlers, client);
+    client->ctrl_queue_len = 0;
+    atomic_store(&client->ctrl_pending, false);
+    client->com_port_active = false;
+    if (client->rx_queue_buffer) {
+        ringbuf_init(&client->rx_queue, client->rx_queue_buffer, client->rx_queue.size);
+    }
+    client->connected = true;
+    client->rx_thread_shutdown = false;
+    pthread_mutex_lock(&client->socket_mutex);
+    client->sock = sock;
+    pthread_mutex_unlock(&client->socket_mutex);
+
+    int res = rfc2217_thread_create(&client->rx_thread, rx_thread_fn, client, "rfc2217_cli",
+                                    client->config.task_stack_size, client->config.task_priority, client->config.task_core_id);
+    if (res != 0) {
+        ESP_LOGE(TAG, "Failed to create receive thread: %d", res);
+        pthread_mutex_lock(&client->socket_mutex);
+        client->sock = -1;
+        pthread_mutex_unlock(&client->socket_mutex);
+        client->connected = false;
+        close(sock);
+        return -1;
+    }
+    client->rx_thread_running = true;
+
+    // the server only replies to negotiation, so the client starts it
+    telnet_options_request(client->telnet_options, TELNET_OPTIONS_COUNT);
+    struct timespec deadline;
+    get_deadline(&deadline, client->config.timeout_ms);
+    pthread_mutex_lock(&client->reply_mutex);
+    while (!client->com_port_active && client->connected) {
+        if (pthread_cond_timedwait(&client->reply_cond, &client->reply_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool ok = client->com_port_active;
+    pthread_mutex_unlock(&client->reply_mutex);
+    if (!ok) {
+        ESP_LOGE(TAG, "Server didn't accept COM-PORT-OPTION");
+        rfc2217_client_disconnect(client);
+        return -1;
+    }
+    ESP_LOGD(TAG, "Connected to %s:%u", host, port);
+    return 0;
+}
+
+int rfc2217_client_disconnect(rfc2217_client_t client)
+{
+    if (client->sock < 0) {
+        return -1;
+    }
+    client->rx_thread_shutdown = true;
+    // wake up the receive thread if blocked in recv or waiting for space in the RX queue
+    pthread_mutex_lock(&client->socket_mutex);
+    shutdown(client->sock, SHUT_RDWR);
+    pthread_mutex_unlock(&client->socket_mutex);
+    pthread_mutex_lock(&client->rx_queue_mutex);
+    pthread_cond_broadcast(&client->rx_queue_cond);
+    pthread_mutex_unlock(&client->rx_queue_mutex);
+    if (client->rx_thread_running) {
+        pthread_join(client->rx_thread, NULL);
+        client->rx_thread_running = false;
+    }
+    // close the socket once no other task is sending
+    pthread_mutex_lock(&client->tx_mutex);
+    pthread_mutex_lock(&client->socket_mutex);
+    close(client->sock);
+    client->sock = -1;
+    pthread_mutex_unlock(&client->socket_mutex);
+    pthread_mutex_unlock(&client->tx_mutex);
+    return 0;
+}
+
+static void *rx_thread_fn(void *ctx /* rfc2217_client_t client */)
+{
+    rfc2217_client_t client = (rfc2217_client_t)ctx;
+    const int sock = client->sock;
+    ESP_LOGD(TAG, "Receive thread started");
+    while (!client->rx_thread_shutdown) {
+        ssize_t len = recv(sock, client->rx_buffer, client->config.rx_buffer_size, 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            if (!client->rx_thread_shutdown) {
+                ESP_LOGE(TAG, "Error occurred during receiving: errno %d (%s)", errno, strerror(errno));
+            }
+            break;
+        } else if (len == 0) {
+            ESP_LOGI(TAG, "Connection closed");
+            break;
+        }
+        telnet_parser_feed(&client->parser, client->rx_buffer, len);
+    }
+    // wake up the tasks waiting for replies or data
+    pthread_mutex_lock(&client->reply_mutex);
+    client->connected = false;
+    pthread_cond_broadcast(&client->reply_cond);
+    pthread_mutex_unlock(&client->reply_mutex);
+    pthread_mutex_lock(&client->rx_queue_mutex);
+    pthread_cond_broadcast(&client->rx_queue_cond);
+    pthread_mutex_unlock(&client->rx_queue_mutex);
+    if (!client->rx_thread_shutdown && client->config.on_disconnected) {
+        client->config.on_disconnected(client->config.ctx);
+    }
+    ESP_LOGD(TAG, "Receive thread done");
+    return NULL;
+}
+
+static void deliver_received_data(void *ctx, const uint8_t *buf, size_t size)
+{
+    rfc2217_client_t client = (rfc2217_client_t)ctx;
+    if (client->config.on_data_received) {
+        client->config.on_data_received(client->config.ctx, buf, size);
+        return;
+    }
+    while (size > 0 && !client->rx_thread_shutdown) {
+        size_t written = ringbuf_write(&client->rx_queue, buf, size);
+        buf += written;
+        size -= written;
+        pthread_mutex_lock(&client->rx_queue_mutex);
+        if (written > 0) {
+            pthread_cond_broadcast(&client->rx_queue_cond);
+        }
+        // queue is full: stop reading from the socket until rfc2217_client_recv makes space
+        if (size > 0 && ringbuf_free(&client->rx_queue) == 0 && !client->rx_thread_shutdown) {
+            pthread_cond_wait(&client->rx_queue_cond, &client->rx_queue_mutex);
+        }
+        pthread_mutex_unlock(&client->rx_queue_mutex);
+    }
+}
+
+int rfc2217_client_recv(rfc2217_client_t client, uint8_t *buf, size_t len, unsigned timeout_ms)
+{
+    if (!client->rx_queue_buffer) {
+        ESP_LOGE(TAG, "on_data_received is set, data is not queued");
+        return -1;
+    }
+    if (ringbuf_used(&client->rx_queue) == 0) {
+        struct timespec deadline;
+        get_deadline(&deadline, timeout_ms);
+        pthread_mutex_lock(&client->rx_queue_mutex);
+        while (ringbuf_used(&client->rx_queue) == 0 && client->connected) {
+            if (pthread_cond_timedwait(&client->rx_queue_cond, &client->rx_queue_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&client->rx_queue_mutex);
+    }
+    size_t copied = 0;
+    while (copied < len) {
+        const uint8_t *data;
+        size_t avail = ringbuf_peek(&client->rx_queue, &data);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > len - copied) {
+            avail = len - copied;
+        }
+        memcpy(buf + copied, data, avail);
+        ringbuf_consume(&client->rx_queue, avail);
+        copied += avail;
+    }
+    if (copied > 0) {
+        // the receive thread may be waiting for space
+        pthread_mutex_lock(&client->rx_queue_mutex);
+        pthread_cond_broadcast(&client->rx_queue_cond);
+        pthread_mutex_unlock(&client->rx_queue_mutex);
+    } else if (!client->connected) {
+        return -1;
+    }
+    return (int) copied;
+}
+
+static bool send_chunk(rfc2217_client_t client, int sock, const uint8_t *data, size_t len)
+{
+    // caller holds tx_mutex
+    if (atomic_load(&client->ctrl_pending)) {
+        ctrl_queue_flush(client, sock);
+    }
+    return socket_send_all(sock, data, len);
+}
+
+int rfc2217_client_send(rfc2217_client_t client, const uint8_t *data, size_t len)
+{
+    // Runs without IAC which fill tx_buffer are sent from the caller's buffer. Shorter runs are
+    // copied into tx_buffer with the IACs doubled, and sent when it is full, so that data with
+    // many IACs (e.g. binary data) doesn't cost a send call per IAC.
+    pthread_mutex_lock(&client->tx_mutex);
+    const int sock = client->sock;
+    bool ok = (sock >= 0 && client->connected);
+    uint8_t *buf = client->tx_buffer;
+    const size_t size = client->config.tx_buffer_size;
+    const uint8_t *end = data + len;
+    const uint8_t *iac = ok ? memchr(data, T_IAC, len) : NULL;
+    size_t staged = 0;
+    while (ok && data < end) {
+        if (iac && iac < data) {
+            iac = memchr(data, T_IAC, end - data);
+        }
+        size_t run = (iac ? iac : end) - data;
+        if (staged == 0 && run >= size) {
+            if (run > TCP_SEND_CHUNK_SIZE) {
+                run = TCP_SEND_CHUNK_SIZE;
+            }
+            ok = send_chunk(client, sock, data, run);
+            data += run;
+            continue;
+        }
+        if (run > size - staged) {
+            run = size - staged;
+        }
+        memcpy(buf + staged, data, run);
+        staged += run;
+        data += run;
+        if (data == iac && size - staged >= 2) {
+            buf[staged++] = T_IAC;
+            buf[staged++] = T_IAC;
+            data++;
+        }
+        if (size - staged < 2 || data == end) {
+            ok = send_chunk(client, sock, buf, staged);
+            staged = 0;
+        }
+    }
+    pthread_mutex_unlock(&client->tx_mutex);
+    ctrl_queue_kick(client);
+    return ok ? 0 : -1;
+}
+
+static void send_control(rfc2217_client_t client, const uint8_t *buf, size_t size)
+{
+    // Same scheme as in the server: control messages are put into ctrl_queue and sent by the task
+    // holding tx_mutex at the next chunk boundary, or right away by ctrl_queue_kick if nobody holds it.
+    // The receive thread never waits for a sender here, so replies to the server can't deadlock with
+    // a sender blocked on a full socket.
+    bool queued = false;
+    pthread_mutex_lock(&client->ctrl_queue_mutex);
+    if (client->ctrl_queue_len + size <= sizeof(client->ctrl_queue)) {
+        memcpy(client->ctrl_queue + client->ctrl_queue_len, buf, size);
+        client->ctrl_queue_len += size;
+        atomic_store(&client->ctrl_pending, true);
+        queued = true;
+    }
+    pthread_mutex_unlock(&client->ctrl_queue_mutex);
+    if (queued) {
+        ctrl_queue_kick(client);
+        return;
+    }
+    // queue is full: wait for tx_mutex, keeping the order of the messages
+    pthread_mutex_lock(&client->tx_mutex);
+    const int sock = client->sock;
+    if (sock >= 0) {
+        ctrl_queue_flush(client, sock);
+        socket_send_all(sock, buf, size);
+    }
+    pthread_mutex_unlock(&client->tx_mutex);
+}
+
+static void ctrl_queue_flush(rfc2217_client_t client, int sock)
+{
+    // caller holds tx_mutex
+    uint8_t buf[CTRL_QUEUE_SIZE];
+    pthread_mutex_lock(&client->ctrl_queue_mutex);
+    size_t len = client->ctrl_queue_len;
+    memcpy(buf, client->ctrl_queue, len);
+    client->ctrl_queue_len = 0;
+    atomic_store(&client->ctrl_pending, false);
+    pthread_mutex_unlock(&client->ctrl_queue_mutex);
+    if (len > 0 && sock >= 0) {
+        socket_send_all(sock, buf, len);
+    }
+}
+
+static void ctrl_queue_kick(rfc2217_client_t client)
+{
+    while (atomic_load(&client->ctrl_pending) && pthread_mutex_trylock(&client->tx_mutex) == 0) {
+        ctrl_queue_flush(client, client->sock);
+        pthread_mutex_unlock(&client->tx_mutex);
+    }
+}
+
+static void telnet_send_option(void *ctx, uint8_t action, uint8_t option)
+{
+    uint8_t buf[3] = {T_IAC, action, option};
+    send_control((rfc2217_client_t)ctx, buf, sizeof(buf));
+}
+
+static void on_com_port(void *ctx, bool active)
+{
+    rfc2217_client_t client = (rfc2217_client_t)ctx;
+    pthread_mutex_lock(&client->reply_mutex);
+    client->com_port_active = active;
+    pthread_cond_broadcast(&client->reply_cond);
+    pthread_mutex_unlock(&client->reply_mutex);
+}
+
+static void telnet_negotiate_option(void *ctx, uint8_t command, uint8_t option)
+{
+    rfc2217_client_t client = (rfc2217_client_t)ctx;
+    ESP_LOGD(TAG, "Telnet negotiate option: 0x%x 0x%x", command, option);
+    if (!telnet_options_process(client->telnet_options, TELNET_OPTIONS_COUNT, command, option)) {
+        // includes DO TIMING-MARK, which the server uses to measure the round-trip time
+        ESP_LOGD(TAG, "Unknown option: 0x%x", option);
+        if (command == T_WILL) {
+            telnet_send_option(client, T_DONT, option);
+        }
+        if (command == T_DO) {
+            telnet_send_option(client, T_WONT, option);
+        }
+    }
+}
+
+static void process_subnegotiation(void *ctx, const uint8_t *suboption, size_t size)
+{
+    rfc2217_client_t client = (rfc2217_client_t)ctx;
+    if (suboption[0] != T_COM_PORT_OPTION || size < 2) {
+        ESP_LOGD(TAG, "Unknown subnegotiation: %x", suboption[0]);
+        return;
+    }
+    uint8_t code = suboption[1];
+    rfc2217_client_on_notify_t on_notify = client->config.on_notify;
+    if (code == T_SERVER_NOTIFY_LINESTATE || code == T_SERVER_NOTIFY_MODEMSTATE) {
+        if (size >= 3 && on_notify) {
+            on_notify(client->config.ctx, code == T_SERVER_NOTIFY_LINESTATE ?
+                      RFC2217_CLIENT_NOTIFY_LINESTATE : RFC2217_CLIENT_NOTIFY_MODEMSTATE, suboption[2]);
+        }
+        return;
+    }
+    if (code == T_SERVER_FLOWCONTROL_SUSPEND || code == T_SERVER_FLOWCONTROL_RESUME) {
+        if (on_notify) {
+            on_notify(client->config.ctx, code == T_SERVER_FLOWCONTROL_SUSPEND ?
+                      RFC2217_CLIENT_NOTIFY_FLOWCONTROL_SUSPEND : RFC2217_CLIENT_NOTIFY_FLOWCONTROL_RESUME, 0);
+        }
+        return;
+    }
+    if (code <= T_SERVER_OFFSET || code - T_SERVER_OFFSET >= REPLY_SLOTS) {
+        ESP_LOGD(TAG, "Unknown subnegotiation: %x", code);
+        return;
+    }
+    uint8_t command = code - T_SERVER_OFFSET;
+    size_t value_len = (command == T_SET_BAUDRATE) ? 4 : 1;
+    if (size < 2 + value_len) {
+        ESP_LOGD(TAG, "Subnegotiation too short: %d bytes", (int) size);
+        return;
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; i < value_len; i++) {
+        value = (value << 8) | suboption[2 + i];
+    }
+    ESP_LOGD(TAG, "Reply to command %d: %" PRIu32, command, value);
+    pthread_mutex_lock(&client->reply_mutex);
+    client->reply_value[command] = value;
+    client->reply_seq[command]++;
+    pthread_cond_broadcast(&client->reply_cond);
+    pthread_mutex_unlock(&client->reply_mutex);
+}
+
+static int send_requests(rfc2217_client_t client, const uint8_t *commands, const uint32_t *values, size_t count, uint32_t *out_values)
+{
+    // Send the requests in one piece, then wait for a reply to each of them. Only one request per command.
+    uint8_t buf[4 * TELNET_SUBNEGOTIATION_MAX];
+    uint32_t seq[4];
+    size_t len = 0;
+    if (!client->connected || count > 4) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint8_t data[4] = {values[i] >> 24, values[i] >> 16, values[i] >> 8, values[i]};
+        if (commands[i] == T_SET_BAUDRATE) {
+            len += telnet_build_subnegotiation(buf + len, commands[i], data, 4);
+        } else {
+            len += telnet_build_subnegotiation(buf + len, commands[i], &data[3], 1);
+        }
+    }
+    pthread_mutex_lock(&client->reply_mutex);
+    for (size_t i = 0; i < count; i++) {
+        seq[i] = client->reply_seq[commands[i]];
+    }
+    pthread_mutex_unlock(&client->reply_mutex);
+
+    send_control(client, buf, len);
+
+    struct timespec deadline;
+    get_deadline(&deadline, client->config.timeout_ms);
+    int res = 0;
+    pthread_mutex_lock(&client->reply_mutex);
+    for (size_t i = 0; i < count && res == 0; i++) {
+        while (client->reply_seq[commands[i]] == seq[i]) {
+            if (!client->connected ||
+                    pthread_cond_timedwait(&client->reply_cond, &client->reply_mutex, &deadline) == ETIMEDOUT) {
+                ESP_LOGE(TAG, "No reply to command %d", commands[i]);
+                res = -1;
+                break;
+            }
+        }
+        if (out_values) {
+            out_values[i] = client->reply_value[commands[i]];
+        }
+    }
+    pthread_mutex_unlock(&client->reply_mutex);
+    return res;
+}
+
+int rfc2217_client_set_line_config(rfc2217_client_t client, const rfc2217_line_config_t *config, rfc2217_line_config_t *out_actual)
+{
+    const uint8_t commands[4] = {T_SET_BAUDRATE, T_SET_DATASIZE, T_SET_PARITY, T_SET_STOPSIZE};
+    const uint32_t values[4] = {config->baudrate, config->datasize, config->parity, config->stopbits};
+    uint32_t actual[4];
+    if (send_requests(client, commands, values, 4, actual) != 0) {
+        return -1;
+    }
+    if (out_actual) {
+        out_actual->baudrate = actual[0];
+        out_actual->datasize = (uint8_t) actual[1];
+        out_actual->parity = (rfc2217_parity_t) actual[2];
+        out_actual->stopbits = (rfc2217_stopbits_t) actual[3];
+    }
+    return 0;
+}
+
+int rfc2217_client_set_control(rfc2217_client_t client, rfc2217_control_t control, rfc2217_control_t *out_actual)
+{
+    const uint8_t command = T_SET_CONTROL;
+    const uint32_t value = control;
+    uint32_t actual;
+    if (send_requests(client, &command, &value, 1, &actual) != 0) {
+        return -1;
+    }
+    if (out_actual) {
+        *out_actual = (rfc2217_control_t) actual;
+    }
+    return 0;
+}
+
+int rfc2217_client_purge(rfc2217_client_t client, rfc2217_purge_t purge)
+{
+    const uint8_t command = T_PURGE_DATA;
+    const uint32_t value = purge;
+    return send_requests(client, &command, &value, 1, NULL);
+}
+
+static void get_deadline(struct timespec *deadline, unsigned timeout_ms)
+{
+    // absolute deadline for pthread_cond_timedwait, which uses CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
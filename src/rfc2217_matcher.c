@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rfc2217_matcher.h"
+#include "rfc2217_scan.h"
+
+// state 0 is the root of the trie, it is never a child, so 0 also means "none" in the links below
+#define MATCHER_ROOT 0
+#define MATCHER_MAX_NODES UINT16_MAX
+
+typedef struct {
+    uint16_t first_child;
+    uint16_t next_sibling;
+    uint16_t fail;          // state for the longest proper suffix of this state which is in the trie
+    uint16_t dict;          // nearest state on the failure chain where a pattern ends, 0 if none
+    uint16_t pattern;       // index + 1 of the pattern ending in this state, 0 if none
+    uint8_t byte;           // byte on the edge from the parent
+} matcher_node_t;
+
+struct matcher_s {
+    matcher_node_t *nodes;
+    size_t node_count;
+    const matcher_allocator_t *allocator;
+    uint16_t root_next[256];    // transitions from the root, also the fallback for all failure chains
+    uint16_t state;
+    // distinct first bytes of the patterns, used to skip over data in the root state if there are at most 2
+    unsigned start_count;
+    uint8_t start_bytes[2];
+};
+
+static void *matcher_alloc(const matcher_allocator_t *allocator, size_t size)
+{
+    return allocator ? allocator->alloc(allocator->ctx, size) : calloc(1, size);
+}
+
+static void matcher_free(const matcher_allocator_t *allocator, void *ptr, size_t size)
+{
+    if (!ptr) {
+        return;
+    }
+    if (allocator) {
+        allocator->free(allocator->ctx, ptr, size);
+    } else {
+        free(ptr);
+    }
+}
+
+static uint16_t find_child(const matcher_node_t *nodes, uint16_t state, uint8_t c)
+{
+    for (uint16_t child = nodes[state].first_child; child != 0; child = nodes[child].next_sibling) {
+        if (nodes[child].byte == c) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+static inline uint16_t next_state(const matcher_t *matcher, uint16_t state, uint8_t c)
+{
+    const matcher_node_t *nodes = matcher->nodes;
+    while (state != MATCHER_ROOT) {
+        uint16_t child = find_child(nodes, state, c);
+        if (child != 0) {
+            return child;
+        }
+        state = nodes[state].fail;
+    }
+    return matcher->root_next[c];
+}
+
+int matcher_create(const char *const *patterns, size_t count, const matcher_allocator_t *allocator, matcher_t **out_matcher)
+{
+    size_t max_nodes = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = patterns[i] ? strlen(patterns[i]) : 0;
+        if (len == 0) {
+            return -1;
+        }
+        max_nodes += len;
+    }
+    if (max_nodes > MATCHER_MAX_NODES) {
+        return -1;
+    }
+    matcher_t *matcher = matcher_alloc(allocator, sizeof(matcher_t));
+    matcher_node_t *nodes = matcher_alloc(allocator, max_nodes * sizeof(matcher_node_t));
+    uint16_t *queue = matcher_alloc(allocator, max_nodes * sizeof(uint16_t));
+    if (!matcher || !nodes || !queue) {
+        matcher_free(allocator, matcher, sizeof(matcher_t));
+        matcher_free(allocator, nodes, max_nodes * sizeof(matcher_node_t));
+        matcher_free(allocator, queue, max_nodes * sizeof(uint16_t));
+        return -1;
+    }
+    matcher->allocator = allocator;
+
+    // build the trie
+    uint16_t node_count = 1;
+    for (size_t i = 0; i < count; i++) {
+        uint16_t state = MATCHER_ROOT;
+        for (const uint8_t *p = (const uint8_t *) patterns[i]; *p; p++) {
+            uint16_t child = find_child(nodes, state, *p);
+            if (child == 0) {
+                child = node_count++;
+                nodes[child].byte = *p;
+                nodes[child].next_sibling = nodes[state].first_child;
+                nodes[state].first_child = child;
+            }
+            state = child;
+        }
+        if (nodes[state].pattern == 0) {
+            nodes[state].pattern = (uint16_t)(i + 1);
+        }
+    }
+
+    // compute the failure links breadth-first, so that the links of shallower states are ready when needed
+    size_t head = 0;
+    size_t tail = 0;
+    for (uint16_t child = nodes[MATCHER_ROOT].first_child; child != 0; child = nodes[child].next_sibling) {
+        matcher->root_next[nodes[child].byte] = child;
+        if (matcher->start_count < 2) {
+            matcher->start_bytes[matcher->start_count] = nodes[child].byte;
+        }
+        matcher->start_count++;
+        queue[tail++] = child;
+    }
+    if (matcher->start_count == 1) {
+        matcher->start_bytes[1] = matcher->start_bytes[0];
+    }
+    matcher->nodes = nodes;
+    while (head < tail) {
+        uint16_t state = queue[head++];
+        for (uint16_t child = nodes[state].first_child; child != 0; child = nodes[child].next_sibling) {
+            uint16_t fail = next_state(matcher, nodes[state].fail, nodes[child].byte);
+            nodes[child].fail = fail;
+            nodes[child].dict = nodes[fail].pattern ? fail : nodes[fail].dict;
+            queue[tail++] = child;
+        }
+    }
+    matcher_free(allocator, queue, max_nodes * sizeof(uint16_t));
+    // common prefixes share states, release the unused part of the array
+    matcher->node_count = max_nodes;
+    if (node_count < max_nodes) {
+        matcher_node_t *shrunk = matcher_alloc(allocator, node_count * sizeof(matcher_node_t));
+        if (shrunk) {
+            memcpy(shrunk, nodes, node_count * sizeof(matcher_node_t));
+            matcher_free(allocator, nodes, max_nodes * sizeof(matcher_node_t));
+            matcher->nodes = shrunk;
+            matcher->node_count = node_count;
+        }
+    }
+
+    *out_matcher = matcher;
+    return 0;
+}
+
+void matcher_destroy(matcher_t *matcher)
+{
+    if (matcher) {
+        const matcher_allocator_t *allocator = matcher->allocator;
+        matcher_free(allocator, matcher->nodes, matcher->node_count * sizeof(matcher_node_t));
+        matcher_free(allocator, matcher, sizeof(matcher_t));
+    }
+}
+
+void matcher_feed(matcher_t *matcher, const uint8_t *data, size_t len, matcher_cb_t cb, void *ctx)
+{
+    const matcher_node_t *nodes = matcher->nodes;
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    uint16_t state = matcher->state;
+    while (p < end) {
+        if (state == MATCHER_ROOT && matcher->start_count <= 2) {
+            // nothing matched so far: skip to the next byte which can start a pattern
+            p = scan_find_any2(p, end - p, matcher->start_bytes[0], matcher->start_bytes[1]);
+            if (!p) {
+                break;
+            }
+        }
+        state = next_state(matcher, state, *p++);
+        for (uint16_t out = nodes[state].pattern ? state : nodes[state].dict; out != 0; out = nodes[out].dict) {
+            cb(ctx, nodes[out].pattern - 1);
+        }
+    }
+    matcher->state = state;
+}
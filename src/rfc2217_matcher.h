@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Streaming multi-pattern matcher (Aho-Corasick).
+ *
+ * The patterns are compiled once into a trie with failure links. The matcher keeps its
+ * position in the automaton between calls of matcher_feed, so matches spanning several
+ * chunks of data are found. The work per byte is constant on average (each failure link
+ * taken is paid for by an earlier byte which went one level deeper), and never more than
+ * the length of the longest pattern. Memory use is proportional to the total length of
+ * the patterns, plus a 256-entry table for the root state.
+ */
+
+typedef struct matcher_s matcher_t;
+
+/* Memory for the matcher. alloc returns zeroed memory; free gets the size passed to alloc. */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} matcher_allocator_t;
+
+/* Called for each occurrence of a pattern, with the index of the pattern in the array passed to matcher_create */
+typedef void (*matcher_cb_t)(void *ctx, size_t pattern_index);
+
+/*
+ * Compile a set of NUL-terminated patterns. Patterns must not be empty. If the same pattern
+ * is given more than once, only the first index is reported. Memory is taken from allocator,
+ * or from the heap if it is NULL; the allocator must stay valid until matcher_destroy.
+ * Returns 0 on success, -1 if the patterns are invalid or out of memory.
+ */
+int matcher_create(const char *const *patterns, size_t count, const matcher_allocator_t *allocator, matcher_t **out_matcher);
+
+void matcher_destroy(matcher_t *matcher);
+
+/* Scan the next chunk of the stream, calling cb for every pattern ending in it */
+void matcher_feed(matcher_t *matcher, const uint8_t *data, size_t len, matcher_cb_t cb, void *ctx);
@@ -0,0 +1,655 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     // for pthread_attr_setaffinity_np
+#endif
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sdkconfig.h"
+#if !CONFIG_RFC2217_SERVER_DEBUG_LOGS
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+#include "rfc2217_mux.h"
+#if CONFIG_RFC2217_SERVER_MUX
+#include "rfc2217_channel.h"
+#include "rfc2217_ringbuf.h"
+#include "rfc2217_socket.h"
+#include "rfc2217_telnet.h"
+#include "rfc2217_thread.h"
+
+static const char *TAG = "rfc2217_mux";
+
+#define DEFAULT_CHANNEL_TX_BUFFER_SIZE 2048
+#define DEFAULT_QUANTUM 512
+// How long a new client has to send the mux subnegotiation
+#define HANDSHAKE_TIMEOUT_MS 3000
+// Size of the buffer the connection is read into
+#define RX_BUFFER_SIZE 2048
+// Frames of all channels are collected into a buffer of at least this size, and sent with one send call
+#define TX_BATCH_SIZE 4096
+// Size of the queue of replies on the control channel
+#define CTRL_RING_SIZE 256
+// Control frames are processed when complete; longer ones are dropped. Fits a command for each channel.
+#define CTRL_FRAME_MAX (2 * RFC2217_MUX_MAX_CHANNELS)
+// <channel> <length high> <length low>
+#define FRAME_HEADER_SIZE 3
+#define FRAME_MAX_PAYLOAD 0xffff
+// IAC SB RFC2217_MUX_OPTION <version> IAC SE
+#define HANDSHAKE_SIZE 6
+
+typedef struct {
+    rfc2217_server_t server;
+    struct rfc2217_mux_s *mux;
+    ringbuf_t tx_ring;          // filled by the send function of the channel, drained by the TX thread
+    uint8_t *tx_buffer;
+    atomic_bool sending;        // TX thread sends the data of the channel; set after the OPEN reply is queued
+    atomic_bool closing;        // the send function drops data instead of waiting for space
+    bool open;                  // session open; changed by the mux thread with socket_mutex held
+} mux_channel_t;
+
+struct rfc2217_mux_s {
+    rfc2217_mux_config_t config;
+    mux_channel_t *channels;
+    int client_socket;
+    int listen_socket;
+    pthread_mutex_t socket_mutex;   // guards changes of client_socket, listen_socket and mux_channel_t.open
+    pthread_t thread;
+    volatile bool thread_running;
+    volatile bool thread_shutdown;
+    uint8_t *rx_buffer;
+    // frame parser of the mux thread
+    uint8_t frame_header[FRAME_HEADER_SIZE];
+    size_t frame_header_len;
+    size_t frame_remaining;     // payload bytes of the current frame not received yet
+    uint8_t ctrl_frame[CTRL_FRAME_MAX];
+    size_t ctrl_frame_len;
+    // TX thread
+    ringbuf_t ctrl_ring;        // replies on the control channel, filled by the mux thread
+    uint8_t ctrl_ring_buffer[CTRL_RING_SIZE];
+    uint8_t *tx_batch;
+    size_t tx_batch_size;
+    size_t tx_next;             // channel whose turn is first in the next batch
+    pthread_t tx_thread;
+    volatile bool tx_thread_shutdown;
+    volatile bool tx_failed;    // sending failed, the data is dropped until the connection is closed
+    pthread_mutex_t tx_mutex;   // held while a batch is collected, and used with tx_cond to wait for data or space
+    pthread_cond_t tx_cond;
+    atomic_int tx_waiters;      // number of threads sleeping on tx_cond
+};
+
+static void *mux_thread_fn(void *ctx /* rfc2217_mux_t mux */);
+static void *tx_thread_fn(void *ctx /* rfc2217_mux_t mux */);
+static bool handshake(rfc2217_mux_t mux, int sock);
+static void serve_connection(rfc2217_mux_t mux, int sock);
+static void process_frames(rfc2217_mux_t mux, uint8_t *data, size_t len);
+static void process_ctrl_frame(rfc2217_mux_t mux);
+static void open_channel(rfc2217_mux_t mux, unsigned index);
+static void close_channel(rfc2217_mux_t mux, unsigned index);
+static void ctrl_reply(rfc2217_mux_t mux, const uint8_t *data, size_t len);
+static void channel_send(void *ctx, const uint8_t *data, size_t len);
+static size_t collect_batch(rfc2217_mux_t mux);
+static size_t collect_frame(ringbuf_t *ring, uint8_t channel, uint8_t *out, size_t max_payload);
+static bool tx_idle(rfc2217_mux_t mux);
+static void tx_wait(rfc2217_mux_t mux, ringbuf_t *for_space);
+static void tx_wake(rfc2217_mux_t mux);
+
+int rfc2217_mux_create(const rfc2217_mux_config_t *config, rfc2217_mux_t *out_mux)
+{
+    if (config->channel_count == 0 || config->channel_count > RFC2217_MUX_MAX_CHANNELS) {
+        ESP_LOGE(TAG, "channel_count must be between 1 and %d", RFC2217_MUX_MAX_CHANNELS);
+        return -1;
+    }
+    rfc2217_mux_t mux = calloc(1, sizeof(struct rfc2217_mux_s));
+    if (!mux) {
+        return -1;
+    }
+    mux->config = *config;
+    mux->config.channels = NULL;
+    if (mux->config.channel_tx_buffer_size == 0) {
+        mux->config.channel_tx_buffer_size = DEFAULT_CHANNEL_TX_BUFFER_SIZE;
+    }
+    if (mux->config.quantum == 0) {
+        mux->config.quantum = DEFAULT_QUANTUM;
+    }
+    if (mux->config.quantum > FRAME_MAX_PAYLOAD) {
+        mux->config.quantum = FRAME_MAX_PAYLOAD;
+    }
+    mux->client_socket = -1;
+    mux->listen_socket = -1;
+    pthread_mutex_init(&mux->socket_mutex, NULL);
+    pthread_mutex_init(&mux->tx_mutex, NULL);
+    pthread_cond_init(&mux->tx_cond, NULL);
+    ringbuf_init(&mux->ctrl_ring, mux->ctrl_ring_buffer, CTRL_RING_SIZE);
+    // at least one quantum of one channel fits in a batch, after the control replies
+    mux->tx_batch_size = TX_BATCH_SIZE;
+    if (mux->tx_batch_size < CTRL_RING_SIZE + mux->config.quantum + 2 * FRAME_HEADER_SIZE) {
+        mux->tx_batch_size = CTRL_RING_SIZE + mux->config.quantum + 2 * FRAME_HEADER_SIZE;
+    }
+    mux->rx_buffer = malloc(RX_BUFFER_SIZE);
+    mux->tx_batch = malloc(mux->tx_batch_size);
+    mux->channels = calloc(config->channel_count, sizeof(mux_channel_t));
+    if (!mux->rx_buffer || !mux->tx_batch || !mux->channels) {
+        rfc2217_mux_destroy(mux);
+        return -1;
+    }
+    size_t ring_size = ringbuf_usable_size(mux->config.channel_tx_buffer_size);
+    for (size_t i = 0; i < config->channel_count; i++) {
+        mux_channel_t *channel = &mux->channels[i];
+        channel->server = config->channels[i];
+        channel->mux = mux;
+        channel->tx_buffer = malloc(ring_size);
+        if (!channel->tx_buffer) {
+            rfc2217_mux_destroy(mux);
+            return -1;
+        }
+        ringbuf_init(&channel->tx_ring, channel->tx_buffer, ring_size);
+    }
+    *out_mux = mux;
+    return 0;
+}
+
+int rfc2217_mux_start(rfc2217_mux_t mux)
+{
+    if (mux->thread_running) {
+        ESP_LOGE(TAG, "Mux thread is already running");
+        return -1;
+    }
+    mux->thread_shutdown = false;
+    int res = rfc2217_thread_create(&mux->thread, mux_thread_fn, mux, "rfc2217_mux", mux->config.task_stack_size,
+                                    mux->config.task_priority, mux->config.task_core_id);
+    if (res != 0) {
+        ESP_LOGE(TAG, "Failed to create mux thread: %d", res);
+        return -1;
+    }
+    mux->thread_running = true;
+    return 0;
+}
+
+int rfc2217_mux_stop(rfc2217_mux_t mux)
+{
+    if (!mux->thread_running) {
+        ESP_LOGE(TAG, "Mux thread is not running");
+        return -1;
+    }
+    mux->thread_shutdown = true;
+    pthread_mutex_lock(&mux->socket_mutex);
+    // wake up the mux thread if it is waiting in a server for XON or for space in the RX queue
+    for (size_t i = 0; i < mux->config.channel_count; i++) {
+        if (mux->channels[i].open) {
+            rfc2217_server_channel_abort(mux->channels[i].server);
+        }
+    }
+    // wake up the threads blocked in accept, recv or send
+    if (mux->client_socket >= 0) {
+        shutdown(mux->client_socket, SHUT_RDWR);
+    }
+    if (mux->listen_socket >= 0) {
+        shutdown(mux->listen_socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mux->socket_mutex);
+    // the mux thread closes the channels and joins the TX thread before exiting
+    pthread_join(mux->thread, NULL);
+    mux->thread_running = false;
+    return 0;
+}
+
+void rfc2217_mux_destroy(rfc2217_mux_t mux)
+{
+    if (mux->thread_running) {
+        rfc2217_mux_stop(mux);
+    }
+    pthread_cond_destroy(&mux->tx_cond);
+    pthread_mutex_destroy(&mux->tx_mutex);
+    pthread_mutex_destroy(&mux->socket_mutex);
+    if (mux->channels) {
+        for (size_t i = 0; i < mux->config.channel_count; i++) {
+            free(mux->channels[i].tx_buffer);
+        }
+    }
+    free(mux->channels);
+    free(mux->tx_batch);
+    free(mux->rx_buffer);
+    free(mux);
+}
+
+static void *mux_thread_fn(void *ctx /* rfc2217_mux_t mux */)
+{
+    rfc2217_mux_t mux = (rfc2217_mux_t)ctx;
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(mux->config.port),
+    };
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d (%s)", errno, strerror(errno));
+        return NULL;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d (%s)", errno, strerror(errno));
+        goto CLEAN_UP;
+    }
+    if (listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Error occurred during listen: errno %d (%s)", errno, strerror(errno));
+        goto CLEAN_UP;
+    }
+    pthread_mutex_lock(&mux->socket_mutex);
+    mux->listen_socket = listen_sock;
+    pthread_mutex_unlock(&mux->socket_mutex);
+
+    while (!mux->thread_shutdown) {
+        if (socket_wait_readable(listen_sock, &mux->thread_shutdown, 0) <= 0) {
+            break;
+        }
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            if (!mux->thread_shutdown) {
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d (%s)", errno, strerror(errno));
+            }
+            break;
+        }
+        // frames are batched by the TX thread; don't hold back the last one
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        pthread_mutex_lock(&mux->socket_mutex);
+        mux->client_socket = sock;
+        pthread_mutex_unlock(&mux->socket_mutex);
+        if (handshake(mux, sock)) {
+            serve_connection(mux, sock);
+        }
+        pthread_mutex_lock(&mux->socket_mutex);
+        mux->client_socket = -1;
+        pthread_mutex_unlock(&mux->socket_mutex);
+        close(sock);
+    }
+    ESP_LOGD(TAG, "Mux thread shutting down");
+
+CLEAN_UP:
+    pthread_mutex_lock(&mux->socket_mutex);
+    mux->listen_socket = -1;
+    close(listen_sock);
+    pthread_mutex_unlock(&mux->socket_mutex);
+    return NULL;
+}
+
+static bool handshake(rfc2217_mux_t mux, int sock)
+{
+    uint8_t request[HANDSHAKE_SIZE];
+    size_t len = 0;
+    while (len < sizeof(request)) {
+        if (socket_wait_readable(sock, &mux->thread_shutdown, HANDSHAKE_TIMEOUT_MS) <= 0) {
+            ESP_LOGW(TAG, "No mux subnegotiation from the client");
+            return false;
+        }
+        ssize_t res = recv(sock, request + len, sizeof(request) - len, 0);
+        if (res <= 0) {
+            return false;
+        }
+        len += res;
+    }
+    if (request[0] != T_IAC || request[1] != T_SB || request[2] != RFC2217_MUX_OPTION ||
+            request[4] != T_IAC || request[5] != T_SE) {
+        ESP_LOGW(TAG, "Client didn't start with the mux subnegotiation");
+        return false;
+    }
+    const uint8_t reply[] = {T_IAC, T_SB, RFC2217_MUX_OPTION, RFC2217_MUX_VERSION,
+                             (uint8_t) mux->config.channel_count, T_IAC, T_SE
+                            };
+    if (!socket_send_all(sock, reply, sizeof(reply))) {
+        return false;
+    }
+    if (request[3] != RFC2217_MUX_VERSION) {
+        ESP_LOGW(TAG, "Client uses mux version %d, expected %d", request[3], RFC2217_MUX_VERSION);
+        return false;
+    }
+    ESP_LOGI(TAG, "Mux connection with %d channels", (int) mux->config.channel_count);
+    return true;
+}
+
+static void serve_connection(rfc2217_mux_t mux, int sock)
+{
+    mux->frame_header_len = 0;
+    mux->frame_remaining = 0;
+    mux->ctrl_frame_len = 0;
+    mux->tx_next = 0;
+    mux->tx_failed = false;
+    mux->tx_thread_shutdown = false;
+    int res = rfc2217_thread_create(&mux->tx_thread, tx_thread_fn, mux, "rfc2217_mux_tx", mux->config.task_stack_size,
+                                    mux->config.task_priority, mux->config.tx_task_core_id);
+    if (res != 0) {
+        ESP_LOGE(TAG, "Failed to create TX thread: %d", res);
+        return;
+    }
+    while (!mux->thread_shutdown) {
+        // time-based work of the servers: RTT probes, merged line state changes
+        unsigned timeout_ms = SHUTDOWN_POLL_INTERVAL_MS;
+        for (size_t i = 0; i < mux->config.channel_count; i++) {
+            if (mux->channels[i].open) {
+                unsigned due_ms = rfc2217_server_channel_poll(mux->channels[i].server, timeout_ms);
+                if (due_ms != 0 && due_ms < timeout_ms) {
+                    timeout_ms = due_ms;
+                }
+            }
+        }
+        int ready = socket_wait_readable(sock, &mux->thread_shutdown, timeout_ms);
+        if (ready < 0) {
+            break;
+        }
+        if (ready == 0) {
+            continue;
+        }
+        ssize_t len = recv(sock, mux->rx_buffer, RX_BUFFER_SIZE, 0);
+        if (len < 0) {
+            if (!mux->thread_shutdown) {
+                ESP_LOGE(TAG, "Error occurred during receiving: errno %d (%s)", errno, strerror(errno));
+            }
+            break;
+        } else if (len == 0) {
+            ESP_LOGI(TAG, "Connection closed");
+            break;
+        }
+        process_frames(mux, mux->rx_buffer, len);
+    }
+    for (size_t i = 0; i < mux->config.channel_count; i++) {
+        if (mux->channels[i].open) {
+            close_channel(mux, i);
+        }
+    }
+    // wake up the TX thread if blocked in send(); it drops the remaining data
+    shutdown(sock, SHUT_RDWR);
+    mux->tx_thread_shutdown = true;
+    tx_wake(mux);
+    pthread_join(mux->tx_thread, NULL);
+    ringbuf_init(&mux->ctrl_ring, mux->ctrl_ring_buffer, CTRL_RING_SIZE);
+}
+
+static void process_frames(rfc2217_mux_t mux, uint8_t *data, size_t len)
+{
+    // Frames may be split anywhere between reads; the payload of a channel is passed on as it arrives
+    while (len > 0) {
+        if (mux->frame_header_len < FRAME_HEADER_SIZE) {
+            mux->frame_header[mux->frame_header_len++] = *data++;
+            len--;
+            if (mux->frame_header_len == FRAME_HEADER_SIZE) {
+                mux->frame_remaining = ((size_t) mux->frame_header[1] << 8) | mux->frame_header[2];
+                mux->ctrl_frame_len = 0;
+            }
+            if (mux->frame_header_len < FRAME_HEADER_SIZE || mux->frame_remaining > 0) {
+                continue;
+            }
+        }
+        size_t chunk = len < mux->frame_remaining ? len : mux->frame_remaining;
+        uint8_t index = mux->frame_header[0];
+        if (index == RFC2217_MUX_CONTROL_CHANNEL) {
+            if (mux->ctrl_frame_len + chunk <= CTRL_FRAME_MAX) {
+                memcpy(mux->ctrl_frame + mux->ctrl_frame_len, data, chunk);
+            }
+            mux->ctrl_frame_len += chunk;
+        } else if (index < mux->config.channel_count && mux->channels[index].open) {
+            rfc2217_server_channel_feed(mux->channels[index].server, data, chunk);
+        }
+        data += chunk;
+        len -= chunk;
+        mux->frame_remaining -= chunk;
+        if (mux->frame_remaining == 0) {
+            if (index == RFC2217_MUX_CONTROL_CHANNEL) {
+                process_ctrl_frame(mux);
+            }
+            mux->frame_header_len = 0;
+        }
+    }
+}
+
+static void process_ctrl_frame(rfc2217_mux_t mux)
+{
+    if (mux->ctrl_frame_len > CTRL_FRAME_MAX) {
+        ESP_LOGW(TAG, "Control frame of %d bytes dropped", (int) mux->ctrl_frame_len);
+        return;
+    }
+    const uint8_t *cmd = mux->ctrl_frame;
+    const uint8_t *end = cmd + mux->ctrl_frame_len;
+    while (end - cmd >= 2) {
+        switch (cmd[0]) {
+        case RFC2217_MUX_CMD_OPEN:
+            open_channel(mux, cmd[1]);
+            break;
+        case RFC2217_MUX_CMD_CLOSE:
+            if (cmd[1] < mux->config.channel_count && mux->channels[cmd[1]].open) {
+                close_channel(mux, cmd[1]);
+            }
+            ctrl_reply(mux, cmd, 2);
+            break;
+        default:
+            ESP_LOGW(TAG, "Unknown mux command %d", cmd[0]);
+            return;
+        }
+        cmd += 2;
+    }
+}
+
+static void open_channel(rfc2217_mux_t mux, unsigned index)
+{
+    uint8_t reply[] = {RFC2217_MUX_CMD_OPEN, (uint8_t) index, RFC2217_MUX_OPEN_OK};
+    if (index >= mux->config.channel_count) {
+        reply[2] = RFC2217_MUX_OPEN_NO_CHANNEL;
+        ctrl_reply(mux, reply, sizeof(reply));
+        return;
+    }
+    mux_channel_t *channel = &mux->channels[index];
+    atomic_store(&channel->closing, false);
+    pthread_mutex_lock(&mux->socket_mutex);
+    // the telnet negotiation of the server waits in the ring until the reply is queued
+    if (channel->open || rfc2217_server_channel_open(channel->server, channel_send, channel) != 0) {
+        reply[2] = RFC2217_MUX_OPEN_BUSY;
+    } else {
+        channel->open = true;
+    }
+    pthread_mutex_unlock(&mux->socket_mutex);
+    ctrl_reply(mux, reply, sizeof(reply));
+    if (reply[2] == RFC2217_MUX_OPEN_OK) {
+        atomic_store(&channel->sending, true);
+        tx_wake(mux);
+    }
+    ESP_LOGD(TAG, "Open channel %u: %d", index, reply[2]);
+}
+
+static void close_channel(rfc2217_mux_t mux, unsigned index)
+{
+    // Like a disconnect: the data of the channel not sent yet is dropped
+    mux_channel_t *channel = &mux->channels[index];
+    // tasks waiting for space in the ring hold the send mutex of the server, which closing takes
+    atomic_store(&channel->closing, true);
+    tx_wake(mux);
+    rfc2217_server_channel_close(channel->server);
+    pthread_mutex_lock(&mux->socket_mutex);
+    channel->open = false;
+    pthread_mutex_unlock(&mux->socket_mutex);
+    pthread_mutex_lock(&mux->tx_mutex);
+    atomic_store(&channel->sending, false);
+    ringbuf_init(&channel->tx_ring, channel->tx_buffer, channel->tx_ring.size);
+    pthread_mutex_unlock(&mux->tx_mutex);
+    ESP_LOGD(TAG, "Closed channel %u", index);
+}
+
+static void ctrl_reply(rfc2217_mux_t mux, const uint8_t *data, size_t len)
+{
+    // replies are queued whole, so that the TX thread never splits one between frames
+    while (ringbuf_free(&mux->ctrl_ring) < len && !mux->tx_thread_shutdown) {
+        tx_wait(mux, &mux->ctrl_ring);
+    }
+    ringbuf_write(&mux->ctrl_ring, data, len);
+    tx_wake(mux);
+}
+
+static void channel_send(void *ctx, const uint8_t *data, size_t len)
+{
+    // Called by the server with its send mutex held, so there is one producer per ring
+    mux_channel_t *channel = (mux_channel_t *)ctx;
+    rfc2217_mux_t mux = channel->mux;
+    while (len > 0 && !atomic_load(&channel->closing)) {
+        size_t written = ringbuf_write(&channel->tx_ring, data, len);
+        if (written > 0) {
+            tx_wake(mux);
+        }
+        data += written;
+        len -= written;
+        if (len > 0) {
+            tx_wait(mux, &channel->tx_ring);
+        }
+    }
+}
+
+static void *tx_thread_fn(void *ctx /* rfc2217_mux_t mux */)
+{
+    rfc2217_mux_t mux = (rfc2217_mux_t)ctx;
+    ESP_LOGD(TAG, "TX thread started");
+    while (true) {
+        size_t len = collect_batch(mux);
+        if (len == 0) {
+            if (mux->tx_thread_shutdown) {
+                break;
+            }
+            tx_wait(mux, NULL);
+            continue;
+        }
+        tx_wake(mux);
+        if (!mux->tx_failed && !socket_send_all(mux->client_socket, mux->tx_batch, len)) {
+            // the mux thread notices the broken connection; until then the data is dropped, so nobody blocks
+            mux->tx_failed = true;
+            shutdown(mux->client_socket, SHUT_RDWR);
+        }
+    }
+    ESP_LOGD(TAG, "TX thread done");
+    return NULL;
+}
+
+static size_t collect_batch(rfc2217_mux_t mux)
+{
+    // Control replies first, then up to quantum bytes of each channel in turn, starting with the channel
+    // after the last one served in the previous batch
+    pthread_mutex_lock(&mux->tx_mutex);
+    uint8_t *out = mux->tx_batch;
+    uint8_t *end = mux->tx_batch + mux->tx_batch_size;
+    out += collect_frame(&mux->ctrl_ring, RFC2217_MUX_CONTROL_CHANNEL, out, CTRL_RING_SIZE);
+    const size_t count = mux->config.channel_count;
+    for (size_t i = 0; i < count && end - out > FRAME_HEADER_SIZE; i++) {
+        size_t index = (mux->tx_next + i) % count;
+        mux_channel_t *channel = &mux->channels[index];
+        if (!atomic_load(&channel->sending)) {
+            continue;
+        }
+        size_t max_payload = end - out - FRAME_HEADER_SIZE;
+        if (max_payload > mux->config.quantum) {
+            max_payload = mux->config.quantum;
+        }
+        size_t len = collect_frame(&channel->tx_ring, index, out, max_payload);
+        if (len > 0) {
+            out += len;
+            mux->tx_next = (index + 1) % count;
+        }
+    }
+    pthread_mutex_unlock(&mux->tx_mutex);
+    return out - mux->tx_batch;
+}
+
+static size_t collect_frame(ringbuf_t *ring, uint8_t channel, uint8_t *out, size_t max_payload)
+{
+    // Moves up to max_payload bytes from the ring into a frame at out, returns the frame length
+    size_t len = 0;
+    while (len < max_payload) {
+        const uint8_t *data;
+        size_t avail = ringbuf_peek(ring, &data);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > max_payload - len) {
+            avail = max_payload - len;
+        }
+        memcpy(out + FRAME_HEADER_SIZE + len, data, avail);
+        ringbuf_consume(ring, avail);
+        len += avail;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    out[0] = channel;
+    out[1] = (uint8_t)(len >> 8);
+    out[2] = (uint8_t) len;
+    return FRAME_HEADER_SIZE + len;
+}
+
+static bool tx_idle(rfc2217_mux_t mux)
+{
+    if (ringbuf_used(&mux->ctrl_ring) > 0) {
+        return false;
+    }
+    for (size_t i = 0; i < mux->config.channel_count; i++) {
+        if (atomic_load(&mux->channels[i].sending) && ringbuf_used(&mux->channels[i].tx_ring) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tx_wait(rfc2217_mux_t mux, ringbuf_t *for_space)
+{
+    // Sleep until there is space in for_space (producers) or data in any ring (TX thread, for_space NULL),
+    // the other side calls tx_wake, or for at most SHUTDOWN_POLL_INTERVAL_MS. The caller re-checks afterwards.
+    pthread_mutex_lock(&mux->tx_mutex);
+    atomic_fetch_add(&mux->tx_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool ready = for_space ? (ringbuf_free(for_space) > 0) : !tx_idle(mux);
+    if (!ready && !mux->tx_thread_shutdown) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SHUTDOWN_POLL_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&mux->tx_cond, &mux->tx_mutex, &deadline);
+    }
+    atomic_fetch_sub(&mux->tx_waiters, 1);
+    pthread_mutex_unlock(&mux->tx_mutex);
+}
+
+static void tx_wake(rfc2217_mux_t mux)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&mux->tx_waiters) > 0) {
+        pthread_mutex_lock(&mux->tx_mutex);
+        pthread_cond_broadcast(&mux->tx_cond);
+        pthread_mutex_unlock(&mux->tx_mutex);
+    }
+}
+
+#else // CONFIG_RFC2217_SERVER_MUX
+
+int rfc2217_mux_create(const rfc2217_mux_config_t *config, rfc2217_mux_t *out_mux)
+{
+    return -1;
+}
+
+int rfc2217_mux_start(rfc2217_mux_t mux)
+{
+    return -1;
+}
+
+int rfc2217_mux_stop(rfc2217_mux_t mux)
+{
+    return -1;
+}
+
+void rfc2217_mux_destroy(rfc2217_mux_t mux)
+{
+}
+
+#endif // CONFIG_RFC2217_SERVER_MUX
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/*
+ * Lock-free single-producer single-consumer byte ring buffer.
+ *
+ * head is only advanced by the producer, tail only by the consumer. Both are free-running
+ * counters, so the number of bytes in the buffer is always head - tail, and the buffer
+ * can be filled completely. The size is a power of two, so that the offsets stay consistent
+ * when the counters wrap around.
+ */
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    atomic_size_t head;     // total number of bytes written
+    atomic_size_t tail;     // total number of bytes consumed
+} ringbuf_t;
+
+/* Round size down to a power of two, as required by ringbuf_init */
+static inline size_t ringbuf_usable_size(size_t size)
+{
+    size_t res = 1;
+    while (res <= size / 2) {
+        res *= 2;
+    }
+    return size ? res : 0;
+}
+
+/* size must be a power of two */
+static inline void ringbuf_init(ringbuf_t *rb, uint8_t *buf, size_t size)
+{
+    rb->buf = buf;
+    rb->size = size;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+}
+
+static inline size_t ringbuf_used(ringbuf_t *rb)
+{
+    return atomic_load_explicit(&rb->head, memory_order_acquire) - atomic_load_explicit(&rb->tail, memory_order_acquire);
+}
+
+static inline size_t ringbuf_free(ringbuf_t *rb)
+{
+    return rb->size - ringbuf_used(rb);
+}
+
+/* Producer: copy up to len bytes into the buffer, returns the number of bytes copied */
+static inline size_t ringbuf_write(ringbuf_t *rb, const uint8_t *data, size_t len)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    size_t space = rb->size - (head - tail);
+    if (len > space) {
+        len = space;
+    }
+    size_t offset = head & (rb->size - 1);
+    size_t first = rb->size - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(rb->buf + offset, data, first);
+    memcpy(rb->buf, data + first, len - first);
+    atomic_store_explicit(&rb->head, head + len, memory_order_release);
+    return len;
+}
+
+/* Consumer: get the contiguous block of data at the start of the buffer, returns its length */
+static inline size_t ringbuf_peek(ringbuf_t *rb, const uint8_t **out_data)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t offset = tail & (rb->size - 1);
+    size_t len = head - tail;
+    if (len > rb->size - offset) {
+        len = rb->size - offset;
+    }
+    *out_data = rb->buf + offset;
+    return len;
+}
+
+/* Consumer: release len bytes obtained with ringbuf_peek */
+static inline void ringbuf_consume(ringbuf_t *rb, size_t len)
+{
+    atomic_fetch_add_explicit(&rb->tail, len, memory_order_release);
+}
+
+/* Consumer: drop the data before position mark (a value of head), unless it was consumed already.
+ * Returns the number of bytes dropped. */
+static inline size_t ringbuf_consume_to(ringbuf_t *rb, size_t mark)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t len = mark - tail;   // wraps around to a large value if mark was consumed already
+    if (len > head - tail) {
+        return 0;
+    }
+    atomic_store_explicit(&rb->tail, mark, memory_order_release);
+    return len;
+}
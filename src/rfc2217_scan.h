@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Word-at-a-time byte search helpers used on the data paths.
+ *
+ * None of the supported targets has a SIMD unit that is worth using for this,
+ * so the "vector" is a machine word: each word is checked for any matching byte
+ * with a couple of ALU operations, and only the word which contains a match is
+ * examined byte by byte.
+ */
+
+typedef uintptr_t scan_word_t;
+
+#define SCAN_ONES   ((scan_word_t)-1 / 0xffU)
+#define SCAN_HIGHS  (SCAN_ONES * 0x80U)
+
+/* Non-zero if any byte of w is zero */
+static inline scan_word_t scan_has_zero(scan_word_t w)
+{
+    return (w - SCAN_ONES) & ~w & SCAN_HIGHS;
+}
+
+/**
+ * Find the first occurrence of either a or b in buf.
+ * Returns pointer to the matching byte, or NULL if there is none.
+ */
+static inline const uint8_t *scan_find_any2(const uint8_t *buf, size_t len, uint8_t a, uint8_t b)
+{
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+
+    // head: advance to word alignment
+    for (; p < end && ((uintptr_t)p % sizeof(scan_word_t)) != 0; ++p) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    // body: skip over words without a match
+    const scan_word_t wa = SCAN_ONES * a;
+    const scan_word_t wb = SCAN_ONES * b;
+    for (; (size_t)(end - p) >= sizeof(scan_word_t); p += sizeof(scan_word_t)) {
+        scan_word_t w;
+        memcpy(&w, p, sizeof(w));
+        if (scan_has_zero(w ^ wa) | scan_has_zero(w ^ wb)) {
+            break;
+        }
+    }
+    // tail, or the word containing the match
+    for (; p < end; ++p) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return NULL;
+}
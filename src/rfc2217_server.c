@@ -1,240 +1,503 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     // for pthread_attr_setaffinity_np
+#endif
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/sockios.h>  // for SIOCOUTQ
+#endif
+#include "sdkconfig.h"
+#if !CONFIG_RFC2217_SERVER_DEBUG_LOGS
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
 #include "esp_log.h"
-#include "esp_pthread.h"
+#if CONFIG_RFC2217_SERVER_BULK_IN_PSRAM
+#include "esp_heap_caps.h"
+#endif
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS && !CONFIG_IDF_TARGET_LINUX
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
 #include "rfc2217_server.h"
+#include "rfc2217_server_test.h"
+#include "rfc2217_scan.h"
+#include "rfc2217_ringbuf.h"
+#include "rfc2217_matcher.h"
+#include "rfc2217_socket.h"
+#include "rfc2217_telnet.h"
+#include "rfc2217_thread.h"
+#if CONFIG_RFC2217_SERVER_MUX
+#include "rfc2217_channel.h"
+#endif
 
 static const char *TAG = "rfc2217_server";
-// telnet
-#define T_SE 0xf0U
-#define T_NOP 0xf1U
-#define T_DM 0xf2U
-#define T_BRK 0xf3U
-#define T_IP 0xf4U
-#define T_AO 0xf5U
-#define T_AYT 0xf6U
-#define T_EC 0xf7U
-#define T_EL 0xf8U
-#define T_GA 0xf9U
-#define T_SB 0xfaU
-#define T_WILL 0xfbU
-#define T_WONT 0xfcU
-#define T_DO 0xfdU
-#define T_DONT 0xfeU
-#define T_IAC 0xffU
-
-// telnet options
-#define T_BINARY 0x00U
-#define T_ECHO 0x01U
-#define T_SGA 0x03U
-
-// RFC2217
-#define T_COM_PORT_OPTION 0x2cU
-
-// Client to server
-#define T_SET_BAUDRATE 0x01U
-#define T_SET_DATASIZE 0x02U
-#define T_SET_PARITY 0x03U
-#define T_SET_STOPSIZE 0x04U
-#define T_SET_CONTROL 0x05U
-#define T_NOTIFY_LINESTATE 0x06U
-#define T_NOTIFY_MODEMSTATE 0x07U
-#define T_FLOWCONTROL_SUSPEND 0x08U
-#define T_FLOWCONTROL_RESUME 0x09U
-#define T_SET_LINESTATE_MASK 0x0aU
-#define T_SET_MODEMSTATE_MASK 0x0bU
-#define T_PURGE_DATA 0x0cU
-
-// Server to client
-#define T_SERVER_SET_BAUDRATE 0x65U
-#define T_SERVER_SET_DATASIZE 0x66U
-#define T_SERVER_SET_PARITY 0x67U
-#define T_SERVER_SET_STOPSIZE 0x68U
-#define T_SERVER_SET_CONTROL 0x69U
-#define T_SERVER_NOTIFY_LINESTATE 0x6aU
-#define T_SERVER_NOTIFY_MODEMSTATE 0x6bU
-#define T_SERVER_FLOWCONTROL_SUSPEND 0x6cU
-#define T_SERVER_FLOWCONTROL_RESUME 0x6dU
-#define T_SERVER_SET_LINESTATE_MASK 0x6eU
-#define T_SERVER_SET_MODEMSTATE_MASK 0x6fU
-#define T_SERVER_PURGE_DATA 0x70U
-
-typedef enum { T_NORMAL, T_GOT_IAC, T_NEGOTIATE } telnet_mode_t;
 
-
-typedef enum {
-    T_REQUESTED,
-    T_ACTIVE,
-    T_INACTIVE,
-    T_REALLY_INACTIVE
-} telnet_option_state_t;
-
-typedef void (*activation_callback_t)(rfc2217_server_t, bool);
-typedef void (*send_option_callback_t)(rfc2217_server_t, uint8_t, uint8_t);
+// Data is sent to the socket in pieces of at most this size; queued control messages are sent between them
+#define TCP_SEND_CHUNK_SIZE 4096
+// Data around IAC characters is copied into a buffer of this size on the stack to double the IACs
+#define TCP_SEND_ESCAPE_SIZE 64
+// Limit of unsent data in the socket, where supported (not in lwIP, which has a small send buffer anyway),
+// so that control messages don't queue behind a large socket send buffer
+#define TCP_NOTSENT_LOWAT_BYTES 16384
+// Size of the queue of control messages (option negotiation, subnegotiation replies) waiting to be sent
+#define CTRL_QUEUE_SIZE 64
+// In RFC2217_SERVER_MODE_AUTO, time to wait for telnet negotiation from a new client, if not configured
+#define AUTO_DETECT_TIMEOUT_MS 200
+// Timeout passed to on_drain, if not configured
+#define DRAIN_TIMEOUT_MS 1000
+// How long queued data without a flush delimiter is held back, if not configured
+#define FLUSH_TIMEOUT_MS 10
+// Replies to merged SET_CONTROL requests kept at most; another request applies the merged changes first
+#define LINE_STATE_MAX_REPLIES 8
+// Value of client_socket while a test session is open; never passed to the socket API
+#define TEST_SESSION_SOCKET INT_MAX
+// Value of client_socket while a mux channel session is open; never passed to the socket API
+#define CHANNEL_SOCKET (INT_MAX - 1)
+// Callback durations are counted in buckets of [2^(i-1), 2^i) microseconds, the last bucket takes all longer ones
+#define CALLBACK_HISTOGRAM_BUCKETS 24
+
+// software flow control characters
+#define XON 0x11U
+#define XOFF 0x13U
+
+// signals passed to on_line_state
+#define LINE_DTR 0x01U
+#define LINE_RTS 0x02U
+#define LINE_BREAK 0x04U
+
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
 typedef struct {
-    uint8_t option;
-    const char *name;
-    telnet_option_state_t initial_state;
-    uint8_t send_yes;
-    uint8_t send_no;
-    uint8_t ack_yes;
-    uint8_t ack_no;
-    activation_callback_t cb;
-    send_option_callback_t send_option_cb;
-} telnet_option_def_t;
+    uint32_t calls;
+    uint32_t over_budget;
+    uint32_t stuck;                 // written by the server thread (watchdog), the other fields by the TCP receive thread
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t histogram[CALLBACK_HISTOGRAM_BUCKETS];
+} callback_stats_t;
+#endif
+
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS && CONFIG_IDF_TARGET_LINUX
+// no cycle counter on the host, count nanoseconds
+typedef uint64_t callback_ticks_t;
+#else
+// CPU cycles, wrap around after 2^32 cycles
+typedef uint32_t callback_ticks_t;
+#endif
+
+static void telnet_send_option(void *ctx, uint8_t action, uint8_t option);
+static void on_client_ok(void *ctx, bool ok);
+
+static const telnet_option_def_t s_telnet_option_defs[] = {
+    {T_ECHO, OPTION_NAME("ECHO"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
+    {T_SGA, OPTION_NAME("we-SGA"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
+    {T_SGA, OPTION_NAME("they-SGA"), T_INACTIVE, T_DO, T_DONT, T_WILL, T_WONT, NULL, NULL},
+    {T_BINARY, OPTION_NAME("we-BINARY"), T_INACTIVE, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
+    {T_BINARY, OPTION_NAME("they-BINARY"), T_REQUESTED, T_DO, T_DONT, T_WILL, T_WONT, NULL, NULL},
+    {T_COM_PORT_OPTION, OPTION_NAME("we-RFC2217"), T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, on_client_ok, telnet_send_option},
+    {T_COM_PORT_OPTION, OPTION_NAME("they-RFC2217"), T_INACTIVE, T_DO, T_DONT, T_WILL, T_WONT, on_client_ok, telnet_send_option}
+};
 
-typedef struct {
-    const telnet_option_def_t *def;
-    void *ctx;
-    bool active;
-    telnet_option_state_t state;
-} telnet_option_t;
+#define TELNET_OPTIONS_COUNT (sizeof(s_telnet_option_defs) / sizeof(s_telnet_option_defs[0]))
 
 struct rfc2217_server_s {
     rfc2217_server_config_t config;
     uint8_t tcp_rx_buffer[128];
-    telnet_mode_t telnet_mode;
+    telnet_parser_t parser;
     int client_socket;
+    int listen_socket;
+    pthread_mutex_t socket_mutex;   // guards changes of client_socket and listen_socket
     pthread_t server_thread;
+    volatile bool server_thread_running;
     volatile bool server_thread_shutdown;
     pthread_t tcp_receive_thread;
+    volatile bool tcp_receive_thread_running;
     volatile bool tcp_receive_thread_shutdown;
     bool client_is_rfc2217;
     pthread_mutex_t tcp_send_mutex;
-    uint8_t suboption[16];
-    size_t suboption_size;
-    telnet_option_t *telnet_options;
-    size_t telnet_options_count;
-    bool collecting_suboption;
-    uint8_t telnet_command;
+    // control messages waiting for the holder of tcp_send_mutex, see tcp_send_control
+    pthread_mutex_t ctrl_queue_mutex;
+    uint8_t ctrl_queue[CTRL_QUEUE_SIZE];
+    size_t ctrl_queue_len;
+    atomic_bool ctrl_pending;
+    // replies to the received data are collected in ctrl_queue and sent together, see parse_received
+    volatile bool ctrl_deferred;
+    pthread_t ctrl_defer_thread;
+    telnet_option_t telnet_options[TELNET_OPTIONS_COUNT];
+    volatile bool xon_xoff_active;  // client selected XON/XOFF flow control, and handle_xon_xoff is set
+    volatile bool serial_tx_paused; // serial device sent XOFF, data delivery to on_data_received is paused
+    pthread_mutex_t flow_control_mutex; // used with flow_control_cond to wait for XON, and for the RX queue
+    pthread_cond_t flow_control_cond;
+    bool statically_allocated;      // created with rfc2217_server_create_static, not freed on destroy
+    rfc2217_alloc_stats_t alloc_stats[RFC2217_ALLOC_SITE_COUNT];   // only changed in create and destroy
+    // separate TX thread, used if config.tx_queue_size != 0
+    ringbuf_t tx_queue;             // filled by rfc2217_server_send_data, drained by the TX thread
+    uint8_t *tx_queue_buffer;
+    pthread_t tx_thread;
+    volatile bool tx_thread_running;
+    volatile bool tx_thread_shutdown;
+    pthread_mutex_t tx_producer_mutex;  // serializes callers of rfc2217_server_send_data
+    pthread_mutex_t tx_queue_mutex;     // used with tx_queue_cond to sleep when the queue is empty or full
+    pthread_cond_t tx_queue_cond;
+    atomic_int tx_queue_waiters;        // number of threads sleeping on tx_queue_cond
+#if CONFIG_RFC2217_SERVER_PURGE
+    atomic_size_t tx_queue_purge_mark;  // tx_queue position up to which the TX thread drops the data after a purge
+    atomic_bool tx_queue_purge_pending; // tx_queue_purge_mark is set and not applied yet
+#endif
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    // queue of received data, used if config.rx_queue_size != 0
+    ringbuf_t rx_queue;             // filled by the TCP receive thread, drained by rfc2217_server_read
+    uint8_t *rx_queue_buffer;
+    atomic_int rx_queue_waiters;    // number of threads sleeping on flow_control_cond for the RX queue
+#if CONFIG_RFC2217_SERVER_PURGE
+    atomic_size_t rx_queue_purge_mark;  // rx_queue position up to which rfc2217_server_read drops the data after a purge
+    atomic_bool rx_queue_purge_pending;
+#endif
+#endif
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+    // delimiter-triggered flush of the TX queue, used if config.flush_delimiter_count != 0
+    atomic_size_t flush_mark;       // tx_queue position just after the last delimiter written
+    size_t flush_threshold;         // queued bytes which are sent without a delimiter, 0 if flushing on delimiters is off
+    uint64_t flush_hold_since_us;   // when the TX thread started holding back data, 0 if it isn't; TX thread only
+    atomic_bool flush_holding;      // TX thread is waiting for a delimiter or flush_threshold bytes
+#endif
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    // DTR, RTS and break changes merged for on_line_state; TCP receive thread only
+    uint8_t line_applied;           // LINE_* signals last passed to on_line_state
+    uint8_t line_pending;           // LINE_* signals after the merged requests
+    uint8_t line_changes;           // requests merged since on_line_state was last called, 0 if none
+    uint8_t line_replies[LINE_STATE_MAX_REPLIES];  // values of the merged requests not replied to yet
+    uint8_t line_reply_count;
+    uint64_t line_pending_since_us; // time of the first merged request
+#endif
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+    // serial line settings requested by the client, used to pace on_data_received if config.rx_shaper_burst != 0
+    uint32_t line_baudrate;         // 0 until the client sets the baud rate
+    uint8_t line_datasize;
+    uint8_t line_parity;
+    uint8_t line_stopsize;
+    uint64_t shaper_char_cost;      // credits needed to deliver one character, 0 if shaping is inactive
+    uint64_t shaper_credits;        // 2 * baudrate credits are added per microsecond
+    uint64_t shaper_last_us;        // time of the last credit update
+#endif
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    // round-trip time measurement with TIMING-MARK, guarded by socket_mutex
+    uint64_t rtt_probe_sent_us;     // time the outstanding probe was sent, 0 if none
+    uint64_t rtt_last_probe_us;     // time the last probe was sent
+    uint32_t rtt_srtt_us;
+    uint32_t rtt_var_us;
+    uint32_t rtt_last_us;
+    uint32_t rtt_samples;
+#endif
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+    matcher_t *trigger_matcher;     // compiled config.trigger_patterns, NULL if there are none
+    matcher_allocator_t trigger_allocator;  // passes the memory of trigger_matcher through server_alloc
+#endif
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    // timing of the application callbacks
+    callback_stats_t *callback_stats;   // RFC2217_CALLBACK_COUNT entries
+    uint32_t callback_ticks_per_us;
+    atomic_uint callback_running;   // rfc2217_callback_t + 1 of the call in progress, 0 if none
+    atomic_uint callback_seq;       // incremented at the start of every call, so that the watchdog can tell calls apart
+    uint32_t callback_arg;          // argument of the call in progress: data length, baud rate, control or purge value
+    volatile bool tcp_receive_thread_done;  // the watchdog in the server thread stops when this is set
+#endif
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    volatile bool raw_session;      // current client is served without telnet processing
+    uint8_t *raw_rx_buffer;         // CONFIG_RFC2217_SERVER_RAW_RX_BUFFER_SIZE bytes, if config.mode isn't RFC2217
+#endif
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    const rfc2217_test_session_t *test_session;    // clock and transport of the open test session, NULL if none
+#endif
+#if CONFIG_RFC2217_SERVER_MUX
+    rfc2217_channel_send_t channel_send;    // transport of the open mux channel session, NULL if none
+    void *channel_ctx;
+#endif
 };
 
+_Static_assert(sizeof(struct rfc2217_server_s) <= sizeof(rfc2217_server_storage_t),
+               "rfc2217_server_storage_t is too small, increase RFC2217_SERVER_STORAGE_WORDS");
+
 static void *server_thread_fn(void *ctx /* rfc2217_server_t server */);
 static void *tcp_receive_thread_fn(void *ctx /* rfc2217_server_t server */);
-
-static void process_received_over_tcp(rfc2217_server_t server, const uint8_t *buf, size_t size);
-static void tcp_send(rfc2217_server_t server, const void *buf, size_t size);
-static void process_subnegotiation(rfc2217_server_t server);
-static void process_telnet_command(rfc2217_server_t server, uint8_t c);
-static void telnet_negotiate_option(rfc2217_server_t server, uint8_t command, uint8_t option);
-static void telnet_send_option(rfc2217_server_t server, uint8_t action, uint8_t option);
-static void on_client_ok(rfc2217_server_t server, bool ok);
+static void *tx_thread_fn(void *ctx /* rfc2217_server_t server */);
+static void session_begin(rfc2217_server_t server);
+static void session_end(rfc2217_server_t server);
+static int create_thread(rfc2217_server_t server, pthread_t *thread, void *(*fn)(void *), const char *name, unsigned core_id);
+static void send_data_to_client(rfc2217_server_t server, const uint8_t *data, size_t len);
+static int tx_queue_push(rfc2217_server_t server, const uint8_t *data, size_t len);
+static void tx_queue_wait(rfc2217_server_t server, bool for_space);
+static void tx_queue_wake(rfc2217_server_t server);
+static void tx_queue_reset(rfc2217_server_t server);
+static void ctrl_queue_reset(rfc2217_server_t server);
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+static void test_tx_queue_send(rfc2217_server_t server);
+#endif
+static bool tx_queue_pushed(rfc2217_server_t server, const uint8_t *data, size_t len, size_t head);
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+static bool flush_mark_delimiter(rfc2217_server_t server, const uint8_t *data, size_t len, size_t head);
+static size_t flush_sendable(rfc2217_server_t server, size_t len);
+#endif
+static void get_deadline(struct timespec *deadline, unsigned timeout_us);
+#if CONFIG_RFC2217_SERVER_PURGE
+static void process_purge(rfc2217_server_t server, uint8_t purge);
+static void tx_queue_apply_purge(rfc2217_server_t server);
+#endif
+
+static void telnet_receive_loop(rfc2217_server_t server);
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+static int detect_raw_session(rfc2217_server_t server, int sock);
+static void raw_receive_loop(rfc2217_server_t server);
+#endif
+static void deliver_received_data(void *ctx, const uint8_t *buf, size_t size);
+static void call_on_data_received(rfc2217_server_t server, const uint8_t *data, size_t len);
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+typedef enum {
+    RX_QUEUE_SPACE,     // the TCP receive thread waits for space to read more from the socket
+    RX_QUEUE_DATA,      // rfc2217_server_read waits for data it can return
+    RX_QUEUE_EMPTY,     // the TCP receive thread waits until the application has read everything
+} rx_queue_wait_t;
+static void rx_queue_push(rfc2217_server_t server, const uint8_t *data, size_t len);
+static size_t rx_queue_credit(rfc2217_server_t server, size_t max_len, unsigned timeout_ms);
+static bool rx_queue_ready(rfc2217_server_t server, rx_queue_wait_t until);
+static bool rx_queue_wait(rfc2217_server_t server, rx_queue_wait_t until, unsigned timeout_ms);
+static void rx_queue_wake(rfc2217_server_t server);
+static size_t rx_queue_unread(rfc2217_server_t server);
+#if CONFIG_RFC2217_SERVER_PURGE
+static bool rx_queue_apply_purge(rfc2217_server_t server);
+#endif
+#endif
+static inline callback_ticks_t callback_begin(rfc2217_server_t server, rfc2217_callback_t callback, uint32_t arg);
+static inline void callback_end(rfc2217_server_t server, rfc2217_callback_t callback, callback_ticks_t start);
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+static void callback_watchdog(rfc2217_server_t server);
+#endif
+static void wait_serial_tx_resumed(rfc2217_server_t server);
+#if CONFIG_RFC2217_SERVER_RX_SHAPER || CONFIG_RFC2217_SERVER_LINK_STATS || CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS || \
+    CONFIG_RFC2217_SERVER_LINE_STATE
+static uint64_t now_us(rfc2217_server_t server);
+#endif
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+static bool line_state_merge(rfc2217_server_t server, uint8_t control);
+static void line_state_apply(rfc2217_server_t server);
+static void line_state_reply(rfc2217_server_t server);
+static unsigned line_state_poll(rfc2217_server_t server, unsigned timeout_ms);
+#endif
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+static void rtt_reset(rfc2217_server_t server);
+static void rtt_probe_poll(rfc2217_server_t server);
+static void rtt_probe_reply(rfc2217_server_t server);
+#endif
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+static void shaper_reset(rfc2217_server_t server);
+static void shaper_update_rate(rfc2217_server_t server);
+static size_t shaper_take(rfc2217_server_t server, size_t size);
+static void shaper_wait(rfc2217_server_t server);
+#endif
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+static void send_data_xon_xoff(rfc2217_server_t server, const uint8_t *data, size_t len);
+static void set_serial_tx_paused(rfc2217_server_t server, bool paused);
+#endif
+static bool send_all(rfc2217_server_t server, int sock, const uint8_t *buf, size_t size);
+static void tcp_send_data(rfc2217_server_t server, const uint8_t *data, size_t size);
+static void tcp_send_control(rfc2217_server_t server, const uint8_t *buf, size_t size);
+static void ctrl_queue_flush(rfc2217_server_t server, int sock);
+static void ctrl_queue_kick(rfc2217_server_t server);
+static void parse_received(rfc2217_server_t server, uint8_t *data, size_t len);
+static void process_subnegotiation(void *ctx, const uint8_t *suboption, size_t size);
+static void process_telnet_command(void *ctx, uint8_t c);
+static void telnet_negotiate_option(void *ctx, uint8_t command, uint8_t option);
 static void rfc2217_send_subnegotiation(rfc2217_server_t server, uint8_t command, const uint8_t *data, size_t size);
-static int telnet_options_init(rfc2217_server_t server);
-static void telnet_options_destroy(rfc2217_server_t server);
+static void drain_serial_tx(rfc2217_server_t server);
+static int server_init(rfc2217_server_t server, const rfc2217_server_config_t *config);
+static void *server_alloc(const rfc2217_allocator_t *allocator, rfc2217_alloc_stats_t *stats, rfc2217_alloc_site_t site, size_t size);
+static void server_free(const rfc2217_allocator_t *allocator, rfc2217_alloc_stats_t *stats, rfc2217_alloc_site_t site, void *ptr, size_t size);
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+static void *trigger_alloc(void *ctx, size_t size);
+static void trigger_free(void *ctx, void *ptr, size_t size);
+#endif
+
+static const rfc2217_alloc_hint_t s_alloc_hints[RFC2217_ALLOC_SITE_COUNT] = {
+    [RFC2217_ALLOC_INSTANCE] = RFC2217_ALLOC_HOT,
+    [RFC2217_ALLOC_TX_QUEUE] = RFC2217_ALLOC_BULK,
+    [RFC2217_ALLOC_TRIGGERS] = RFC2217_ALLOC_HOT,
+    [RFC2217_ALLOC_RAW_RX] = RFC2217_ALLOC_HOT,
+    [RFC2217_ALLOC_CALLBACK_STATS] = RFC2217_ALLOC_HOT,
+    [RFC2217_ALLOC_RX_QUEUE] = RFC2217_ALLOC_BULK,
+};
 
+static const telnet_parser_handlers_t s_telnet_parser_handlers = {
+    .on_data = deliver_received_data,
+    .on_negotiate = telnet_negotiate_option,
+    .on_subnegotiation = process_subnegotiation,
+    .on_command = process_telnet_command,
+};
 
-void telnet_option_process_incoming(telnet_option_t *option, uint8_t command)
+static int server_init(rfc2217_server_t server, const rfc2217_server_config_t *config)
 {
-    ESP_LOGD(TAG, "Option %s (state=%d) received command 0x%x", option->def->name, option->state, command);
-    if (command == option->def->ack_yes) {
-        if (option->state == T_REQUESTED) {
-            option->state = T_ACTIVE;
-            option->active = true;
-            ESP_LOGD(TAG, "Option %s activated", option->def->name);
-            if (option->def->cb) {
-                option->def->cb(option->ctx, true);
-            }
-        } else if (option->state == T_ACTIVE) {
-            // Do nothing
-        } else if (option->state == T_INACTIVE) {
-            option->state = T_ACTIVE;
-            if (option->def->send_option_cb) {
-                option->def->send_option_cb(option->ctx, option->def->send_yes, option->def->option);
-            }
-            option->active = true;
-            if (option->def->cb) {
-                option->def->cb(option->ctx, true);
-            }
-        } else if (option->state == T_REALLY_INACTIVE) {
-            if (option->def->send_option_cb) {
-                option->def->send_option_cb(option->ctx, option->def->send_no, option->def->option);
-            }
+    server->config = *config;
+    telnet_parser_init(&server->parser, &s_telnet_parser_handlers, server);
+    server->client_socket = -1;
+    server->listen_socket = -1;
+    pthread_mutex_init(&server->socket_mutex, NULL);
+    pthread_mutex_init(&server->tcp_send_mutex, NULL);
+    pthread_mutex_init(&server->ctrl_queue_mutex, NULL);
+    atomic_init(&server->ctrl_pending, false);
+    pthread_mutex_init(&server->flow_control_mutex, NULL);
+    pthread_cond_init(&server->flow_control_cond, NULL);
+    pthread_mutex_init(&server->tx_producer_mutex, NULL);
+    pthread_mutex_init(&server->tx_queue_mutex, NULL);
+    pthread_cond_init(&server->tx_queue_cond, NULL);
+    atomic_init(&server->tx_queue_waiters, 0);
+#if CONFIG_RFC2217_SERVER_PURGE
+    atomic_init(&server->tx_queue_purge_mark, 0);
+    atomic_init(&server->tx_queue_purge_pending, false);
+#endif
+    if (config->tx_queue_size > 0) {
+        size_t size = ringbuf_usable_size(config->tx_queue_size);
+        server->tx_queue_buffer = server_alloc(config->allocator, server->alloc_stats, RFC2217_ALLOC_TX_QUEUE, size);
+        if (!server->tx_queue_buffer) {
+            ESP_LOGE(TAG, "Failed to allocate TX queue");
+            return -1;
         }
-    } else if (command == option->def->ack_no) {
-        if (option->state == T_REQUESTED) {
-            option->state = T_INACTIVE;
-            option->active = false;
-        } else if (option->state == T_ACTIVE) {
-            option->state = T_INACTIVE;
-            if (option->def->send_option_cb) {
-                option->def->send_option_cb(option->ctx, option->def->send_no, option->def->option);
-            }
-            option->active = false;
-        } else if (option->state == T_INACTIVE) {
-            // Do nothing
-        } else if (option->state == T_REALLY_INACTIVE) {
-            // Do nothing
+        ringbuf_init(&server->tx_queue, server->tx_queue_buffer, size);
+    }
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    atomic_init(&server->rx_queue_waiters, 0);
+#if CONFIG_RFC2217_SERVER_PURGE
+    atomic_init(&server->rx_queue_purge_mark, 0);
+    atomic_init(&server->rx_queue_purge_pending, false);
+#endif
+    if (config->rx_queue_size > 0) {
+        size_t size = ringbuf_usable_size(config->rx_queue_size);
+        server->rx_queue_buffer = server_alloc(config->allocator, server->alloc_stats, RFC2217_ALLOC_RX_QUEUE, size);
+        if (!server->rx_queue_buffer) {
+            ESP_LOGE(TAG, "Failed to allocate RX queue");
+            return -1;
+        }
+        ringbuf_init(&server->rx_queue, server->rx_queue_buffer, size);
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+    if (config->flush_delimiter_count > 2) {
+        ESP_LOGE(TAG, "At most 2 flush delimiters are supported");
+        return -1;
+    }
+    atomic_init(&server->flush_mark, 0);
+    atomic_init(&server->flush_holding, false);
+    if (config->flush_delimiter_count > 0 && server->tx_queue_buffer) {
+        server->flush_threshold = config->flush_threshold ? config->flush_threshold : server->tx_queue.size / 2;
+        if (server->flush_threshold > server->tx_queue.size) {
+            server->flush_threshold = server->tx_queue.size;
+        }
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+    if (config->trigger_pattern_count > 0) {
+        server->trigger_allocator = (matcher_allocator_t) {
+            .alloc = trigger_alloc,
+            .free = trigger_free,
+            .ctx = server,
+        };
+        if (matcher_create(config->trigger_patterns, config->trigger_pattern_count, &server->trigger_allocator,
+                           &server->trigger_matcher) != 0) {
+            ESP_LOGE(TAG, "Failed to compile trigger patterns");
+            return -1;
+        }
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    server->callback_stats = server_alloc(config->allocator, server->alloc_stats, RFC2217_ALLOC_CALLBACK_STATS,
+                                          sizeof(callback_stats_t) * RFC2217_CALLBACK_COUNT);
+    if (!server->callback_stats) {
+        ESP_LOGE(TAG, "Failed to allocate callback statistics");
+        return -1;
+    }
+#if CONFIG_IDF_TARGET_LINUX
+    server->callback_ticks_per_us = 1000;
+#else
+    server->callback_ticks_per_us = esp_rom_get_cpu_ticks_per_us();
+#endif
+    atomic_init(&server->callback_running, 0);
+    atomic_init(&server->callback_seq, 0);
+#endif
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (config->mode != RFC2217_SERVER_MODE_RFC2217) {
+        server->raw_rx_buffer = server_alloc(config->allocator, server->alloc_stats, RFC2217_ALLOC_RAW_RX,
+                                             CONFIG_RFC2217_SERVER_RAW_RX_BUFFER_SIZE);
+        if (!server->raw_rx_buffer) {
+            ESP_LOGE(TAG, "Failed to allocate raw mode receive buffer");
+            return -1;
         }
     }
-    ESP_LOGD(TAG, "Option %s state: %d active: %d", option->def->name, option->state, option->active);
+#endif
+    return 0;
 }
 
-static int telnet_options_init(rfc2217_server_t server)
+int rfc2217_server_create(const rfc2217_server_config_t *config, rfc2217_server_t *out_server)
 {
-    static const telnet_option_def_t option_defs[] = {
-        {T_ECHO, "ECHO", T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
-        {T_SGA, "we-SGA", T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
-        {T_SGA, "they-SGA", T_INACTIVE, T_DO, T_DONT, T_WILL, T_WONT, NULL, NULL},
-        {T_BINARY, "we-BINARY", T_INACTIVE, T_WILL, T_WONT, T_DO, T_DONT, NULL, NULL},
-        {T_BINARY, "they-BINARY", T_REQUESTED, T_DO, T_DONT, T_WILL, T_WONT, NULL, NULL},
-        {T_COM_PORT_OPTION, "we-RFC2217", T_REQUESTED, T_WILL, T_WONT, T_DO, T_DONT, on_client_ok, telnet_send_option},
-        {T_COM_PORT_OPTION, "they-RFC2217", T_INACTIVE, T_DO, T_DONT, T_WILL, T_WONT, on_client_ok, telnet_send_option}
-    };
-
-    server->telnet_options_count = sizeof(option_defs) / sizeof(option_defs[0]);
-
-    telnet_option_t *options = calloc(server->telnet_options_count, sizeof(telnet_option_t));
-    if (!options) {
-        ESP_LOGE(TAG, "Failed to allocate memory for telnet options");
+    rfc2217_alloc_stats_t stats[RFC2217_ALLOC_SITE_COUNT] = {};
+    rfc2217_server_t server = server_alloc(config->allocator, stats, RFC2217_ALLOC_INSTANCE, sizeof(struct rfc2217_server_s));
+    if (!server) {
         return -1;
     }
+    memcpy(server->alloc_stats, stats, sizeof(stats));
 
-    for (size_t i = 0; i < server->telnet_options_count; i++) {
-        options[i].def = &option_defs[i];
-        options[i].ctx = server;
-        options[i].state = option_defs[i].initial_state;
-        options[i].active = false;
+    if (server_init(server, config) != 0) {
+        rfc2217_server_destroy(server);
+        return -1;
     }
-
-    server->telnet_options = options;
+    *out_server = server;
     return 0;
 }
 
-static void telnet_options_destroy(rfc2217_server_t server)
-{
-    free(server->telnet_options);
-}
-
-int rfc2217_server_create(const rfc2217_server_config_t *config, rfc2217_server_t *out_server)
+int rfc2217_server_create_static(const rfc2217_server_config_t *config, rfc2217_server_storage_t *storage, rfc2217_server_t *out_server)
 {
-    rfc2217_server_t server = calloc(1, sizeof(struct rfc2217_server_s));
-    if (!server) {
+    if (!storage) {
+        return -1;
+    }
+    rfc2217_server_t server = (rfc2217_server_t) storage;
+    memset(server, 0, sizeof(*server));
+    server->statically_allocated = true;
+    if (server_init(server, config) != 0) {
+        rfc2217_server_destroy(server);
         return -1;
     }
-
-    server->config = *config;
-    server->telnet_mode = T_NORMAL;
-    pthread_mutex_init(&server->tcp_send_mutex, NULL);
     *out_server = server;
     return 0;
 }
 
 int rfc2217_server_start(rfc2217_server_t server)
 {
+    if (server->server_thread_running) {
+        ESP_LOGE(TAG, "Server thread is already running");
+        return -1;
+    }
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        ESP_LOGE(TAG, "A test session is open");
+        return -1;
+    }
+#endif
+    server->server_thread_shutdown = false;
+    server->tcp_receive_thread_shutdown = false;
 
-
-    int res = pthread_create(&server->server_thread, NULL, server_thread_fn, server);
+    int res = create_thread(server, &server->server_thread, server_thread_fn, "rfc2217_srv", server->config.task_core_id);
     if (res != 0) {
         ESP_LOGE(TAG, "Failed to create server thread: %d", res);
         return -1;
     }
+    server->server_thread_running = true;
 
     return 0;
 }
@@ -242,26 +505,356 @@ int rfc2217_server_start(rfc2217_server_t server)
 int rfc2217_server_stop(rfc2217_server_t server)
 {
     // check if the server thread is running
-    if (server->server_thread == 0) {
+    if (!server->server_thread_running) {
         ESP_LOGE(TAG, "Server thread is not running");
         return -1;
     }
-    // stop the tcp receive thread
     server->tcp_receive_thread_shutdown = true;
-    pthread_join(server->tcp_receive_thread, NULL);
-    server->tcp_receive_thread = 0;
-    // stop the server thread
     server->server_thread_shutdown = true;
+    // wake up the receive thread if it is waiting in deliver_received_data or for the RX queue
+    pthread_mutex_lock(&server->flow_control_mutex);
+    server->serial_tx_paused = false;
+    pthread_cond_broadcast(&server->flow_control_cond);
+    pthread_mutex_unlock(&server->flow_control_mutex);
+    // wake up the threads blocked in accept, recv or send
+    pthread_mutex_lock(&server->socket_mutex);
+    if (server->client_socket >= 0) {
+        shutdown(server->client_socket, SHUT_RDWR);
+    }
+    if (server->listen_socket >= 0) {
+        shutdown(server->listen_socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->socket_mutex);
+    // the server thread joins the tcp receive thread before exiting
     pthread_join(server->server_thread, NULL);
-    server->server_thread = 0;
+    server->server_thread_running = false;
     return 0;
 }
 
 void rfc2217_server_destroy(rfc2217_server_t server)
 {
-    free(server);
+    if (server->server_thread_running) {
+        rfc2217_server_stop(server);
+    }
+    pthread_cond_destroy(&server->flow_control_cond);
+    pthread_mutex_destroy(&server->flow_control_mutex);
+    pthread_mutex_destroy(&server->ctrl_queue_mutex);
+    pthread_mutex_destroy(&server->tcp_send_mutex);
+    pthread_mutex_destroy(&server->socket_mutex);
+    pthread_cond_destroy(&server->tx_queue_cond);
+    pthread_mutex_destroy(&server->tx_queue_mutex);
+    pthread_mutex_destroy(&server->tx_producer_mutex);
+    const rfc2217_allocator_t *allocator = server->config.allocator;
+    if (server->tx_queue_buffer) {
+        server_free(allocator, server->alloc_stats, RFC2217_ALLOC_TX_QUEUE, server->tx_queue_buffer,
+                    ringbuf_usable_size(server->config.tx_queue_size));
+    }
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (server->rx_queue_buffer) {
+        server_free(allocator, server->alloc_stats, RFC2217_ALLOC_RX_QUEUE, server->rx_queue_buffer,
+                    ringbuf_usable_size(server->config.rx_queue_size));
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+    matcher_destroy(server->trigger_matcher);
+#endif
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (server->raw_rx_buffer) {
+        server_free(allocator, server->alloc_stats, RFC2217_ALLOC_RAW_RX, server->raw_rx_buffer,
+                    CONFIG_RFC2217_SERVER_RAW_RX_BUFFER_SIZE);
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    if (server->callback_stats) {
+        server_free(allocator, server->alloc_stats, RFC2217_ALLOC_CALLBACK_STATS, server->callback_stats,
+                    sizeof(callback_stats_t) * RFC2217_CALLBACK_COUNT);
+    }
+#endif
+    if (!server->statically_allocated) {
+        server_free(allocator, server->alloc_stats, RFC2217_ALLOC_INSTANCE, server, sizeof(struct rfc2217_server_s));
+    }
+}
+
+int rfc2217_server_get_alloc_stats(rfc2217_server_t server, rfc2217_alloc_stats_t out_stats[RFC2217_ALLOC_SITE_COUNT])
+{
+    memcpy(out_stats, server->alloc_stats, sizeof(server->alloc_stats));
+    return 0;
+}
+
+int rfc2217_server_get_callback_stats(rfc2217_server_t server, rfc2217_callback_t callback, rfc2217_callback_stats_t *out_stats)
+{
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    if ((unsigned) callback >= RFC2217_CALLBACK_COUNT) {
+        return -1;
+    }
+    const callback_stats_t *stats = &server->callback_stats[callback];
+    memset(out_stats, 0, sizeof(*out_stats));
+    out_stats->calls = stats->calls;
+    out_stats->over_budget = stats->over_budget;
+    out_stats->stuck = stats->stuck;
+    out_stats->max_us = stats->max_us;
+    if (stats->calls == 0) {
+        return 0;
+    }
+    out_stats->mean_us = (uint32_t)(stats->total_us / stats->calls);
+    // percentiles as the upper end of the bucket containing them, but not above the maximum
+    uint32_t p50 = (stats->calls + 1) / 2;
+    uint32_t p99 = stats->calls - stats->calls / 100;
+    uint32_t count = 0;
+    for (unsigned i = 0; i < CALLBACK_HISTOGRAM_BUCKETS; i++) {
+        uint32_t bound = (1U << i) - 1;
+        if (bound > stats->max_us || i == CALLBACK_HISTOGRAM_BUCKETS - 1) {
+            bound = stats->max_us;
+        }
+        uint32_t prev = count;
+        count += stats->histogram[i];
+        if (prev < p50 && count >= p50) {
+            out_stats->p50_us = bound;
+        }
+        if (prev < p99 && count >= p99) {
+            out_stats->p99_us = bound;
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int rfc2217_server_test_open(rfc2217_server_t server, const rfc2217_test_session_t *session, bool raw)
+{
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->server_thread_running || server->client_socket >= 0) {
+        ESP_LOGE(TAG, "Server is running or a session is open");
+        return -1;
+    }
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    server->raw_session = raw;
+#else
+    if (raw) {
+        ESP_LOGE(TAG, "Raw mode is disabled");
+        return -1;
+    }
+#endif
+    // the same steps as the server thread takes for a new client, with the session in place of the socket
+    server->test_session = session;
+    ctrl_queue_reset(server);
+    server->client_socket = TEST_SESSION_SOCKET;
+    if (server->tx_queue_buffer) {
+        tx_queue_reset(server);
+        server->tx_thread_shutdown = false;
+        server->tx_thread_running = true;
+    }
+    server->tcp_receive_thread_shutdown = false;
+    server->tcp_receive_thread_running = true;
+    session_begin(server);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int rfc2217_server_test_feed(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (!server->test_session) {
+        return -1;
+    }
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (server->raw_session) {
+        call_on_data_received(server, data, len);
+        return 0;
+    }
+#endif
+    // as in telnet_receive_loop, a probe due is sent before the data is processed
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    rtt_probe_poll(server);
+#endif
+    // the parser unescapes in place, so it gets a copy, in pieces the size of a read from the socket
+    uint8_t buf[sizeof(server->tcp_rx_buffer) - 1];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        memcpy(buf, data, chunk);
+        parse_received(server, buf, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    line_state_poll(server, 0);
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void rfc2217_server_test_poll(rfc2217_server_t server)
+{
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (!server->test_session) {
+        return;
+    }
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    rtt_probe_poll(server);
+#endif
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    line_state_poll(server, 0);
+#endif
+    if (server->tx_queue_buffer) {
+        test_tx_queue_send(server);
+    }
+#endif
+}
+
+void rfc2217_server_test_close(rfc2217_server_t server)
+{
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (!server->test_session) {
+        return;
+    }
+    session_end(server);
+    server->tcp_receive_thread_running = false;
+    server->tx_thread_running = false;
+    server->client_socket = -1;
+    server->test_session = NULL;
+#endif
+}
+
+#if CONFIG_RFC2217_SERVER_MUX
+int rfc2217_server_channel_open(rfc2217_server_t server, rfc2217_channel_send_t send, void *ctx)
+{
+    // the same steps as the server thread takes for a new client, with the mux connection in place of the socket
+    pthread_mutex_lock(&server->socket_mutex);
+    bool busy = server->client_socket >= 0;
+    if (!busy) {
+        ctrl_queue_reset(server);
+        server->channel_send = send;
+        server->channel_ctx = ctx;
+        server->client_socket = CHANNEL_SOCKET;
+    }
+    pthread_mutex_unlock(&server->socket_mutex);
+    if (busy) {
+        return -1;
+    }
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    server->raw_session = false;
+#endif
+    server->tcp_receive_thread_shutdown = false;
+    server->tcp_receive_thread_running = true;
+    session_begin(server);
+    return 0;
+}
+
+void rfc2217_server_channel_feed(rfc2217_server_t server, uint8_t *data, size_t len)
+{
+    // as in telnet_receive_loop, a probe due is sent before the data is processed
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    rtt_probe_poll(server);
+#endif
+    parse_received(server, data, len);
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    line_state_poll(server, 0);
+#endif
+}
+
+unsigned rfc2217_server_channel_poll(rfc2217_server_t server, unsigned timeout_ms)
+{
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    rtt_probe_poll(server);
+    unsigned interval_ms = server->config.rtt_probe_interval_ms;
+    if (interval_ms != 0 && (timeout_ms == 0 || interval_ms < timeout_ms)) {
+        timeout_ms = interval_ms;
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    timeout_ms = line_state_poll(server, timeout_ms);
+#endif
+    return timeout_ms;
+}
+
+void rfc2217_server_channel_abort(rfc2217_server_t server)
+{
+    server->tcp_receive_thread_shutdown = true;
+    pthread_mutex_lock(&server->flow_control_mutex);
+    server->serial_tx_paused = false;
+    pthread_cond_broadcast(&server->flow_control_cond);
+    pthread_mutex_unlock(&server->flow_control_mutex);
+}
+
+void rfc2217_server_channel_close(rfc2217_server_t server)
+{
+    session_end(server);
+    server->tcp_receive_thread_running = false;
+    // the send function isn't called after this returns: senders check client_socket with tcp_send_mutex held
+    pthread_mutex_lock(&server->tcp_send_mutex);
+    pthread_mutex_lock(&server->socket_mutex);
+    server->client_socket = -1;
+    server->channel_send = NULL;
+    server->channel_ctx = NULL;
+    pthread_mutex_unlock(&server->socket_mutex);
+    pthread_mutex_unlock(&server->tcp_send_mutex);
+    // undo rfc2217_server_channel_abort, for the next client on the listener of the port
+    server->tcp_receive_thread_shutdown = server->server_thread_shutdown;
+}
+#endif // CONFIG_RFC2217_SERVER_MUX
+
+static void *default_alloc(rfc2217_alloc_hint_t hint, size_t size)
+{
+#if CONFIG_RFC2217_SERVER_BULK_IN_PSRAM
+    if (hint == RFC2217_ALLOC_BULK) {
+        void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (ptr) {
+            return ptr;
+        }
+    }
+    return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#else
+    return malloc(size);
+#endif
+}
+
+static void *server_alloc(const rfc2217_allocator_t *allocator, rfc2217_alloc_stats_t *stats, rfc2217_alloc_site_t site, size_t size)
+{
+    rfc2217_alloc_hint_t hint = s_alloc_hints[site];
+    void *ptr = allocator ? allocator->alloc(allocator->ctx, site, hint, size) : default_alloc(hint, size);
+    if (!ptr) {
+        stats[site].failures++;
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    stats[site].allocations++;
+    stats[site].current += size;
+    if (stats[site].current > stats[site].peak) {
+        stats[site].peak = stats[site].current;
+    }
+    return ptr;
+}
+
+static void server_free(const rfc2217_allocator_t *allocator, rfc2217_alloc_stats_t *stats, rfc2217_alloc_site_t site, void *ptr, size_t size)
+{
+    // stats may be inside the memory being freed, update them first
+    stats[site].current -= size;
+    if (allocator) {
+        allocator->free(allocator->ctx, site, ptr, size);
+    } else {
+        free(ptr);  // also releases memory from heap_caps_malloc
+    }
+}
+
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+static void *trigger_alloc(void *ctx, size_t size)
+{
+    rfc2217_server_t server = (rfc2217_server_t) ctx;
+    return server_alloc(server->config.allocator, server->alloc_stats, RFC2217_ALLOC_TRIGGERS, size);
 }
 
+static void trigger_free(void *ctx, void *ptr, size_t size)
+{
+    rfc2217_server_t server = (rfc2217_server_t) ctx;
+    server_free(server->config.allocator, server->alloc_stats, RFC2217_ALLOC_TRIGGERS, ptr, size);
+}
+#endif
+
 void *server_thread_fn(void *ctx /* rfc2217_server_t server */)
 {
     rfc2217_server_t server = (rfc2217_server_t)ctx;
@@ -292,31 +885,111 @@ void *server_thread_fn(void *ctx /* rfc2217_server_t server */)
         goto CLEAN_UP;
     }
 
-    while (true) {
+    pthread_mutex_lock(&server->socket_mutex);
+    server->listen_socket = listen_sock;
+    pthread_mutex_unlock(&server->socket_mutex);
+
+    while (!server->server_thread_shutdown) {
         ESP_LOGD(TAG, "Socket listening");
 
+        if (socket_wait_readable(listen_sock, &server->server_thread_shutdown, 0) <= 0) {
+            break;
+        }
         struct sockaddr_storage source_addr = {}; // Large enough for both IPv4 or IPv6
         socklen_t addr_len = sizeof(source_addr);
-        server->client_socket = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (server->client_socket < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d (%s)", errno, strerror(errno));
+        int client_socket = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+        if (client_socket < 0) {
+            if (!server->server_thread_shutdown) {
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d (%s)", errno, strerror(errno));
+            }
             break;
         }
 
-        server->tcp_receive_thread_shutdown = false;
-        pthread_create(&server->tcp_receive_thread, NULL, tcp_receive_thread_fn, server);
+#if defined(TCP_NOTSENT_LOWAT)
+        int notsent_lowat = TCP_NOTSENT_LOWAT_BYTES;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat, sizeof(notsent_lowat));
+#endif
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+        // decided before the socket is published, so that no data is sent to the client in the wrong format
+        int raw = detect_raw_session(server, client_socket);
+        if (raw < 0) {
+            close(client_socket);
+            continue;
+        }
+        server->raw_session = raw;
+#endif
+        pthread_mutex_lock(&server->socket_mutex);
+        bool busy = server->client_socket >= 0;     // a mux channel session has the port
+        if (!busy) {
+            // drop control messages queued after the previous client disconnected
+            ctrl_queue_reset(server);
+            server->client_socket = client_socket;
+        }
+        pthread_mutex_unlock(&server->socket_mutex);
+        if (busy) {
+            ESP_LOGW(TAG, "Port is in use by a mux channel, closing the connection");
+            close(client_socket);
+            continue;
+        }
 
-        pthread_join(server->tcp_receive_thread, NULL);
+        if (server->tx_queue_buffer) {
+            tx_queue_reset(server);
+            server->tx_thread_shutdown = false;
+            server->tx_thread_running = true;
+            int res = create_thread(server, &server->tx_thread, tx_thread_fn, "rfc2217_tx", server->config.tx_task_core_id);
+            if (res != 0) {
+                ESP_LOGE(TAG, "Failed to create TX thread: %d", res);
+                server->tx_thread_running = false;
+            }
+        }
 
-        shutdown(server->client_socket, 0);
-        close(server->client_socket);
+        server->tcp_receive_thread_running = true;
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+        server->tcp_receive_thread_done = false;
+#endif
+        int res = create_thread(server, &server->tcp_receive_thread, tcp_receive_thread_fn, "rfc2217_rx", server->config.task_core_id);
+        if (res != 0) {
+            ESP_LOGE(TAG, "Failed to create TCP receive thread: %d", res);
+        } else {
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+            callback_watchdog(server);
+#endif
+            pthread_join(server->tcp_receive_thread, NULL);
+        }
+        server->tcp_receive_thread_running = false;
+
+        pthread_mutex_lock(&server->socket_mutex);
+        server->client_socket = -1;
+        pthread_mutex_unlock(&server->socket_mutex);
+        // wake up rfc2217_server_send_data or the TX thread if blocked in send(), and close the socket once they are done
+        shutdown(client_socket, SHUT_RDWR);
+        if (server->tx_thread_running) {
+            server->tx_thread_shutdown = true;
+            tx_queue_wake(server);
+            pthread_join(server->tx_thread, NULL);
+            server->tx_thread_running = false;
+            // let senders waiting for space in the queue notice that the session is over
+            tx_queue_wake(server);
+        }
+        pthread_mutex_lock(&server->tcp_send_mutex);
+        close(client_socket);
+        pthread_mutex_unlock(&server->tcp_send_mutex);
     }
     ESP_LOGD(TAG, "Server thread shutting down");
 
 CLEAN_UP:
+    pthread_mutex_lock(&server->socket_mutex);
+    server->listen_socket = -1;
     close(listen_sock);
+    pthread_mutex_unlock(&server->socket_mutex);
 
-    pthread_exit(NULL);
+    return NULL;
+}
+
+static int create_thread(rfc2217_server_t server, pthread_t *thread, void *(*fn)(void *), const char *name, unsigned core_id)
+{
+    // apply task_stack_size, task_priority and the core ID to the new thread
+    return rfc2217_thread_create(thread, fn, server, name, server->config.task_stack_size, server->config.task_priority, core_id);
 }
 
 
@@ -324,278 +997,1515 @@ static void *tcp_receive_thread_fn(void *ctx /* rfc2217_server_t server */)
 {
     rfc2217_server_t server = (rfc2217_server_t)ctx;
     ESP_LOGI(TAG, "TCP receive thread started, socket: %d", server->client_socket);
-    ssize_t len;
-
-    telnet_options_init(server);
-    server->client_is_rfc2217 = false;
-    server->collecting_suboption = false;
-    server->suboption_size = 0;
-    server->telnet_mode = T_NORMAL;
-
-    do {
-        len = recv(server->client_socket, server->tcp_rx_buffer, sizeof(server->tcp_rx_buffer) - 1, 0);
-
-
-        if (len < 0) {
-            ESP_LOGE(TAG, "Error occurred during receiving: errno %d (%s)", errno, strerror(errno));
-        } else if (len == 0) {
-            ESP_LOGI(TAG, "Connection closed");
-        } else {
-            server->tcp_rx_buffer[len] = 0; // Null-terminate whatever is received and treat it like a string
 
-            ESP_LOGD(TAG, "Received %d bytes:", (int) len);
-            ESP_LOG_BUFFER_HEX_LEVEL(TAG, server->tcp_rx_buffer, len, ESP_LOG_DEBUG);
-            process_received_over_tcp(server, server->tcp_rx_buffer, len);
-        }
-    } while (len > 0);
-    if (server->config.on_client_disconnected) {
-        server->config.on_client_disconnected(server->config.ctx);
+    session_begin(server);
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (server->raw_session) {
+        raw_receive_loop(server);
+    } else
+#endif
+    {
+        telnet_receive_loop(server);
     }
-    telnet_options_destroy(server);
+    session_end(server);
     ESP_LOGI(TAG, "TCP receive thread done");
-    pthread_exit(NULL);
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+    server->tcp_receive_thread_done = true;
+#endif
+    return NULL;
 }
 
-static void tcp_send(rfc2217_server_t server, const void *buf, size_t size)
+static void session_begin(rfc2217_server_t server)
 {
-    pthread_mutex_lock(&server->tcp_send_mutex);
-    const uint8_t *cbuf = (const uint8_t *)buf;
-    size_t to_write = size;
-    while (to_write > 0) {
-        ssize_t written = send(server->client_socket, cbuf, to_write, 0);
-        if (written < 0) {
-            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-            pthread_mutex_unlock(&server->tcp_send_mutex);
-            return;
+    // reset the per-client state; called on the task which then processes the data from the client
+    telnet_options_init(server->telnet_options, s_telnet_option_defs, TELNET_OPTIONS_COUNT, server);
+    server->client_is_rfc2217 = false;
+    telnet_parser_init(&server->parser, &s_telnet_parser_handlers, server);
+    server->xon_xoff_active = false;
+    server->serial_tx_paused = false;
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    server->line_applied = 0;
+    server->line_pending = 0;
+    server->line_changes = 0;
+    server->line_reply_count = 0;
+#endif
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+    shaper_reset(server);
+#endif
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    rtt_reset(server);
+#endif
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (server->raw_session) {
+        ESP_LOGI(TAG, "Raw session");
+        if (server->config.on_client_connected) {
+            server->config.on_client_connected(server->config.ctx);
         }
-        to_write -= written;
-        cbuf += written;
     }
-    pthread_mutex_unlock(&server->tcp_send_mutex);
+#endif
 }
 
-static void process_received_over_tcp(rfc2217_server_t server, const uint8_t *buf, size_t size)
+static void session_end(rfc2217_server_t server)
 {
-    // fast path: if we are not in telnet mode and there is no IAC, just pass the data on to the callback
-    if (server->telnet_mode == T_NORMAL && memchr(buf, T_IAC, size) == NULL) {
-        if (server->config.on_data_received) {
-            server->config.on_data_received(server->config.ctx, buf, size);
-        }
-        return;
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    // the client asked for these changes before it went away; there is nobody to reply to
+    server->line_reply_count = 0;
+    line_state_apply(server);
+#endif
+    if (server->config.on_client_disconnected) {
+        server->config.on_client_disconnected(server->config.ctx);
     }
+}
 
-    // otherwise, process the data byte by byte
-    const uint8_t *end = buf + size;
-    for (; buf < end; ++buf) {
-        uint8_t c = *buf;
-        switch (server->telnet_mode) {
-        case T_NORMAL: {
-            if (c == T_IAC) {
-                server->telnet_mode = T_GOT_IAC;
-            } else if (server->collecting_suboption) {
-                if (server->suboption_size < sizeof(server->suboption)) {
-                    server->suboption[server->suboption_size++] = c;
-                } else {
-                    ESP_LOGE(TAG, "Suboption buffer overflow");
-                    server->collecting_suboption = false;
-                    server->suboption_size = 0;
-                }
-            } else {
-                if (server->config.on_data_received) {
-                    server->config.on_data_received(server->config.ctx, &c, 1);
-                }
-            }
-            break;
+static void telnet_receive_loop(rfc2217_server_t server)
+{
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    const unsigned poll_interval_ms = server->config.rtt_probe_interval_ms;
+#else
+    const unsigned poll_interval_ms = 0;
+#endif
+    while (!server->tcp_receive_thread_shutdown) {
+        unsigned timeout_ms = poll_interval_ms;
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+        timeout_ms = line_state_poll(server, timeout_ms);
+#endif
+        size_t max_len = sizeof(server->tcp_rx_buffer) - 1;
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+        if (server->rx_queue_buffer) {
+            // read no more than the queue can take, so that the data never waits in this thread
+            max_len = rx_queue_credit(server, max_len, timeout_ms);
         }
-        case T_GOT_IAC: {
-            if (c == T_IAC) {
-                if (server->collecting_suboption) {
-                    if (server->suboption_size < sizeof(server->suboption)) {
-                        server->suboption[server->suboption_size++] = c;
-                    } else {
-                        ESP_LOGE(TAG, "Suboption buffer overflow");
-                        server->collecting_suboption = false;
-                        server->suboption_size = 0;
-                    }
-                } else {
-                    if (server->config.on_data_received) {
-                        server->config.on_data_received(server->config.ctx, &c, 1);
-                    }
-                }
-                server->telnet_mode = T_NORMAL;
-            } else if (c == T_SB) {
-                server->suboption_size = 0;
-                server->collecting_suboption = true;
-                server->telnet_mode = T_NORMAL;
-            } else if (c == T_SE) {
-                process_subnegotiation(server);
-                server->suboption_size = 0;
-                server->collecting_suboption = false;
-                server->telnet_mode = T_NORMAL;
-            } else if (c == T_WILL || c == T_WONT || c == T_DO || c == T_DONT) {
-                server->telnet_command = c;
-                server->telnet_mode = T_NEGOTIATE;
-            } else {
-                process_telnet_command(server, c);
-                server->telnet_mode = T_NORMAL;
-            }
+#endif
+        int ready = max_len > 0 ? socket_wait_readable(server->client_socket, &server->tcp_receive_thread_shutdown, timeout_ms) : 0;
+        if (ready < 0) {
             break;
         }
-        case T_NEGOTIATE: {
-            telnet_negotiate_option(server, server->telnet_command, c);
-            server->telnet_mode = T_NORMAL;
-            break;
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+        rtt_probe_poll(server);
+#endif
+        if (ready == 0) {
+            continue;
         }
+        ssize_t len = recv(server->client_socket, server->tcp_rx_buffer, max_len, 0);
+        if (len < 0) {
+            ESP_LOGE(TAG, "Error occurred during receiving: errno %d (%s)", errno, strerror(errno));
+            break;
+        } else if (len == 0) {
+            ESP_LOGI(TAG, "Connection closed");
+            break;
         }
+        server->tcp_rx_buffer[len] = 0; // Null-terminate whatever is received and treat it like a string
+
+        ESP_LOGD(TAG, "Received %d bytes:", (int) len);
+        ESP_LOG_BUFFER_HEX_LEVEL(TAG, server->tcp_rx_buffer, len, ESP_LOG_DEBUG);
+        parse_received(server, server->tcp_rx_buffer, len);
     }
 }
 
+static void parse_received(rfc2217_server_t server, uint8_t *data, size_t len)
+{
+    // Replies to the requests in the data are collected in ctrl_queue while it is parsed, and sent together
+    // at the end, or before data is passed on (see deliver_received_data): a batch full of requests costs
+    // a few sends, not one per request.
+    server->ctrl_defer_thread = pthread_self();
+    server->ctrl_deferred = true;
+    telnet_parser_feed(&server->parser, data, len);
+    server->ctrl_deferred = false;
+    ctrl_queue_kick(server);
+}
 
-int rfc2217_server_send_data(rfc2217_server_t server, const uint8_t *data, size_t len)
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+static int detect_raw_session(rfc2217_server_t server, int sock)
 {
-    if (server->client_socket < 0) {
-        ESP_LOGE(TAG, "Client socket is not connected");
-        return -1;
+    // Returns 1 if the client should be served in raw mode, 0 for RFC2217, -1 if the server is stopping
+    if (server->config.mode == RFC2217_SERVER_MODE_RAW) {
+        return 1;
     }
-    if (server->tcp_receive_thread == 0) {
-        ESP_LOGE(TAG, "TCP receive thread is not running");
+    if (server->config.mode != RFC2217_SERVER_MODE_AUTO) {
+        return 0;
+    }
+    unsigned timeout_ms = server->config.auto_detect_timeout_ms ? server->config.auto_detect_timeout_ms : AUTO_DETECT_TIMEOUT_MS;
+    int ready = socket_wait_readable(sock, &server->server_thread_shutdown, timeout_ms);
+    if (ready < 0) {
         return -1;
     }
-    tcp_send(server, data, len);
-    return 0;
+    uint8_t c;
+    if (ready > 0 && recv(sock, &c, 1, MSG_PEEK) == 1 && c == T_IAC) {
+        return 0;
+    }
+    return 1;
 }
 
-
-static void process_telnet_command(rfc2217_server_t server, uint8_t c)
+static void raw_receive_loop(rfc2217_server_t server)
 {
-    ESP_LOGD(TAG, "Ignoring telnet command: %d", c);
+    // No telnet processing: the data goes from the socket straight to on_data_received.
+    // Blocking recv with a timeout instead of select, to save a system call per block.
+    const int sock = server->client_socket;
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = SHUTDOWN_POLL_INTERVAL_MS * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (!server->tcp_receive_thread_shutdown) {
+        size_t max_len = CONFIG_RFC2217_SERVER_RAW_RX_BUFFER_SIZE;
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+        if (server->rx_queue_buffer) {
+            max_len = rx_queue_credit(server, max_len, SHUTDOWN_POLL_INTERVAL_MS);
+            if (max_len == 0) {
+                continue;
+            }
+        }
+#endif
+        ssize_t len = recv(sock, server->raw_rx_buffer, max_len, 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            if (!server->tcp_receive_thread_shutdown) {
+                ESP_LOGE(TAG, "Error occurred during receiving: errno %d (%s)", errno, strerror(errno));
+            }
+            break;
+        } else if (len == 0) {
+            ESP_LOGI(TAG, "Connection closed");
+            break;
+        }
+        call_on_data_received(server, server->raw_rx_buffer, len);
+    }
 }
+#endif
 
-static void telnet_negotiate_option(rfc2217_server_t server, uint8_t command, uint8_t option)
+static bool send_all(rfc2217_server_t server, int sock, const uint8_t *buf, size_t size)
 {
-    ESP_LOGD(TAG, "Telnet negotiate option: 0x%x 0x%x", command, option);
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        server->test_session->on_send(server->test_session->ctx, buf, size);
+        return true;
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_MUX
+    if (sock == CHANNEL_SOCKET) {
+        server->channel_send(server->channel_ctx, buf, size);
+        return true;
+    }
+#endif
+    return socket_send_all(sock, buf, size);
+}
 
-    bool known = false;
-    for (size_t i = 0; i < server->telnet_options_count; i++) {
-        ESP_LOGD(TAG, "Trying option %s (0x%x)", server->telnet_options[i].def->name, server->telnet_options[i].def->option);
-        if (server->telnet_options[i].def->option == option) {
-            telnet_option_process_incoming(&server->telnet_options[i], command);
-            known = true;
+static void tcp_send_data(rfc2217_server_t server, const uint8_t *data, size_t size)
+{
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+    if (server->raw_session) {
+        // nothing to escape, and no control messages to send in between
+        pthread_mutex_lock(&server->tcp_send_mutex);
+        if (server->client_socket >= 0) {
+            send_all(server, server->client_socket, data, size);
         }
+        pthread_mutex_unlock(&server->tcp_send_mutex);
+        return;
     }
-    if (!known) {
-        ESP_LOGD(TAG, "Unknown option: 0x%x", option);
-        if (command == T_WILL) {
-            telnet_send_option(server, T_DONT, option);
+#endif
+    // Send data to the client, doubling IAC characters. The data is sent in pieces of at most
+    // TCP_SEND_CHUNK_SIZE bytes, and queued control messages are sent between the pieces, so that they
+    // don't have to wait until all the data is written. An escaped IAC pair is never split.
+    pthread_mutex_lock(&server->tcp_send_mutex);
+    const int sock = server->client_socket;
+    const uint8_t *end = data + size;
+    bool ok = (sock >= 0);
+    while (ok && data < end) {
+        if (atomic_load(&server->ctrl_pending)) {
+            ctrl_queue_flush(server, sock);
         }
-        if (command == T_DO) {
-            telnet_send_option(server, T_WONT, option);
+        size_t len = end - data;
+        if (len > TCP_SEND_CHUNK_SIZE) {
+            len = TCP_SEND_CHUNK_SIZE;
+        }
+        const uint8_t *iac = memchr(data, T_IAC, len);
+        if (iac != data) {
+            // send the data up to the next IAC directly from the caller's buffer
+            if (iac) {
+                len = iac - data;
+            }
+            ok = send_all(server, sock, data, len);
+            data += len;
+            continue;
+        }
+        // IAC at the start: copy the next few bytes with IACs doubled, and send them in one piece
+        uint8_t escaped[TCP_SEND_ESCAPE_SIZE];
+        size_t escaped_len = 0;
+        while (data < end && escaped_len < sizeof(escaped) - 1) {
+            if (*data == T_IAC) {
+                escaped[escaped_len++] = T_IAC;
+            }
+            escaped[escaped_len++] = *data++;
         }
+        ok = send_all(server, sock, escaped, escaped_len);
     }
+    pthread_mutex_unlock(&server->tcp_send_mutex);
+    ctrl_queue_kick(server);
 }
 
-void telnet_send_option(rfc2217_server_t server, uint8_t action, uint8_t option)
+static void tcp_send_control(rfc2217_server_t server, const uint8_t *buf, size_t size)
 {
-    uint8_t buf[3] = {T_IAC, action, option};
-    tcp_send(server, buf, sizeof(buf));
+    // Control messages don't wait for data being sent by other tasks: they are put into ctrl_queue,
+    // and the task holding tcp_send_mutex sends them at the next chunk boundary (see tcp_send_data).
+    // If nobody holds tcp_send_mutex, ctrl_queue_kick sends them right away.
+    bool queued = false;
+    pthread_mutex_lock(&server->ctrl_queue_mutex);
+    if (server->ctrl_queue_len + size <= sizeof(server->ctrl_queue)) {
+        memcpy(server->ctrl_queue + server->ctrl_queue_len, buf, size);
+        server->ctrl_queue_len += size;
+        atomic_store(&server->ctrl_pending, true);
+        queued = true;
+    }
+    pthread_mutex_unlock(&server->ctrl_queue_mutex);
+    if (queued) {
+        // a reply to received data waits for the end of the batch, see parse_received
+        if (!server->ctrl_deferred || !pthread_equal(server->ctrl_defer_thread, pthread_self())) {
+            ctrl_queue_kick(server);
+        }
+        return;
+    }
+    // queue is full (or the message is too long): wait for tcp_send_mutex, keeping the order of the messages
+    pthread_mutex_lock(&server->tcp_send_mutex);
+    const int sock = server->client_socket;
+    if (sock >= 0) {
+        ctrl_queue_flush(server, sock);
+        send_all(server, sock, buf, size);
+    }
+    pthread_mutex_unlock(&server->tcp_send_mutex);
 }
 
-void on_client_ok(rfc2217_server_t server, bool ok)
+static void ctrl_queue_flush(rfc2217_server_t server, int sock)
 {
-    if (!server->client_is_rfc2217) {
-        ESP_LOGD(TAG, "Client is RFC2217");
-        server->client_is_rfc2217 = true;
-        if (server->config.on_client_connected) {
-            server->config.on_client_connected(server->config.ctx);
-        }
+    // caller holds tcp_send_mutex
+    uint8_t buf[CTRL_QUEUE_SIZE];
+    pthread_mutex_lock(&server->ctrl_queue_mutex);
+    size_t len = server->ctrl_queue_len;
+    memcpy(buf, server->ctrl_queue, len);
+    server->ctrl_queue_len = 0;
+    atomic_store(&server->ctrl_pending, false);
+    pthread_mutex_unlock(&server->ctrl_queue_mutex);
+    if (len > 0 && sock >= 0) {
+        send_all(server, sock, buf, len);
     }
 }
 
-
-static void process_subnegotiation(rfc2217_server_t server)
+static void ctrl_queue_kick(rfc2217_server_t server)
 {
-    ESP_LOGD(TAG, "Processing subnegotiation");
-    if (server->suboption[0] != T_COM_PORT_OPTION) {
-        ESP_LOGD(TAG, "Unknown subnegotiation: %x", server->suboption[0]);
+    // Send queued control messages unless another task holds tcp_send_mutex; that task will send them.
+    // Checked again after unlocking, in case a message was queued while the mutex was held here.
+    while (atomic_load(&server->ctrl_pending) && pthread_mutex_trylock(&server->tcp_send_mutex) == 0) {
+        ctrl_queue_flush(server, server->client_socket);
+        pthread_mutex_unlock(&server->tcp_send_mutex);
+    }
+}
+
+static void ctrl_queue_reset(rfc2217_server_t server)
+{
+    pthread_mutex_lock(&server->ctrl_queue_mutex);
+    server->ctrl_queue_len = 0;
+    atomic_store(&server->ctrl_pending, false);
+    pthread_mutex_unlock(&server->ctrl_queue_mutex);
+}
+
+int rfc2217_server_send_data(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+#if CONFIG_RFC2217_SERVER_TRIGGERS
+    // the serial stream is scanned whether a client is connected or not
+    if (server->trigger_matcher && server->config.on_trigger) {
+        matcher_feed(server->trigger_matcher, data, len, server->config.on_trigger, server->config.ctx);
+    }
+#endif
+    if (server->client_socket < 0) {
+        ESP_LOGE(TAG, "Client socket is not connected");
+        return -1;
+    }
+    if (!server->tcp_receive_thread_running) {
+        ESP_LOGE(TAG, "TCP receive thread is not running");
+        return -1;
+    }
+    if (server->tx_queue_buffer && server->tx_thread_running) {
+        return tx_queue_push(server, data, len);
+    }
+    send_data_to_client(server, data, len);
+    return 0;
+}
+
+int rfc2217_server_read(rfc2217_server_t server, uint8_t *buf, size_t len, unsigned timeout_ms)
+{
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (!server->rx_queue_buffer) {
+        ESP_LOGE(TAG, "rx_queue_size is not set, data is passed to on_data_received");
+        return -1;
+    }
+#if CONFIG_RFC2217_SERVER_PURGE
+    if (rx_queue_apply_purge(server)) {
+        rx_queue_wake(server);
+    }
+#endif
+    if (!rx_queue_ready(server, RX_QUEUE_DATA) && !rx_queue_wait(server, RX_QUEUE_DATA, timeout_ms)) {
+        return 0;
+    }
+#if CONFIG_RFC2217_SERVER_PURGE
+    rx_queue_apply_purge(server);   // a purge since the check; rx_queue_wake follows
+#endif
+    size_t copied = 0;
+    while (copied < len) {
+        const uint8_t *data;
+        size_t avail = ringbuf_peek(&server->rx_queue, &data);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > len - copied) {
+            avail = len - copied;
+        }
+        memcpy(buf + copied, data, avail);
+        ringbuf_consume(&server->rx_queue, avail);
+        copied += avail;
+    }
+    // the TCP receive thread may be waiting for space, or for the queue to be read before a baud rate change
+    rx_queue_wake(server);
+    return (int) copied;
+#else
+    return -1;
+#endif
+}
+
+int rfc2217_server_get_link_stats(rfc2217_server_t server, rfc2217_server_link_stats_t *out_stats)
+{
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    memset(out_stats, 0, sizeof(*out_stats));
+    pthread_mutex_lock(&server->socket_mutex);
+    if (server->client_socket < 0) {
+        pthread_mutex_unlock(&server->socket_mutex);
+        return -1;
+    }
+    out_stats->srtt_us = server->rtt_srtt_us;
+    out_stats->rttvar_us = server->rtt_var_us;
+    out_stats->last_rtt_us = server->rtt_last_us;
+    out_stats->rtt_samples = server->rtt_samples;
+    out_stats->socket_unsent_bytes = -1;
+#if defined(SIOCOUTQ)
+    int outq = 0;
+    if (ioctl(server->client_socket, SIOCOUTQ, &outq) == 0) {
+        out_stats->socket_unsent_bytes = outq;
+    }
+#endif
+    pthread_mutex_unlock(&server->socket_mutex);
+    if (server->tx_queue_buffer) {
+        out_stats->tx_queue_bytes = ringbuf_used(&server->tx_queue);
+    }
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (server->rx_queue_buffer) {
+        out_stats->rx_queue_bytes = ringbuf_used(&server->rx_queue);
+    }
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void send_data_to_client(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+    if (server->xon_xoff_active) {
+        send_data_xon_xoff(server, data, len);
+        return;
+    }
+#endif
+    tcp_send_data(server, data, len);
+}
+
+static int tx_queue_push(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+    int res = 0;
+    pthread_mutex_lock(&server->tx_producer_mutex);
+    while (len > 0) {
+        size_t head = atomic_load_explicit(&server->tx_queue.head, memory_order_relaxed);
+        size_t written = ringbuf_write(&server->tx_queue, data, len);
+        if (written > 0 && tx_queue_pushed(server, data, written, head)) {
+            tx_queue_wake(server);
+        }
+        data += written;
+        len -= written;
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+        if (server->test_session) {
+            // no TX thread: send what it would send now, which also makes space if the queue is full
+            test_tx_queue_send(server);
+            continue;
+        }
+#endif
+        if (len > 0) {
+            if (!server->tx_thread_running || server->tx_thread_shutdown) {
+                res = -1;
+                break;
+            }
+            // queue is full, wait for the TX thread to make space
+            tx_queue_wait(server, true);
+        }
+    }
+    pthread_mutex_unlock(&server->tx_producer_mutex);
+    return res;
+}
+
+static void tx_queue_wait(rfc2217_server_t server, bool for_space)
+{
+    // Sleep until there is space (producer) or data (TX thread) in the queue, the other side calls
+    // tx_queue_wake, or for at most SHUTDOWN_POLL_INTERVAL_MS. The caller re-checks the queue state afterwards.
+    pthread_mutex_lock(&server->tx_queue_mutex);
+    atomic_fetch_add(&server->tx_queue_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool ready = for_space ? (ringbuf_free(&server->tx_queue) > 0) : (ringbuf_used(&server->tx_queue) > 0);
+    if (ready || server->tx_thread_shutdown) {
+        atomic_fetch_sub(&server->tx_queue_waiters, 1);
+        pthread_mutex_unlock(&server->tx_queue_mutex);
+        return;
+    }
+    struct timespec deadline;
+    get_deadline(&deadline, SHUTDOWN_POLL_INTERVAL_MS * 1000);
+    pthread_cond_timedwait(&server->tx_queue_cond, &server->tx_queue_mutex, &deadline);
+    atomic_fetch_sub(&server->tx_queue_waiters, 1);
+    pthread_mutex_unlock(&server->tx_queue_mutex);
+}
+
+static void tx_queue_wake(rfc2217_server_t server)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&server->tx_queue_waiters) > 0) {
+        pthread_mutex_lock(&server->tx_queue_mutex);
+        pthread_cond_broadcast(&server->tx_queue_cond);
+        pthread_mutex_unlock(&server->tx_queue_mutex);
+    }
+}
+
+static void tx_queue_reset(rfc2217_server_t server)
+{
+    // drop queued data; only called while no other task uses the queue
+    ringbuf_init(&server->tx_queue, server->tx_queue_buffer, server->tx_queue.size);
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+    atomic_store(&server->flush_mark, 0);
+    server->flush_hold_since_us = 0;
+#endif
+#if CONFIG_RFC2217_SERVER_PURGE
+    atomic_store(&server->tx_queue_purge_pending, false);
+#endif
+}
+
+#if CONFIG_RFC2217_SERVER_PURGE
+static void tx_queue_apply_purge(rfc2217_server_t server)
+{
+    // TX thread: drop the data queued before a purge
+    if (!atomic_exchange(&server->tx_queue_purge_pending, false)) {
+        return;
+    }
+    size_t dropped = ringbuf_consume_to(&server->tx_queue, atomic_load(&server->tx_queue_purge_mark));
+    ESP_LOGD(TAG, "Purge: dropped %zu bytes from the TX queue", dropped);
+    if (dropped > 0) {
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+        server->flush_hold_since_us = 0;
+#endif
+        tx_queue_wake(server);
+    }
+}
+#endif
+
+static bool tx_queue_pushed(rfc2217_server_t server, const uint8_t *data, size_t len, size_t head)
+{
+    // Called by the producer after writing len bytes at position head, returns whether to wake the TX thread
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+    if (server->flush_threshold != 0) {
+        bool marked = flush_mark_delimiter(server, data, len, head);
+        // while the TX thread holds back data, only wake it for a delimiter or a full batch
+        atomic_thread_fence(memory_order_seq_cst);
+        return marked || !atomic_load(&server->flush_holding) ||
+               ringbuf_used(&server->tx_queue) >= server->flush_threshold;
+    }
+#endif
+    return true;
+}
+
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+static bool flush_mark_delimiter(rfc2217_server_t server, const uint8_t *data, size_t len, size_t head)
+{
+    // Find the last delimiter in the data just written to the queue at position head; the TX thread
+    // sends everything up to it without waiting for more
+    uint8_t a = server->config.flush_delimiters[0];
+    uint8_t b = server->config.flush_delimiters[server->config.flush_delimiter_count - 1];
+    const uint8_t *end = data + len;
+    size_t mark = atomic_load_explicit(&server->flush_mark, memory_order_relaxed);
+    size_t new_mark = mark;
+    for (const uint8_t *p = data; (p = scan_find_any2(p, end - p, a, b)) != NULL; ++p) {
+        size_t pos = head + (size_t)(p - data);
+        // a delimiter right after the previous one starts a frame (SLIP frames begin and end with 0xC0),
+        // flushing on it would send it on its own
+        if (pos != new_mark) {
+            new_mark = pos + 1;
+        }
+    }
+    if (new_mark == mark) {
+        return false;
+    }
+    atomic_store_explicit(&server->flush_mark, new_mark, memory_order_release);
+    return true;
+}
+
+static size_t flush_sendable(rfc2217_server_t server, size_t len)
+{
+    // Called by the TX thread with len contiguous bytes at the start of the queue. Returns how many of
+    // them to send now: up to the last delimiter if there is one, all of them if flush_threshold bytes
+    // are queued, the data was held back for flush_timeout_ms, or the session is ending. Otherwise waits
+    // for more data (at most until the hold time runs out) and returns 0.
+    size_t mark = atomic_load_explicit(&server->flush_mark, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&server->tx_queue.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&server->tx_queue.head, memory_order_acquire);
+    size_t marked = mark - tail;    // wraps around to a large value if the mark was already sent
+    if (marked != 0 && marked <= head - tail) {
+        server->flush_hold_since_us = 0;
+        return len < marked ? len : marked;
+    }
+    if (head - tail >= server->flush_threshold || server->tx_thread_shutdown) {
+        server->flush_hold_since_us = 0;
+        return len;
+    }
+    uint64_t timeout_us = (uint64_t)(server->config.flush_timeout_ms ? server->config.flush_timeout_ms : FLUSH_TIMEOUT_MS) * 1000;
+    uint64_t now = now_us(server);
+    if (server->flush_hold_since_us == 0) {
+        server->flush_hold_since_us = now;
+    } else if (now - server->flush_hold_since_us >= timeout_us) {
+        server->flush_hold_since_us = 0;
+        return len;
+    }
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        return 0;   // rfc2217_server_test_poll checks again after the clock has advanced
+    }
+#endif
+    uint64_t wait_us = server->flush_hold_since_us + timeout_us - now;
+    if (wait_us > SHUTDOWN_POLL_INTERVAL_MS * 1000) {
+        wait_us = SHUTDOWN_POLL_INTERVAL_MS * 1000;
+    }
+    // same protocol as tx_queue_wait; the producer only wakes this thread for a delimiter or a full batch
+    atomic_store(&server->flush_holding, true);
+    pthread_mutex_lock(&server->tx_queue_mutex);
+    atomic_fetch_add(&server->tx_queue_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool purge_pending = false;
+#if CONFIG_RFC2217_SERVER_PURGE
+    purge_pending = atomic_load(&server->tx_queue_purge_pending);
+#endif
+    if (atomic_load(&server->flush_mark) == mark && ringbuf_used(&server->tx_queue) < server->flush_threshold &&
+            !purge_pending && !server->tx_thread_shutdown) {
+        struct timespec deadline;
+        get_deadline(&deadline, (unsigned) wait_us);
+        pthread_cond_timedwait(&server->tx_queue_cond, &server->tx_queue_mutex, &deadline);
+    }
+    atomic_fetch_sub(&server->tx_queue_waiters, 1);
+    pthread_mutex_unlock(&server->tx_queue_mutex);
+    atomic_store(&server->flush_holding, false);
+    return 0;
+}
+#endif
+
+static void get_deadline(struct timespec *deadline, unsigned timeout_us)
+{
+    // absolute deadline for pthread_cond_timedwait, which uses CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_us / 1000000;
+    deadline->tv_nsec += (long)(timeout_us % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *tx_thread_fn(void *ctx /* rfc2217_server_t server */)
+{
+    rfc2217_server_t server = (rfc2217_server_t)ctx;
+    ESP_LOGD(TAG, "TX thread started");
+    while (true) {
+#if CONFIG_RFC2217_SERVER_PURGE
+        tx_queue_apply_purge(server);
+#endif
+        const uint8_t *data;
+        size_t len = ringbuf_peek(&server->tx_queue, &data);
+        if (len == 0) {
+            if (server->tx_thread_shutdown) {
+                break;
+            }
+            tx_queue_wait(server, false);
+            continue;
+        }
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+        if (server->flush_threshold != 0) {
+            len = flush_sendable(server, len);
+            if (len == 0) {
+                continue;
+            }
+        }
+#endif
+        send_data_to_client(server, data, len);
+        ringbuf_consume(&server->tx_queue, len);
+        tx_queue_wake(server);
+    }
+    ESP_LOGD(TAG, "TX thread done");
+    return NULL;
+}
+
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+static void test_tx_queue_send(rfc2217_server_t server)
+{
+    // what the TX thread would send at the current time of the session clock, without waiting
+    while (true) {
+#if CONFIG_RFC2217_SERVER_PURGE
+        tx_queue_apply_purge(server);
+#endif
+        const uint8_t *data;
+        size_t len = ringbuf_peek(&server->tx_queue, &data);
+#if CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS
+        if (len > 0 && server->flush_threshold != 0) {
+            len = flush_sendable(server, len);
+        }
+#endif
+        if (len == 0) {
+            break;
+        }
+        send_data_to_client(server, data, len);
+        ringbuf_consume(&server->tx_queue, len);
+    }
+}
+#endif
+
+static void deliver_received_data(void *ctx, const uint8_t *buf, size_t size)
+{
+    rfc2217_server_t server = (rfc2217_server_t)ctx;
+    // replies to the requests before the data don't wait until it is passed on
+    ctrl_queue_kick(server);
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    // data sent by the client after a line change goes out after it
+    line_state_apply(server);
+#endif
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (server->rx_queue_buffer) {
+        // no pacing: the application takes the data at its own pace, and XOFF holds back rfc2217_server_read
+        call_on_data_received(server, buf, size);
+        return;
+    }
+#endif
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+    // release the data at the serial line rate; while waiting, the socket isn't read, so the client gets TCP backpressure
+    while (server->shaper_char_cost != 0 && size > 0 && !server->tcp_receive_thread_shutdown) {
+        wait_serial_tx_resumed(server);
+        size_t len = shaper_take(server, size);
+        if (len == 0) {
+            shaper_wait(server);
+            continue;
+        }
+        call_on_data_received(server, buf, len);
+        buf += len;
+        size -= len;
+    }
+    if (server->shaper_char_cost != 0) {
+        return;
+    }
+#endif
+    wait_serial_tx_resumed(server);
+    call_on_data_received(server, buf, size);
+}
+
+static void call_on_data_received(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (server->rx_queue_buffer) {
+        rx_queue_push(server, data, len);
+        return;
+    }
+#endif
+    if (server->config.on_data_received) {
+        callback_ticks_t start = callback_begin(server, RFC2217_CALLBACK_DATA_RECEIVED, len);
+        server->config.on_data_received(server->config.ctx, data, len);
+        callback_end(server, RFC2217_CALLBACK_DATA_RECEIVED, start);
+    }
+}
+
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+static void rx_queue_push(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+    // There is normally space: the TCP receive thread reads no more than the queue can take, and the
+    // data never gets longer in the telnet parser
+    while (len > 0) {
+        size_t written = ringbuf_write(&server->rx_queue, data, len);
+        if (written > 0) {
+            rx_queue_wake(server);
+        }
+        data += written;
+        len -= written;
+        if (len == 0) {
+            break;
+        }
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+        if (server->test_session) {
+            ESP_LOGW(TAG, "RX queue full, dropping %zu bytes", len);
+            break;
+        }
+#endif
+        if (server->tcp_receive_thread_shutdown) {
+            break;
+        }
+        rx_queue_wait(server, RX_QUEUE_SPACE, SHUTDOWN_POLL_INTERVAL_MS);
+    }
+}
+
+static size_t rx_queue_credit(rfc2217_server_t server, size_t max_len, unsigned timeout_ms)
+{
+    // Returns how much the TCP receive thread may read from the socket, at most max_len. If the queue is
+    // full, waits for space for up to timeout_ms (0: SHUTDOWN_POLL_INTERVAL_MS), and returns 0 if there
+    // is still none; the caller then does its time-based work and tries again.
+    if (ringbuf_free(&server->rx_queue) == 0) {
+        rx_queue_wait(server, RX_QUEUE_SPACE, timeout_ms ? timeout_ms : SHUTDOWN_POLL_INTERVAL_MS);
+    }
+    size_t space = ringbuf_free(&server->rx_queue);
+    return space < max_len ? space : max_len;
+}
+
+static bool rx_queue_ready(rfc2217_server_t server, rx_queue_wait_t until)
+{
+    switch (until) {
+    case RX_QUEUE_SPACE:
+        return ringbuf_free(&server->rx_queue) > 0;
+    case RX_QUEUE_DATA:
+        return rx_queue_unread(server) > 0 && !server->serial_tx_paused;
+    default:
+        return rx_queue_unread(server) == 0;
+    }
+}
+
+static size_t rx_queue_unread(rfc2217_server_t server)
+{
+    // bytes in the RX queue, without those dropped by a purge which the reader hasn't applied yet
+    size_t tail = atomic_load(&server->rx_queue.tail);
+    size_t used = atomic_load(&server->rx_queue.head) - tail;
+#if CONFIG_RFC2217_SERVER_PURGE
+    if (atomic_load(&server->rx_queue_purge_pending)) {
+        size_t dropped = atomic_load(&server->rx_queue_purge_mark) - tail;
+        if (dropped <= used) {
+            used -= dropped;
+        }
+    }
+#endif
+    return used;
+}
+
+#if CONFIG_RFC2217_SERVER_PURGE
+static bool rx_queue_apply_purge(rfc2217_server_t server)
+{
+    // reader of the RX queue: drop the data queued before a purge. Returns whether there was any; the
+    // caller then wakes the TCP receive thread, which may be waiting for space.
+    if (!atomic_exchange(&server->rx_queue_purge_pending, false)) {
+        return false;
+    }
+    size_t dropped = ringbuf_consume_to(&server->rx_queue, atomic_load(&server->rx_queue_purge_mark));
+    ESP_LOGD(TAG, "Purge: dropped %zu bytes from the RX queue", dropped);
+    return dropped > 0;
+}
+#endif
+
+static bool rx_queue_wait(rfc2217_server_t server, rx_queue_wait_t until, unsigned timeout_ms)
+{
+    // Sleep until the queue is in the state given by until, or for at most timeout_ms; the other side calls
+    // rx_queue_wake after changing the queue. The TCP receive thread also stops waiting when it is asked
+    // to shut down. Returns whether the queue is in that state.
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        return rx_queue_ready(server, until);   // the test task is on both sides of the queue
+    }
+#endif
+    struct timespec deadline;
+    get_deadline(&deadline, timeout_ms < UINT_MAX / 1000 ? timeout_ms * 1000 : UINT_MAX);
+    pthread_mutex_lock(&server->flow_control_mutex);
+    atomic_fetch_add(&server->rx_queue_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool ready = rx_queue_ready(server, until);
+    while (!ready && (until == RX_QUEUE_DATA || !server->tcp_receive_thread_shutdown)) {
+        int res = pthread_cond_timedwait(&server->flow_control_cond, &server->flow_control_mutex, &deadline);
+#if CONFIG_RFC2217_SERVER_PURGE
+        if (until == RX_QUEUE_DATA && rx_queue_apply_purge(server)) {
+            pthread_cond_broadcast(&server->flow_control_cond);
+        }
+#endif
+        ready = rx_queue_ready(server, until);
+        if (res == ETIMEDOUT) {
+            break;
+        }
+    }
+    atomic_fetch_sub(&server->rx_queue_waiters, 1);
+    pthread_mutex_unlock(&server->flow_control_mutex);
+    return ready;
+}
+
+static void rx_queue_wake(rfc2217_server_t server)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&server->rx_queue_waiters) > 0) {
+        pthread_mutex_lock(&server->flow_control_mutex);
+        pthread_cond_broadcast(&server->flow_control_cond);
+        pthread_mutex_unlock(&server->flow_control_mutex);
+    }
+}
+#endif // CONFIG_RFC2217_SERVER_RX_QUEUE
+
+#if CONFIG_RFC2217_SERVER_CALLBACK_STATS
+static const char *const s_callback_names[RFC2217_CALLBACK_COUNT] = {
+    [RFC2217_CALLBACK_DATA_RECEIVED] = "on_data_received",
+    [RFC2217_CALLBACK_BAUDRATE] = "on_baudrate",
+    [RFC2217_CALLBACK_CONTROL] = "on_control",
+    [RFC2217_CALLBACK_PURGE] = "on_purge",
+    [RFC2217_CALLBACK_LINE_STATE] = "on_line_state",
+};
+
+static inline callback_ticks_t callback_ticks(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#else
+    return esp_cpu_get_cycle_count();
+#endif
+}
+
+static inline callback_ticks_t callback_begin(rfc2217_server_t server, rfc2217_callback_t callback, uint32_t arg)
+{
+    server->callback_arg = arg;
+    atomic_fetch_add_explicit(&server->callback_seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&server->callback_running, callback + 1, memory_order_relaxed);
+    return callback_ticks();
+}
+
+static inline void callback_end(rfc2217_server_t server, rfc2217_callback_t callback, callback_ticks_t start)
+{
+    uint32_t us = (uint32_t)((callback_ticks_t)(callback_ticks() - start) / server->callback_ticks_per_us);
+    atomic_store_explicit(&server->callback_running, 0, memory_order_relaxed);
+    callback_stats_t *stats = &server->callback_stats[callback];
+    stats->calls++;
+    stats->total_us += us;
+    unsigned bucket = us ? 32 - __builtin_clz(us) : 0;
+    stats->histogram[bucket < CALLBACK_HISTOGRAM_BUCKETS ? bucket : CALLBACK_HISTOGRAM_BUCKETS - 1]++;
+    bool longest = us > stats->max_us;
+    if (longest) {
+        stats->max_us = us;
+    }
+    unsigned budget_us = server->config.callback_budget_us[callback];
+    if (budget_us != 0 && us > budget_us) {
+        stats->over_budget++;
+        if (longest) {
+            ESP_LOGW(TAG, "%s took %" PRIu32 " us, budget %u us", s_callback_names[callback], us, budget_us);
+        }
+    }
+}
+
+static void callback_watchdog(rfc2217_server_t server)
+{
+    // Runs in the server thread until the TCP receive thread is done. A call seen in progress for
+    // callback_watchdog_ms is reported once. The time is counted in polling intervals, as the cycle
+    // counters of different cores don't agree.
+    const unsigned watchdog_ms = server->config.callback_watchdog_ms;
+    if (watchdog_ms == 0) {
         return;
     }
+    unsigned interval_ms = watchdog_ms / 4;
+    if (interval_ms > SHUTDOWN_POLL_INTERVAL_MS) {
+        interval_ms = SHUTDOWN_POLL_INTERVAL_MS;
+    } else if (interval_ms == 0) {
+        interval_ms = 1;
+    }
+    unsigned last_seq = 0;
+    unsigned running_ms = 0;
+    bool reported = false;
+    while (!server->tcp_receive_thread_done) {
+        usleep(interval_ms * 1000);
+        unsigned running = atomic_load(&server->callback_running);
+        unsigned seq = atomic_load(&server->callback_seq);
+        if (running == 0 || seq != last_seq) {
+            last_seq = seq;
+            running_ms = 0;
+            reported = false;
+            continue;
+        }
+        running_ms += interval_ms;
+        if (running_ms < watchdog_ms || reported) {
+            continue;
+        }
+        reported = true;
+        rfc2217_callback_t callback = (rfc2217_callback_t)(running - 1);
+        server->callback_stats[callback].stuck++;
+        bool raw = false;
+#if CONFIG_RFC2217_SERVER_RAW_MODE
+        raw = server->raw_session;
+#endif
+        ESP_LOGE(TAG, "%s(%" PRIu32 ") running for %u ms: socket %d, %s session, TX queue %zu bytes, serial TX %s",
+                 s_callback_names[callback], server->callback_arg, running_ms, server->client_socket,
+                 raw ? "raw" : "RFC2217", server->tx_queue_buffer ? ringbuf_used(&server->tx_queue) : 0,
+                 server->serial_tx_paused ? "paused by XOFF" : "running");
+    }
+}
+#else
+static inline callback_ticks_t callback_begin(rfc2217_server_t server, rfc2217_callback_t callback, uint32_t arg)
+{
+    return 0;
+}
+
+static inline void callback_end(rfc2217_server_t server, rfc2217_callback_t callback, callback_ticks_t start)
+{
+}
+#endif
 
-    uint8_t subnegotiation = server->suboption[1];
+static void wait_serial_tx_resumed(rfc2217_server_t server)
+{
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        return;     // the task which would send XON is the one which would wait here
+    }
+#endif
+    if (server->serial_tx_paused) {
+        // serial device has sent XOFF; block here (and hence stop reading from the socket) until XON
+        pthread_mutex_lock(&server->flow_control_mutex);
+        while (server->serial_tx_paused && !server->tcp_receive_thread_shutdown) {
+            pthread_cond_wait(&server->flow_control_cond, &server->flow_control_mutex);
+        }
+        pthread_mutex_unlock(&server->flow_control_mutex);
+    }
+#endif
+}
+
+#if CONFIG_RFC2217_SERVER_RX_SHAPER || CONFIG_RFC2217_SERVER_LINK_STATS || CONFIG_RFC2217_SERVER_FLUSH_DELIMITERS || \
+    CONFIG_RFC2217_SERVER_LINE_STATE
+static uint64_t now_us(rfc2217_server_t server)
+{
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        return server->test_session->now_us(server->test_session->ctx);
+    }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+#endif
+
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+static void rtt_reset(rfc2217_server_t server)
+{
+    pthread_mutex_lock(&server->socket_mutex);
+    server->rtt_probe_sent_us = 0;
+    server->rtt_last_probe_us = 0;
+    server->rtt_srtt_us = 0;
+    server->rtt_var_us = 0;
+    server->rtt_last_us = 0;
+    server->rtt_samples = 0;
+    pthread_mutex_unlock(&server->socket_mutex);
+}
+
+static void rtt_probe_poll(rfc2217_server_t server)
+{
+    // Send IAC DO TIMING-MARK every rtt_probe_interval_ms. Only one probe is outstanding at a time, so a client
+    // which never replies gets only one. Plain TCP clients don't get probes, the bytes would end up in their data.
+    if (server->config.rtt_probe_interval_ms == 0 || !server->client_is_rfc2217 || server->rtt_probe_sent_us != 0) {
+        return;
+    }
+    uint64_t now = now_us(server);
+    if (server->rtt_last_probe_us != 0 && now - server->rtt_last_probe_us < (uint64_t) server->config.rtt_probe_interval_ms * 1000) {
+        return;
+    }
+    // timestamp taken before sending, the reply may be processed before telnet_send_option returns
+    pthread_mutex_lock(&server->socket_mutex);
+    server->rtt_probe_sent_us = now;
+    server->rtt_last_probe_us = now;
+    pthread_mutex_unlock(&server->socket_mutex);
+    telnet_send_option(server, T_DO, T_TIMING_MARK);
+}
+
+static void rtt_probe_reply(rfc2217_server_t server)
+{
+    if (server->rtt_probe_sent_us == 0) {
+        ESP_LOGD(TAG, "Unexpected TIMING-MARK reply");
+        return;
+    }
+    uint64_t rtt = now_us(server) - server->rtt_probe_sent_us;
+    if (rtt > UINT32_MAX) {
+        rtt = UINT32_MAX;
+    }
+    pthread_mutex_lock(&server->socket_mutex);
+    server->rtt_probe_sent_us = 0;
+    server->rtt_last_us = (uint32_t) rtt;
+    // smoothing as in RFC 6298: alpha = 1/8, beta = 1/4
+    if (server->rtt_samples == 0) {
+        server->rtt_srtt_us = (uint32_t) rtt;
+        server->rtt_var_us = (uint32_t) rtt / 2;
+    } else {
+        uint32_t delta = (rtt > server->rtt_srtt_us) ? (uint32_t) rtt - server->rtt_srtt_us : server->rtt_srtt_us - (uint32_t) rtt;
+        server->rtt_var_us = server->rtt_var_us - server->rtt_var_us / 4 + delta / 4;
+        server->rtt_srtt_us = server->rtt_srtt_us - server->rtt_srtt_us / 8 + (uint32_t) rtt / 8;
+    }
+    server->rtt_samples++;
+    pthread_mutex_unlock(&server->socket_mutex);
+    ESP_LOGD(TAG, "RTT sample %" PRIu32 " us, smoothed %" PRIu32 " us, variation %" PRIu32 " us",
+             server->rtt_last_us, server->rtt_srtt_us, server->rtt_var_us);
+}
+#endif // CONFIG_RFC2217_SERVER_LINK_STATS
+
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+static void shaper_reset(rfc2217_server_t server)
+{
+    server->line_baudrate = 0;
+    server->line_datasize = 8;
+    server->line_parity = PARITY_NONE;
+    server->line_stopsize = STOPSIZE_1;
+    server->shaper_char_cost = 0;
+}
+
+static void shaper_update_rate(rfc2217_server_t server)
+{
+    if (server->config.rx_shaper_burst == 0 || server->line_baudrate == 0) {
+        server->shaper_char_cost = 0;
+        return;
+    }
+    // character length in half bits (to allow for 1.5 stop bits): start bit, data bits, parity bit, stop bits
+    unsigned half_bits = 2 * (1 + server->line_datasize);
+    if (server->line_parity != PARITY_NONE) {
+        half_bits += 2;
+    }
+    half_bits += (server->line_stopsize == STOPSIZE_2) ? 4 : (server->line_stopsize == STOPSIZE_1_5) ? 3 : 2;
+    // credits are added at 2 * baudrate per microsecond, so one character costs half_bits * 1000000
+    server->shaper_char_cost = (uint64_t) half_bits * 1000000;
+    // start with a full bucket
+    server->shaper_credits = server->shaper_char_cost * server->config.rx_shaper_burst;
+    server->shaper_last_us = now_us(server);
+    ESP_LOGD(TAG, "RX shaper: %" PRIu32 " baud, %u half bits per character", server->line_baudrate, half_bits);
+}
+
+static size_t shaper_take(rfc2217_server_t server, size_t size)
+{
+    // refill the bucket according to the time passed, up to rx_shaper_burst characters
+    const uint64_t max_credits = server->shaper_char_cost * server->config.rx_shaper_burst;
+    const uint64_t rate = 2 * (uint64_t) server->line_baudrate;
+    uint64_t now = now_us(server);
+    uint64_t elapsed = now - server->shaper_last_us;
+    server->shaper_last_us = now;
+    if (elapsed > max_credits / rate + 1) {
+        elapsed = max_credits / rate + 1;   // bucket is full anyway; also avoids overflow after a long idle time
+    }
+    server->shaper_credits += elapsed * rate;
+    if (server->shaper_credits > max_credits) {
+        server->shaper_credits = max_credits;
+    }
+
+    size_t len = server->shaper_credits / server->shaper_char_cost;
+    if (len > size) {
+        len = size;
+    }
+    server->shaper_credits -= len * server->shaper_char_cost;
+    return len;
+}
+
+static void shaper_wait(rfc2217_server_t server)
+{
+    // sleep until one character can be delivered, or stop is requested
+    const uint64_t rate = 2 * (uint64_t) server->line_baudrate;
+    uint64_t wait_us = (server->shaper_char_cost - server->shaper_credits) / rate + 1;
+#if CONFIG_RFC2217_SERVER_TEST_HOOKS
+    if (server->test_session) {
+        server->test_session->sleep_us(server->test_session->ctx, wait_us);
+        return;
+    }
+#endif
+    if (wait_us > SHUTDOWN_POLL_INTERVAL_MS * 1000) {
+        wait_us = SHUTDOWN_POLL_INTERVAL_MS * 1000;
+    }
+    struct timespec deadline;
+    get_deadline(&deadline, (unsigned) wait_us);
+    pthread_mutex_lock(&server->flow_control_mutex);
+    if (!server->tcp_receive_thread_shutdown) {
+        pthread_cond_timedwait(&server->flow_control_cond, &server->flow_control_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&server->flow_control_mutex);
+}
+#endif // CONFIG_RFC2217_SERVER_RX_SHAPER
+
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+static void set_serial_tx_paused(rfc2217_server_t server, bool paused)
+{
+    pthread_mutex_lock(&server->flow_control_mutex);
+    if (server->serial_tx_paused != paused) {
+        ESP_LOGD(TAG, "Serial device sent %s", paused ? "XOFF" : "XON");
+        server->serial_tx_paused = paused;
+        pthread_cond_broadcast(&server->flow_control_cond);
+    }
+    pthread_mutex_unlock(&server->flow_control_mutex);
+}
+
+static void send_data_xon_xoff(rfc2217_server_t server, const uint8_t *data, size_t len)
+{
+    // strip XON/XOFF characters from the stream, sending the data in between as is
+    const uint8_t *end = data + len;
+    while (data < end) {
+        const uint8_t *p = scan_find_any2(data, end - data, XON, XOFF);
+        if (p == NULL) {
+            tcp_send_data(server, data, end - data);
+            break;
+        }
+        if (p > data) {
+            tcp_send_data(server, data, p - data);
+        }
+        set_serial_tx_paused(server, *p == XOFF);
+        data = p + 1;
+    }
+}
+#endif // CONFIG_RFC2217_SERVER_XON_XOFF
+
+
+static void process_telnet_command(void *ctx, uint8_t c)
+{
+    ESP_LOGD(TAG, "Ignoring telnet command: %d", c);
+}
+
+static void telnet_negotiate_option(void *ctx, uint8_t command, uint8_t option)
+{
+    rfc2217_server_t server = (rfc2217_server_t)ctx;
+    ESP_LOGD(TAG, "Telnet negotiate option: 0x%x 0x%x", command, option);
+#if CONFIG_RFC2217_SERVER_LINK_STATS
+    if (option == T_TIMING_MARK && (command == T_WILL || command == T_WONT)) {
+        // reply to our DO TIMING-MARK; both answers mean that the client has processed everything sent before it
+        rtt_probe_reply(server);
+        return;
+    }
+#endif
+
+    if (!telnet_options_process(server->telnet_options, TELNET_OPTIONS_COUNT, command, option)) {
+        ESP_LOGD(TAG, "Unknown option: 0x%x", option);
+        if (command == T_WILL) {
+            telnet_send_option(server, T_DONT, option);
+        }
+        if (command == T_DO) {
+            telnet_send_option(server, T_WONT, option);
+        }
+    }
+}
+
+static void telnet_send_option(void *ctx, uint8_t action, uint8_t option)
+{
+    uint8_t buf[3] = {T_IAC, action, option};
+    tcp_send_control((rfc2217_server_t)ctx, buf, sizeof(buf));
+}
+
+static void on_client_ok(void *ctx, bool ok)
+{
+    rfc2217_server_t server = (rfc2217_server_t)ctx;
+    if (!server->client_is_rfc2217) {
+        ESP_LOGD(TAG, "Client is RFC2217");
+        server->client_is_rfc2217 = true;
+        if (server->config.on_client_connected) {
+            server->config.on_client_connected(server->config.ctx);
+        }
+    }
+}
+
+
+static void process_subnegotiation(void *ctx, const uint8_t *suboption, size_t size)
+{
+    rfc2217_server_t server = (rfc2217_server_t)ctx;
+    ESP_LOGD(TAG, "Processing subnegotiation");
+    if (suboption[0] != T_COM_PORT_OPTION) {
+        ESP_LOGD(TAG, "Unknown subnegotiation: %x", suboption[0]);
+        return;
+    }
+    if (size < 2) {
+        ESP_LOGD(TAG, "Empty COM-PORT-OPTION subnegotiation");
+        return;
+    }
+
+    uint8_t subnegotiation = suboption[1];
+    // except for the flow control notifications, all the commands handled here have at least one byte of data
+    if (size < 3 && subnegotiation != T_FLOWCONTROL_SUSPEND && subnegotiation != T_FLOWCONTROL_RESUME) {
+        ESP_LOGD(TAG, "Subnegotiation too short: %d bytes", (int) size);
+        return;
+    }
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+    if (server->config.on_line_state) {
+        if (subnegotiation == T_SET_CONTROL && line_state_merge(server, suboption[2])) {
+            return;
+        }
+        // other requests are processed after the merged changes, in the order they arrived
+        line_state_apply(server);
+    }
+#endif
     if (subnegotiation == T_SET_BAUDRATE) {
-        uint32_t baudrate = (server->suboption[2] << 24) | (server->suboption[3] << 16) | (server->suboption[4] << 8) | server->suboption[5];
+        if (size < 6) {
+            ESP_LOGD(TAG, "Subnegotiation too short: %d bytes", (int) size);
+            return;
+        }
+        uint32_t baudrate = ((uint32_t) suboption[2] << 24) | (suboption[3] << 16) | (suboption[4] << 8) | suboption[5];
         uint32_t new_baudrate = baudrate;
+        if (baudrate != 0) {
+            // data received before the request must go out at the old baud rate
+            drain_serial_tx(server);
+        }
         if (server->config.on_baudrate) {
+            callback_ticks_t start = callback_begin(server, RFC2217_CALLBACK_BAUDRATE, baudrate);
             new_baudrate = server->config.on_baudrate(server->config.ctx, baudrate);
+            callback_end(server, RFC2217_CALLBACK_BAUDRATE, start);
         }
         ESP_LOGD(TAG, "Set baudrate: requested %" PRIu32 ", accepted %" PRIu32, baudrate, baudrate);
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+        if (new_baudrate != 0) {
+            server->line_baudrate = new_baudrate;
+            shaper_update_rate(server);
+        }
+#endif
         uint8_t data[4] = {new_baudrate >> 24, new_baudrate >> 16, new_baudrate >> 8, new_baudrate};
         rfc2217_send_subnegotiation(server, T_SERVER_SET_BAUDRATE, data, 4);
     } else if (subnegotiation == T_SET_DATASIZE) {
-        uint8_t datasize = server->suboption[2];
+        uint8_t datasize = suboption[2];
         ESP_LOGD(TAG, "Set datasize: %d - not supported, accepting", datasize);
-        rfc2217_send_subnegotiation(server, T_SERVER_SET_DATASIZE, &server->suboption[2], 1);
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+        if (datasize >= 5 && datasize <= 8) {
+            server->line_datasize = datasize;
+            shaper_update_rate(server);
+        }
+#endif
+        rfc2217_send_subnegotiation(server, T_SERVER_SET_DATASIZE, &suboption[2], 1);
     } else if (subnegotiation == T_SET_PARITY) {
-        uint8_t parity = server->suboption[2];
+        uint8_t parity = suboption[2];
         ESP_LOGD(TAG, "Set parity: %d - not supported, accepting", parity);
-        rfc2217_send_subnegotiation(server, T_SERVER_SET_PARITY, &server->suboption[2], 1);
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+        if (parity != 0) {
+            server->line_parity = parity;
+            shaper_update_rate(server);
+        }
+#endif
+        rfc2217_send_subnegotiation(server, T_SERVER_SET_PARITY, &suboption[2], 1);
     } else if (subnegotiation == T_SET_STOPSIZE) {
-        uint8_t stopsize = server->suboption[2];
+        uint8_t stopsize = suboption[2];
         ESP_LOGD(TAG, "Set stopsize: %d - not supported, accepting", stopsize);
-        rfc2217_send_subnegotiation(server, T_SERVER_SET_STOPSIZE, &server->suboption[2], 1);
+#if CONFIG_RFC2217_SERVER_RX_SHAPER
+        if (stopsize != 0) {
+            server->line_stopsize = stopsize;
+            shaper_update_rate(server);
+        }
+#endif
+        rfc2217_send_subnegotiation(server, T_SERVER_SET_STOPSIZE, &suboption[2], 1);
+#if CONFIG_RFC2217_SERVER_CONTROL
     } else if (subnegotiation == T_SET_CONTROL) {
-        uint8_t control_byte = server->suboption[2];
+        uint8_t control_byte = suboption[2];
         rfc2217_control_t control = (rfc2217_control_t)control_byte;
         rfc2217_control_t new_control = control;
+        if (control == RFC2217_CONTROL_SET_BREAK) {
+            drain_serial_tx(server);
+        }
         if (server->config.on_control) {
+            callback_ticks_t start = callback_begin(server, RFC2217_CALLBACK_CONTROL, control);
             new_control = server->config.on_control(server->config.ctx, control);
+            callback_end(server, RFC2217_CALLBACK_CONTROL, start);
         }
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+        if (server->config.handle_xon_xoff &&
+                (control == RFC2217_CONTROL_SET_NO_FLOW_CONTROL ||
+                 control == RFC2217_CONTROL_SET_XON_XOFF_FLOW_CONTROL ||
+                 control == RFC2217_CONTROL_SET_HARDWARE_FLOW_CONTROL)) {
+            if (control == RFC2217_CONTROL_SET_XON_XOFF_FLOW_CONTROL) {
+                new_control = control;
+            }
+            server->xon_xoff_active = (new_control == RFC2217_CONTROL_SET_XON_XOFF_FLOW_CONTROL);
+            if (!server->xon_xoff_active) {
+                set_serial_tx_paused(server, false);
+            }
+        }
+#endif
         ESP_LOGD(TAG, "Set control: requested %d, accepted %d", control, new_control);
         uint8_t data[1] = {new_control};
         rfc2217_send_subnegotiation(server, T_SERVER_SET_CONTROL, data, 1);
+#endif // CONFIG_RFC2217_SERVER_CONTROL
     } else if (subnegotiation == T_NOTIFY_LINESTATE) {
-        uint8_t linestate = server->suboption[2];
+        uint8_t linestate = suboption[2];
         ESP_LOGD(TAG, "Notify linestate: %d - not supported", linestate);
-        rfc2217_send_subnegotiation(server, T_SERVER_NOTIFY_LINESTATE, &server->suboption[2], 1);
+        rfc2217_send_subnegotiation(server, T_SERVER_NOTIFY_LINESTATE, &suboption[2], 1);
     } else if (subnegotiation == T_NOTIFY_MODEMSTATE) {
-        uint8_t modemstate = server->suboption[2];
+        uint8_t modemstate = suboption[2];
         ESP_LOGD(TAG, "Notify modemstate: %d - not supported", modemstate);
-        rfc2217_send_subnegotiation(server, T_SERVER_NOTIFY_MODEMSTATE, &server->suboption[2], 1);
+        rfc2217_send_subnegotiation(server, T_SERVER_NOTIFY_MODEMSTATE, &suboption[2], 1);
+#if CONFIG_RFC2217_SERVER_XON_XOFF
+    } else if (subnegotiation == T_FLOWCONTROL_SUSPEND || subnegotiation == T_FLOWCONTROL_RESUME) {
+        bool suspend = (subnegotiation == T_FLOWCONTROL_SUSPEND);
+        ESP_LOGD(TAG, "Flow control %s", suspend ? "suspend" : "resume");
+        if (server->xon_xoff_active) {
+            const uint8_t c = suspend ? XOFF : XON;
+            call_on_data_received(server, &c, 1);
+        }
+#endif
+#if CONFIG_RFC2217_SERVER_PURGE
     } else if (subnegotiation == T_PURGE_DATA) {
-        uint8_t purge = server->suboption[2];
-        rfc2217_send_subnegotiation(server, T_SERVER_PURGE_DATA, &server->suboption[2], 1);
-        rfc2217_purge_t purge_type = (rfc2217_purge_t)purge;
-        rfc2217_purge_t purge_result = purge_type;
-        if (server->config.on_purge) {
-            server->config.on_purge(server->config.ctx, purge_type);
-        }
-        ESP_LOGD(TAG, "Purge data: requested %d, accepted %d", purge_type, purge_result);
-        uint8_t data[1] = {purge_result};
-        rfc2217_send_subnegotiation(server, T_SERVER_PURGE_DATA, data, 1);
+        process_purge(server, suboption[2]);
+#endif
     } else {
         ESP_LOGD(TAG, "Unknown subnegotiation: %x", subnegotiation);
     }
 }
 
-void rfc2217_send_subnegotiation(rfc2217_server_t server, uint8_t command, const uint8_t *data, size_t size)
+#if CONFIG_RFC2217_SERVER_PURGE
+static void process_purge(rfc2217_server_t server, uint8_t purge)
 {
-    uint8_t buf[256]; // Adjust size as needed
-    size_t buf_index = 0;
+    // Drop the data in the server's queues and reply once, with the result of on_purge. The queues are
+    // dropped in O(1) by moving a mark, which their consumers apply before taking more data. The data
+    // the TX thread is sending, and what is in the socket's send buffer already (at most
+    // TCP_NOTSENT_LOWAT_BYTES not yet sent, where supported), still reaches the client.
+    if (purge < RFC2217_PURGE_RECEIVE || purge > RFC2217_PURGE_BOTH) {
+        ESP_LOGW(TAG, "Purge data: invalid request %d", purge);
+        rfc2217_send_subnegotiation(server, T_SERVER_PURGE_DATA, &purge, 1);
+        return;
+    }
+    rfc2217_purge_t requested = (rfc2217_purge_t) purge;
+    rfc2217_purge_t result = requested;
+    if (server->config.on_purge) {
+        callback_ticks_t start = callback_begin(server, RFC2217_CALLBACK_PURGE, requested);
+        result = server->config.on_purge(server->config.ctx, requested);
+        callback_end(server, RFC2217_CALLBACK_PURGE, start);
+    }
+    // after the callback, so that data the application took from the device before purging it is dropped too
+    if (requested != RFC2217_PURGE_TRANSMIT && server->tx_queue_buffer) {
+        atomic_store(&server->tx_queue_purge_mark, atomic_load(&server->tx_queue.head));
+        atomic_store(&server->tx_queue_purge_pending, true);
+        tx_queue_wake(server);
+    }
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    if (requested != RFC2217_PURGE_RECEIVE && server->rx_queue_buffer) {
+        atomic_store(&server->rx_queue_purge_mark, atomic_load(&server->rx_queue.head));
+        atomic_store(&server->rx_queue_purge_pending, true);
+        rx_queue_wake(server);
+    }
+#endif
+    ESP_LOGD(TAG, "Purge data: requested %d, result %d", requested, result);
+    uint8_t data[1] = {(uint8_t) result};
+    rfc2217_send_subnegotiation(server, T_SERVER_PURGE_DATA, data, 1);
+}
+#endif
 
-    buf[buf_index++] = T_IAC;
-    buf[buf_index++] = T_SB;
-    buf[buf_index++] = T_COM_PORT_OPTION;
-    buf[buf_index++] = command;
+#if CONFIG_RFC2217_SERVER_LINE_STATE
+static bool line_state_merge(rfc2217_server_t server, uint8_t control)
+{
+    // Record a DTR, RTS or break change for the next on_line_state call. Returns false for other
+    // SET_CONTROL values, which are passed to on_control.
+    uint8_t signal;
+    switch (control) {
+    case RFC2217_CONTROL_SET_DTR:
+    case RFC2217_CONTROL_CLEAR_DTR:
+        signal = LINE_DTR;
+        break;
+    case RFC2217_CONTROL_SET_RTS:
+    case RFC2217_CONTROL_CLEAR_RTS:
+        signal = LINE_RTS;
+        break;
+    case RFC2217_CONTROL_SET_BREAK:
+    case RFC2217_CONTROL_CLEAR_BREAK:
+        signal = LINE_BREAK;
+        break;
+    default:
+        return false;
+    }
+    bool on = (control == RFC2217_CONTROL_SET_DTR || control == RFC2217_CONTROL_SET_RTS ||
+               control == RFC2217_CONTROL_SET_BREAK);
+    if (server->line_reply_count == LINE_STATE_MAX_REPLIES) {
+        line_state_apply(server);
+    }
+    if (server->line_changes == 0) {
+        server->line_pending_since_us = now_us(server);
+    }
+    server->line_changes++;
+    server->line_pending = on ? (server->line_pending | signal) : (server->line_pending & ~signal);
+    server->line_replies[server->line_reply_count++] = control;
+    if (signal == LINE_BREAK) {
+        // a break isn't held back: a break shorter than the window would otherwise cancel out
+        line_state_apply(server);
+    }
+    return true;
+}
 
-    // escape IAC
-    for (size_t i = 0; i < size; i++) {
-        if (data[i] == T_IAC) {
-            buf[buf_index++] = T_IAC;
+static void line_state_apply(rfc2217_server_t server)
+{
+    // Pass the merged changes to on_line_state, unless they cancel out, then send the replies not sent yet
+    if (server->line_changes != 0) {
+        const uint8_t state = server->line_pending;
+        if (state != server->line_applied) {
+            if ((state & LINE_BREAK) && !(server->line_applied & LINE_BREAK)) {
+                drain_serial_tx(server);
+            }
+            callback_ticks_t start = callback_begin(server, RFC2217_CALLBACK_LINE_STATE, state);
+            server->config.on_line_state(server->config.ctx, state & LINE_DTR, state & LINE_RTS, state & LINE_BREAK);
+            callback_end(server, RFC2217_CALLBACK_LINE_STATE, start);
         }
-        buf[buf_index++] = data[i];
+        ESP_LOGD(TAG, "Line state: DTR %d, RTS %d, break %d, from %d requests", !!(state & LINE_DTR),
+                 !!(state & LINE_RTS), !!(state & LINE_BREAK), server->line_changes);
+        server->line_applied = state;
+        server->line_changes = 0;
+    }
+    line_state_reply(server);
+}
+
+static void line_state_reply(rfc2217_server_t server)
+{
+    // reply to the merged requests in one message
+    if (server->line_reply_count == 0) {
+        return;
+    }
+    uint8_t buf[LINE_STATE_MAX_REPLIES * TELNET_SUBNEGOTIATION_MAX];
+    size_t len = 0;
+    for (unsigned i = 0; i < server->line_reply_count; i++) {
+        len += telnet_build_subnegotiation(buf + len, T_SERVER_SET_CONTROL, &server->line_replies[i], 1);
+    }
+    server->line_reply_count = 0;
+    tcp_send_control(server, buf, len);
+}
+
+static unsigned line_state_poll(rfc2217_server_t server, unsigned timeout_ms)
+{
+    // Called after each block of data from the client. Applies the merged changes if line_state_window_us
+    // has passed since the first one, otherwise replies to the requests so that clients which wait for
+    // the reply (like pySerial) send the next change. Returns the timeout for waiting for data from the
+    // client: timeout_ms (0: none), or shorter, until the changes are due.
+    if (server->line_changes == 0) {
+        return timeout_ms;
+    }
+    uint64_t elapsed = now_us(server) - server->line_pending_since_us;
+    if (elapsed >= server->config.line_state_window_us) {
+        line_state_apply(server);
+        return timeout_ms;
     }
+    line_state_reply(server);
+    unsigned due_ms = (unsigned)((server->config.line_state_window_us - elapsed + 999) / 1000);
+    return (timeout_ms == 0 || due_ms < timeout_ms) ? due_ms : timeout_ms;
+}
+#endif // CONFIG_RFC2217_SERVER_LINE_STATE
 
-    buf[buf_index++] = T_IAC;
-    buf[buf_index++] = T_SE;
+static void drain_serial_tx(rfc2217_server_t server)
+{
+    unsigned timeout_ms = server->config.drain_timeout_ms ? server->config.drain_timeout_ms : DRAIN_TIMEOUT_MS;
+#if CONFIG_RFC2217_SERVER_RX_QUEUE
+    // data received before the request must reach the application first
+    if (server->rx_queue_buffer && !rx_queue_wait(server, RX_QUEUE_EMPTY, timeout_ms)) {
+        ESP_LOGW(TAG, "RX queue not read in %u ms, applying the change anyway", timeout_ms);
+    }
+#endif
+    if (!server->config.on_drain) {
+        return;
+    }
+    if (server->config.on_drain(server->config.ctx, timeout_ms) != 0) {
+        ESP_LOGW(TAG, "Serial TX not drained in %u ms, applying the change anyway", timeout_ms);
+    }
+}
 
-    tcp_send(server, buf, buf_index);
+void rfc2217_send_subnegotiation(rfc2217_server_t server, uint8_t command, const uint8_t *data, size_t size)
+{
+    uint8_t buf[TELNET_SUBNEGOTIATION_MAX];
+    size_t len = telnet_build_subnegotiation(buf, command, data, size);
+    tcp_send_control(server, buf, len);
 }
@@ -0,0 +1,57 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include "sdkconfig.h"
+#if !CONFIG_RFC2217_SERVER_DEBUG_LOGS
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+#include "rfc2217_socket.h"
+
+static const char *TAG = "rfc2217_socket";
+
+int socket_wait_readable(int sock, volatile bool *shutdown_requested, unsigned timeout_ms)
+{
+    unsigned waited_ms = 0;
+    while (!*shutdown_requested) {
+        if (timeout_ms != 0 && waited_ms >= timeout_ms) {
+            return 0;
+        }
+        unsigned interval_ms = SHUTDOWN_POLL_INTERVAL_MS;
+        if (timeout_ms != 0 && timeout_ms - waited_ms < interval_ms) {
+            interval_ms = timeout_ms - waited_ms;
+        }
+        waited_ms += interval_ms;
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sock, &read_fds);
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = interval_ms * 1000,
+        };
+        int res = select(sock + 1, &read_fds, NULL, NULL, &timeout);
+        if (res > 0) {
+            return 1;
+        }
+        if (res < 0 && errno != EINTR) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d (%s)", errno, strerror(errno));
+            return -1;
+        }
+    }
+    return -1;
+}
+
+bool socket_send_all(int sock, const uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = send(sock, buf, size, 0);
+        if (written < 0) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        size -= written;
+        buf += written;
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Blocking socket helpers shared by the RFC2217 server, mux and client.
+ * Include after sdkconfig.h.
+ */
+
+// Blocking socket calls are done with this timeout, so that a stop or disconnect request is noticed
+// within this time even if waking up the blocked call doesn't work
+#define SHUTDOWN_POLL_INTERVAL_MS 100
+
+/* Waits until sock is readable, polling *shutdown_requested every SHUTDOWN_POLL_INTERVAL_MS.
+ * Returns 1 if the socket is readable, 0 if timeout_ms has passed (0: no timeout),
+ * -1 on shutdown request or error. */
+int socket_wait_readable(int sock, volatile bool *shutdown_requested, unsigned timeout_ms);
+
+/* Sends all of buf, retrying partial sends. Returns false on error. */
+bool socket_send_all(int sock, const uint8_t *buf, size_t size);
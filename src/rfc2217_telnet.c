@@ -0,0 +1,221 @@
+#include <string.h>
+#include "sdkconfig.h"
+#if !CONFIG_RFC2217_SERVER_DEBUG_LOGS
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#include "esp_log.h"
+#include "rfc2217_telnet.h"
+
+static const char *TAG = "rfc2217_telnet";
+
+void telnet_options_init(telnet_option_t *options, const telnet_option_def_t *defs, size_t count, void *ctx)
+{
+    for (size_t i = 0; i < count; i++) {
+        options[i].def = &defs[i];
+        options[i].ctx = ctx;
+        options[i].state = defs[i].initial_state;
+        options[i].active = false;
+    }
+}
+
+void telnet_options_request(telnet_option_t *options, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const telnet_option_def_t *def = options[i].def;
+        if (options[i].state == T_REQUESTED && def->send_option_cb) {
+            def->send_option_cb(options[i].ctx, def->send_yes, def->option);
+        }
+    }
+}
+
+bool telnet_options_process(telnet_option_t *options, size_t count, uint8_t command, uint8_t option)
+{
+    bool known = false;
+    for (size_t i = 0; i < count; i++) {
+        ESP_LOGD(TAG, "Trying option %s (0x%x)", options[i].def->name, options[i].def->option);
+        if (options[i].def->option == option) {
+            telnet_option_process_incoming(&options[i], command);
+            known = true;
+        }
+    }
+    return known;
+}
+
+void telnet_option_process_incoming(telnet_option_t *option, uint8_t command)
+{
+    ESP_LOGD(TAG, "Option %s (state=%d) received command 0x%x", option->def->name, option->state, command);
+    if (command == option->def->ack_yes) {
+        if (option->state == T_REQUESTED) {
+            option->state = T_ACTIVE;
+            option->active = true;
+            ESP_LOGD(TAG, "Option %s activated", option->def->name);
+            if (option->def->cb) {
+                option->def->cb(option->ctx, true);
+            }
+        } else if (option->state == T_ACTIVE) {
+            // Do nothing
+        } else if (option->state == T_INACTIVE) {
+            option->state = T_ACTIVE;
+            if (option->def->send_option_cb) {
+                option->def->send_option_cb(option->ctx, option->def->send_yes, option->def->option);
+            }
+            option->active = true;
+            if (option->def->cb) {
+                option->def->cb(option->ctx, true);
+            }
+        } else if (option->state == T_REALLY_INACTIVE) {
+            if (option->def->send_option_cb) {
+                option->def->send_option_cb(option->ctx, option->def->send_no, option->def->option);
+            }
+        }
+    } else if (command == option->def->ack_no) {
+        if (option->state == T_REQUESTED) {
+            option->state = T_INACTIVE;
+            option->active = false;
+        } else if (option->state == T_ACTIVE) {
+            option->state = T_INACTIVE;
+            if (option->def->send_option_cb) {
+                option->def->send_option_cb(option->ctx, option->def->send_no, option->def->option);
+            }
+            option->active = false;
+        } else if (option->state == T_INACTIVE) {
+            // Do nothing
+        } else if (option->state == T_REALLY_INACTIVE) {
+            // Do nothing
+        }
+    }
+    ESP_LOGD(TAG, "Option %s state: %d active: %d", option->def->name, option->state, option->active);
+}
+
+size_t telnet_build_subnegotiation(uint8_t *buf, uint8_t command, const uint8_t *data, size_t size)
+{
+    size_t len = 0;
+    buf[len++] = T_IAC;
+    buf[len++] = T_SB;
+    buf[len++] = T_COM_PORT_OPTION;
+    buf[len++] = command;
+    // escape IAC
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == T_IAC) {
+            buf[len++] = T_IAC;
+        }
+        buf[len++] = data[i];
+    }
+    buf[len++] = T_IAC;
+    buf[len++] = T_SE;
+    return len;
+}
+
+void telnet_parser_init(telnet_parser_t *parser, const telnet_parser_handlers_t *handlers, void *ctx)
+{
+    parser->handlers = handlers;
+    parser->ctx = ctx;
+    parser->mode = T_NORMAL;
+    parser->collecting_suboption = false;
+    parser->suboption_overflow = false;
+    parser->command = 0;
+    parser->suboption_size = 0;
+}
+
+static void collect_suboption(telnet_parser_t *parser, const uint8_t *data, size_t len)
+{
+    if (parser->suboption_overflow) {
+        return;
+    }
+    size_t space = sizeof(parser->suboption) - parser->suboption_size;
+    if (len > space) {
+        // skipped up to IAC SE, so that the rest isn't taken for data; the start is kept for the log
+        parser->suboption_overflow = true;
+        len = space;
+    }
+    memcpy(parser->suboption + parser->suboption_size, data, len);
+    parser->suboption_size += len;
+}
+
+static void end_suboption(telnet_parser_t *parser)
+{
+    if (parser->suboption_overflow) {
+        ESP_LOGD(TAG, "Skipped subnegotiation of option 0x%x longer than %d bytes", parser->suboption[0],
+                 TELNET_SUBOPTION_MAX);
+    } else if (parser->suboption_size > 0) {
+        parser->handlers->on_subnegotiation(parser->ctx, parser->suboption, parser->suboption_size);
+    }
+    parser->suboption_size = 0;
+    parser->suboption_overflow = false;
+    parser->collecting_suboption = false;
+}
+
+void telnet_parser_feed(telnet_parser_t *parser, uint8_t *buf, size_t size)
+{
+    const telnet_parser_handlers_t *h = parser->handlers;
+    uint8_t *p = buf;
+    uint8_t *const end = buf + size;
+    uint8_t *run = NULL;            // start of data not yet passed to on_data
+    uint8_t *run_end = NULL;        // end of that data; behind p once an escaped IAC was removed
+    while (p < end) {
+        if (parser->mode == T_NORMAL) {
+            // data or the contents of a subnegotiation, up to the next IAC in one piece
+            uint8_t *iac = memchr(p, T_IAC, end - p);
+            uint8_t *stop = iac ? iac : end;
+            if (parser->collecting_suboption) {
+                collect_suboption(parser, p, stop - p);
+            } else if (!run) {
+                run = p;
+                run_end = stop;
+            } else {
+                if (run_end != p) {
+                    memmove(run_end, p, stop - p);
+                }
+                run_end += stop - p;
+            }
+            if (!iac) {
+                break;
+            }
+            parser->mode = T_GOT_IAC;
+            p = iac + 1;
+            continue;
+        }
+        uint8_t c = *p++;
+        if (parser->mode == T_GOT_IAC && c == T_IAC) {
+            // escaped IAC
+            parser->mode = T_NORMAL;
+            if (parser->collecting_suboption) {
+                collect_suboption(parser, &c, 1);
+            } else if (!run) {
+                run = p - 1;
+                run_end = p;
+            } else {
+                *run_end++ = T_IAC;
+            }
+            continue;
+        }
+        // a telnet command: the data before it goes first
+        if (run && run_end > run) {
+            h->on_data(parser->ctx, run, run_end - run);
+        }
+        run = NULL;
+        if (parser->mode == T_NEGOTIATE) {
+            parser->mode = T_NORMAL;
+            h->on_negotiate(parser->ctx, parser->command, c);
+            continue;
+        }
+        parser->mode = T_NORMAL;
+        if (c == T_SB) {
+            parser->suboption_size = 0;
+            parser->suboption_overflow = false;
+            parser->collecting_suboption = true;
+        } else if (c == T_SE) {
+            if (parser->collecting_suboption) {
+                end_suboption(parser);
+            }
+        } else if (c == T_WILL || c == T_WONT || c == T_DO || c == T_DONT) {
+            parser->command = c;
+            parser->mode = T_NEGOTIATE;
+        } else if (h->on_command) {
+            h->on_command(parser->ctx, c);
+        }
+    }
+    if (run && run_end > run) {
+        h->on_data(parser->ctx, run, run_end - run);
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Telnet protocol engine shared by the RFC2217 server and client: protocol constants,
+ * option negotiation state machine, and the parser of the received byte stream.
+ * Include after sdkconfig.h.
+ */
+
+// telnet
+#define T_SE 0xf0U
+#define T_NOP 0xf1U
+#define T_DM 0xf2U
+#define T_BRK 0xf3U
+#define T_IP 0xf4U
+#define T_AO 0xf5U
+#define T_AYT 0xf6U
+#define T_EC 0xf7U
+#define T_EL 0xf8U
+#define T_GA 0xf9U
+#define T_SB 0xfaU
+#define T_WILL 0xfbU
+#define T_WONT 0xfcU
+#define T_DO 0xfdU
+#define T_DONT 0xfeU
+#define T_IAC 0xffU
+
+// telnet options
+#define T_BINARY 0x00U
+#define T_ECHO 0x01U
+#define T_SGA 0x03U
+#define T_TIMING_MARK 0x06U
+
+// RFC2217
+#define T_COM_PORT_OPTION 0x2cU
+
+// Client to server
+#define T_SET_BAUDRATE 0x01U
+#define T_SET_DATASIZE 0x02U
+#define T_SET_PARITY 0x03U
+#define T_SET_STOPSIZE 0x04U
+#define T_SET_CONTROL 0x05U
+#define T_NOTIFY_LINESTATE 0x06U
+#define T_NOTIFY_MODEMSTATE 0x07U
+#define T_FLOWCONTROL_SUSPEND 0x08U
+#define T_FLOWCONTROL_RESUME 0x09U
+#define T_SET_LINESTATE_MASK 0x0aU
+#define T_SET_MODEMSTATE_MASK 0x0bU
+#define T_PURGE_DATA 0x0cU
+
+// Server to client: the client to server code plus this offset
+#define T_SERVER_OFFSET 0x64U
+#define T_SERVER_SET_BAUDRATE 0x65U
+#define T_SERVER_SET_DATASIZE 0x66U
+#define T_SERVER_SET_PARITY 0x67U
+#define T_SERVER_SET_STOPSIZE 0x68U
+#define T_SERVER_SET_CONTROL 0x69U
+#define T_SERVER_NOTIFY_LINESTATE 0x6aU
+#define T_SERVER_NOTIFY_MODEMSTATE 0x6bU
+#define T_SERVER_FLOWCONTROL_SUSPEND 0x6cU
+#define T_SERVER_FLOWCONTROL_RESUME 0x6dU
+#define T_SERVER_SET_LINESTATE_MASK 0x6eU
+#define T_SERVER_SET_MODEMSTATE_MASK 0x6fU
+#define T_SERVER_PURGE_DATA 0x70U
+
+// SET_PARITY and SET_STOPSIZE values
+#define PARITY_NONE 1U
+#define STOPSIZE_1 1U
+#define STOPSIZE_2 2U
+#define STOPSIZE_1_5 3U
+
+// Maximum length of a subnegotiation, including the option byte; longer ones are skipped
+#define TELNET_SUBOPTION_MAX CONFIG_RFC2217_SERVER_SUBNEGOTIATION_MAX
+// Maximum length of a COM-PORT-OPTION subnegotiation built by telnet_build_subnegotiation (4 data bytes, all escaped)
+#define TELNET_SUBNEGOTIATION_MAX (4 + 2 * 4 + 2)
+
+#if CONFIG_RFC2217_SERVER_OPTION_NAMES
+#define OPTION_NAME(name) name
+#else
+#define OPTION_NAME(name) ""
+#endif
+
+typedef enum {
+    T_REQUESTED,
+    T_ACTIVE,
+    T_INACTIVE,
+    T_REALLY_INACTIVE
+} telnet_option_state_t;
+
+typedef void (*activation_callback_t)(void *ctx, bool active);
+typedef void (*send_option_callback_t)(void *ctx, uint8_t action, uint8_t option);
+typedef struct {
+    uint8_t option;
+    const char *name;
+    telnet_option_state_t initial_state;
+    uint8_t send_yes;
+    uint8_t send_no;
+    uint8_t ack_yes;
+    uint8_t ack_no;
+    activation_callback_t cb;
+    send_option_callback_t send_option_cb;
+} telnet_option_def_t;
+
+typedef struct {
+    const telnet_option_def_t *def;
+    void *ctx;
+    bool active;
+    telnet_option_state_t state;
+} telnet_option_t;
+
+void telnet_options_init(telnet_option_t *options, const telnet_option_def_t *defs, size_t count, void *ctx);
+
+/* Send the initial request of every option in T_REQUESTED state (the side that starts the negotiation) */
+void telnet_options_request(telnet_option_t *options, size_t count);
+
+/* Process WILL/WONT/DO/DONT for an option; returns false if none of the options is the one negotiated */
+bool telnet_options_process(telnet_option_t *options, size_t count, uint8_t command, uint8_t option);
+
+void telnet_option_process_incoming(telnet_option_t *option, uint8_t command);
+
+/*
+ * Build IAC SB COM-PORT-OPTION <command> <data, IAC escaped> IAC SE into buf, which must hold
+ * TELNET_SUBNEGOTIATION_MAX bytes. size must not exceed 4. Returns the length of the message.
+ */
+size_t telnet_build_subnegotiation(uint8_t *buf, uint8_t command, const uint8_t *data, size_t size);
+
+typedef enum { T_NORMAL, T_GOT_IAC, T_NEGOTIATE } telnet_mode_t;
+
+typedef struct {
+    void (*on_data)(void *ctx, const uint8_t *data, size_t len);
+    void (*on_negotiate)(void *ctx, uint8_t command, uint8_t option);
+    void (*on_subnegotiation)(void *ctx, const uint8_t *data, size_t len);  // data starts with the option byte
+    void (*on_command)(void *ctx, uint8_t command);
+} telnet_parser_handlers_t;
+
+typedef struct {
+    const telnet_parser_handlers_t *handlers;
+    void *ctx;
+    telnet_mode_t mode;
+    bool collecting_suboption;
+    bool suboption_overflow;    // the subnegotiation being collected is too long, skipped up to IAC SE
+    uint8_t command;
+    uint8_t suboption[TELNET_SUBOPTION_MAX];
+    size_t suboption_size;
+} telnet_parser_t;
+
+void telnet_parser_init(telnet_parser_t *parser, const telnet_parser_handlers_t *handlers, void *ctx);
+
+/*
+ * Parse received bytes. Data between telnet commands is passed to on_data in runs as long
+ * as possible, pointing into buf. Escaped IACs are unescaped in place, so buf is modified, and
+ * a run only ends at another telnet command or at the end of buf.
+ *
+ * Cost: the data and the contents of subnegotiations are scanned with memchr and copied at most
+ * once; every other byte is handled in constant time. Each telnet command (at least 2 bytes) leads
+ * to at most one handler call, plus one on_data call for the data before it. Subnegotiations longer
+ * than TELNET_SUBOPTION_MAX are skipped up to IAC SE without calling a handler.
+ */
+void telnet_parser_feed(telnet_parser_t *parser, uint8_t *buf, size_t size);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "esp_pthread.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+#include "rfc2217_server.h"
+
+/*
+ * Thread creation with the stack size, priority and core of the task, used by the server and
+ * the client. Include after sdkconfig.h; on Linux, define _GNU_SOURCE before including any
+ * system header, for pthread_attr_setaffinity_np.
+ */
+
+/* stack_size and priority: 0 for the default; core_id: RFC2217_NO_AFFINITY to leave the thread unpinned.
+ * Returns the result of pthread_create. */
+static inline int rfc2217_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg, const char *name,
+                                        size_t stack_size, unsigned priority, unsigned core_id)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stack_size > 0) {
+        if (stack_size < (size_t) PTHREAD_STACK_MIN) {
+            stack_size = PTHREAD_STACK_MIN;
+        }
+        pthread_attr_setstacksize(&attr, stack_size);
+    }
+#if defined(__linux__)
+    // ignore core IDs which don't exist on the host (including RFC2217_NO_AFFINITY), like esp_pthread does with tskNO_AFFINITY
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (core_id < CPU_SETSIZE && (long) core_id < cpu_count) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core_id, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+    int res = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return res;
+#else
+    // esp_pthread configuration applies to threads created by the calling thread; restore it afterwards
+    esp_pthread_cfg_t prev_cfg;
+    bool has_prev_cfg = (esp_pthread_get_cfg(&prev_cfg) == ESP_OK);
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    if (stack_size > 0) {
+        cfg.stack_size = stack_size;
+    }
+    if (priority > 0) {
+        cfg.prio = priority;
+    }
+    cfg.pin_to_core = core_id == RFC2217_NO_AFFINITY ? tskNO_AFFINITY : (int) core_id;
+    cfg.thread_name = name;
+    cfg.inherit_cfg = false;
+    esp_pthread_set_cfg(&cfg);
+    int res = pthread_create(thread, NULL, fn, arg);
+    if (has_prev_cfg) {
+        esp_pthread_set_cfg(&prev_cfg);
+    } else {
+        esp_pthread_cfg_t default_cfg = esp_pthread_get_default_config();
+        esp_pthread_set_cfg(&default_cfg);
+    }
+    return res;
+#endif
+}
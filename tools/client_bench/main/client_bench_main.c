@@ -0,0 +1,1033 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "esp_log.h"
+#include "rfc2217_server.h"
+#include "rfc2217_client.h"
+#include "sim_serial.h"
+
+static const char *TAG = "client_bench";
+
+// port of the in-process server
+#define DEFAULT_PORT 3333
+// the data sent is taken from a pattern of this size
+#define PATTERN_SIZE 65536
+// give up waiting for the echo after this long without progress
+#define STALL_TIMEOUT_MS 5000
+// how long the in-process server waits for space in the TX FIFO of the simulated port
+#define SIM_WRITE_TIMEOUT_MS 1000
+// line changes recorded during the reset sequence
+#define MAX_LINE_EVENTS 32
+// baud rate changes made right after sending data
+#define BAUD_SWITCH_ROUNDS 10
+// SLIP frame delimiter, used by esptool
+#define SLIP_END 0xC0
+// bytes of the purge test: data sent before the purge, and after it
+#define PURGE_STALE 'S'
+#define PURGE_FRESH 'F'
+#define PURGE_FRESH_SIZE 1024
+// rfc2217_server_stop must return within this time; the server threads check for shutdown every 100 ms at worst
+#define STOP_BOUND_US 200000
+// how long a client keeps trying to connect to the restarted server
+#define RESTART_TIMEOUT_US 2000000
+
+typedef struct {
+    const char *target_host;    // NULL: start a server in this process
+    unsigned target_port;
+    size_t bytes;
+    size_t chunk;
+    bool binary;                // false: log-like text, true: random bytes, including IAC
+    unsigned control_rounds;
+    bool pull;                  // read the echo with rfc2217_client_recv instead of on_data_received
+    uint32_t sim_baudrate;      // 0: the in-process server echoes the data directly, otherwise through a simulated port
+    bool sim_drain;             // the server waits for the TX FIFO of the simulated port to drain before a baud rate change
+    unsigned frames;            // number of SLIP frames in the request/response test
+    size_t frame_size;          // size of each frame, including the delimiters
+    size_t tx_queue_size;       // tx_queue_size of the in-process server
+    size_t rx_queue_size;       // rx_queue_size of the in-process server, read by a dispatch thread if non-zero
+    bool flush;                 // the in-process server flushes its TX queue on SLIP_END
+    size_t purge_bytes;         // stale data in flight when the purge is requested, 0 skips the purge test
+    unsigned stop_rounds;       // stops and restarts of the in-process server, idle and with a client
+} bench_config_t;
+
+typedef struct {
+    const bench_config_t *config;
+    rfc2217_client_t client;
+    uint8_t *pattern;           // PATTERN_SIZE + chunk bytes, so that any chunk is contiguous
+    atomic_size_t received;
+    atomic_bool mismatch;
+    atomic_bool load_done;
+    // request/response test
+    const uint8_t *frame;       // frame sent and expected back, NULL during the other tests
+    atomic_uint deliveries;     // calls of on_data_received or reads which returned data
+    pthread_mutex_t frame_mutex;
+    pthread_cond_t frame_cond;  // signalled when data is received
+    // purge test
+    atomic_bool purging;        // data is counted by check_purge
+    atomic_bool purge_replied;  // rfc2217_client_purge has returned
+    atomic_size_t stale_before; // stale bytes received before the reply
+    atomic_size_t stale_after;  // stale bytes received after the reply
+    atomic_size_t fresh;        // fresh bytes received
+    _Atomic uint64_t first_fresh_us;
+} bench_t;
+
+typedef struct {
+    unsigned lines;
+    uint64_t time_us;
+} line_event_t;
+
+static rfc2217_server_t s_server;
+static sim_serial_t s_sim;
+static line_event_t s_line_events[MAX_LINE_EVENTS];
+static atomic_size_t s_line_event_count;
+static atomic_bool s_record_lines;
+static atomic_bool s_dispatch_stop;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// in-process server: echoes the data and accepts all the settings, like the loopback example,
+// or passes them to a simulated serial port with a loopback plug, like the uart example
+static void server_on_data(void *ctx, const uint8_t *data, size_t len)
+{
+    if (s_sim) {
+        sim_serial_write(s_sim, data, len, SIM_WRITE_TIMEOUT_MS);
+    } else {
+        rfc2217_server_send_data(s_server, data, len);
+    }
+}
+
+// reads the RX queue of the in-process server, like an application task with rx_queue_size set
+static void *server_dispatch_fn(void *ctx)
+{
+    uint8_t buf[4096];
+    while (!atomic_load(&s_dispatch_stop)) {
+        int len = rfc2217_server_read(s_server, buf, sizeof(buf), 100);
+        if (len > 0) {
+            server_on_data(NULL, buf, len);
+        }
+    }
+    return NULL;
+}
+
+static unsigned server_on_baudrate(void *ctx, unsigned baudrate)
+{
+    if (s_sim) {
+        return sim_serial_set_line_config(s_sim, baudrate, 0, 0, 0);
+    }
+    return baudrate;
+}
+
+static rfc2217_control_t server_on_control(void *ctx, rfc2217_control_t control)
+{
+    if (!s_sim) {
+        return control;
+    }
+    switch (control) {
+    case RFC2217_CONTROL_SET_NO_FLOW_CONTROL:
+        sim_serial_set_flow_control(s_sim, SIM_SERIAL_FLOW_NONE);
+        break;
+    case RFC2217_CONTROL_SET_HARDWARE_FLOW_CONTROL:
+        sim_serial_set_flow_control(s_sim, SIM_SERIAL_FLOW_RTS_CTS);
+        break;
+    case RFC2217_CONTROL_SET_BREAK:
+    case RFC2217_CONTROL_CLEAR_BREAK:
+        sim_serial_set_break(s_sim, control == RFC2217_CONTROL_SET_BREAK);
+        break;
+    case RFC2217_CONTROL_SET_DTR:
+    case RFC2217_CONTROL_CLEAR_DTR:
+        sim_serial_set_lines(s_sim, SIM_SERIAL_LINE_DTR, control == RFC2217_CONTROL_SET_DTR ? SIM_SERIAL_LINE_DTR : 0);
+        break;
+    case RFC2217_CONTROL_SET_RTS:
+    case RFC2217_CONTROL_CLEAR_RTS:
+        sim_serial_set_lines(s_sim, SIM_SERIAL_LINE_RTS, control == RFC2217_CONTROL_SET_RTS ? SIM_SERIAL_LINE_RTS : 0);
+        break;
+    default:
+        break;
+    }
+    return control;
+}
+
+static rfc2217_purge_t server_on_purge(void *ctx, rfc2217_purge_t purge)
+{
+    if (s_sim) {
+        sim_serial_purge(s_sim, purge != RFC2217_PURGE_TRANSMIT, purge != RFC2217_PURGE_RECEIVE);
+    }
+    return purge;
+}
+
+static int server_on_drain(void *ctx, unsigned timeout_ms)
+{
+    return sim_serial_wait_tx_done(s_sim, timeout_ms);
+}
+
+static void sim_on_rx(void *ctx, const uint8_t *data, size_t len)
+{
+    rfc2217_server_send_data(s_server, data, len);
+}
+
+static void sim_on_event(void *ctx, sim_serial_event_t event, uint32_t value, uint64_t time_us)
+{
+    if (event == SIM_SERIAL_EVENT_LINES && atomic_load(&s_record_lines)) {
+        size_t i = atomic_fetch_add(&s_line_event_count, 1);
+        if (i < MAX_LINE_EVENTS) {
+            s_line_events[i] = (line_event_t) {
+                value, time_us
+            };
+        }
+    }
+}
+
+static void make_pattern(bench_t *bench)
+{
+    const size_t size = PATTERN_SIZE + bench->config->chunk;
+    bench->pattern = malloc(size);
+    const char *line = "I (1234) app_main: sensor reading 1023, status ok\n";
+    size_t line_len = strlen(line);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < size; i++) {
+        size_t pos = i % PATTERN_SIZE;
+        if (bench->config->binary) {
+            if (pos == 0) {
+                seed = 1;
+            }
+            seed = seed * 1103515245 + 12345;
+            bench->pattern[i] = seed >> 16;
+        } else {
+            bench->pattern[i] = line[pos % line_len];
+        }
+    }
+}
+
+static void check_received(bench_t *bench, const uint8_t *data, size_t len)
+{
+    size_t pos = atomic_load(&bench->received);
+    while (len > 0) {
+        size_t offset = pos % PATTERN_SIZE;
+        size_t n = PATTERN_SIZE - offset < len ? PATTERN_SIZE - offset : len;
+        if (memcmp(data, bench->pattern + offset, n) != 0) {
+            atomic_store(&bench->mismatch, true);
+        }
+        data += n;
+        len -= n;
+        pos += n;
+    }
+    atomic_store(&bench->received, pos);
+}
+
+static void check_frame(bench_t *bench, const uint8_t *data, size_t len)
+{
+    size_t pos = atomic_load(&bench->received);
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != bench->frame[(pos + i) % bench->config->frame_size]) {
+            atomic_store(&bench->mismatch, true);
+        }
+    }
+    atomic_fetch_add(&bench->deliveries, 1);
+    pthread_mutex_lock(&bench->frame_mutex);
+    atomic_store(&bench->received, pos + len);
+    pthread_cond_signal(&bench->frame_cond);
+    pthread_mutex_unlock(&bench->frame_mutex);
+}
+
+static void check_purge(bench_t *bench, const uint8_t *data, size_t len)
+{
+    size_t fresh = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == PURGE_FRESH) {
+            fresh++;
+        }
+    }
+    if (fresh > 0 && atomic_load(&bench->first_fresh_us) == 0) {
+        atomic_store(&bench->first_fresh_us, now_us());
+    }
+    atomic_fetch_add(atomic_load(&bench->purge_replied) ? &bench->stale_after : &bench->stale_before, len - fresh);
+    atomic_fetch_add(&bench->fresh, fresh);
+}
+
+static void client_on_data(void *ctx, const uint8_t *data, size_t len)
+{
+    bench_t *bench = (bench_t *) ctx;
+    if (atomic_load(&bench->purging)) {
+        check_purge(bench, data, len);
+    } else if (bench->frame) {
+        check_frame(bench, data, len);
+    } else {
+        check_received(bench, data, len);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(const char *name, uint64_t *samples, size_t count)
+{
+    if (count == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    qsort(samples, count, sizeof(samples[0]), compare_u64);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    printf("%s (us, %zu samples): mean %" PRIu64 ", median %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+           name, count, sum / count, samples[count / 2], samples[count * 99 / 100], samples[count - 1]);
+}
+
+static size_t measure_control(bench_t *bench, uint64_t *samples, size_t max_samples, atomic_bool *stop)
+{
+    size_t count = 0;
+    while (count < max_samples && !(stop && atomic_load(stop))) {
+        rfc2217_control_t control = (count % 2) ? RFC2217_CONTROL_CLEAR_DTR : RFC2217_CONTROL_SET_DTR;
+        uint64_t start = now_us();
+        if (rfc2217_client_set_control(bench->client, control, NULL) != 0) {
+            break;
+        }
+        samples[count++] = now_us() - start;
+    }
+    return count;
+}
+
+typedef struct {
+    bench_t *bench;
+    uint64_t *samples;
+    size_t max_samples;
+    size_t count;
+} load_control_t;
+
+static void *control_under_load_fn(void *ctx)
+{
+    load_control_t *lc = (load_control_t *) ctx;
+    lc->count = measure_control(lc->bench, lc->samples, lc->max_samples, &lc->bench->load_done);
+    return NULL;
+}
+
+typedef struct {
+    rfc2217_control_t control;
+    unsigned line;              // SIM_SERIAL_LINE_* bit changed by the request
+    bool value;
+    unsigned delay_ms;          // wait after the request
+} reset_step_t;
+
+// classic reset of esptool: RTS drives EN and DTR drives IO0, both inverted
+static const reset_step_t s_reset_sequence[] = {
+    {RFC2217_CONTROL_CLEAR_DTR, SIM_SERIAL_LINE_DTR, false, 0},     // IO0 high
+    {RFC2217_CONTROL_SET_RTS, SIM_SERIAL_LINE_RTS, true, 100},      // EN low: chip in reset
+    {RFC2217_CONTROL_SET_DTR, SIM_SERIAL_LINE_DTR, true, 0},        // IO0 low
+    {RFC2217_CONTROL_CLEAR_RTS, SIM_SERIAL_LINE_RTS, false, 50},    // EN high: chip starts in download mode
+    {RFC2217_CONTROL_CLEAR_DTR, SIM_SERIAL_LINE_DTR, false, 0},     // IO0 high
+};
+#define RESET_STEPS (sizeof(s_reset_sequence) / sizeof(s_reset_sequence[0]))
+
+static int run_reset_sequence(bench_t *bench)
+{
+    // timing of the line changes at the serial port, as seen by a chip connected to it
+    uint64_t request_us[RESET_STEPS];
+    uint64_t edge_us[RESET_STEPS] = {0};
+    unsigned lines = sim_serial_get_lines(s_sim);
+    atomic_store(&s_line_event_count, 0);
+    atomic_store(&s_record_lines, true);
+    for (size_t i = 0; i < RESET_STEPS; i++) {
+        request_us[i] = now_us();
+        if (rfc2217_client_set_control(bench->client, s_reset_sequence[i].control, NULL) != 0) {
+            atomic_store(&s_record_lines, false);
+            return -1;
+        }
+        usleep(s_reset_sequence[i].delay_ms * 1000);
+    }
+    atomic_store(&s_record_lines, false);
+
+    size_t count = atomic_load(&s_line_event_count);
+    count = count < MAX_LINE_EVENTS ? count : MAX_LINE_EVENTS;
+    uint64_t max_latency = 0;
+    for (size_t i = 0; i < RESET_STEPS; i++) {
+        const reset_step_t *step = &s_reset_sequence[i];
+        unsigned prev = lines;
+        for (size_t e = 0; e < count && edge_us[i] == 0; e++) {
+            bool changed = ((s_line_events[e].lines ^ prev) & step->line) != 0;
+            prev = s_line_events[e].lines;
+            // the server changes the line before replying, so before the next request is sent
+            bool in_step = s_line_events[e].time_us >= request_us[i] &&
+                           (i + 1 == RESET_STEPS || s_line_events[e].time_us < request_us[i + 1]);
+            if (changed && in_step && ((prev & step->line) != 0) == step->value) {
+                edge_us[i] = s_line_events[e].time_us;
+            }
+        }
+        if (edge_us[i] == 0) {
+            // the line was already in the requested state
+            continue;
+        }
+        if (edge_us[i] - request_us[i] > max_latency) {
+            max_latency = edge_us[i] - request_us[i];
+        }
+    }
+    if (edge_us[1] == 0 || edge_us[2] == 0 || edge_us[3] == 0) {
+        ESP_LOGE(TAG, "Reset sequence: line changes missing at the serial port");
+        return -1;
+    }
+    printf("Reset sequence: edge latency max %" PRIu64 " us, EN low for %" PRIu64 " us (requested %u ms), "
+           "IO0 low %" PRIu64 " us before EN high\n", max_latency, edge_us[3] - edge_us[1],
+           s_reset_sequence[1].delay_ms, edge_us[3] - edge_us[2]);
+    return 0;
+}
+
+static int wait_echo(bench_t *bench, size_t total)
+{
+    // wait until total bytes of the pattern were received
+    uint8_t buf[4096];
+    uint64_t last_progress = now_us();
+    size_t last = atomic_load(&bench->received);
+    while (atomic_load(&bench->received) < total) {
+        if (bench->config->pull) {
+            int len = rfc2217_client_recv(bench->client, buf, sizeof(buf), 10);
+            if (len > 0) {
+                check_received(bench, buf, len);
+            }
+        } else {
+            usleep(1000);
+        }
+        if (atomic_load(&bench->received) != last) {
+            last = atomic_load(&bench->received);
+            last_progress = now_us();
+        } else if (now_us() - last_progress > STALL_TIMEOUT_MS * 1000) {
+            ESP_LOGE(TAG, "Echo stalled at %zu bytes", last);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_baud_switch(bench_t *bench)
+{
+    // esptool-style baud rate changes right after data: with draining, none of the data should still be
+    // in the TX FIFO of the port when the baud rate changes
+    const bench_config_t *config = bench->config;
+    // about 10 ms of data
+    const size_t chunk = config->sim_baudrate / 100 < config->chunk ? config->sim_baudrate / 100 : config->chunk;
+    sim_serial_stats_t before;
+    sim_serial_get_stats(s_sim, &before);
+    atomic_store(&bench->received, 0);
+    uint64_t switch_us = 0;
+    int res = 0;
+    for (unsigned i = 0; i < BAUD_SWITCH_ROUNDS && res == 0; i++) {
+        rfc2217_line_config_t line = {
+            .baudrate = (i % 2) ? config->sim_baudrate : config->sim_baudrate / 2,
+            .datasize = 8,
+            .parity = RFC2217_PARITY_NONE,
+            .stopbits = RFC2217_STOPBITS_1,
+        };
+        if (rfc2217_client_send(bench->client, bench->pattern + (i * chunk) % PATTERN_SIZE, chunk) != 0) {
+            res = -1;
+            break;
+        }
+        uint64_t start = now_us();
+        res = rfc2217_client_set_line_config(bench->client, &line, NULL);
+        switch_us += now_us() - start;
+        if (res == 0 && config->pull) {
+            // the echo stays in the receive buffer of the client until it is read; once the buffer is
+            // full, the client stops reading the socket, and the next reply would be stuck behind the data
+            res = wait_echo(bench, (i + 1) * chunk);
+        }
+    }
+    if (res == 0) {
+        res = wait_echo(bench, BAUD_SWITCH_ROUNDS * chunk);
+    }
+    sim_serial_stats_t after;
+    sim_serial_get_stats(s_sim, &after);
+    printf("Baud rate changes after %zu bytes of data (%s): %u changes in %" PRIu64 " us on average, "
+           "%" PRIu32 " with data in the TX FIFO (%" PRIu64 " bytes sent at the wrong rate)%s\n",
+           chunk, config->sim_drain ? "server drains" : "no draining", BAUD_SWITCH_ROUNDS, switch_us / BAUD_SWITCH_ROUNDS,
+           after.config_changes_tx_pending - before.config_changes_tx_pending, after.tx_pending_bytes - before.tx_pending_bytes,
+           atomic_load(&bench->mismatch) ? ", DATA MISMATCH" : "");
+    return (res == 0 && !atomic_load(&bench->mismatch)) ? 0 : -1;
+}
+
+static int wait_frame(bench_t *bench, size_t total)
+{
+    // wait until total bytes of frames were received
+    uint8_t buf[4096];
+    uint64_t start = now_us();
+    while (atomic_load(&bench->received) < total) {
+        if (now_us() - start > STALL_TIMEOUT_MS * 1000) {
+            ESP_LOGE(TAG, "Frame echo stalled at %zu bytes", atomic_load(&bench->received));
+            return -1;
+        }
+        if (bench->config->pull) {
+            int len = rfc2217_client_recv(bench->client, buf, sizeof(buf), 100);
+            if (len < 0) {
+                return -1;
+            }
+            if (len > 0) {
+                check_frame(bench, buf, len);
+            }
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&bench->frame_mutex);
+        if (atomic_load(&bench->received) < total) {
+            pthread_cond_timedwait(&bench->frame_cond, &bench->frame_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&bench->frame_mutex);
+    }
+    return 0;
+}
+
+static int run_frames(bench_t *bench)
+{
+    // esptool-style request/response: send a SLIP frame and wait until all of it came back, then the next
+    const bench_config_t *config = bench->config;
+    const size_t size = config->frame_size;
+    uint8_t *frame = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        // SLIP would escape SLIP_END in the payload
+        frame[i] = bench->pattern[i] == SLIP_END ? SLIP_END + 1 : bench->pattern[i];
+    }
+    frame[0] = SLIP_END;
+    frame[size - 1] = SLIP_END;
+    uint64_t *samples = calloc(config->frames + 1, sizeof(uint64_t));
+    atomic_store(&bench->received, 0);
+    atomic_store(&bench->deliveries, 0);
+    bench->frame = frame;
+
+    int res = 0;
+    size_t count = 0;
+    uint64_t start = now_us();
+    while (count < config->frames) {
+        uint64_t sent = now_us();
+        if (rfc2217_client_send(bench->client, frame, size) != 0 || wait_frame(bench, (count + 1) * size) != 0) {
+            res = -1;
+            break;
+        }
+        samples[count++] = now_us() - sent;
+    }
+    uint64_t elapsed = now_us() - start;
+    bench->frame = NULL;
+
+    const char *server = config->target_host ? "" : !config->tx_queue_size ? ", server without TX queue" :
+                         config->flush ? ", server flushes on 0xC0" : ", server with TX queue";
+    printf("Frames: %zu frames of %zu bytes in %.3f s, %.0f frames/s, %.2f %s per frame%s%s\n", count, size,
+           elapsed / 1e6, count * 1e6 / elapsed, count ? (double) atomic_load(&bench->deliveries) / count : 0.0,
+           config->pull ? "reads" : "deliveries", server, atomic_load(&bench->mismatch) ? ", DATA MISMATCH" : "");
+    report_latency("Frame round trip", samples, count);
+    free(samples);
+    free(frame);
+    return (res == 0 && !atomic_load(&bench->mismatch)) ? 0 : -1;
+}
+
+static void *purge_pull_fn(void *ctx)
+{
+    // the data is read while rfc2217_client_purge waits, otherwise the reply would be stuck behind it
+    bench_t *bench = (bench_t *) ctx;
+    uint8_t buf[4096];
+    while (atomic_load(&bench->purging)) {
+        int len = rfc2217_client_recv(bench->client, buf, sizeof(buf), 10);
+        if (len < 0) {
+            break;
+        }
+        check_purge(bench, buf, len);
+    }
+    return NULL;
+}
+
+static int wait_purge(atomic_size_t *counter, size_t total)
+{
+    // wait until total bytes were counted in counter
+    uint64_t last_progress = now_us();
+    size_t last = atomic_load(counter);
+    while (atomic_load(counter) < total) {
+        usleep(100);
+        if (atomic_load(counter) != last) {
+            last = atomic_load(counter);
+            last_progress = now_us();
+        } else if (now_us() - last_progress > STALL_TIMEOUT_MS * 1000) {
+            ESP_LOGE(TAG, "Purge test stalled at %zu bytes", last);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_purge(bench_t *bench)
+{
+    // Send stale data, and once it is being echoed, purge both directions. Then send fresh data, and
+    // measure the time from the purge request to the first fresh byte, and how much stale data was still
+    // delivered after the reply: what the server couldn't drop (its socket buffer, or data it was already
+    // sending), and what the client had received before the reply but not yet delivered.
+    const bench_config_t *config = bench->config;
+    uint8_t *block = malloc(config->chunk > PURGE_FRESH_SIZE ? config->chunk : PURGE_FRESH_SIZE);
+    atomic_store(&bench->purge_replied, false);
+    atomic_store(&bench->stale_before, 0);
+    atomic_store(&bench->stale_after, 0);
+    atomic_store(&bench->fresh, 0);
+    atomic_store(&bench->first_fresh_us, 0);
+    atomic_store(&bench->purging, true);
+    pthread_t pull_thread;
+    if (config->pull) {
+        pthread_create(&pull_thread, NULL, purge_pull_fn, bench);
+    }
+
+    int res = 0;
+    memset(block, PURGE_STALE, config->chunk);
+    for (size_t sent = 0; sent < config->purge_bytes && res == 0;) {
+        size_t len = config->purge_bytes - sent < config->chunk ? config->purge_bytes - sent : config->chunk;
+        res = rfc2217_client_send(bench->client, block, len);
+        sent += len;
+    }
+    if (res == 0) {
+        res = wait_purge(&bench->stale_before, 1);
+    }
+    uint64_t request_us = now_us();
+    uint64_t reply_us = 0;
+    if (res == 0) {
+        res = rfc2217_client_purge(bench->client, RFC2217_PURGE_BOTH);
+        reply_us = now_us();
+        atomic_store(&bench->purge_replied, true);
+    }
+    memset(block, PURGE_FRESH, PURGE_FRESH_SIZE);
+    if (res == 0) {
+        res = rfc2217_client_send(bench->client, block, PURGE_FRESH_SIZE);
+    }
+    if (res == 0) {
+        res = wait_purge(&bench->fresh, PURGE_FRESH_SIZE);
+    }
+    atomic_store(&bench->purging, false);
+    if (config->pull) {
+        pthread_join(pull_thread, NULL);
+    }
+    free(block);
+    if (res != 0) {
+        ESP_LOGE(TAG, "Purge test failed");
+        return -1;
+    }
+    size_t stale_before = atomic_load(&bench->stale_before);
+    size_t stale_after = atomic_load(&bench->stale_after);
+    printf("Purge: %zu stale bytes sent, %zu received before the reply, %zu delivered after it, %zu dropped; "
+           "reply after %" PRIu64 " us, first fresh byte after %" PRIu64 " us\n", config->purge_bytes, stale_before,
+           stale_after, config->purge_bytes - stale_before - stale_after, reply_us - request_us,
+           atomic_load(&bench->first_fresh_us) - request_us);
+    return 0;
+}
+
+static void *pull_fn(void *ctx)
+{
+    bench_t *bench = (bench_t *) ctx;
+    uint8_t buf[16384];
+    while (atomic_load(&bench->received) < bench->config->bytes && !atomic_load(&bench->load_done)) {
+        int len = rfc2217_client_recv(bench->client, buf, sizeof(buf), 100);
+        if (len < 0) {
+            break;
+        }
+        check_received(bench, buf, len);
+    }
+    return NULL;
+}
+
+static int run_echo(bench_t *bench)
+{
+    const bench_config_t *config = bench->config;
+    atomic_store(&bench->received, 0);
+    atomic_store(&bench->load_done, false);
+    pthread_t pull_thread;
+    if (config->pull) {
+        pthread_create(&pull_thread, NULL, pull_fn, bench);
+    }
+    load_control_t lc = {
+        .bench = bench,
+        .max_samples = config->control_rounds,
+    };
+    lc.samples = calloc(lc.max_samples + 1, sizeof(uint64_t));
+    pthread_t control_thread;
+    pthread_create(&control_thread, NULL, control_under_load_fn, &lc);
+
+    uint64_t start = now_us();
+    int res = 0;
+    for (size_t sent = 0; sent < config->bytes;) {
+        size_t len = config->bytes - sent < config->chunk ? config->bytes - sent : config->chunk;
+        if (rfc2217_client_send(bench->client, bench->pattern + sent % PATTERN_SIZE, len) != 0) {
+            ESP_LOGE(TAG, "Send failed");
+            res = -1;
+            break;
+        }
+        sent += len;
+    }
+    uint64_t send_done = now_us();
+    size_t last = 0;
+    uint64_t last_progress = send_done;
+    while (res == 0 && atomic_load(&bench->received) < config->bytes) {
+        usleep(1000);
+        size_t received = atomic_load(&bench->received);
+        if (received != last) {
+            last = received;
+            last_progress = now_us();
+        } else if (now_us() - last_progress > STALL_TIMEOUT_MS * 1000) {
+            ESP_LOGE(TAG, "Echo stalled at %zu bytes", received);
+            res = -1;
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+    atomic_store(&bench->load_done, true);
+    pthread_join(control_thread, NULL);
+    if (config->pull) {
+        pthread_join(pull_thread, NULL);
+    }
+
+    printf("Echo: %zu bytes in %.3f s, %.1f MB/s (sending took %.3f s)%s\n", atomic_load(&bench->received),
+           elapsed / 1e6, atomic_load(&bench->received) / (double) elapsed, (send_done - start) / 1e6,
+           atomic_load(&bench->mismatch) ? ", DATA MISMATCH" : "");
+    if (config->sim_baudrate) {
+        // 10 bits per character with 8N1
+        printf("Line utilization: %.1f%% of %" PRIu32 " baud\n",
+               atomic_load(&bench->received) * 10 * 100.0 / config->sim_baudrate / (elapsed / 1e6), config->sim_baudrate);
+    }
+    report_latency("SET_CONTROL latency during echo", lc.samples, lc.count);
+    free(lc.samples);
+    if (atomic_load(&bench->mismatch)) {
+        res = -1;
+    }
+    return res;
+}
+
+static int run_bench(const bench_config_t *config)
+{
+    bench_t bench = {
+        .config = config,
+    };
+    pthread_mutex_init(&bench.frame_mutex, NULL);
+    pthread_cond_init(&bench.frame_cond, NULL);
+    make_pattern(&bench);
+    rfc2217_client_config_t client_config = {
+        .ctx = &bench,
+        .on_data_received = config->pull ? NULL : client_on_data,
+        .rx_buffer_size = 16384,
+        .tx_buffer_size = 16384,
+        .task_core_id = RFC2217_NO_AFFINITY,
+    };
+    if (rfc2217_client_create(&client_config, &bench.client) != 0) {
+        ESP_LOGE(TAG, "Failed to create the client");
+        return -1;
+    }
+    const char *host = config->target_host ? config->target_host : "localhost";
+    uint64_t start = now_us();
+    if (rfc2217_client_connect(bench.client, host, config->target_port) != 0) {
+        rfc2217_client_destroy(bench.client);
+        free(bench.pattern);
+        return -1;
+    }
+    printf("Connected to %s:%u in %" PRIu64 " us\n", host, config->target_port, now_us() - start);
+
+    int res = -1;
+    const rfc2217_line_config_t line = {
+        .baudrate = config->sim_baudrate ? config->sim_baudrate : 115200,
+        .datasize = 8,
+        .parity = RFC2217_PARITY_NONE,
+        .stopbits = RFC2217_STOPBITS_1,
+    };
+    rfc2217_line_config_t actual;
+    start = now_us();
+    if (rfc2217_client_set_line_config(bench.client, &line, &actual) != 0) {
+        goto done;
+    }
+    printf("Line settings: %" PRIu32 " %u%c%s in %" PRIu64 " us\n", actual.baudrate, (unsigned) actual.datasize,
+           "?NOEMS"[actual.parity <= RFC2217_PARITY_SPACE ? actual.parity : 0],
+           actual.stopbits == RFC2217_STOPBITS_2 ? "2" : actual.stopbits == RFC2217_STOPBITS_1_5 ? "1.5" : "1", now_us() - start);
+
+    uint64_t *samples = calloc(config->control_rounds + 1, sizeof(uint64_t));
+    size_t count = measure_control(&bench, samples, config->control_rounds, NULL);
+    report_latency("SET_CONTROL latency, idle", samples, count);
+    free(samples);
+    if (count < config->control_rounds) {
+        goto done;
+    }
+    if (s_sim && run_reset_sequence(&bench) != 0) {
+        goto done;
+    }
+
+    if (config->bytes > 0) {
+        res = run_echo(&bench);
+    } else {
+        res = 0;
+    }
+    if (res == 0 && config->frames > 0) {
+        res = run_frames(&bench);
+    }
+    if (res == 0 && config->purge_bytes > 0) {
+        res = run_purge(&bench);
+    }
+    if (res == 0 && s_sim) {
+        res = run_baud_switch(&bench);
+    }
+
+done:
+    rfc2217_client_destroy(bench.client);
+    free(bench.pattern);
+    pthread_cond_destroy(&bench.frame_cond);
+    pthread_mutex_destroy(&bench.frame_mutex);
+    return res;
+}
+
+static int connect_restarted(const bench_config_t *config, rfc2217_client_t *out_client, uint64_t *ready_us)
+{
+    // connect to the server just started, retrying until it listens, and check that it replies
+    rfc2217_client_config_t client_config = {
+        .task_core_id = RFC2217_NO_AFFINITY,
+    };
+    if (rfc2217_client_create(&client_config, out_client) != 0) {
+        return -1;
+    }
+    uint64_t start = now_us();
+    while (rfc2217_client_connect(*out_client, "localhost", config->target_port) != 0) {
+        if (now_us() - start > RESTART_TIMEOUT_US) {
+            ESP_LOGE(TAG, "Couldn't connect to the restarted server");
+            rfc2217_client_destroy(*out_client);
+            return -1;
+        }
+        usleep(1000);
+    }
+    if (rfc2217_client_set_control(*out_client, RFC2217_CONTROL_SET_DTR, NULL) != 0) {
+        ESP_LOGE(TAG, "No reply from the restarted server");
+        rfc2217_client_destroy(*out_client);
+        return -1;
+    }
+    *ready_us = now_us() - start;
+    return 0;
+}
+
+static int run_stop(const bench_config_t *config)
+{
+    // Stop the in-process server while it is idle, and while a client is connected, and start it again
+    // right away each time; a new client must be served after each restart.
+    uint64_t max_idle_us = 0;
+    uint64_t max_client_us = 0;
+    uint64_t max_ready_us = 0;
+    int res = 0;
+    for (unsigned i = 0; i < config->stop_rounds && res == 0; i++) {
+        for (int with_client = 0; with_client < 2 && res == 0; with_client++) {
+            rfc2217_client_t client = NULL;
+            uint64_t ready_us;
+            if (with_client && connect_restarted(config, &client, &ready_us) != 0) {
+                res = -1;
+                break;
+            }
+            uint64_t start = now_us();
+            rfc2217_server_stop(s_server);
+            uint64_t elapsed = now_us() - start;
+            uint64_t *max_us = with_client ? &max_client_us : &max_idle_us;
+            *max_us = elapsed > *max_us ? elapsed : *max_us;
+            if (client) {
+                rfc2217_client_destroy(client);
+            }
+            if (rfc2217_server_start(s_server) != 0) {
+                ESP_LOGE(TAG, "Failed to restart the server");
+                res = -1;
+                break;
+            }
+            if (connect_restarted(config, &client, &ready_us) != 0) {
+                res = -1;
+                break;
+            }
+            rfc2217_client_destroy(client);
+            max_ready_us = ready_us > max_ready_us ? ready_us : max_ready_us;
+        }
+    }
+    bool pass = res == 0 && max_idle_us <= STOP_BOUND_US && max_client_us <= STOP_BOUND_US;
+    printf("Stop: %u rounds, max %" PRIu64 " us idle, %" PRIu64 " us with a client (bound %d us); "
+           "restarted and serving a client in max %" PRIu64 " us: %s\n", config->stop_rounds, max_idle_us,
+           max_client_us, STOP_BOUND_US, max_ready_us, pass ? "PASS" : "FAIL");
+    return pass ? 0 : -1;
+}
+
+static unsigned env_unsigned(const char *name, unsigned default_value)
+{
+    const char *value = getenv(name);
+    return (value && *value) ? (unsigned) strtoul(value, NULL, 0) : default_value;
+}
+
+static void report_sim_stats(void)
+{
+    sim_serial_stats_t stats;
+    sim_serial_get_stats(s_sim, &stats);
+    printf("Serial port: sent %" PRIu64 ", received %" PRIu64 " bytes, %" PRIu32 " overruns (%" PRIu64 " bytes lost), "
+           "max RX FIFO use %" PRIu32 ", max RX delay %" PRIu64 " us, %" PRIu32 " line changes, %" PRIu32 " breaks\n",
+           stats.tx_bytes, stats.rx_bytes, stats.overruns, stats.overrun_bytes, stats.max_rx_fifo_used,
+           stats.max_rx_delay_us, stats.line_changes, stats.breaks);
+}
+
+static void report_callback_stats(void)
+{
+    static const char *const names[RFC2217_CALLBACK_COUNT] = {
+        "on_data_received", "on_baudrate", "on_control", "on_purge", "on_line_state"
+    };
+    for (int i = 0; i < RFC2217_CALLBACK_COUNT; i++) {
+        rfc2217_callback_stats_t stats;
+        if (rfc2217_server_get_callback_stats(s_server, (rfc2217_callback_t) i, &stats) != 0 || stats.calls == 0) {
+            continue;
+        }
+        printf("Server %s (us, %" PRIu32 " calls): mean %" PRIu32 ", median <= %" PRIu32 ", p99 <= %" PRIu32 ", max %" PRIu32 "\n",
+               names[i], stats.calls, stats.mean_us, stats.p50_us, stats.p99_us, stats.max_us);
+    }
+}
+
+static int parse_target(const char *target, char *host, size_t host_size, unsigned *port)
+{
+    const char *colon = strrchr(target, ':');
+    if (!colon || colon == target || (size_t)(colon - target) >= host_size) {
+        ESP_LOGE(TAG, "BENCH_TARGET must be <host>:<port>");
+        return -1;
+    }
+    memcpy(host, target, colon - target);
+    host[colon - target] = '\0';
+    *port = (unsigned) strtoul(colon + 1, NULL, 10);
+    return 0;
+}
+
+void app_main(void)
+{
+    static char target_host[64];
+    bench_config_t config = {
+        .target_port = DEFAULT_PORT,
+        .bytes = (size_t) env_unsigned("BENCH_MB", 64) * 1024 * 1024,
+        .chunk = env_unsigned("BENCH_CHUNK", 16384),
+        .control_rounds = env_unsigned("BENCH_CONTROL_ROUNDS", 1000),
+        .pull = env_unsigned("BENCH_PULL", 0) != 0,
+        .sim_baudrate = env_unsigned("BENCH_SIM_BAUD", 0),
+        .sim_drain = env_unsigned("BENCH_SIM_DRAIN", 1) != 0,
+        .frames = env_unsigned("BENCH_FRAMES", 200),
+        .frame_size = env_unsigned("BENCH_FRAME_SIZE", 64),
+        .tx_queue_size = env_unsigned("BENCH_TX_QUEUE", 0),
+        .rx_queue_size = env_unsigned("BENCH_RX_QUEUE", 0),
+        .flush = env_unsigned("BENCH_FLUSH", 0) != 0,
+        .purge_bytes = (size_t) env_unsigned("BENCH_PURGE_KB", 256) * 1024,
+        .stop_rounds = env_unsigned("BENCH_STOP_ROUNDS", 5),
+    };
+    const char *data = getenv("BENCH_DATA");
+    const char *target = getenv("BENCH_TARGET");
+
+    // sockets closed by the other side are reported by send() returning an error
+    signal(SIGPIPE, SIG_IGN);
+
+    int res = -1;
+    pthread_t dispatch_thread;
+    bool dispatching = false;
+    if (data && strcmp(data, "binary") == 0) {
+        config.binary = true;
+    }
+    if (config.chunk == 0) {
+        config.chunk = 16384;
+    }
+    if (config.frame_size < 3 || config.frame_size > PATTERN_SIZE) {
+        config.frame_size = 64;
+    }
+    if (config.flush && config.tx_queue_size == 0) {
+        // flushing on delimiters needs the TX queue
+        config.tx_queue_size = 16384;
+    }
+    if (getenv("BENCH_KB")) {
+        config.bytes = (size_t) env_unsigned("BENCH_KB", 0) * 1024;
+    } else if (config.sim_baudrate && !getenv("BENCH_MB")) {
+        // about 2 seconds of data at the line rate
+        config.bytes = config.sim_baudrate / 5;
+    }
+    if (config.sim_baudrate && !getenv("BENCH_PURGE_KB")) {
+        // about 0.2 seconds of data at the line rate
+        config.purge_bytes = config.sim_baudrate / 50;
+    }
+    if (target) {
+        if (parse_target(target, target_host, sizeof(target_host), &config.target_port) != 0) {
+            goto done;
+        }
+        config.target_host = target_host;
+        config.sim_baudrate = 0;
+    } else {
+        if (config.sim_baudrate) {
+            sim_serial_config_t sim_config = {
+                .on_rx = sim_on_rx,
+                .on_event = sim_on_event,
+                .baudrate = config.sim_baudrate,
+                .tx_fifo_size = env_unsigned("BENCH_SIM_FIFO", 0),
+                .rx_fifo_size = env_unsigned("BENCH_SIM_FIFO", 0),
+                .rx_latency_us = env_unsigned("BENCH_SIM_LATENCY_US", 0),
+                .rx_jitter_us = env_unsigned("BENCH_SIM_JITTER_US", 0),
+            };
+            if (sim_serial_create(&sim_config, &s_sim) != 0) {
+                ESP_LOGE(TAG, "Failed to create the simulated serial port");
+                goto done;
+            }
+        }
+        rfc2217_server_config_t server_config = {
+            .on_data_received = server_on_data,
+            .on_baudrate = server_on_baudrate,
+            .on_control = server_on_control,
+            .on_purge = server_on_purge,
+            .on_drain = (s_sim && config.sim_drain) ? server_on_drain : NULL,
+            .port = DEFAULT_PORT,
+            .task_core_id = RFC2217_NO_AFFINITY,
+            .tx_queue_size = config.tx_queue_size,
+            .tx_task_core_id = RFC2217_NO_AFFINITY,
+            .rx_queue_size = config.rx_queue_size,
+            .flush_delimiters = {SLIP_END},
+            .flush_delimiter_count = config.flush ? 1 : 0,
+        };
+        if (rfc2217_server_create(&server_config, &s_server) != 0 || rfc2217_server_start(s_server) != 0) {
+            ESP_LOGE(TAG, "Failed to start the server");
+            goto done;
+        }
+        if (config.rx_queue_size) {
+            dispatching = pthread_create(&dispatch_thread, NULL, server_dispatch_fn, NULL) == 0;
+        }
+        usleep(100000);     // let the server thread start listening
+    }
+    printf("Data: %zu bytes of %s data, in writes of %zu bytes, %s\n", config.bytes, config.binary ? "binary" : "text",
+           config.chunk, config.pull ? "read with rfc2217_client_recv" : "received in on_data_received");
+    if (s_sim) {
+        printf("Serial port: simulated, %" PRIu32 " baud, with a loopback plug\n", config.sim_baudrate);
+    }
+    if (dispatching) {
+        printf("Server: data read with rfc2217_server_read from a %zu byte queue\n", config.rx_queue_size);
+    }
+    res = run_bench(&config);
+    if (res == 0 && s_server && config.stop_rounds > 0) {
+        res = run_stop(&config);
+    }
+    if (s_sim) {
+        // the server and the port call each other: stop the server first, then the port
+        rfc2217_server_stop(s_server);
+    }
+    if (dispatching) {
+        atomic_store(&s_dispatch_stop, true);
+        pthread_join(dispatch_thread, NULL);
+    }
+    if (s_sim) {
+        report_sim_stats();
+        sim_serial_destroy(s_sim);
+    }
+    if (s_server) {
+        report_callback_stats();
+        rfc2217_server_destroy(s_server);
+    }
+
+done:
+    fflush(stdout);
+    exit(res == 0 ? 0 : 1);
+}
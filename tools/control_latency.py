@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+# Measure how long the server takes to acknowledge SET_CONTROL requests.
+#
+# Connects as a minimal RFC2217 client, reads everything the server sends as fast as possible,
+# and toggles DTR a number of times, measuring the time until the server's SET_CONTROL reply
+# arrives. To measure the latency under saturated server-to-client traffic, run it against the
+# loopback example built with CONFIG_EXAMPLE_LOOPBACK_FLOOD_BLOCK_SIZE set, so that the device
+# sends data continuously while the requests are made.
+#
+# A raw socket client is used instead of pySerial, because pySerial parses the received data
+# in Python and can't keep up with a saturated link.
+#
+# On a fast link, most of the data in flight waits in the client's receive buffer, and the reply
+# waits behind it. Use --rcvbuf to limit it, e.g. to the TCP window of lwIP (5744 bytes by default).
+#
+# Usage: tools/control_latency.py [--count N] [--rcvbuf BYTES] rfc2217://<host>:<port>
+
+import argparse
+import socket
+import statistics
+import time
+
+IAC = 0xff
+SB = 0xfa
+SE = 0xf0
+WILL = 0xfb
+DO = 0xfd
+COM_PORT_OPTION = 0x2c
+SET_CONTROL = 0x05
+SERVER_SET_CONTROL = 0x69
+SET_DTR = 8
+CLEAR_DTR = 9
+
+REPLY = bytes([IAC, SB, COM_PORT_OPTION, SERVER_SET_CONTROL])
+
+
+def find_reply(data):
+    # Return the end of the first SET_CONTROL reply in data, or -1. An IAC which is preceded by
+    # an odd number of IACs is an escaped data byte, not the start of a command.
+    pos = data.find(REPLY)
+    while pos >= 0:
+        start = pos
+        while start > 0 and data[start - 1] == IAC:
+            start -= 1
+        if (pos - start) % 2 == 0 and len(data) >= pos + len(REPLY) + 3:
+            return pos + len(REPLY) + 3
+        pos = data.find(REPLY, pos + 1)
+    return -1
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure SET_CONTROL acknowledgement time')
+    parser.add_argument('url', help='rfc2217://<host>:<port>')
+    parser.add_argument('--count', type=int, default=100, help='number of SET_CONTROL requests')
+    parser.add_argument('--rcvbuf', type=int, default=0,
+                        help='socket receive buffer size, limits the data in flight (default: OS default)')
+    args = parser.parse_args()
+
+    host, port = args.url.split('://', 1)[-1].rsplit(':', 1)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    if args.rcvbuf:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, args.rcvbuf)
+    sock.connect((host, int(port)))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.sendall(bytes([IAC, WILL, COM_PORT_OPTION, IAC, DO, COM_PORT_OPTION]))
+    received = 0
+
+    def wait_reply(timeout):
+        nonlocal received
+        deadline = time.monotonic() + timeout
+        tail = b''
+        while time.monotonic() < deadline:
+            data = sock.recv(65536)
+            if not data:
+                raise RuntimeError('Connection closed')
+            received += len(data)
+            # keep a few bytes from the previous block, the reply can be split between blocks
+            data = tail + data
+            if find_reply(data) >= 0:
+                return True
+            tail = data[-8:]
+        return False
+
+    # let the negotiation finish and the data flow start before measuring
+    sock.settimeout(0.1)
+    deadline = time.monotonic() + 1
+    while time.monotonic() < deadline:
+        try:
+            sock.recv(65536)
+        except socket.timeout:
+            pass
+    sock.settimeout(10)
+
+    samples = []
+    received = 0
+    start = time.monotonic()
+    for i in range(args.count):
+        t = time.monotonic()
+        sock.sendall(bytes([IAC, SB, COM_PORT_OPTION, SET_CONTROL, SET_DTR if i % 2 else CLEAR_DTR, IAC, SE]))
+        if not wait_reply(10):
+            raise RuntimeError('No reply to SET_CONTROL')
+        samples.append((time.monotonic() - t) * 1000)
+    elapsed = time.monotonic() - start
+    sock.close()
+
+    samples.sort()
+    print('SET_CONTROL acknowledged in: min {:.2f} ms, median {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms'.format(
+        samples[0], statistics.median(samples), samples[min(len(samples) - 1, int(len(samples) * 0.99))], samples[-1]))
+    print('Received {} bytes while measuring ({:.0f} kB/s)'.format(received, received / elapsed / 1000))
+
+
+if __name__ == '__main__':
+    main()
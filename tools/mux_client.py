@@ -0,0 +1,305 @@
+#!/usr/bin/env python
+# Reference client of the multi-port mux (rfc2217_mux.h), and a comparison of the mux with one
+# connection per port.
+#
+# Opens N ports twice: first with one RFC2217 connection per port, on the listeners of the ports
+# (<host>:<port + 1> to <host>:<port + N>), then as N channels of one mux connection (<host>:<port>).
+# Each port is ready when the server has replied to SET_BAUDRATE. The time until all ports are ready
+# is printed for both. Then the same block of data is sent to every channel at once, and the time
+# until all of it has come back is printed, with the spread of the completion times of the channels,
+# which shows how evenly the server shares the connection between them. The ports must echo the
+# data back, like the loopback example.
+#
+# Usage: tools/mux_client.py [--ports N] [--size BYTES] <host>:<port>
+
+import argparse
+import socket
+import struct
+import threading
+import time
+
+IAC = 0xff
+SB = 0xfa
+SE = 0xf0
+WILL = 0xfb
+DO = 0xfd
+COM_PORT_OPTION = 0x2c
+SET_BAUDRATE = 0x01
+SERVER_SET_BAUDRATE = 0x65
+
+MUX_OPTION = 0xc8
+MUX_VERSION = 1
+MUX_CONTROL_CHANNEL = 0xff
+MUX_CMD_OPEN = 1
+MUX_CMD_CLOSE = 2
+
+
+class TelnetStream:
+    """Separates the data from the telnet commands in the byte stream of one port"""
+
+    def __init__(self):
+        self.data = bytearray()
+        self.subnegotiations = []
+        self.state = 'data'
+        self.sb = bytearray()
+        self.changed = threading.Condition()
+        self.target = 0         # done_at is set when this much data has arrived
+        self.done_at = None
+
+    def feed(self, chunk):
+        with self.changed:
+            pos = 0
+            while pos < len(chunk):
+                if self.state == 'data':
+                    # data up to the next IAC in one piece
+                    end = chunk.find(IAC, pos)
+                    if end < 0:
+                        end = len(chunk)
+                    self.data += chunk[pos:end]
+                    pos = end
+                    if pos < len(chunk):
+                        self.state = 'iac'
+                        pos += 1
+                    continue
+                c = chunk[pos]
+                pos += 1
+                if self.state == 'iac':
+                    if c == IAC:
+                        self.data.append(c)
+                        self.state = 'data'
+                    elif c == SB:
+                        self.sb = bytearray()
+                        self.state = 'sb'
+                    elif c >= WILL:
+                        self.state = 'option'
+                    else:
+                        self.state = 'data'
+                elif self.state == 'option':
+                    self.state = 'data'
+                elif self.state == 'sb':
+                    if c == IAC:
+                        self.state = 'sb_iac'
+                    else:
+                        self.sb.append(c)
+                elif self.state == 'sb_iac':
+                    if c == SE:
+                        self.subnegotiations.append(bytes(self.sb))
+                        self.state = 'data'
+                    else:
+                        self.sb.append(c)
+                        self.state = 'sb'
+            if self.target and self.done_at is None and len(self.data) >= self.target:
+                self.done_at = time.monotonic()
+            self.changed.notify_all()
+
+    def wait(self, predicate, timeout=5.0):
+        with self.changed:
+            if not self.changed.wait_for(predicate, timeout):
+                raise RuntimeError('Timeout waiting for the server')
+
+
+def escape(data):
+    return data.replace(bytes([IAC]), bytes([IAC, IAC]))
+
+
+def set_baudrate_request(baudrate):
+    return bytes([IAC, SB, COM_PORT_OPTION, SET_BAUDRATE]) + escape(struct.pack('>I', baudrate)) + bytes([IAC, SE])
+
+
+def has_baudrate_reply(stream):
+    return any(sb[:2] == bytes([COM_PORT_OPTION, SERVER_SET_BAUDRATE]) for sb in stream.subnegotiations)
+
+
+class Port:
+    """One port on a connection of its own"""
+
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.stream = TelnetStream()
+        threading.Thread(target=self._reader, daemon=True).start()
+        self.sock.sendall(bytes([IAC, WILL, COM_PORT_OPTION, IAC, DO, COM_PORT_OPTION]))
+
+    def _reader(self):
+        while True:
+            try:
+                chunk = self.sock.recv(65536)
+            except OSError:
+                return
+            if not chunk:
+                return
+            self.stream.feed(chunk)
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def close(self):
+        # shutdown first: closing alone doesn't end the connection while the reader thread is in recv
+        self.sock.shutdown(socket.SHUT_RDWR)
+        self.sock.close()
+
+
+class MuxClient:
+    """All ports on one mux connection"""
+
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.send_lock = threading.Lock()
+        self.sock.sendall(bytes([IAC, SB, MUX_OPTION, MUX_VERSION, IAC, SE]))
+        reply = self._recv_exact(7)
+        if reply[:3] != bytes([IAC, SB, MUX_OPTION]) or reply[5:] != bytes([IAC, SE]):
+            raise RuntimeError('Server does not support the mux: %s' % reply.hex())
+        if reply[3] != MUX_VERSION:
+            raise RuntimeError('Server uses mux version %d' % reply[3])
+        self.channel_count = reply[4]
+        self.streams = [TelnetStream() for _ in range(self.channel_count)]
+        self.control = TelnetStream()     # only .data is used: the command replies
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    def _recv_exact(self, size):
+        data = b''
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                raise RuntimeError('Connection closed')
+            data += chunk
+        return data
+
+    def _reader(self):
+        buf = bytearray()
+        while True:
+            try:
+                chunk = self.sock.recv(65536)
+            except OSError:
+                return
+            if not chunk:
+                return
+            buf += chunk
+            pos = 0
+            while len(buf) - pos >= 3:
+                channel, length = buf[pos], (buf[pos + 1] << 8) | buf[pos + 2]
+                if len(buf) - pos < 3 + length:
+                    break
+                payload = bytes(buf[pos + 3:pos + 3 + length])
+                pos += 3 + length
+                if channel == MUX_CONTROL_CHANNEL:
+                    with self.control.changed:
+                        self.control.data += payload
+                        self.control.changed.notify_all()
+                elif channel < self.channel_count:
+                    self.streams[channel].feed(payload)
+            del buf[:pos]
+
+    def send(self, channel, data):
+        # frames of at most 64 KiB - 1, sent in one piece so that other threads don't split them
+        frames = bytearray()
+        for pos in range(0, len(data), 0xffff):
+            piece = data[pos:pos + 0xffff]
+            frames += struct.pack('>BH', channel, len(piece)) + piece
+        with self.send_lock:
+            self.sock.sendall(frames)
+
+    def replies(self):
+        # command replies received so far: OPEN <channel> <status> or CLOSE <channel>
+        data = bytes(self.control.data)
+        result = []
+        pos = 0
+        while pos + 2 <= len(data):
+            size = 3 if data[pos] == MUX_CMD_OPEN else 2
+            if pos + size > len(data):
+                break
+            result.append(data[pos:pos + size])
+            pos += size
+        return result
+
+    def command_all(self, cmd, channels):
+        # commands for all channels in one frame, waits for all replies
+        with self.control.changed:
+            self.control.data.clear()
+        self.send(MUX_CONTROL_CHANNEL, b''.join(bytes([cmd, ch]) for ch in channels))
+        self.control.wait(lambda: len(self.replies()) >= len(channels))
+        for reply in self.replies():
+            if reply[0] == MUX_CMD_OPEN and reply[2] != 0:
+                raise RuntimeError('Channel %d not opened, status %d' % (reply[1], reply[2]))
+
+    def close(self):
+        # shutdown first: closing alone doesn't end the connection while the reader thread is in recv
+        self.sock.shutdown(socket.SHUT_RDWR)
+        self.sock.close()
+
+
+def echo_test(send_fns, streams, size):
+    # Returns the times until the last and the first port has echoed all the data
+    block = bytes(range(256)) * (size // 256)
+    for stream in streams:
+        stream.target = len(stream.data) + len(block)
+    start = time.monotonic()
+    # in turns, so that all ports have data in flight at the same time
+    for pos in range(0, len(block), 4096):
+        piece = escape(block[pos:pos + 4096])
+        for send in send_fns:
+            send(piece)
+    for stream in streams:
+        stream.wait(lambda: stream.done_at is not None, timeout=60.0)
+        if bytes(stream.data[-len(block):]) != block:
+            raise RuntimeError('Echoed data differs')
+    done = [stream.done_at - start for stream in streams]
+    return max(done), min(done)
+
+
+def run_separate(host, port, count, size):
+    start = time.monotonic()
+    ports = [Port(host, port + 1 + i) for i in range(count)]
+    for p in ports:
+        p.send(set_baudrate_request(115200))
+    for p in ports:
+        p.stream.wait(lambda: has_baudrate_reply(p.stream))
+    setup = time.monotonic() - start
+    total, first = echo_test([p.send for p in ports], [p.stream for p in ports], size)
+    for p in ports:
+        p.close()
+    # a channel can't be opened until the server has noticed that the client of the port is gone
+    time.sleep(0.2)
+    return setup, total, first
+
+
+def run_mux(host, port, count, size):
+    start = time.monotonic()
+    mux = MuxClient(host, port)
+    if mux.channel_count < count:
+        raise RuntimeError('Mux has %d channels' % mux.channel_count)
+    channels = list(range(count))
+    mux.command_all(MUX_CMD_OPEN, channels)
+    request = bytes([IAC, WILL, COM_PORT_OPTION, IAC, DO, COM_PORT_OPTION]) + set_baudrate_request(115200)
+    for ch in channels:
+        mux.send(ch, request)
+    for ch in channels:
+        mux.streams[ch].wait(lambda: has_baudrate_reply(mux.streams[ch]))
+    setup = time.monotonic() - start
+    total, first = echo_test([lambda d, ch=ch: mux.send(ch, d) for ch in channels],
+                             [mux.streams[ch] for ch in channels], size)
+    mux.command_all(MUX_CMD_CLOSE, channels)
+    mux.close()
+    return setup, total, first
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare the multi-port mux with one connection per port')
+    parser.add_argument('address', help='<host>:<mux port>; port + 1 ... port + N are the listeners of the ports')
+    parser.add_argument('--ports', type=int, default=8, help='number of ports')
+    parser.add_argument('--size', type=int, default=65536, help='bytes echoed on each port')
+    args = parser.parse_args()
+
+    host, port = args.address.rsplit(':', 1)
+    port = int(port)
+    for name, fn in (('separate connections', run_separate), ('mux connection', run_mux)):
+        setup, total, first = fn(host, port, args.ports, args.size)
+        rate = args.ports * args.size / total / 1e6
+        print('%-21s %3d ports ready in %7.1f ms, echo of %d bytes per port in %7.1f ms (%.1f MB/s), '
+              'first port done after %7.1f ms' % (name, args.ports, setup * 1e3, args.size, total * 1e3,
+                                                  rate, first * 1e3))
+
+
+if __name__ == '__main__':
+    main()
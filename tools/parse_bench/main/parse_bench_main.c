@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "esp_log.h"
+#include "rfc2217_server.h"
+#include "rfc2217_server_test.h"
+
+static const char *TAG = "parse_bench";
+
+// input of each scenario, fed in pieces of the size of a TCP segment
+#define BENCH_BYTES (16 * 1024 * 1024)
+#define SEGMENT_SIZE 1460
+// bounds checked for every scenario, see README.md
+#define MAX_NS_PER_BYTE 100
+#define MIN_BYTES_PER_SEND 32
+#define MIN_BYTES_PER_ON_DATA 32    // plus one on_data_received call per telnet command
+
+#define LONG_SUBNEGOTIATION_SIZE 200
+#define UNKNOWN_OPTION 0x99U
+
+#define T_SE 0xf0U
+#define T_NOP 0xf1U
+#define T_SB 0xfaU
+#define T_WILL 0xfbU
+#define T_WONT 0xfcU
+#define T_DO 0xfdU
+#define T_IAC 0xffU
+#define T_COM_PORT_OPTION 0x2cU
+#define T_SET_BAUDRATE 0x01U
+#define T_SET_PARITY 0x03U
+#define T_SERVER_SET_PARITY 0x67U
+
+// byte of the data, and of the contents of subnegotiations which must not reach on_data_received
+#define DATA_BYTE 'd'
+#define SKIPPED_BYTE 'x'
+
+typedef struct {
+    const char *name;
+    uint8_t pattern[LONG_SUBNEGOTIATION_SIZE + 64];
+    size_t pattern_size;
+    uint8_t data_byte;          // the bytes passed to on_data_received, after unescaping
+    size_t data_per_pattern;    // number of them in the pattern
+    size_t commands_per_pattern;    // telnet commands other than escaped IACs, SB and SE count as one each
+    size_t requests_per_pattern;
+    uint8_t reply[3];           // the start of the reply to a request
+    bool unterminated;          // the input is a single subnegotiation, closed at the end
+} scenario_t;
+
+typedef struct {
+    size_t received;            // bytes passed to on_data_received
+    size_t received_calls;
+    size_t leaked;              // SKIPPED_BYTE passed to on_data_received
+    size_t unexpected;          // other bytes which aren't data of the scenario
+    uint8_t data_byte;          // the data byte of the scenario
+    size_t sends;               // on_send calls
+    size_t sent_bytes;
+    size_t replies;             // replies to the requests of the scenario
+    uint8_t reply[3];           // the first bytes of a reply
+    uint64_t now_us;
+} bench_t;
+
+static uint64_t bench_now_us(void *ctx)
+{
+    return ((bench_t *) ctx)->now_us;
+}
+
+static void bench_sleep_us(void *ctx, uint64_t us)
+{
+    ((bench_t *) ctx)->now_us += us;
+}
+
+static void bench_on_send(void *ctx, const uint8_t *data, size_t len)
+{
+    bench_t *bench = (bench_t *) ctx;
+    bench->sends++;
+    bench->sent_bytes += len;
+    // control messages are sent in one piece
+    for (size_t i = 0; i + 2 < len; i++) {
+        if (data[i] == bench->reply[0] && data[i + 1] == bench->reply[1] && data[i + 2] == bench->reply[2]) {
+            bench->replies++;
+        }
+    }
+}
+
+static void on_data_received(void *ctx, const uint8_t *data, size_t len)
+{
+    bench_t *bench = (bench_t *) ctx;
+    bench->received += len;
+    bench->received_calls++;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == SKIPPED_BYTE) {
+            bench->leaked++;
+        } else if (data[i] != bench->data_byte) {
+            bench->unexpected++;
+        }
+    }
+}
+
+static uint64_t cpu_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void append(scenario_t *s, const uint8_t *bytes, size_t len)
+{
+    memcpy(s->pattern + s->pattern_size, bytes, len);
+    s->pattern_size += len;
+}
+
+static void fill(scenario_t *s, uint8_t c, size_t len)
+{
+    memset(s->pattern + s->pattern_size, c, len);
+    s->pattern_size += len;
+}
+
+static bool run(const scenario_t *s, double *ns_per_byte, double baseline)
+{
+    // baseline: ns per byte of plain data, 0 when measuring it
+    bench_t bench = {
+        .now_us = 1,
+        .data_byte = s->data_byte,
+    };
+    memcpy(bench.reply, s->reply, sizeof(bench.reply));
+    rfc2217_test_session_t session = {
+        .ctx = &bench,
+        .now_us = bench_now_us,
+        .sleep_us = bench_sleep_us,
+        .on_send = bench_on_send,
+    };
+    rfc2217_server_config_t config = {
+        .ctx = &bench,
+        .on_data_received = on_data_received,
+    };
+    rfc2217_server_t server;
+    if (rfc2217_server_create(&config, &server) != 0 || rfc2217_server_test_open(server, &session, false) != 0) {
+        ESP_LOGE(TAG, "Failed to open test session");
+        exit(1);
+    }
+    const uint8_t negotiation[] = {T_IAC, T_DO, T_COM_PORT_OPTION, T_IAC, T_WILL, T_COM_PORT_OPTION};
+    rfc2217_server_test_feed(server, negotiation, sizeof(negotiation));
+    bench.sends = 0;
+    bench.sent_bytes = 0;
+
+    // the input: the pattern repeated, cut into segments anywhere
+    static uint8_t input[BENCH_BYTES];
+    size_t patterns = BENCH_BYTES / s->pattern_size;
+    size_t size = patterns * s->pattern_size;
+    if (!s->unterminated) {
+        for (size_t i = 0; i < patterns; i++) {
+            memcpy(input + i * s->pattern_size, s->pattern, s->pattern_size);
+        }
+    } else {
+        // one subnegotiation as long as the input, then data
+        patterns = 1;
+        size = BENCH_BYTES;
+        memset(input, SKIPPED_BYTE, size);
+        memcpy(input, s->pattern, s->pattern_size);
+        size_t tail = s->data_per_pattern + 2;
+        input[size - tail] = T_IAC;
+        input[size - tail + 1] = T_SE;
+        memset(input + size - s->data_per_pattern, DATA_BYTE, s->data_per_pattern);
+    }
+
+    uint64_t start = cpu_time_ns();
+    for (size_t offset = 0; offset < size; offset += SEGMENT_SIZE) {
+        size_t len = size - offset < SEGMENT_SIZE ? size - offset : SEGMENT_SIZE;
+        rfc2217_server_test_feed(server, input + offset, len);
+    }
+    uint64_t elapsed = cpu_time_ns() - start;
+    rfc2217_server_test_close(server);
+    rfc2217_server_destroy(server);
+
+    size_t expected_data = patterns * s->data_per_pattern;
+    size_t expected_replies = patterns * s->requests_per_pattern;
+    size_t max_calls = patterns * s->commands_per_pattern + size / MIN_BYTES_PER_ON_DATA;
+    *ns_per_byte = (double) elapsed / size;
+    bool pass = bench.received == expected_data && bench.leaked == 0 && bench.unexpected == 0 &&
+                bench.replies == expected_replies && *ns_per_byte <= MAX_NS_PER_BYTE &&
+                bench.sends <= size / MIN_BYTES_PER_SEND && bench.received_calls <= max_calls;
+    if (baseline == 0) {
+        return pass;
+    }
+    printf("%-22s %5.1f ns/byte (%4.1fx data), %8zu of %8zu bytes delivered in %7zu calls, %7zu replies in %6zu sends",
+           s->name, *ns_per_byte, *ns_per_byte / baseline, bench.received, size, bench.received_calls,
+           bench.replies, bench.sends);
+    if (bench.leaked || bench.unexpected) {
+        printf(", %zu bytes of subnegotiations and %zu other bytes leaked into the data", bench.leaked, bench.unexpected);
+    }
+    printf(": %s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+void app_main(void)
+{
+    static scenario_t scenarios[7];
+    scenario_t *s = scenarios;
+
+    // plain data: the baseline, passed on in large runs
+    s->name = "text data";
+    s->data_byte = DATA_BYTE;
+    fill(s, DATA_BYTE, 64);
+    s->data_per_pattern = 64;
+    s++;
+
+    // binary data made only of IACs, each escaped
+    s->name = "escaped IAC data";
+    s->data_byte = T_IAC;
+    fill(s, T_IAC, 64);
+    s->data_per_pattern = 32;
+    s++;
+
+    // negotiation of an unknown option, each refused with a reply
+    s->name = "DO storm";
+    s->commands_per_pattern = 1;
+    s->requests_per_pattern = 1;
+    memcpy(s->reply, (const uint8_t[]) {T_IAC, T_WONT, UNKNOWN_OPTION}, 3);
+    append(s, (const uint8_t[]) {T_IAC, T_DO, UNKNOWN_OPTION}, 3);
+    s++;
+
+    // a telnet command after every data byte, each ending a run of data
+    s->name = "data and NOP";
+    s->data_byte = DATA_BYTE;
+    s->data_per_pattern = 1;
+    s->commands_per_pattern = 1;
+    append(s, (const uint8_t[]) {DATA_BYTE, T_IAC, T_NOP}, 3);
+    s++;
+
+    // COM-PORT-OPTION requests, each with a reply
+    s->name = "SET_PARITY storm";
+    s->commands_per_pattern = 2;
+    s->requests_per_pattern = 1;
+    memcpy(s->reply, (const uint8_t[]) {T_SB, T_COM_PORT_OPTION, T_SERVER_SET_PARITY}, 3);
+    append(s, (const uint8_t[]) {T_IAC, T_SB, T_COM_PORT_OPTION, T_SET_PARITY, 1, T_IAC, T_SE}, 7);
+    s++;
+
+    // subnegotiations longer than CONFIG_RFC2217_SERVER_SUBNEGOTIATION_MAX, with data between them
+    s->name = "long subnegotiations";
+    s->data_byte = DATA_BYTE;
+    append(s, (const uint8_t[]) {T_IAC, T_SB, T_COM_PORT_OPTION, T_SET_BAUDRATE}, 4);
+    fill(s, SKIPPED_BYTE, LONG_SUBNEGOTIATION_SIZE);
+    append(s, (const uint8_t[]) {T_IAC, T_SE}, 2);
+    fill(s, DATA_BYTE, 32);
+    s->data_per_pattern = 32;
+    s->commands_per_pattern = 2;
+    s++;
+
+    // a single subnegotiation over the whole input, then data
+    s->name = "endless subnegotiation";
+    s->data_byte = DATA_BYTE;
+    append(s, (const uint8_t[]) {T_IAC, T_SB, T_COM_PORT_OPTION, T_SET_BAUDRATE}, 4);
+    s->data_per_pattern = 1024;
+    s->commands_per_pattern = 2;
+    s->unterminated = true;
+    s++;
+
+    // warm up, then measure the baseline
+    double baseline;
+    run(&scenarios[0], &baseline, 0);
+    run(&scenarios[0], &baseline, 0);
+
+    bool pass = true;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        double ns_per_byte;
+        pass &= run(&scenarios[i], &ns_per_byte, baseline);
+    }
+    exit(pass ? 0 : 1);
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "capture.h"
+
+static const char *TAG = "capture";
+
+// maximum number of data bytes per line written by capture_write_record
+#define CAPTURE_MAX_RECORD_LEN 256
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int parse_line(char *line, capture_record_t *record)
+{
+    char *p = line;
+    char *end;
+    unsigned long long time_us = strtoull(p, &end, 10);
+    if (end == p || (*end != ' ' && *end != '\t')) {
+        return -1;
+    }
+    p = end;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == 'C') {
+        record->dir = CAPTURE_FROM_CLIENT;
+    } else if (*p == 'S') {
+        record->dir = CAPTURE_FROM_SERVER;
+    } else {
+        return -1;
+    }
+    p++;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    size_t hex_len = strcspn(p, " \t\r\n");
+    if (hex_len == 0 || hex_len % 2 != 0) {
+        return -1;
+    }
+    record->time_us = time_us;
+    record->len = hex_len / 2;
+    record->data = malloc(record->len);
+    if (!record->data) {
+        return -1;
+    }
+    for (size_t i = 0; i < record->len; i++) {
+        int hi = hex_digit(p[2 * i]);
+        int lo = hex_digit(p[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            free(record->data);
+            record->data = NULL;
+            return -1;
+        }
+        record->data[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+int capture_load(const char *path, capture_t *out_capture)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return -1;
+    }
+    capture_t capture = {};
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned line_num = 0;
+    int res = 0;
+    while (getline(&line, &line_size, f) >= 0) {
+        line_num++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+        if (capture.count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            capture_record_t *records = realloc(capture.records, new_capacity * sizeof(*records));
+            if (!records) {
+                ESP_LOGE(TAG, "Out of memory");
+                res = -1;
+                break;
+            }
+            capture.records = records;
+            capacity = new_capacity;
+        }
+        capture_record_t *record = &capture.records[capture.count];
+        if (parse_line(p, record) != 0) {
+            ESP_LOGE(TAG, "%s:%u: invalid record", path, line_num);
+            res = -1;
+            break;
+        }
+        if (capture.count > 0 && record->time_us < capture.records[capture.count - 1].time_us) {
+            ESP_LOGE(TAG, "%s:%u: timestamps must not decrease", path, line_num);
+            free(record->data);
+            res = -1;
+            break;
+        }
+        capture.count++;
+    }
+    free(line);
+    fclose(f);
+    if (res != 0) {
+        capture_free(&capture);
+        return -1;
+    }
+    *out_capture = capture;
+    return 0;
+}
+
+void capture_free(capture_t *capture)
+{
+    for (size_t i = 0; i < capture->count; i++) {
+        free(capture->records[i].data);
+    }
+    free(capture->records);
+    capture->records = NULL;
+    capture->count = 0;
+}
+
+void capture_write_record(FILE *f, uint64_t time_us, capture_dir_t dir, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t chunk = len < CAPTURE_MAX_RECORD_LEN ? len : CAPTURE_MAX_RECORD_LEN;
+        fprintf(f, "%" PRIu64 " %c ", time_us, dir == CAPTURE_FROM_CLIENT ? 'C' : 'S');
+        for (size_t i = 0; i < chunk; i++) {
+            fprintf(f, "%02x", data[i]);
+        }
+        fputc('\n', f);
+        data += chunk;
+        len -= chunk;
+    }
+}
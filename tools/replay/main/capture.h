@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Session capture file
+ *
+ * Text file, one record per line:
+ *
+ *     <microseconds since the connection was accepted> <C|S> <data as hex>
+ *
+ * C: data sent by the client to the server, S: data sent by the server to the client.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+
+typedef enum {
+    CAPTURE_FROM_CLIENT,
+    CAPTURE_FROM_SERVER,
+} capture_dir_t;
+
+typedef struct {
+    uint64_t time_us;
+    capture_dir_t dir;
+    uint8_t *data;
+    size_t len;
+} capture_record_t;
+
+typedef struct {
+    capture_record_t *records;
+    size_t count;
+} capture_t;
+
+/**
+ * @brief Load a capture file
+ * @return 0 on success, -1 on failure (the error is logged)
+ */
+int capture_load(const char *path, capture_t *out_capture);
+
+/**
+ * @brief Free the memory allocated by capture_load
+ */
+void capture_free(capture_t *capture);
+
+/**
+ * @brief Append a record to a capture file
+ *
+ * Long data is split into several records with the same timestamp.
+ */
+void capture_write_record(FILE *f, uint64_t time_us, capture_dir_t dir, const uint8_t *data, size_t len);
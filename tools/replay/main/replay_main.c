@@ -0,0 +1,740 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "esp_log.h"
+#include "rfc2217_server.h"
+#include "capture.h"
+
+static const char *TAG = "replay";
+
+// in-process servers listen on consecutive ports starting from this one
+#define DEFAULT_BASE_PORT 3333
+// a session ends when no expected reply arrived for this long after the last client record was sent
+#define TAIL_TIMEOUT_MS 2000
+// telnet commands longer than this are truncated for comparison
+#define CMD_MAX_LEN 64
+
+#define T_SE 0xf0U
+#define T_SB 0xfaU
+#define T_WILL 0xfbU
+#define T_DONT 0xfeU
+#define T_IAC 0xffU
+
+typedef enum {
+    CHECK_NONE,     // don't compare the server's responses
+    CHECK_CONTROL,  // compare telnet commands and subnegotiations sent by the server
+    CHECK_ALL,      // also compare the data sent by the server
+} check_mode_t;
+
+typedef struct {
+    const char *capture_path;
+    const char *target_host;    // NULL: start servers in this process
+    unsigned target_port;
+    bool original_timing;       // false: send the client records back to back
+    unsigned sessions;
+    unsigned parallel;
+    check_mode_t check;
+} replay_config_t;
+
+// telnet command sent by the server, as found in the capture
+typedef struct {
+    uint8_t bytes[CMD_MAX_LEN];
+    size_t len;
+    int64_t recorded_delay_us;  // time from sending the trigger record to receiving the command, in the capture
+    size_t trigger;             // index of the last client record sent before this command, SIZE_MAX if none
+} expected_cmd_t;
+
+typedef struct {
+    expected_cmd_t *cmds;
+    size_t cmd_count;
+    uint8_t *data;              // data sent by the server, telnet escaping removed
+    size_t data_len;
+} expected_t;
+
+typedef enum {
+    P_DATA,
+    P_IAC,
+    P_OPTION,
+    P_SB,
+    P_SB_IAC,
+} parser_state_t;
+
+typedef enum {
+    PARSE_NONE,
+    PARSE_DATA,
+    PARSE_CMD,
+} parse_result_t;
+
+typedef struct {
+    parser_state_t state;
+    uint8_t cmd[CMD_MAX_LEN];
+    size_t cmd_len;
+} telnet_parser_t;
+
+typedef struct {
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t duration_us;
+    size_t cmds_matched;
+    size_t cmds_mismatched;
+    size_t cmds_missing;
+    size_t data_mismatches;     // sessions in which the data didn't match
+    int64_t *deviations_us;     // actual - recorded reply delay, for each matched command with a trigger
+    size_t deviation_count;
+    size_t deviation_capacity;
+    unsigned failed_sessions;   // connection errors
+} results_t;
+
+typedef struct {
+    const replay_config_t *config;
+    const capture_t *capture;
+    const expected_t *expected;
+    unsigned index;
+    unsigned sessions;
+    rfc2217_server_t server;
+    pthread_t thread;
+    results_t results;
+} worker_t;
+
+// state shared by the sender and the receiver of one session
+typedef struct {
+    worker_t *worker;
+    int sock;
+    uint64_t start_us;
+    _Atomic uint64_t *send_time_us;     // per capture record, 0 until sent
+    atomic_size_t cmd_pos;
+    atomic_size_t data_pos;
+    atomic_bool data_mismatch;
+    _Atomic uint64_t last_progress_us;
+    uint64_t bytes_received;
+} session_t;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static parse_result_t parser_feed(telnet_parser_t *p, uint8_t c, uint8_t *out_data)
+{
+    switch (p->state) {
+    case P_DATA:
+        if (c == T_IAC) {
+            p->cmd[0] = c;
+            p->cmd_len = 1;
+            p->state = P_IAC;
+            return PARSE_NONE;
+        }
+        *out_data = c;
+        return PARSE_DATA;
+    case P_IAC:
+        if (c == T_IAC) {
+            p->state = P_DATA;
+            *out_data = c;
+            return PARSE_DATA;
+        }
+        p->cmd[p->cmd_len++] = c;
+        if (c >= T_WILL && c <= T_DONT) {
+            p->state = P_OPTION;
+            return PARSE_NONE;
+        }
+        if (c == T_SB) {
+            p->state = P_SB;
+            return PARSE_NONE;
+        }
+        p->state = P_DATA;
+        return PARSE_CMD;
+    case P_OPTION:
+        p->cmd[p->cmd_len++] = c;
+        p->state = P_DATA;
+        return PARSE_CMD;
+    case P_SB:
+        if (c == T_IAC) {
+            p->state = P_SB_IAC;
+        } else if (p->cmd_len < CMD_MAX_LEN - 2) {
+            p->cmd[p->cmd_len++] = c;
+        }
+        return PARSE_NONE;
+    case P_SB_IAC:
+        if (c == T_SE) {
+            p->cmd[p->cmd_len++] = T_IAC;
+            p->cmd[p->cmd_len++] = T_SE;
+            p->state = P_DATA;
+            return PARSE_CMD;
+        }
+        // escaped IAC in the subnegotiation (or a malformed one), keep it unescaped
+        if (p->cmd_len < CMD_MAX_LEN - 2) {
+            p->cmd[p->cmd_len++] = c;
+        }
+        p->state = P_SB;
+        return PARSE_NONE;
+    }
+    return PARSE_NONE;
+}
+
+static int build_expected(const capture_t *capture, expected_t *out)
+{
+    expected_t expected = {};
+    size_t cmd_capacity = 0;
+    size_t data_capacity = 0;
+    telnet_parser_t parser = {};
+    size_t trigger = SIZE_MAX;
+    for (size_t i = 0; i < capture->count; i++) {
+        const capture_record_t *record = &capture->records[i];
+        if (record->dir == CAPTURE_FROM_CLIENT) {
+            trigger = i;
+            continue;
+        }
+        for (size_t j = 0; j < record->len; j++) {
+            uint8_t c;
+            parse_result_t res = parser_feed(&parser, record->data[j], &c);
+            if (res == PARSE_DATA) {
+                if (expected.data_len == data_capacity) {
+                    data_capacity = data_capacity ? data_capacity * 2 : 4096;
+                    uint8_t *data = realloc(expected.data, data_capacity);
+                    if (!data) {
+                        goto fail;
+                    }
+                    expected.data = data;
+                }
+                expected.data[expected.data_len++] = c;
+            } else if (res == PARSE_CMD) {
+                if (expected.cmd_count == cmd_capacity) {
+                    cmd_capacity = cmd_capacity ? cmd_capacity * 2 : 64;
+                    expected_cmd_t *cmds = realloc(expected.cmds, cmd_capacity * sizeof(*cmds));
+                    if (!cmds) {
+                        goto fail;
+                    }
+                    expected.cmds = cmds;
+                }
+                expected_cmd_t *cmd = &expected.cmds[expected.cmd_count++];
+                memcpy(cmd->bytes, parser.cmd, parser.cmd_len);
+                cmd->len = parser.cmd_len;
+                cmd->trigger = trigger;
+                cmd->recorded_delay_us = (trigger == SIZE_MAX) ? 0 :
+                                         (int64_t)(record->time_us - capture->records[trigger].time_us);
+            }
+        }
+    }
+    *out = expected;
+    return 0;
+
+fail:
+    ESP_LOGE(TAG, "Out of memory");
+    free(expected.cmds);
+    free(expected.data);
+    return -1;
+}
+
+static void add_deviation(results_t *results, int64_t deviation_us)
+{
+    if (results->deviation_count == results->deviation_capacity) {
+        size_t capacity = results->deviation_capacity ? results->deviation_capacity * 2 : 256;
+        int64_t *deviations = realloc(results->deviations_us, capacity * sizeof(*deviations));
+        if (!deviations) {
+            return;
+        }
+        results->deviations_us = deviations;
+        results->deviation_capacity = capacity;
+    }
+    results->deviations_us[results->deviation_count++] = deviation_us;
+}
+
+static void *receiver_fn(void *ctx)
+{
+    session_t *session = (session_t *) ctx;
+    worker_t *worker = session->worker;
+    const expected_t *expected = worker->expected;
+    const check_mode_t check = worker->config->check;
+    telnet_parser_t parser = {};
+    uint8_t buf[4096];
+    while (true) {
+        ssize_t len = recv(session->sock, buf, sizeof(buf), 0);
+        if (len <= 0) {
+            break;
+        }
+        uint64_t now = now_us();
+        session->bytes_received += len;
+        for (ssize_t i = 0; i < len; i++) {
+            uint8_t c;
+            parse_result_t res = parser_feed(&parser, buf[i], &c);
+            if (res == PARSE_DATA && check == CHECK_ALL) {
+                size_t pos = atomic_load(&session->data_pos);
+                if (pos >= expected->data_len || expected->data[pos] != c) {
+                    atomic_store(&session->data_mismatch, true);
+                }
+                atomic_store(&session->data_pos, pos + 1);
+                atomic_store(&session->last_progress_us, now);
+            } else if (res == PARSE_CMD && check != CHECK_NONE) {
+                size_t pos = atomic_load(&session->cmd_pos);
+                if (pos >= expected->cmd_count) {
+                    worker->results.cmds_mismatched++;
+                    continue;
+                }
+                const expected_cmd_t *cmd = &expected->cmds[pos];
+                if (cmd->len != parser.cmd_len || memcmp(cmd->bytes, parser.cmd, cmd->len) != 0) {
+                    worker->results.cmds_mismatched++;
+                } else {
+                    worker->results.cmds_matched++;
+                    uint64_t sent = (cmd->trigger == SIZE_MAX) ? session->start_us : atomic_load(&session->send_time_us[cmd->trigger]);
+                    if (sent != 0) {
+                        add_deviation(&worker->results, (int64_t)(now - sent) - cmd->recorded_delay_us);
+                    }
+                }
+                atomic_store(&session->cmd_pos, pos + 1);
+                atomic_store(&session->last_progress_us, now);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int connect_to_server(const char *host, unsigned port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        ESP_LOGE(TAG, "Invalid address: %s", host);
+        return -1;
+    }
+    // the server may not be listening yet, or may still be closing the previous session
+    for (int attempt = 0; attempt < 50; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+            return -1;
+        }
+        if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            int opt = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            return sock;
+        }
+        close(sock);
+        usleep(20000);
+    }
+    ESP_LOGE(TAG, "Unable to connect to %s:%u: errno %d", host, port, errno);
+    return -1;
+}
+
+static bool send_all(int sock, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = send(sock, data, len, 0);
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+static void run_session(worker_t *worker)
+{
+    const replay_config_t *config = worker->config;
+    const capture_t *capture = worker->capture;
+    const expected_t *expected = worker->expected;
+    results_t *results = &worker->results;
+
+    const char *host = config->target_host ? config->target_host : "127.0.0.1";
+    unsigned port = config->target_host ? config->target_port : DEFAULT_BASE_PORT + worker->index;
+    session_t session = {
+        .worker = worker,
+        .sock = connect_to_server(host, port),
+    };
+    if (session.sock < 0) {
+        results->failed_sessions++;
+        return;
+    }
+    session.send_time_us = calloc(capture->count ? capture->count : 1, sizeof(*session.send_time_us));
+    if (!session.send_time_us) {
+        close(session.sock);
+        results->failed_sessions++;
+        return;
+    }
+    session.start_us = now_us();
+    atomic_store(&session.last_progress_us, session.start_us);
+
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, receiver_fn, &session) != 0) {
+        ESP_LOGE(TAG, "Failed to create receiver thread");
+        free(session.send_time_us);
+        close(session.sock);
+        results->failed_sessions++;
+        return;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < capture->count && ok; i++) {
+        const capture_record_t *record = &capture->records[i];
+        if (record->dir != CAPTURE_FROM_CLIENT) {
+            continue;
+        }
+        if (config->original_timing) {
+            uint64_t due = session.start_us + record->time_us;
+            uint64_t now = now_us();
+            if (due > now) {
+                usleep(due - now);
+            }
+        }
+        // the reply may arrive before send() returns
+        atomic_store(&session.send_time_us[i], now_us());
+        ok = send_all(session.sock, record->data, record->len);
+        results->bytes_sent += record->len;
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "Session %u: error sending data: errno %d", worker->index, errno);
+    }
+
+    // wait for the remaining replies, as long as they keep coming
+    size_t cmds_wanted = (config->check == CHECK_NONE) ? 0 : expected->cmd_count;
+    size_t data_wanted = (config->check == CHECK_ALL) ? expected->data_len : 0;
+    atomic_store(&session.last_progress_us, now_us());
+    while (ok && (atomic_load(&session.cmd_pos) < cmds_wanted || atomic_load(&session.data_pos) < data_wanted) &&
+            now_us() - atomic_load(&session.last_progress_us) < TAIL_TIMEOUT_MS * 1000) {
+        usleep(1000);
+    }
+    results->duration_us += now_us() - session.start_us;
+
+    shutdown(session.sock, SHUT_RDWR);
+    pthread_join(receiver, NULL);
+    close(session.sock);
+    free(session.send_time_us);
+
+    results->bytes_received += session.bytes_received;
+    if (atomic_load(&session.cmd_pos) < cmds_wanted) {
+        results->cmds_missing += cmds_wanted - atomic_load(&session.cmd_pos);
+    }
+    if (atomic_load(&session.data_mismatch) || atomic_load(&session.data_pos) != data_wanted) {
+        results->data_mismatches++;
+    }
+}
+
+static void *worker_fn(void *ctx)
+{
+    worker_t *worker = (worker_t *) ctx;
+    for (unsigned i = 0; i < worker->sessions; i++) {
+        run_session(worker);
+    }
+    return NULL;
+}
+
+// in-process server: echoes the data back and accepts all settings, like the loopback example
+static void on_data_received(void *ctx, const uint8_t *data, size_t len)
+{
+    worker_t *worker = (worker_t *) ctx;
+    rfc2217_server_send_data(worker->server, data, len);
+}
+
+static unsigned on_baudrate(void *ctx, unsigned requested_baudrate)
+{
+    return requested_baudrate;
+}
+
+static rfc2217_control_t on_control(void *ctx, rfc2217_control_t requested_control)
+{
+    return requested_control;
+}
+
+static rfc2217_purge_t on_purge(void *ctx, rfc2217_purge_t requested_purge)
+{
+    return requested_purge;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_report(const replay_config_t *config, worker_t *workers, uint64_t elapsed_us)
+{
+    results_t total = {};
+    for (unsigned i = 0; i < config->parallel; i++) {
+        results_t *r = &workers[i].results;
+        total.bytes_sent += r->bytes_sent;
+        total.bytes_received += r->bytes_received;
+        total.duration_us += r->duration_us;
+        total.cmds_matched += r->cmds_matched;
+        total.cmds_mismatched += r->cmds_mismatched;
+        total.cmds_missing += r->cmds_missing;
+        total.data_mismatches += r->data_mismatches;
+        total.failed_sessions += r->failed_sessions;
+        for (size_t j = 0; j < r->deviation_count; j++) {
+            add_deviation(&total, r->deviations_us[j]);
+        }
+    }
+
+    printf("Sessions: %u (%u in parallel), failed to connect: %u\n", config->sessions, config->parallel, total.failed_sessions);
+    printf("Elapsed: %.3f s, mean session duration: %.3f s\n", elapsed_us / 1e6,
+           config->sessions ? total.duration_us / 1e6 / config->sessions : 0.0);
+    printf("Throughput: sent %" PRIu64 " bytes (%.1f kB/s), received %" PRIu64 " bytes (%.1f kB/s)\n",
+           total.bytes_sent, elapsed_us ? total.bytes_sent * 1000.0 / elapsed_us : 0.0,
+           total.bytes_received, elapsed_us ? total.bytes_received * 1000.0 / elapsed_us : 0.0);
+    if (config->check != CHECK_NONE) {
+        printf("Control replies: %zu matched, %zu mismatched, %zu missing\n",
+               total.cmds_matched, total.cmds_mismatched, total.cmds_missing);
+    }
+    if (config->check == CHECK_ALL) {
+        printf("Sessions with mismatched data: %zu\n", total.data_mismatches);
+    }
+    if (total.deviation_count > 0) {
+        qsort(total.deviations_us, total.deviation_count, sizeof(int64_t), compare_int64);
+        int64_t sum = 0;
+        for (size_t i = 0; i < total.deviation_count; i++) {
+            sum += total.deviations_us[i];
+        }
+        printf("Reply latency deviation from the capture (us): mean %" PRId64 ", median %" PRId64 ", p99 %" PRId64 ", min %" PRId64 ", max %" PRId64 "\n",
+               sum / (int64_t) total.deviation_count,
+               total.deviations_us[total.deviation_count / 2],
+               total.deviations_us[total.deviation_count * 99 / 100],
+               total.deviations_us[0],
+               total.deviations_us[total.deviation_count - 1]);
+    }
+    free(total.deviations_us);
+}
+
+static int run_replay(const replay_config_t *config)
+{
+    capture_t capture;
+    if (capture_load(config->capture_path, &capture) != 0) {
+        return -1;
+    }
+    expected_t expected;
+    if (build_expected(&capture, &expected) != 0) {
+        capture_free(&capture);
+        return -1;
+    }
+    ESP_LOGI(TAG, "Loaded %zu records, %zu control replies and %zu data bytes expected from the server",
+             capture.count, expected.cmd_count, expected.data_len);
+
+    int res = 0;
+    worker_t *workers = calloc(config->parallel, sizeof(worker_t));
+    if (!workers) {
+        ESP_LOGE(TAG, "Out of memory");
+        res = -1;
+        goto out;
+    }
+    for (unsigned i = 0; i < config->parallel; i++) {
+        worker_t *worker = &workers[i];
+        worker->config = config;
+        worker->capture = &capture;
+        worker->expected = &expected;
+        worker->index = i;
+        // distribute the sessions over the workers
+        worker->sessions = config->sessions / config->parallel + (i < config->sessions % config->parallel ? 1 : 0);
+        if (config->target_host) {
+            continue;
+        }
+        rfc2217_server_config_t server_config = {
+            .ctx = worker,
+            .on_baudrate = on_baudrate,
+            .on_control = on_control,
+            .on_purge = on_purge,
+            .on_data_received = on_data_received,
+            .port = DEFAULT_BASE_PORT + i,
+            .task_core_id = RFC2217_NO_AFFINITY,
+        };
+        if (rfc2217_server_create(&server_config, &worker->server) != 0 || rfc2217_server_start(worker->server) != 0) {
+            ESP_LOGE(TAG, "Failed to start server %u", i);
+            res = -1;
+            break;
+        }
+    }
+
+    if (res == 0) {
+        uint64_t start = now_us();
+        unsigned started = 0;
+        for (; started < config->parallel; started++) {
+            if (pthread_create(&workers[started].thread, NULL, worker_fn, &workers[started]) != 0) {
+                ESP_LOGE(TAG, "Failed to create worker thread");
+                res = -1;
+                break;
+            }
+        }
+        for (unsigned i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        print_report(config, workers, now_us() - start);
+        for (unsigned i = 0; i < config->parallel; i++) {
+            const results_t *r = &workers[i].results;
+            if (r->failed_sessions || r->cmds_mismatched || r->cmds_missing || r->data_mismatches) {
+                res = 1;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < config->parallel; i++) {
+        if (workers[i].server) {
+            rfc2217_server_destroy(workers[i].server);
+        }
+        free(workers[i].results.deviations_us);
+    }
+    free(workers);
+out:
+    free(expected.cmds);
+    free(expected.data);
+    capture_free(&capture);
+    return res;
+}
+
+static int run_record(const char *capture_path, const char *target_host, unsigned target_port, unsigned listen_port)
+{
+    // forward one session between a client and the target server, writing the capture file
+    FILE *f = fopen(capture_path, "w");
+    if (!f) {
+        ESP_LOGE(TAG, "Failed to open %s for writing", capture_path);
+        return -1;
+    }
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(listen_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %u: errno %d", listen_port, errno);
+        close(listen_sock);
+        fclose(f);
+        return -1;
+    }
+    ESP_LOGI(TAG, "Waiting for a client on port %u", listen_port);
+    int client = accept(listen_sock, NULL, NULL);
+    close(listen_sock);
+    if (client < 0) {
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        fclose(f);
+        return -1;
+    }
+    int server = connect_to_server(target_host, target_port);
+    if (server < 0) {
+        close(client);
+        fclose(f);
+        return -1;
+    }
+    fprintf(f, "# rfc2217 session capture: <time, us> <C: client to server, S: server to client> <hex data>\n");
+    uint64_t start = now_us();
+    uint8_t buf[4096];
+    size_t records = 0;
+    while (true) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(client, &fds);
+        FD_SET(server, &fds);
+        if (select((client > server ? client : server) + 1, &fds, NULL, NULL, NULL) < 0) {
+            break;
+        }
+        int from = FD_ISSET(client, &fds) ? client : server;
+        int to = (from == client) ? server : client;
+        ssize_t len = recv(from, buf, sizeof(buf), 0);
+        if (len <= 0) {
+            break;
+        }
+        capture_write_record(f, now_us() - start, from == client ? CAPTURE_FROM_CLIENT : CAPTURE_FROM_SERVER, buf, len);
+        records++;
+        if (!send_all(to, buf, len)) {
+            break;
+        }
+    }
+    close(client);
+    close(server);
+    fclose(f);
+    ESP_LOGI(TAG, "Session ended, %zu records written to %s", records, capture_path);
+    return 0;
+}
+
+static unsigned env_unsigned(const char *name, unsigned default_value)
+{
+    const char *value = getenv(name);
+    return (value && *value) ? (unsigned) strtoul(value, NULL, 0) : default_value;
+}
+
+static int parse_target(const char *target, char *host, size_t host_size, unsigned *port)
+{
+    const char *colon = strrchr(target, ':');
+    if (!colon || colon == target || (size_t)(colon - target) >= host_size) {
+        ESP_LOGE(TAG, "REPLAY_TARGET must be <ipv4 address>:<port>");
+        return -1;
+    }
+    memcpy(host, target, colon - target);
+    host[colon - target] = '\0';
+    *port = (unsigned) strtoul(colon + 1, NULL, 10);
+    return 0;
+}
+
+void app_main(void)
+{
+    static char target_host[64];
+    replay_config_t config = {
+        .capture_path = getenv("REPLAY_CAPTURE"),
+        .original_timing = true,
+        .sessions = env_unsigned("REPLAY_SESSIONS", 1),
+        .parallel = env_unsigned("REPLAY_PARALLEL", 1),
+        .check = CHECK_CONTROL,
+    };
+    const char *mode = getenv("REPLAY_MODE");
+    const char *timing = getenv("REPLAY_TIMING");
+    const char *check = getenv("REPLAY_CHECK");
+    const char *target = getenv("REPLAY_TARGET");
+
+    // sockets closed by the other side are reported by send() returning an error
+    signal(SIGPIPE, SIG_IGN);
+
+    int res = -1;
+    if (!config.capture_path) {
+        ESP_LOGE(TAG, "Set REPLAY_CAPTURE to the path of the capture file");
+        goto done;
+    }
+    if (target) {
+        if (parse_target(target, target_host, sizeof(target_host), &config.target_port) != 0) {
+            goto done;
+        }
+        config.target_host = target_host;
+    }
+    if (mode && strcmp(mode, "record") == 0) {
+        if (!target) {
+            ESP_LOGE(TAG, "Set REPLAY_TARGET to the address of the server to record");
+            goto done;
+        }
+        res = run_record(config.capture_path, config.target_host, config.target_port, env_unsigned("REPLAY_LISTEN_PORT", 2217));
+        goto done;
+    }
+    if (timing && strcmp(timing, "fast") == 0) {
+        config.original_timing = false;
+    }
+    if (check && strcmp(check, "none") == 0) {
+        config.check = CHECK_NONE;
+    } else if (check && strcmp(check, "all") == 0) {
+        config.check = CHECK_ALL;
+    }
+    if (config.parallel == 0) {
+        config.parallel = 1;
+    }
+    if (config.sessions < config.parallel) {
+        config.sessions = config.parallel;
+    }
+    res = run_replay(&config);
+
+done:
+    fflush(stdout);
+    exit(res == 0 ? 0 : 1);
+}
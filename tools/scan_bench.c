@@ -0,0 +1,122 @@
+// Benchmark of the word-at-a-time byte search used to find XON/XOFF in the data from the serial device.
+//
+// Searches a stream for two bytes with scan_find_any2 and with a plain byte loop, fed in chunks of the
+// given size (as rfc2217_server_send_data would receive them from a serial driver), and prints the
+// throughput of both. The stream is log-like text with an XON or XOFF about every MATCH_INTERVAL bytes;
+// the positions found by both searches are checked against each other.
+//
+// Build and run on the host:
+//     gcc -O2 -Isrc tools/scan_bench.c -o scan_bench
+//     ./scan_bench [chunk size, default 256]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rfc2217_scan.h"
+
+#define STREAM_SIZE (32 * 1024 * 1024)
+// an XON or XOFF is inserted into the stream about this often
+#define MATCH_INTERVAL 4096
+#define ROUNDS 8
+#define XON 0x11U
+#define XOFF 0x13U
+
+static const char *s_log_lines[] = {
+    "I (1234) wifi:new:<6,0>, old:<1,0>, ap:<255,255>, sta:<6,0>, prof:1\n",
+    "I (1240) wifi:state: init -> auth (b0)\n",
+    "I (1302) esp_netif_handlers: sta ip: 192.168.0.196, mask: 255.255.255.0, gw: 192.168.0.1\n",
+    "D (2011) app_main: Data received: (1 bytes)\n",
+    "W (2500) sensor: reading out of range: 1023\n",
+    "I (3001) heap_init: At 3FFB2C28 len 0002D3D8 (180 KiB): DRAM\n",
+    "load:0x3fff0030,len:7112\n",
+};
+
+static uint8_t *s_stream;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_stream(void)
+{
+    s_stream = malloc(STREAM_SIZE);
+    size_t pos = 0;
+    size_t line = 0;
+    unsigned seed = 1;
+    while (pos < STREAM_SIZE) {
+        const char *text = s_log_lines[line++ % (sizeof(s_log_lines) / sizeof(s_log_lines[0]))];
+        size_t len = strlen(text);
+        if (len > STREAM_SIZE - pos) {
+            len = STREAM_SIZE - pos;
+        }
+        memcpy(s_stream + pos, text, len);
+        pos += len;
+    }
+    for (pos = MATCH_INTERVAL; pos < STREAM_SIZE; pos += MATCH_INTERVAL) {
+        seed = seed * 1103515245 + 12345;
+        s_stream[pos - (seed >> 16) % 64] = (seed >> 8) & 1 ? XON : XOFF;
+    }
+}
+
+// the search before rfc2217_scan.h; noinline, so that it isn't optimized for the constant arguments
+__attribute__((noinline))
+static const uint8_t *byte_find_any2(const uint8_t *buf, size_t len, uint8_t a, uint8_t b)
+{
+    for (const uint8_t *p = buf; p < buf + len; ++p) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+typedef const uint8_t *(*find_fn_t)(const uint8_t *buf, size_t len, uint8_t a, uint8_t b);
+
+static size_t run(find_fn_t find, size_t chunk, size_t *checksum, double *elapsed)
+{
+    // returns the number of matches, and the sum of their positions in checksum
+    size_t matches = 0;
+    *checksum = 0;
+    double start = now_s();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t pos = 0; pos < STREAM_SIZE; pos += chunk) {
+            size_t len = STREAM_SIZE - pos < chunk ? STREAM_SIZE - pos : chunk;
+            const uint8_t *end = s_stream + pos + len;
+            for (const uint8_t *p = s_stream + pos; (p = find(p, end - p, XON, XOFF)) != NULL; ++p) {
+                matches++;
+                *checksum += p - s_stream;
+            }
+        }
+    }
+    *elapsed = now_s() - start;
+    return matches;
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunk = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+    if (chunk == 0) {
+        chunk = 256;
+    }
+    make_stream();
+    printf("Stream: %d MiB, %d rounds, chunk size: %zu bytes\n", STREAM_SIZE / (1024 * 1024), ROUNDS, chunk);
+
+    size_t word_sum, byte_sum;
+    double word_elapsed, byte_elapsed;
+    // warm up
+    run(scan_find_any2, chunk, &word_sum, &word_elapsed);
+    size_t word_matches = run(scan_find_any2, chunk, &word_sum, &word_elapsed);
+    size_t byte_matches = run(byte_find_any2, chunk, &byte_sum, &byte_elapsed);
+    bool ok = word_matches == byte_matches && word_sum == byte_sum;
+    double total = (double) STREAM_SIZE * ROUNDS;
+    printf("scan_find_any2: %7.1f MB/s, %.2f ns/byte, %zu matches (%s)\n", total / word_elapsed / 1e6,
+           word_elapsed * 1e9 / total, word_matches, ok ? "ok" : "MISMATCH");
+    printf("byte loop:      %7.1f MB/s, %.2f ns/byte, %zu matches\n", total / byte_elapsed / 1e6,
+           byte_elapsed * 1e9 / total, byte_matches);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Simulated serial port instance handle
+ */
+typedef struct sim_serial_s *sim_serial_t;
+
+/**
+ * @brief Modem control and status lines, as bits of a mask
+ */
+#define SIM_SERIAL_LINE_DTR (1U << 0)   //!< Data Terminal Ready, output of the host
+#define SIM_SERIAL_LINE_RTS (1U << 1)   //!< Request To Send, output of the host
+#define SIM_SERIAL_LINE_CTS (1U << 2)   //!< Clear To Send, input of the host
+#define SIM_SERIAL_LINE_DSR (1U << 3)   //!< Data Set Ready, input of the host
+
+/**
+ * @brief Parity, same values as RFC2217 SET_PARITY
+ */
+typedef enum {
+    SIM_SERIAL_PARITY_NONE = 1,     //!< No parity
+    SIM_SERIAL_PARITY_ODD = 2,      //!< Odd parity
+    SIM_SERIAL_PARITY_EVEN = 3,     //!< Even parity
+    SIM_SERIAL_PARITY_MARK = 4,     //!< Mark parity
+    SIM_SERIAL_PARITY_SPACE = 5     //!< Space parity
+} sim_serial_parity_t;
+
+/**
+ * @brief Stop bits, same values as RFC2217 SET_STOPSIZE
+ */
+typedef enum {
+    SIM_SERIAL_STOPBITS_1 = 1,      //!< 1 stop bit
+    SIM_SERIAL_STOPBITS_2 = 2,      //!< 2 stop bits
+    SIM_SERIAL_STOPBITS_1_5 = 3     //!< 1.5 stop bits
+} sim_serial_stopbits_t;
+
+/**
+ * @brief Flow control
+ */
+typedef enum {
+    SIM_SERIAL_FLOW_NONE,       //!< No flow control
+    SIM_SERIAL_FLOW_RTS_CTS     //!< Hardware flow control: RTS follows the RX FIFO level, TX waits for CTS
+} sim_serial_flow_t;
+
+/**
+ * @brief Events reported to on_event
+ */
+typedef enum {
+    SIM_SERIAL_EVENT_LINES,         //!< a line changed, value is the new mask of SIM_SERIAL_LINE_* bits
+    SIM_SERIAL_EVENT_BREAK_START,   //!< host started a break, value is 0
+    SIM_SERIAL_EVENT_BREAK_END,     //!< host ended a break, value is its duration in microseconds
+    SIM_SERIAL_EVENT_OVERRUN,       //!< RX FIFO overflowed, value is the number of bytes lost since the last event
+    SIM_SERIAL_EVENT_LINE_CONFIG    //!< line settings changed, value is the baud rate
+} sim_serial_event_t;
+
+/**
+ * @brief callback with data received by the host side of the port
+ * @param ctx context pointer from the configuration
+ * @param data received data
+ * @param len length of the data
+ */
+typedef void (*sim_serial_on_rx_t)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief callback with data arriving at the simulated device, at the line rate
+ * @param ctx context pointer from the configuration
+ * @param data data sent by the host
+ * @param len length of the data
+ */
+typedef void (*sim_serial_on_device_rx_t)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief callback on an event of the port
+ * @param ctx context pointer from the configuration
+ * @param event type of the event
+ * @param value value depending on the event
+ * @param time_us time of the event, CLOCK_MONOTONIC in microseconds
+ */
+typedef void (*sim_serial_on_event_t)(void *ctx, sim_serial_event_t event, uint32_t value, uint64_t time_us);
+
+/**
+ * @brief Simulated serial port configuration
+ */
+typedef struct {
+    void *ctx;                  //!< context pointer passed to callbacks
+    sim_serial_on_rx_t on_rx;   //!< callback called with data for the host (required)
+    sim_serial_on_device_rx_t on_device_rx; //!< callback called with data for the device; if NULL, the port has a loopback plug, see below
+    sim_serial_on_event_t on_event; //!< callback called on events, may be NULL
+    uint32_t baudrate;          //!< initial baud rate (0: 115200), 8N1
+    size_t tx_fifo_size;        //!< size of the TX FIFO (0: default, 1024)
+    size_t rx_fifo_size;        //!< size of the RX FIFO (0: default, 1024)
+    unsigned rx_latency_us;     //!< time from receiving a character until it is passed to on_rx, like the RX timeout of a UART driver
+    unsigned rx_jitter_us;      //!< random extra delay added to rx_latency_us, up to this value
+    uint32_t seed;              //!< seed of the jitter generator, for reproducible runs
+} sim_serial_config_t;
+
+/**
+ * @brief Counters of the port
+ */
+typedef struct {
+    uint64_t tx_bytes;          //!< bytes sent on the line by the host
+    uint64_t rx_bytes;          //!< bytes passed to on_rx
+    uint64_t overrun_bytes;     //!< bytes lost because the RX FIFO was full
+    uint32_t overruns;          //!< number of overrun events
+    uint32_t breaks;            //!< number of breaks sent by the host
+    uint32_t line_changes;      //!< number of changes of DTR and RTS by the host
+    uint32_t max_rx_fifo_used;  //!< highest RX FIFO level seen
+    uint64_t max_rx_delay_us;   //!< longest time from receiving a character until it was passed to on_rx
+    uint32_t config_changes;    //!< number of calls of sim_serial_set_line_config
+    uint32_t config_changes_tx_pending; //!< number of those made while the TX FIFO wasn't empty, so that its data was sent with the new settings
+    uint64_t tx_pending_bytes;  //!< bytes in the TX FIFO at those changes
+} sim_serial_stats_t;
+
+/*
+ * Model
+ *
+ * The host writes into the TX FIFO with sim_serial_write, which blocks while the FIFO is full, like
+ * uart_write_bytes. A task moves the characters onto the line at the rate given by the baud rate and
+ * the framing, in both directions at once. Characters from the line go into the RX FIFO and are passed
+ * to on_rx after rx_latency_us plus jitter, or as soon as the FIFO is 3/4 full. If on_rx doesn't return
+ * in time, the line keeps running: characters which don't fit into the RX FIFO are lost (overrun), as
+ * with a real UART. Time is taken from CLOCK_MONOTONIC, and the task runs every millisecond while data
+ * is moving, so data moves in bursts of about 1 ms worth of characters.
+ * With a loopback plug (on_device_rx is NULL), the TX line is wired to RX, RTS to CTS and DTR to DSR.
+ * Otherwise, the device receives data in on_device_rx, sends data with sim_serial_device_write and
+ * drives CTS and DSR with sim_serial_device_set_lines.
+ * With SIM_SERIAL_FLOW_RTS_CTS, RTS is deasserted when the RX FIFO is 3/4 full and asserted again when
+ * it is below 1/2; the host stops sending while CTS is deasserted, and the device while RTS is.
+ * During a break, the host doesn't send data.
+ * on_rx and on_device_rx are called from the task of the port. on_event is called from the task, or
+ * from the function which caused the event. No callback is called while holding the lock of the port,
+ * so callbacks may call the functions of the port.
+ */
+
+/** @brief Create a simulated serial port and start its task
+ *
+ * @param config configuration
+ * @param out_sim pointer to store the created instance
+ * @return 0 on success, -1 on failure
+ */
+int sim_serial_create(const sim_serial_config_t *config, sim_serial_t *out_sim);
+
+/** @brief Stop the task and free the port
+ *
+ * @param sim port instance
+ */
+void sim_serial_destroy(sim_serial_t sim);
+
+/** @brief Set the line settings
+ *
+ * @param sim port instance
+ * @param baudrate baud rate, 0 to keep the current one
+ * @param datasize data bits, 5 to 8, 0 to keep the current value
+ * @param parity parity, 0 to keep the current value
+ * @param stopbits stop bits, 0 to keep the current value
+ * @return the baud rate in effect
+ */
+uint32_t sim_serial_set_line_config(sim_serial_t sim, uint32_t baudrate, uint8_t datasize, sim_serial_parity_t parity, sim_serial_stopbits_t stopbits);
+
+/** @brief Set the flow control mode
+ *
+ * @param sim port instance
+ * @param flow flow control mode
+ */
+void sim_serial_set_flow_control(sim_serial_t sim, sim_serial_flow_t flow);
+
+/** @brief Set DTR and RTS
+ *
+ * @param sim port instance
+ * @param mask lines to change, SIM_SERIAL_LINE_DTR and/or SIM_SERIAL_LINE_RTS
+ * @param values new values of the lines in mask
+ */
+void sim_serial_set_lines(sim_serial_t sim, unsigned mask, unsigned values);
+
+/** @brief Get the state of all the lines
+ *
+ * @param sim port instance
+ * @return mask of SIM_SERIAL_LINE_* bits which are asserted
+ */
+unsigned sim_serial_get_lines(sim_serial_t sim);
+
+/** @brief Start or end a break
+ *
+ * @param sim port instance
+ * @param on true to start, false to end the break
+ */
+void sim_serial_set_break(sim_serial_t sim, bool on);
+
+/** @brief Write data into the TX FIFO
+ *
+ * @param sim port instance
+ * @param data data to send
+ * @param len length of the data
+ * @param timeout_ms how long to wait for space in the FIFO
+ * @return number of bytes written
+ */
+size_t sim_serial_write(sim_serial_t sim, const uint8_t *data, size_t len, unsigned timeout_ms);
+
+/** @brief Wait until the TX FIFO is empty
+ *
+ * @param sim port instance
+ * @param timeout_ms how long to wait
+ * @return 0 if the FIFO is empty, -1 on timeout
+ */
+int sim_serial_wait_tx_done(sim_serial_t sim, unsigned timeout_ms);
+
+/** @brief Discard the contents of the FIFOs
+ *
+ * @param sim port instance
+ * @param rx discard the RX FIFO
+ * @param tx discard the TX FIFO
+ */
+void sim_serial_purge(sim_serial_t sim, bool rx, bool tx);
+
+/** @brief Send data from the device to the host, without a loopback plug
+ *
+ * @param sim port instance
+ * @param data data to send
+ * @param len length of the data
+ * @param timeout_ms how long to wait for space in the device's queue (same size as the TX FIFO)
+ * @return number of bytes written
+ */
+size_t sim_serial_device_write(sim_serial_t sim, const uint8_t *data, size_t len, unsigned timeout_ms);
+
+/** @brief Set CTS and DSR, without a loopback plug
+ *
+ * @param sim port instance
+ * @param mask lines to change, SIM_SERIAL_LINE_CTS and/or SIM_SERIAL_LINE_DSR
+ * @param values new values of the lines in mask
+ */
+void sim_serial_device_set_lines(sim_serial_t sim, unsigned mask, unsigned values);
+
+/** @brief Get the counters of the port
+ *
+ * @param sim port instance
+ * @param out_stats pointer to store the counters
+ */
+void sim_serial_get_stats(sim_serial_t sim, sim_serial_stats_t *out_stats);
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,615 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "sim_serial.h"
+
+#define DEFAULT_BAUDRATE 115200
+#define DEFAULT_FIFO_SIZE 1024
+// period of the task while data is moving
+#define TICK_US 1000
+// longest time accounted in one tick, so that a task stalled for a long time doesn't overflow the credits
+#define MAX_ELAPSED_US 1000000
+// events collected in one tick; more are dropped
+#define MAX_TICK_EVENTS 8
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t head;    // index of the oldest byte
+    size_t used;
+} fifo_t;
+
+typedef struct {
+    sim_serial_event_t event;
+    uint32_t value;
+    uint64_t time_us;
+} event_t;
+
+struct sim_serial_s {
+    sim_serial_config_t config;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake_cond;       // signalled when the task has something to do
+    pthread_cond_t space_cond;      // signalled when space is made in tx_fifo or dev_fifo
+    pthread_t thread;
+    bool shutdown;
+    // line settings
+    uint32_t baudrate;
+    uint8_t datasize;
+    sim_serial_parity_t parity;
+    sim_serial_stopbits_t stopbits;
+    uint64_t char_cost;             // credits per character: half bits * 1000000, 2 * baudrate credits are added per microsecond
+    sim_serial_flow_t flow;
+    unsigned lines;                 // SIM_SERIAL_LINE_* bits
+    bool host_rts;                  // RTS as set by the host; the line may be deasserted by flow control
+    bool in_break;
+    uint64_t break_start_us;
+    // data path
+    fifo_t tx_fifo;                 // host to line
+    fifo_t dev_fifo;                // device to line, without a loopback plug
+    fifo_t rx_fifo;                 // line to host
+    uint8_t *scratch;               // data taken out of a FIFO in one tick
+    uint8_t *rx_scratch;
+    uint64_t tx_credits;
+    uint64_t dev_credits;
+    uint64_t last_us;
+    uint64_t rx_first_us;           // arrival of the oldest byte in rx_fifo
+    uint64_t rx_deliver_us;         // when rx_fifo is passed to on_rx, valid while it is not empty
+    uint32_t overrun_pending;       // bytes lost, not reported yet
+    uint32_t rng;
+    sim_serial_stats_t stats;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void get_deadline(struct timespec *deadline, unsigned timeout_us)
+{
+    // absolute deadline for pthread_cond_timedwait, which uses CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_us / 1000000;
+    deadline->tv_nsec += (long)(timeout_us % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int fifo_init(fifo_t *fifo, size_t size)
+{
+    fifo->buf = malloc(size);
+    fifo->size = size;
+    fifo->head = 0;
+    fifo->used = 0;
+    return fifo->buf ? 0 : -1;
+}
+
+static size_t fifo_push(fifo_t *fifo, const uint8_t *data, size_t len)
+{
+    if (len > fifo->size - fifo->used) {
+        len = fifo->size - fifo->used;
+    }
+    for (size_t done = 0; done < len;) {
+        size_t tail = (fifo->head + fifo->used) % fifo->size;
+        size_t n = fifo->size - tail < len - done ? fifo->size - tail : len - done;
+        memcpy(fifo->buf + tail, data + done, n);
+        fifo->used += n;
+        done += n;
+    }
+    return len;
+}
+
+static size_t fifo_pop(fifo_t *fifo, uint8_t *out, size_t len)
+{
+    if (len > fifo->used) {
+        len = fifo->used;
+    }
+    for (size_t done = 0; done < len;) {
+        size_t n = fifo->size - fifo->head < len - done ? fifo->size - fifo->head : len - done;
+        memcpy(out + done, fifo->buf + fifo->head, n);
+        fifo->head = (fifo->head + n) % fifo->size;
+        fifo->used -= n;
+        done += n;
+    }
+    return len;
+}
+
+static void update_char_cost(sim_serial_t sim)
+{
+    // start bit, data bits, parity bit, stop bits, in half bits to allow for 1.5 stop bits
+    unsigned half_bits = 2 * (1 + sim->datasize);
+    if (sim->parity != SIM_SERIAL_PARITY_NONE) {
+        half_bits += 2;
+    }
+    half_bits += (sim->stopbits == SIM_SERIAL_STOPBITS_2) ? 4 : (sim->stopbits == SIM_SERIAL_STOPBITS_1_5) ? 3 : 2;
+    sim->char_cost = (uint64_t) half_bits * 1000000;
+}
+
+static bool loopback(sim_serial_t sim)
+{
+    return sim->config.on_device_rx == NULL;
+}
+
+static void add_event(event_t *events, size_t *count, sim_serial_event_t event, uint32_t value, uint64_t time_us)
+{
+    if (*count < MAX_TICK_EVENTS) {
+        events[*count] = (event_t) {
+            event, value, time_us
+        };
+        (*count)++;
+    }
+}
+
+static void dispatch_events(sim_serial_t sim, const event_t *events, size_t count)
+{
+    for (size_t i = 0; sim->config.on_event && i < count; i++) {
+        sim->config.on_event(sim->config.ctx, events[i].event, events[i].value, events[i].time_us);
+    }
+}
+
+static void set_line(sim_serial_t sim, unsigned line, bool on)
+{
+    sim->lines = on ? (sim->lines | line) : (sim->lines & ~line);
+}
+
+static void update_lines(sim_serial_t sim, event_t *events, size_t *count, uint64_t now)
+{
+    // caller holds the mutex; apply flow control and the loopback plug, and report a change
+    unsigned prev = sim->lines;
+    bool rts = sim->host_rts;
+    if (sim->flow == SIM_SERIAL_FLOW_RTS_CTS) {
+        if (sim->rx_fifo.used >= sim->rx_fifo.size * 3 / 4) {
+            rts = false;
+        } else if (sim->rx_fifo.used >= sim->rx_fifo.size / 2) {
+            rts = rts && (prev & SIM_SERIAL_LINE_RTS);    // hysteresis: stay deasserted until below 1/2
+        }
+    }
+    set_line(sim, SIM_SERIAL_LINE_RTS, rts);
+    if (loopback(sim)) {
+        set_line(sim, SIM_SERIAL_LINE_CTS, sim->lines & SIM_SERIAL_LINE_RTS);
+        set_line(sim, SIM_SERIAL_LINE_DSR, sim->lines & SIM_SERIAL_LINE_DTR);
+    }
+    if (sim->lines != prev) {
+        add_event(events, count, SIM_SERIAL_EVENT_LINES, sim->lines, now);
+    }
+}
+
+static size_t line_chars(uint64_t *credits, uint64_t earned, uint64_t cost, size_t pending)
+{
+    // characters which fit into the time since the last tick; the credits are kept only while data is waiting
+    if (pending == 0) {
+        *credits = 0;
+        return 0;
+    }
+    *credits += earned;
+    size_t n = *credits / cost;
+    if (n > pending) {
+        n = pending;
+        *credits = 0;
+    } else {
+        *credits -= n * cost;
+    }
+    return n;
+}
+
+static size_t flow_limit(sim_serial_t sim, size_t n)
+{
+    // With hardware flow control, RTS is deasserted as soon as the RX FIFO is 3/4 full, and the sender
+    // stops. Since a tick moves many characters at once, cap them at that level here.
+    size_t threshold = sim->rx_fifo.size * 3 / 4;
+    if (sim->flow != SIM_SERIAL_FLOW_RTS_CTS) {
+        return n;
+    }
+    if (sim->rx_fifo.used >= threshold) {
+        return 0;
+    }
+    return n < threshold - sim->rx_fifo.used ? n : threshold - sim->rx_fifo.used;
+}
+
+static void rx_input(sim_serial_t sim, const uint8_t *data, size_t len, uint64_t now)
+{
+    // characters arriving from the line; what doesn't fit into the RX FIFO is lost
+    if (len == 0) {
+        return;
+    }
+    if (sim->rx_fifo.used == 0) {
+        sim->rx_first_us = now;
+        uint32_t jitter = 0;
+        if (sim->config.rx_jitter_us) {
+            // xorshift32
+            sim->rng ^= sim->rng << 13;
+            sim->rng ^= sim->rng >> 17;
+            sim->rng ^= sim->rng << 5;
+            jitter = sim->rng % (sim->config.rx_jitter_us + 1);
+        }
+        sim->rx_deliver_us = now + sim->config.rx_latency_us + jitter;
+    }
+    size_t stored = fifo_push(&sim->rx_fifo, data, len);
+    if (stored < len) {
+        if (sim->overrun_pending == 0) {
+            sim->stats.overruns++;
+        }
+        sim->overrun_pending += len - stored;
+        sim->stats.overrun_bytes += len - stored;
+    }
+    if (sim->rx_fifo.used > sim->stats.max_rx_fifo_used) {
+        sim->stats.max_rx_fifo_used = sim->rx_fifo.used;
+    }
+}
+
+static bool sim_tick(sim_serial_t sim)
+{
+    // Move the data for the time since the last tick. Returns true if data is still moving.
+    event_t events[MAX_TICK_EVENTS];
+    size_t event_count = 0;
+    size_t dev_len = 0;
+    size_t rx_len = 0;
+
+    pthread_mutex_lock(&sim->mutex);
+    uint64_t now = now_us();
+    uint64_t elapsed = now - sim->last_us;
+    sim->last_us = now;
+    if (elapsed > MAX_ELAPSED_US) {
+        elapsed = MAX_ELAPSED_US;
+    }
+    const uint64_t earned = elapsed * 2 * sim->baudrate;
+
+    // host to line
+    bool tx_allowed = !sim->in_break &&
+                      (sim->flow != SIM_SERIAL_FLOW_RTS_CTS || (sim->lines & SIM_SERIAL_LINE_CTS));
+    size_t pending = tx_allowed ? sim->tx_fifo.used : 0;
+    if (loopback(sim)) {
+        pending = flow_limit(sim, pending);
+    }
+    size_t n = line_chars(&sim->tx_credits, earned, sim->char_cost, pending);
+    if (n > 0) {
+        fifo_pop(&sim->tx_fifo, sim->scratch, n);
+        sim->stats.tx_bytes += n;
+        if (loopback(sim)) {
+            rx_input(sim, sim->scratch, n, now);
+        } else {
+            dev_len = n;
+        }
+        pthread_cond_broadcast(&sim->space_cond);
+    }
+    // device to line
+    if (!loopback(sim)) {
+        bool dev_allowed = (sim->flow != SIM_SERIAL_FLOW_RTS_CTS || (sim->lines & SIM_SERIAL_LINE_RTS));
+        n = line_chars(&sim->dev_credits, earned, sim->char_cost, dev_allowed ? flow_limit(sim, sim->dev_fifo.used) : 0);
+        if (n > 0) {
+            fifo_pop(&sim->dev_fifo, sim->rx_scratch, n);
+            rx_input(sim, sim->rx_scratch, n, now);
+            pthread_cond_broadcast(&sim->space_cond);
+        }
+    }
+    if (sim->overrun_pending) {
+        add_event(events, &event_count, SIM_SERIAL_EVENT_OVERRUN, sim->overrun_pending, now);
+        sim->overrun_pending = 0;
+    }
+    // line to host: after the latency, or when the FIFO is getting full
+    if (sim->rx_fifo.used > 0 && (now >= sim->rx_deliver_us || sim->rx_fifo.used >= sim->rx_fifo.size * 3 / 4)) {
+        uint64_t delay = now - sim->rx_first_us;
+        if (delay > sim->stats.max_rx_delay_us) {
+            sim->stats.max_rx_delay_us = delay;
+        }
+        rx_len = fifo_pop(&sim->rx_fifo, sim->rx_scratch, sim->rx_fifo.used);
+        sim->stats.rx_bytes += rx_len;
+    }
+    update_lines(sim, events, &event_count, now);
+    bool busy = sim->tx_fifo.used > 0 || sim->dev_fifo.used > 0 || sim->rx_fifo.used > 0;
+    pthread_mutex_unlock(&sim->mutex);
+
+    // callbacks without the lock; the line keeps running while they take time
+    dispatch_events(sim, events, event_count);
+    if (dev_len > 0) {
+        sim->config.on_device_rx(sim->config.ctx, sim->scratch, dev_len);
+    }
+    if (rx_len > 0) {
+        sim->config.on_rx(sim->config.ctx, sim->rx_scratch, rx_len);
+    }
+    return busy || rx_len > 0;
+}
+
+static void *sim_thread_fn(void *ctx)
+{
+    sim_serial_t sim = (sim_serial_t) ctx;
+    bool busy = false;
+    while (true) {
+        pthread_mutex_lock(&sim->mutex);
+        bool pending = sim->tx_fifo.used > 0 || sim->dev_fifo.used > 0 || sim->rx_fifo.used > 0;
+        if (!sim->shutdown) {
+            if (busy || pending) {
+                struct timespec deadline;
+                get_deadline(&deadline, TICK_US);
+                pthread_cond_timedwait(&sim->wake_cond, &sim->mutex, &deadline);
+            } else {
+                pthread_cond_wait(&sim->wake_cond, &sim->mutex);
+            }
+        }
+        bool shutdown = sim->shutdown;
+        pthread_mutex_unlock(&sim->mutex);
+        if (shutdown) {
+            break;
+        }
+        busy = sim_tick(sim);
+    }
+    return NULL;
+}
+
+int sim_serial_create(const sim_serial_config_t *config, sim_serial_t *out_sim)
+{
+    if (!config->on_rx) {
+        return -1;
+    }
+    sim_serial_t sim = calloc(1, sizeof(struct sim_serial_s));
+    if (!sim) {
+        return -1;
+    }
+    sim->config = *config;
+    size_t tx_size = config->tx_fifo_size ? config->tx_fifo_size : DEFAULT_FIFO_SIZE;
+    size_t rx_size = config->rx_fifo_size ? config->rx_fifo_size : DEFAULT_FIFO_SIZE;
+    if (fifo_init(&sim->tx_fifo, tx_size) != 0 || fifo_init(&sim->dev_fifo, tx_size) != 0 ||
+            fifo_init(&sim->rx_fifo, rx_size) != 0 ||
+            !(sim->scratch = malloc(tx_size)) || !(sim->rx_scratch = malloc(tx_size > rx_size ? tx_size : rx_size))) {
+        free(sim->tx_fifo.buf);
+        free(sim->dev_fifo.buf);
+        free(sim->rx_fifo.buf);
+        free(sim->scratch);
+        free(sim);
+        return -1;
+    }
+    sim->baudrate = config->baudrate ? config->baudrate : DEFAULT_BAUDRATE;
+    sim->datasize = 8;
+    sim->parity = SIM_SERIAL_PARITY_NONE;
+    sim->stopbits = SIM_SERIAL_STOPBITS_1;
+    update_char_cost(sim);
+    sim->rng = config->seed ? config->seed : 1;
+    sim->last_us = now_us();
+    if (!loopback(sim)) {
+        sim->lines = SIM_SERIAL_LINE_CTS | SIM_SERIAL_LINE_DSR;
+    }
+    pthread_mutex_init(&sim->mutex, NULL);
+    pthread_cond_init(&sim->wake_cond, NULL);
+    pthread_cond_init(&sim->space_cond, NULL);
+    if (pthread_create(&sim->thread, NULL, sim_thread_fn, sim) != 0) {
+        sim->shutdown = true;
+        sim_serial_destroy(sim);
+        return -1;
+    }
+    *out_sim = sim;
+    return 0;
+}
+
+void sim_serial_destroy(sim_serial_t sim)
+{
+    pthread_mutex_lock(&sim->mutex);
+    bool started = !sim->shutdown;
+    sim->shutdown = true;
+    pthread_cond_broadcast(&sim->wake_cond);
+    pthread_cond_broadcast(&sim->space_cond);
+    pthread_mutex_unlock(&sim->mutex);
+    if (started) {
+        pthread_join(sim->thread, NULL);
+    }
+    pthread_cond_destroy(&sim->space_cond);
+    pthread_cond_destroy(&sim->wake_cond);
+    pthread_mutex_destroy(&sim->mutex);
+    free(sim->tx_fifo.buf);
+    free(sim->dev_fifo.buf);
+    free(sim->rx_fifo.buf);
+    free(sim->scratch);
+    free(sim->rx_scratch);
+    free(sim);
+}
+
+static void wake(sim_serial_t sim)
+{
+    // caller holds the mutex
+    pthread_cond_signal(&sim->wake_cond);
+}
+
+uint32_t sim_serial_set_line_config(sim_serial_t sim, uint32_t baudrate, uint8_t datasize, sim_serial_parity_t parity, sim_serial_stopbits_t stopbits)
+{
+    pthread_mutex_lock(&sim->mutex);
+    if (baudrate) {
+        sim->baudrate = baudrate;
+    }
+    if (datasize >= 5 && datasize <= 8) {
+        sim->datasize = datasize;
+    }
+    if (parity >= SIM_SERIAL_PARITY_NONE && parity <= SIM_SERIAL_PARITY_SPACE) {
+        sim->parity = parity;
+    }
+    if (stopbits >= SIM_SERIAL_STOPBITS_1 && stopbits <= SIM_SERIAL_STOPBITS_1_5) {
+        sim->stopbits = stopbits;
+    }
+    update_char_cost(sim);
+    sim->stats.config_changes++;
+    if (sim->tx_fifo.used > 0) {
+        sim->stats.config_changes_tx_pending++;
+        sim->stats.tx_pending_bytes += sim->tx_fifo.used;
+    }
+    uint32_t res = sim->baudrate;
+    pthread_mutex_unlock(&sim->mutex);
+    event_t event = {SIM_SERIAL_EVENT_LINE_CONFIG, res, now_us()};
+    dispatch_events(sim, &event, 1);
+    return res;
+}
+
+void sim_serial_set_flow_control(sim_serial_t sim, sim_serial_flow_t flow)
+{
+    event_t events[MAX_TICK_EVENTS];
+    size_t count = 0;
+    pthread_mutex_lock(&sim->mutex);
+    sim->flow = flow;
+    update_lines(sim, events, &count, now_us());
+    wake(sim);
+    pthread_mutex_unlock(&sim->mutex);
+    dispatch_events(sim, events, count);
+}
+
+void sim_serial_set_lines(sim_serial_t sim, unsigned mask, unsigned values)
+{
+    event_t events[MAX_TICK_EVENTS];
+    size_t count = 0;
+    pthread_mutex_lock(&sim->mutex);
+    unsigned prev = sim->lines;
+    if (mask & SIM_SERIAL_LINE_DTR) {
+        set_line(sim, SIM_SERIAL_LINE_DTR, values & SIM_SERIAL_LINE_DTR);
+    }
+    if (mask & SIM_SERIAL_LINE_RTS) {
+        sim->host_rts = (values & SIM_SERIAL_LINE_RTS) != 0;
+    }
+    update_lines(sim, events, &count, now_us());
+    if (count == 0 && sim->lines != prev) {
+        // only DTR changed, without a loopback plug
+        add_event(events, &count, SIM_SERIAL_EVENT_LINES, sim->lines, now_us());
+    }
+    if (count > 0) {
+        sim->stats.line_changes++;
+    }
+    wake(sim);
+    pthread_mutex_unlock(&sim->mutex);
+    dispatch_events(sim, events, count);
+}
+
+unsigned sim_serial_get_lines(sim_serial_t sim)
+{
+    pthread_mutex_lock(&sim->mutex);
+    unsigned lines = sim->lines;
+    pthread_mutex_unlock(&sim->mutex);
+    return lines;
+}
+
+void sim_serial_set_break(sim_serial_t sim, bool on)
+{
+    event_t event = {0};
+    bool changed = false;
+    pthread_mutex_lock(&sim->mutex);
+    uint64_t now = now_us();
+    if (on != sim->in_break) {
+        changed = true;
+        sim->in_break = on;
+        if (on) {
+            sim->break_start_us = now;
+            sim->stats.breaks++;
+            event = (event_t) {
+                SIM_SERIAL_EVENT_BREAK_START, 0, now
+            };
+        } else {
+            uint64_t duration = now - sim->break_start_us;
+            event = (event_t) {
+                SIM_SERIAL_EVENT_BREAK_END, duration > UINT32_MAX ? UINT32_MAX : (uint32_t) duration, now
+            };
+        }
+        wake(sim);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    if (changed) {
+        dispatch_events(sim, &event, 1);
+    }
+}
+
+static size_t write_fifo(sim_serial_t sim, fifo_t *fifo, const uint8_t *data, size_t len, unsigned timeout_ms)
+{
+    struct timespec deadline;
+    get_deadline(&deadline, timeout_ms * 1000);
+    size_t written = 0;
+    pthread_mutex_lock(&sim->mutex);
+    while (written < len && !sim->shutdown) {
+        if (fifo->used == 0 && sim->tx_fifo.used == 0 && sim->dev_fifo.used == 0 && sim->rx_fifo.used == 0) {
+            // the task was idle: don't count the idle time as line time
+            sim->last_us = now_us();
+        }
+        size_t n = fifo_push(fifo, data + written, len - written);
+        written += n;
+        if (n > 0) {
+            wake(sim);
+        }
+        if (written < len && pthread_cond_timedwait(&sim->space_cond, &sim->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    return written;
+}
+
+size_t sim_serial_write(sim_serial_t sim, const uint8_t *data, size_t len, unsigned timeout_ms)
+{
+    return write_fifo(sim, &sim->tx_fifo, data, len, timeout_ms);
+}
+
+size_t sim_serial_device_write(sim_serial_t sim, const uint8_t *data, size_t len, unsigned timeout_ms)
+{
+    if (loopback(sim)) {
+        return 0;
+    }
+    return write_fifo(sim, &sim->dev_fifo, data, len, timeout_ms);
+}
+
+int sim_serial_wait_tx_done(sim_serial_t sim, unsigned timeout_ms)
+{
+    struct timespec deadline;
+    get_deadline(&deadline, timeout_ms * 1000);
+    int res = 0;
+    pthread_mutex_lock(&sim->mutex);
+    while (sim->tx_fifo.used > 0 && !sim->shutdown) {
+        if (pthread_cond_timedwait(&sim->space_cond, &sim->mutex, &deadline) == ETIMEDOUT) {
+            res = sim->tx_fifo.used > 0 ? -1 : 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    return res;
+}
+
+void sim_serial_purge(sim_serial_t sim, bool rx, bool tx)
+{
+    pthread_mutex_lock(&sim->mutex);
+    if (rx) {
+        sim->rx_fifo.head = 0;
+        sim->rx_fifo.used = 0;
+    }
+    if (tx) {
+        sim->tx_fifo.head = 0;
+        sim->tx_fifo.used = 0;
+        pthread_cond_broadcast(&sim->space_cond);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+void sim_serial_device_set_lines(sim_serial_t sim, unsigned mask, unsigned values)
+{
+    if (loopback(sim)) {
+        return;
+    }
+    event_t event = {0};
+    bool changed = false;
+    pthread_mutex_lock(&sim->mutex);
+    unsigned prev = sim->lines;
+    mask &= SIM_SERIAL_LINE_CTS | SIM_SERIAL_LINE_DSR;
+    sim->lines = (sim->lines & ~mask) | (values & mask);
+    if (sim->lines != prev) {
+        changed = true;
+        event = (event_t) {
+            SIM_SERIAL_EVENT_LINES, sim->lines, now_us()
+        };
+        wake(sim);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    if (changed) {
+        dispatch_events(sim, &event, 1);
+    }
+}
+
+void sim_serial_get_stats(sim_serial_t sim, sim_serial_stats_t *out_stats)
+{
+    pthread_mutex_lock(&sim->mutex);
+    *out_stats = sim->stats;
+    pthread_mutex_unlock(&sim->mutex);
+}
@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+# Print flash/RAM usage of the rfc2217-server component for each feature combination.
+#
+# Builds the loopback example once with the default configuration and once for each
+# examples/loopback/sdkconfig.ci.* file, and prints the component's line from
+# "idf.py size-components" for each build.
+#
+# Usage: tools/size_report.sh [target]   (default target: esp32c3)
+
+set -euo pipefail
+
+target=${1:-esp32c3}
+root=$(cd "$(dirname "$0")/.." && pwd)
+example="${root}/examples/loopback"
+
+report() {
+    local name=$1
+    local defaults=$2
+    local build_dir="${example}/build_size_${target}_${name}"
+    local args=(-C "${example}" -B "${build_dir}" -DIDF_TARGET="${target}" -DSDKCONFIG="${build_dir}/sdkconfig")
+    if [ -n "${defaults}" ]; then
+        args+=(-DSDKCONFIG_DEFAULTS="${defaults}")
+    fi
+    idf.py "${args[@]}" build > "${build_dir}.log" 2>&1 || { echo "${name}: build failed, see ${build_dir}.log"; return 1; }
+    printf '%-12s ' "${name}"
+    idf.py "${args[@]}" size-components 2>/dev/null | grep -E 'rfc2217-server|rfc2217_server' | head -n 1 || echo "(component not found in size report)"
+}
+
+echo "rfc2217-server size on ${target}, see 'idf.py size-components' for the column names"
+report default ""
+for f in "${example}"/sdkconfig.ci.*; do
+    [ -e "${f}" ] || continue
+    report "${f##*sdkconfig.ci.}" "${f}"
+done
@@ -0,0 +1,147 @@
+// Benchmark of the trigger pattern matcher used by rfc2217_server_send_data.
+//
+// Scans a log-like data stream with 1, 16 and 128 patterns, fed in chunks of the given size
+// (as rfc2217_server_send_data would receive them from a serial driver), and prints the
+// throughput. The number of matches is checked against a naive search of the whole stream,
+// so that matches across chunk boundaries are verified too.
+//
+// Build and run on the host:
+//     gcc -O2 -Isrc tools/trigger_bench.c src/rfc2217_matcher.c -o trigger_bench
+//     ./trigger_bench [chunk size, default 256]
+
+#define _GNU_SOURCE     // for memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rfc2217_matcher.h"
+
+#define STREAM_SIZE (32 * 1024 * 1024)
+#define MAX_PATTERNS 128
+// a pattern is inserted into the stream about this often
+#define MATCH_INTERVAL 65536
+
+static const char *s_common_patterns[] = {
+    "Guru Meditation", "rst:0x", "abort() was called", "Backtrace:", "Stack smashing",
+    "CORRUPT HEAP", "assert failed", "Brownout detector", "waiting for download", "ESP-ROM:",
+    "Task watchdog got triggered", "LoadProhibited", "StoreProhibited", "InstrFetchProhibited",
+    "IllegalInstruction", "Rebooting...",
+};
+
+static const char *s_log_lines[] = {
+    "I (1234) wifi:new:<6,0>, old:<1,0>, ap:<255,255>, sta:<6,0>, prof:1\n",
+    "I (1240) wifi:state: init -> auth (b0)\n",
+    "I (1302) esp_netif_handlers: sta ip: 192.168.0.196, mask: 255.255.255.0, gw: 192.168.0.1\n",
+    "D (2011) app_main: Data received: (1 bytes)\n",
+    "W (2500) sensor: reading out of range: 1023\n",
+    "I (3001) heap_init: At 3FFB2C28 len 0002D3D8 (180 KiB): DRAM\n",
+    "load:0x3fff0030,len:7112\n",
+};
+
+static char *s_patterns[MAX_PATTERNS];
+static uint8_t *s_stream;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_patterns(void)
+{
+    size_t common = sizeof(s_common_patterns) / sizeof(s_common_patterns[0]);
+    for (size_t i = 0; i < MAX_PATTERNS; i++) {
+        char buf[64];
+        if (i < common) {
+            snprintf(buf, sizeof(buf), "%s", s_common_patterns[i]);
+        } else {
+            snprintf(buf, sizeof(buf), "E (%zu) test_case_%zu: failed", i * 7919 % 100000, i);
+        }
+        s_patterns[i] = strdup(buf);
+    }
+}
+
+static void make_stream(void)
+{
+    s_stream = malloc(STREAM_SIZE);
+    size_t pos = 0;
+    size_t line = 0;
+    size_t next_match = MATCH_INTERVAL;
+    unsigned seed = 1;
+    while (pos < STREAM_SIZE) {
+        const char *text = s_log_lines[line++ % (sizeof(s_log_lines) / sizeof(s_log_lines[0]))];
+        if (pos >= next_match) {
+            seed = seed * 1103515245 + 12345;
+            text = s_patterns[(seed >> 16) % MAX_PATTERNS];
+            next_match += MATCH_INTERVAL;
+        }
+        size_t len = strlen(text);
+        if (len > STREAM_SIZE - pos) {
+            len = STREAM_SIZE - pos;
+        }
+        memcpy(s_stream + pos, text, len);
+        pos += len;
+    }
+}
+
+static size_t naive_count(size_t pattern_count)
+{
+    size_t matches = 0;
+    for (size_t i = 0; i < pattern_count; i++) {
+        size_t len = strlen(s_patterns[i]);
+        const uint8_t *p = s_stream;
+        const uint8_t *end = s_stream + STREAM_SIZE;
+        while ((p = memmem(p, end - p, s_patterns[i], len)) != NULL) {
+            matches++;
+            p++;
+        }
+    }
+    return matches;
+}
+
+static void count_match(void *ctx, size_t pattern_index)
+{
+    (*(size_t *) ctx)++;
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunk = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+    if (chunk == 0) {
+        chunk = 256;
+    }
+    make_patterns();
+    make_stream();
+    printf("Stream: %d MiB, chunk size: %zu bytes\n", STREAM_SIZE / (1024 * 1024), chunk);
+
+    const size_t pattern_counts[] = { 1, 16, 128 };
+    int res = 0;
+    for (size_t i = 0; i < sizeof(pattern_counts) / sizeof(pattern_counts[0]); i++) {
+        size_t count = pattern_counts[i];
+        matcher_t *matcher;
+        if (matcher_create((const char *const *) s_patterns, count, NULL, &matcher) != 0) {
+            printf("Failed to create the matcher\n");
+            return 1;
+        }
+        size_t matches = 0;
+        double start = now_s();
+        for (size_t pos = 0; pos < STREAM_SIZE; pos += chunk) {
+            size_t len = STREAM_SIZE - pos < chunk ? STREAM_SIZE - pos : chunk;
+            matcher_feed(matcher, s_stream + pos, len, count_match, &matches);
+        }
+        double elapsed = now_s() - start;
+        matcher_destroy(matcher);
+
+        start = now_s();
+        size_t expected = naive_count(count);
+        double naive_elapsed = now_s() - start;
+        printf("%3zu patterns: %7.1f MB/s, %.2f ns/byte, %zu matches (%s); memmem per pattern: %7.1f MB/s\n",
+               count, STREAM_SIZE / elapsed / 1e6, elapsed * 1e9 / STREAM_SIZE, matches,
+               matches == expected ? "ok" : "MISMATCH", STREAM_SIZE / naive_elapsed / 1e6);
+        if (matches != expected) {
+            res = 1;
+        }
+    }
+    return res;
+}
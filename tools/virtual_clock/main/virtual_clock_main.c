@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "esp_log.h"
+#include "rfc2217_server.h"
+#include "rfc2217_server_test.h"
+
+static const char *TAG = "virtual_clock";
+
+// the virtual clock starts here rather than at 0, which the server uses for "never"
+#define CLOCK_START_US 1000000ULL
+// time step of the scenarios which poll the server
+#define POLL_STEP_US 1000ULL
+
+#define SHAPER_BYTES 65536
+#define SHAPER_BAUDRATE 9600
+#define SHAPER_BURST 16
+
+#define RTT_INTERVAL_MS 1000
+#define RTT_DURATION_US (600ULL * 1000000)
+#define RTT_REPLY_DELAY_US 25000ULL
+
+#define LINE_STATE_WINDOW_US 60000
+// pySerial checks for the reply to a request every 50 ms, and sends the next request after that
+#define LINE_STATE_REPLY_POLL_US 50000
+#define LINE_STATE_MAX_CALLS 16
+
+#define FLUSH_TIMEOUT_MS 10
+#define FLUSH_FRAME_SIZE 64
+#define SLIP_END 0xC0U
+
+#define T_SE 0xf0U
+#define T_SB 0xfaU
+#define T_WILL 0xfbU
+#define T_DO 0xfdU
+#define T_IAC 0xffU
+#define T_TIMING_MARK 0x06U
+#define T_COM_PORT_OPTION 0x2cU
+#define T_SET_BAUDRATE 0x01U
+#define T_SET_CONTROL 0x05U
+#define T_SERVER_SET_CONTROL 0x69U
+
+typedef struct {
+    uint64_t now_us;
+    size_t sent_bytes;          // bytes sent by the server to the client
+    uint64_t last_send_us;      // time of the last on_send call
+    uint64_t probe_us;          // time the last DO TIMING-MARK was sent, 0 if it was answered
+    size_t received_bytes;      // bytes passed to on_data_received
+    uint64_t last_receive_us;   // time of the last on_data_received call
+    size_t control_replies;     // SET_CONTROL replies sent by the server
+    uint8_t line_states[LINE_STATE_MAX_CALLS];  // DTR | RTS << 1 of each on_line_state call
+    size_t line_state_calls;
+} vclock_t;
+
+static uint64_t vclock_now_us(void *ctx)
+{
+    return ((vclock_t *) ctx)->now_us;
+}
+
+static void vclock_sleep_us(void *ctx, uint64_t us)
+{
+    ((vclock_t *) ctx)->now_us += us;
+}
+
+static void vclock_on_send(void *ctx, const uint8_t *data, size_t len)
+{
+    vclock_t *clock = (vclock_t *) ctx;
+    clock->sent_bytes += len;
+    clock->last_send_us = clock->now_us;
+    // control messages are sent in one piece
+    for (size_t i = 0; i + 2 < len; i++) {
+        if (data[i] == T_IAC && data[i + 1] == T_DO && data[i + 2] == T_TIMING_MARK) {
+            clock->probe_us = clock->now_us;
+        }
+        if (data[i] == T_SB && data[i + 1] == T_COM_PORT_OPTION && data[i + 2] == T_SERVER_SET_CONTROL) {
+            clock->control_replies++;
+        }
+    }
+}
+
+static void on_data_received(void *ctx, const uint8_t *data, size_t len)
+{
+    vclock_t *clock = (vclock_t *) ctx;
+    clock->received_bytes += len;
+    clock->last_receive_us = clock->now_us;
+}
+
+static void on_line_state(void *ctx, bool dtr, bool rts, bool brk)
+{
+    vclock_t *clock = (vclock_t *) ctx;
+    if (clock->line_state_calls < LINE_STATE_MAX_CALLS) {
+        clock->line_states[clock->line_state_calls] = dtr | rts << 1;
+    }
+    clock->line_state_calls++;
+}
+
+static double wall_time_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_session(vclock_t *clock, rfc2217_test_session_t *session, rfc2217_server_config_t *config,
+                        rfc2217_server_t *out_server)
+{
+    memset(clock, 0, sizeof(*clock));
+    clock->now_us = CLOCK_START_US;
+    *session = (rfc2217_test_session_t) {
+        .ctx = clock,
+        .now_us = vclock_now_us,
+        .sleep_us = vclock_sleep_us,
+        .on_send = vclock_on_send,
+    };
+    config->ctx = clock;
+    config->on_data_received = on_data_received;
+    if (rfc2217_server_create(config, out_server) != 0) {
+        ESP_LOGE(TAG, "Failed to create server");
+        return -1;
+    }
+    if (rfc2217_server_test_open(*out_server, session, false) != 0) {
+        ESP_LOGE(TAG, "Failed to open test session");
+        rfc2217_server_destroy(*out_server);
+        return -1;
+    }
+    // the client accepts COM-PORT-OPTION, which makes it an RFC2217 client for the server
+    const uint8_t negotiation[] = {T_IAC, T_DO, T_COM_PORT_OPTION, T_IAC, T_WILL, T_COM_PORT_OPTION};
+    rfc2217_server_test_feed(*out_server, negotiation, sizeof(negotiation));
+    return 0;
+}
+
+static void close_session(rfc2217_server_t server)
+{
+    rfc2217_server_test_close(server);
+    rfc2217_server_destroy(server);
+}
+
+static bool run_shaper(void)
+{
+    // 64 KiB at 9600 8N1 are paced at 10 bits per byte; the first SHAPER_BURST bytes pass at once
+    vclock_t clock;
+    rfc2217_test_session_t session;
+    rfc2217_server_config_t config = {
+        .rx_shaper_burst = SHAPER_BURST,
+    };
+    rfc2217_server_t server;
+    if (open_session(&clock, &session, &config, &server) != 0) {
+        return false;
+    }
+    double start = wall_time_s();
+    const uint8_t set_baudrate[] = {
+        T_IAC, T_SB, T_COM_PORT_OPTION, T_SET_BAUDRATE,
+        (uint8_t)(SHAPER_BAUDRATE >> 24), (uint8_t)(SHAPER_BAUDRATE >> 16), (uint8_t)(SHAPER_BAUDRATE >> 8), (uint8_t) SHAPER_BAUDRATE,
+        T_IAC, T_SE
+    };
+    rfc2217_server_test_feed(server, set_baudrate, sizeof(set_baudrate));
+    uint64_t t0 = clock.now_us;
+    static uint8_t data[SHAPER_BYTES];
+    memset(data, 'U', sizeof(data));
+    rfc2217_server_test_feed(server, data, sizeof(data));
+    double wall = wall_time_s() - start;
+    close_session(server);
+
+    uint64_t elapsed = clock.last_receive_us - t0;
+    uint64_t expected = (uint64_t)(SHAPER_BYTES - SHAPER_BURST) * 10 * 1000000 / SHAPER_BAUDRATE;
+    // the server wakes up 1 us after the last character is due, at most
+    bool pass = clock.received_bytes == SHAPER_BYTES && elapsed >= expected && elapsed <= expected + 1;
+    printf("RX shaper: %zu bytes at %d 8N1 in %" PRIu64 " us of server time (expected %" PRIu64 " us), %.3f s of wall time: %s\n",
+           clock.received_bytes, SHAPER_BAUDRATE, elapsed, expected, wall, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static bool run_rtt(void)
+{
+    // a client which answers every TIMING-MARK probe after exactly RTT_REPLY_DELAY_US, for 10 minutes
+    vclock_t clock;
+    rfc2217_test_session_t session;
+    rfc2217_server_config_t config = {
+        .rtt_probe_interval_ms = RTT_INTERVAL_MS,
+    };
+    rfc2217_server_t server;
+    if (open_session(&clock, &session, &config, &server) != 0) {
+        return false;
+    }
+    double start = wall_time_s();
+    const uint64_t end_us = clock.now_us + RTT_DURATION_US;
+    const uint8_t reply[] = {T_IAC, T_WILL, T_TIMING_MARK};
+    while (clock.now_us < end_us) {
+        rfc2217_server_test_poll(server);
+        clock.now_us += POLL_STEP_US;
+        if (clock.probe_us != 0 && clock.now_us - clock.probe_us >= RTT_REPLY_DELAY_US) {
+            clock.probe_us = 0;
+            rfc2217_server_test_feed(server, reply, sizeof(reply));
+        }
+    }
+    rfc2217_server_link_stats_t stats = {};
+    int res = rfc2217_server_get_link_stats(server, &stats);
+    double wall = wall_time_s() - start;
+    close_session(server);
+
+    uint32_t expected_samples = RTT_DURATION_US / (RTT_INTERVAL_MS * 1000ULL);
+    bool pass = res == 0 && stats.rtt_samples == expected_samples &&
+                stats.srtt_us == RTT_REPLY_DELAY_US && stats.last_rtt_us == RTT_REPLY_DELAY_US;
+    printf("RTT probes: %" PRIu32 " samples (expected %" PRIu32 ") in %.0f s of server time, srtt %" PRIu32 " us, "
+           "last %" PRIu32 " us (expected %" PRIu64 " us), %.3f s of wall time: %s\n",
+           stats.rtt_samples, expected_samples, RTT_DURATION_US / 1e6, stats.srtt_us, stats.last_rtt_us,
+           (uint64_t) RTT_REPLY_DELAY_US, wall, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static void advance(rfc2217_server_t server, vclock_t *clock, uint64_t us)
+{
+    // let time pass, polling the server as its tasks would
+    while (us > 0) {
+        uint64_t step = us < POLL_STEP_US ? us : POLL_STEP_US;
+        clock->now_us += step;
+        us -= step;
+        rfc2217_server_test_poll(server);
+    }
+}
+
+static bool run_line_state(void)
+{
+    // esptool's reset sequence from a client which waits for the reply to each request like pySerial;
+    // the five requests should reach the device as three line states, without the ones in between
+    static const struct {
+        uint8_t control;
+        unsigned delay_ms;      // time to wait before sending the request
+    } steps[] = {
+        {RFC2217_CONTROL_CLEAR_DTR, 0},
+        {RFC2217_CONTROL_SET_RTS, 0},       // EN low
+        {RFC2217_CONTROL_SET_DTR, 100},     // IO0 low
+        {RFC2217_CONTROL_CLEAR_RTS, 0},     // EN high
+        {RFC2217_CONTROL_CLEAR_DTR, 50},
+    };
+    static const uint8_t expected[] = {0x2, 0x1, 0x0};  // DTR | RTS << 1
+    vclock_t clock;
+    rfc2217_test_session_t session;
+    rfc2217_server_config_t config = {
+        .on_line_state = on_line_state,
+        .line_state_window_us = LINE_STATE_WINDOW_US,
+    };
+    rfc2217_server_t server;
+    if (open_session(&clock, &session, &config, &server) != 0) {
+        return false;
+    }
+    const size_t count = sizeof(steps) / sizeof(steps[0]);
+    for (size_t i = 0; i < count; i++) {
+        advance(server, &clock, steps[i].delay_ms * 1000ULL);
+        const uint8_t request[] = {T_IAC, T_SB, T_COM_PORT_OPTION, T_SET_CONTROL, steps[i].control, T_IAC, T_SE};
+        rfc2217_server_test_feed(server, request, sizeof(request));
+        advance(server, &clock, LINE_STATE_REPLY_POLL_US);
+    }
+    advance(server, &clock, 2 * LINE_STATE_WINDOW_US);
+    close_session(server);
+
+    bool pass = clock.control_replies == count && clock.line_state_calls == sizeof(expected) &&
+                memcmp(clock.line_states, expected, sizeof(expected)) == 0;
+    printf("Line state: %zu SET_CONTROL requests, %zu replies, %zu on_line_state calls (expected %zu):",
+           count, clock.control_replies, clock.line_state_calls, sizeof(expected));
+    for (size_t i = 0; i < clock.line_state_calls && i < LINE_STATE_MAX_CALLS; i++) {
+        printf(" DTR %d RTS %d%s", clock.line_states[i] & 1, clock.line_states[i] >> 1,
+               i + 1 < clock.line_state_calls ? "," : "");
+    }
+    printf(": %s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static bool run_flush(void)
+{
+    // a complete SLIP frame is sent at once, the start of one is held back for flush_timeout_ms
+    vclock_t clock;
+    rfc2217_test_session_t session;
+    rfc2217_server_config_t config = {
+        .tx_queue_size = 4096,
+        .flush_delimiters = {SLIP_END},
+        .flush_delimiter_count = 1,
+        .flush_timeout_ms = FLUSH_TIMEOUT_MS,
+    };
+    rfc2217_server_t server;
+    if (open_session(&clock, &session, &config, &server) != 0) {
+        return false;
+    }
+    uint8_t frame[FLUSH_FRAME_SIZE];
+    memset(frame, 0x55, sizeof(frame));
+    frame[0] = SLIP_END;
+    frame[sizeof(frame) - 1] = SLIP_END;
+
+    size_t sent_before = clock.sent_bytes;
+    uint64_t t0 = clock.now_us;
+    rfc2217_server_send_data(server, frame, sizeof(frame));
+    uint64_t frame_us = clock.last_send_us - t0;
+    bool frame_ok = clock.sent_bytes - sent_before == sizeof(frame) && frame_us == 0;
+
+    // the first half of the next frame
+    sent_before = clock.sent_bytes;
+    clock.now_us += POLL_STEP_US;
+    uint64_t t1 = clock.now_us;
+    rfc2217_server_send_data(server, frame, sizeof(frame) / 2);
+    while (clock.sent_bytes == sent_before && clock.now_us - t1 < 10 * FLUSH_TIMEOUT_MS * 1000ULL) {
+        clock.now_us += POLL_STEP_US;
+        rfc2217_server_test_poll(server);
+    }
+    uint64_t held_us = clock.last_send_us - t1;
+    bool partial_ok = clock.sent_bytes - sent_before == sizeof(frame) / 2 && held_us == FLUSH_TIMEOUT_MS * 1000ULL;
+    close_session(server);
+
+    bool pass = frame_ok && partial_ok;
+    printf("Flush: full frame sent after %" PRIu64 " us, partial frame after %" PRIu64 " us (flush_timeout_ms %d): %s\n",
+           frame_us, held_us, FLUSH_TIMEOUT_MS, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+void app_main(void)
+{
+    bool pass = true;
+    pass &= run_shaper();
+    pass &= run_rtt();
+    pass &= run_line_state();
+    pass &= run_flush();
+    exit(pass ? 0 : 1);
+}